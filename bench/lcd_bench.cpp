@@ -0,0 +1,137 @@
+#include "nc1020_lcd.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace wqx;
+
+static const uint32_t ITERATIONS = 2000;
+static const size_t LCD_SIZE = LCD_WIDTH * LCD_HEIGHT / 8;
+
+// Straightforward per-pixel conversion, used to check the kernels and as the baseline timing.
+template <typename T>
+static void ConvertReference(const uint8_t *lcd, T *out, size_t pitch, uint32_t scale, const T palette[2]) {
+    for (uint32_t y = 0; y < LCD_HEIGHT * scale; y++) {
+        T *line = reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(out) + y * pitch);
+        for (uint32_t x = 0; x < LCD_WIDTH * scale; x++) {
+            uint32_t sx = x / scale;
+            uint32_t sy = y / scale;
+            line[x] = palette[(lcd[sy * (LCD_WIDTH / 8) + sx / 8] >> (7 - sx % 8)) & 1];
+        }
+    }
+}
+
+static bool Convert(const uint8_t *lcd, uint8_t *out, size_t pitch, uint32_t scale, const uint8_t palette[2]) {
+    return ConvertLcd8(lcd, out, pitch, scale, palette);
+}
+
+static bool Convert(const uint8_t *lcd, uint16_t *out, size_t pitch, uint32_t scale, const uint16_t palette[2]) {
+    return ConvertLcd16(lcd, out, pitch, scale, palette);
+}
+
+static bool Convert(const uint8_t *lcd, uint32_t *out, size_t pitch, uint32_t scale, const uint32_t palette[2]) {
+    return ConvertLcd32(lcd, out, pitch, scale, palette);
+}
+
+static uint8_t BlendReference(uint8_t level, bool set, uint32_t rise, uint32_t fall) {
+    uint32_t target = set ? 255 : 0;
+    uint32_t speed = set ? rise : fall;
+    uint32_t next = (level * (256 - speed) + target * speed + (set ? 255 : 0)) / 256;
+    return next;
+}
+
+template <typename F>
+static double NanosPerFrame(F convert) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        convert();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ITERATIONS;
+}
+
+template <typename T>
+static bool Run(const uint8_t *lcd, const T palette[2]) {
+    bool ok = true;
+    for (uint32_t scale = 1; scale <= 4; scale++) {
+        // Pad the pitch so row addressing is exercised as well.
+        size_t pitch = (LCD_WIDTH * scale + 3) * sizeof(T);
+        std::vector<uint8_t> expected(pitch * LCD_HEIGHT * scale);
+        std::vector<uint8_t> actual(expected.size());
+        T *expectedPixels = reinterpret_cast<T *>(expected.data());
+        T *actualPixels = reinterpret_cast<T *>(actual.data());
+
+        ConvertReference(lcd, expectedPixels, pitch, scale, palette);
+        Convert(lcd, actualPixels, pitch, scale, palette);
+        for (uint32_t y = 0; y < LCD_HEIGHT * scale; y++) {
+            if (memcmp(&expected[y * pitch], &actual[y * pitch], LCD_WIDTH * scale * sizeof(T)) != 0) {
+                printf("%2zubpp %ux: mismatch on row %u\n", sizeof(T) * 8, scale, y);
+                ok = false;
+                break;
+            }
+        }
+
+        double reference = NanosPerFrame([&] { ConvertReference(lcd, expectedPixels, pitch, scale, palette); });
+        double kernel = NanosPerFrame([&] { Convert(lcd, actualPixels, pitch, scale, palette); });
+        printf("%2zubpp %ux: %9.0f ns/frame (reference %9.0f ns/frame, %.1fx)\n", sizeof(T) * 8, scale, kernel,
+               reference, reference / kernel);
+    }
+    return ok;
+}
+
+static bool RunPersistence() {
+    static const uint32_t FRAMES = 16;
+    static const uint32_t RISE = 160;
+    static const uint32_t FALL = 48;
+    std::vector<uint8_t> frames(FRAMES * LCD_SIZE);
+    for (size_t i = 0; i < frames.size(); i++) {
+        frames[i] = rand() & 0xFF;
+    }
+
+    LcdPersistence persistence;
+    persistence.setResponse(RISE, FALL);
+    std::vector<uint8_t> expected(LCD_WIDTH * LCD_HEIGHT, 0);
+    bool ok = true;
+    for (uint32_t frame = 0; frame < FRAMES; frame++) {
+        const uint8_t *lcd = &frames[frame * LCD_SIZE];
+        persistence.blend(lcd);
+        for (uint32_t i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++) {
+            expected[i] = BlendReference(expected[i], (lcd[i / 8] >> (7 - i % 8)) & 1, RISE, FALL);
+        }
+        if (memcmp(persistence.levels(), expected.data(), expected.size()) != 0) {
+            printf("persistence: mismatch on frame %u\n", frame);
+            ok = false;
+            break;
+        }
+    }
+
+    uint32_t frame = 0;
+    double blend = NanosPerFrame([&] { persistence.blend(&frames[(frame++ % FRAMES) * LCD_SIZE]); });
+    const uint32_t palette[2] = {0xFFFFFF, 0x000000};
+    size_t pitch = LCD_WIDTH * 2 * sizeof(uint32_t);
+    std::vector<uint32_t> out(LCD_WIDTH * 2 * LCD_HEIGHT * 2);
+    double convert = NanosPerFrame([&] { persistence.convert32(out.data(), pitch, 2, palette); });
+    printf("persistence: blend %7.0f ns/frame, convert 32bpp 2x %7.0f ns/frame\n", blend, convert);
+    return ok;
+}
+
+int main() {
+    uint8_t lcd[LCD_SIZE];
+    srand(1020);
+    for (size_t i = 0; i < LCD_SIZE; i++) {
+        lcd[i] = rand() & 0xFF;
+    }
+
+    const uint8_t palette8[2] = {0xFF, 0x00};
+    const uint16_t palette16[2] = {0xFFFF, 0x0000};
+    const uint32_t palette32[2] = {0xFFFFFF, 0x000000};
+
+    printf("kernel: %s\n", GetLcdKernelName());
+    bool ok = Run(lcd, palette8);
+    ok = Run(lcd, palette16) && ok;
+    ok = Run(lcd, palette32) && ok;
+    ok = RunPersistence() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,350 @@
+// Round trip checks for the chunked save states, incremental chains and legacy dumps. Runs a small guest program on
+// in-memory images, so no firmware is needed.
+
+#include "nc1020.h"
+#include "nc1020_rewind.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace wqx;
+
+static const uint32_t RUN_MS = 200;
+
+// Enables interrupts, points the LCD at 0x400 and keeps writing a counter over the LCD buffer.
+static const uint8_t PROGRAM[] = {
+    0x58,                   // E000: CLI
+    0xA9, 0x40,             // E001: LDA #$40
+    0x85, 0x06,             // E003: STA $06
+    0xA2, 0x00,             // E005: LDX #$00
+    0xE8,                   // E007: INX
+    0x8A,                   // E008: TXA
+    0x9D, 0x00, 0x04,       // E009: STA $0400,X
+    0x4C, 0x07, 0xE0,       // E00C: JMP $E007
+    0x40,                   // E00F: RTI
+};
+
+// Loaded at 0x1000 by a legacy dump. Programs 0x5A into NOR page 0 at 0x4123 through the flash command sequence,
+// then keeps copying it to the first LCD byte.
+static const uint8_t FLASH_PROGRAM[] = {
+    0xA9, 0xAA,             // 1000: LDA #$AA
+    0x8D, 0x55, 0x55,       // 1002: STA $5555
+    0xA9, 0x55,             // 1005: LDA #$55
+    0x8D, 0xAA, 0xAA,       // 1007: STA $AAAA
+    0xA9, 0xA0,             // 100A: LDA #$A0
+    0x8D, 0x55, 0x55,       // 100C: STA $5555
+    0xA9, 0x5A,             // 100F: LDA #$5A
+    0x8D, 0x23, 0x41,       // 1011: STA $4123
+    0xAD, 0x23, 0x41,       // 1014: LDA $4123
+    0x8D, 0x00, 0x04,       // 1017: STA $0400
+    0x4C, 0x14, 0x10,       // 101A: JMP $1014
+};
+
+class MemoryHal : public IWqxHal {
+public:
+    MemoryHal() : rom(0x8000 * 0x180, 0), nor(0x8000 * 0x20, 0xff), bbsImage(0x20000, 0) {
+        page = rom.data();
+        bbs = bbsImage.data();
+        shadowBbs = bbsImage.data() + 0x2000;
+        memcpy(shadowBbs, PROGRAM, sizeof(PROGRAM));
+        // Reset vector and IRQ vector.
+        shadowBbs[0x1FFC] = 0x00;
+        shadowBbs[0x1FFD] = 0xE0;
+        shadowBbs[0x1FFE] = 0x0F;
+        shadowBbs[0x1FFF] = 0xE0;
+    }
+    uint8_t norByte(uint32_t offset) const {
+        return nor[offset];
+    }
+    virtual bool loadNorPage(uint32_t page) override {
+        this->page = nor.data() + page * 0x8000;
+        return true;
+    }
+    virtual bool saveNorPage(uint32_t page) override {
+        (void) page;
+        return true;
+    }
+    virtual bool wipeNorFlash() override {
+        memset(nor.data(), 0xff, nor.size());
+        return true;
+    }
+    virtual bool loadRomPage(uint32_t volume, uint32_t page) override {
+        this->page = rom.data() + (volume * 0x80 + page) * 0x8000;
+        return true;
+    }
+    virtual bool loadBbsPage(uint32_t volume, uint32_t page) override {
+        (void) volume;
+        bbs = bbsImage.data() + page * 0x2000;
+        return true;
+    }
+    virtual bool saveState(const char *states, size_t size) override {
+        (void) states;
+        (void) size;
+        return false;
+    }
+    virtual bool loadState(char *states, size_t size) override {
+        (void) states;
+        (void) size;
+        return false;
+    }
+
+private:
+    std::vector<uint8_t> rom;
+    std::vector<uint8_t> nor;
+    std::vector<uint8_t> bbsImage;
+};
+
+// Layout of the legacy version 6 dumps, a raw copy of the emulator states. Frozen.
+struct legacy_states_t {
+    uint32_t version;
+    struct {
+        uint16_t reg_pc;
+        uint8_t reg_a;
+        uint8_t reg_ps;
+        uint8_t reg_x;
+        uint8_t reg_y;
+        uint8_t reg_sp;
+    } cpu;
+    uint8_t ram[0x8000];
+    uint8_t bak_40[0x40];
+    uint8_t clock_buff[80];
+    uint8_t clock_flags;
+    uint8_t jg_wav_buff[0x20];
+    uint8_t jg_wav_flags;
+    uint8_t jg_wav_index;
+    bool jg_wav_playing;
+    uint8_t fp_step;
+    uint8_t fp_type;
+    uint8_t fp_bank_idx;
+    uint8_t fp_bak1;
+    uint8_t fp_bak2;
+    uint8_t fp_buff[0x100];
+    bool slept;
+    bool should_wake_up;
+    bool wake_up_pending;
+    uint8_t wake_up_key;
+    bool timer0_toggle;
+    uint32_t cycles;
+    uint32_t timer0_cycles;
+    uint32_t timer1_cycles;
+    bool should_irq;
+    uint32_t lcd_addr;
+    uint8_t keypad_matrix[8];
+};
+
+static std::vector<uint8_t> Save(uint32_t flags) {
+    std::vector<uint8_t> state(GetStatesSizeBound(flags));
+    state.resize(SaveStatesToBuffer(state.data(), state.size(), flags));
+    return state;
+}
+
+static std::vector<uint8_t> Save(Machine &machine) {
+    std::vector<uint8_t> state(machine.getStatesSizeBound(0));
+    state.resize(machine.saveStatesToBuffer(state.data(), state.size(), 0));
+    return state;
+}
+
+static std::vector<uint8_t> TakeSnapshot(Machine &machine) {
+    std::vector<uint8_t> snapshot(machine.getSnapshotSize());
+    snapshot.resize(machine.snapshot(snapshot.data(), snapshot.size()));
+    return snapshot;
+}
+
+static std::vector<uint8_t> TakeSnapshot() {
+    std::vector<uint8_t> snapshot(GetSnapshotSize());
+    snapshot.resize(Snapshot(snapshot.data(), snapshot.size()));
+    return snapshot;
+}
+
+// Snapshots of machines in the same state. Each NOR write draws a new generation for the header, so machines that made
+// the same writes separately still differ there.
+static bool SameState(std::vector<uint8_t> a, std::vector<uint8_t> b) {
+    const size_t generation = 12;
+    if (a.size() < generation + 4 || b.size() < generation + 4) {
+        return false;
+    }
+    memset(a.data() + generation, 0, 4);
+    memset(b.data() + generation, 0, 4);
+    return a == b;
+}
+
+static bool Check(bool condition, const char *what) {
+    printf("%-44s %s\n", what, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+// A state loads back to the same state, and the guest carries on from it exactly as it did the first time.
+static bool CheckFull() {
+    std::vector<uint8_t> saved = Save(0);
+    RunTimeSlice(RUN_MS, false);
+    std::vector<uint8_t> later = Save(0);
+    bool ok = Check(!saved.empty(), "full state saved");
+    ok = Check(LoadStatesFromBuffer(saved.data(), saved.size()), "full state loaded") && ok;
+    ok = Check(Save(0) == saved, "full state saves back the same") && ok;
+    RunTimeSlice(RUN_MS, false);
+    return Check(Save(0) == later, "full state resumes the same") && ok;
+}
+
+// A full state with incremental states appended loads to the state at the end of the chain.
+static bool CheckIncremental() {
+    std::vector<uint8_t> chain = Save(0);
+    for (int i = 0; i < 3; i++) {
+        RunTimeSlice(RUN_MS, false);
+        std::vector<uint8_t> delta = Save(STATE_INCREMENTAL);
+        chain.insert(chain.end(), delta.begin(), delta.end());
+    }
+    std::vector<uint8_t> expected = Save(0);
+    bool ok = Check(LoadStatesFromBuffer(chain.data(), chain.size()), "incremental chain loaded");
+    ok = Check(Save(0) == expected, "incremental chain ends at the last state") && ok;
+
+    // A torn delta ends the chain at the last complete state.
+    std::vector<uint8_t> torn = chain;
+    torn.resize(torn.size() - 1);
+    return Check(LoadStatesFromBuffer(torn.data(), torn.size()), "torn incremental chain loaded") && ok;
+}
+
+// Interrupts stay masked, bank 0 is NOR page 0 and the LCD is at 0x400.
+static void InitLegacy(legacy_states_t &legacy, uint16_t pc) {
+    memset(&legacy, 0, sizeof(legacy));
+    legacy.version = 6;
+    legacy.cpu.reg_pc = pc;
+    legacy.cpu.reg_sp = 0xFF;
+    legacy.cpu.reg_ps = 0x24;
+    legacy.lcd_addr = 0x400;
+}
+
+static bool CheckLegacy() {
+    legacy_states_t legacy;
+    InitLegacy(legacy, 0xE007);
+    for (uint32_t i = 0; i < 1600; i++) {
+        legacy.ram[0x400 + i] = i * 7;
+    }
+    const uint8_t *buffer = reinterpret_cast<const uint8_t *>(&legacy);
+    bool ok = Check(LoadStatesFromBuffer(buffer, sizeof(legacy)), "legacy dump loaded");
+    uint8_t lcd[1600];
+    ok = Check(CopyLcdBuffer(lcd) && memcmp(lcd, legacy.ram + 0x400, sizeof(lcd)) == 0, "legacy dump RAM") && ok;
+
+    legacy.lcd_addr = 0x8000 - 1599;
+    return Check(!LoadStatesFromBuffer(buffer, sizeof(legacy)), "legacy dump with a bad LCD address rejected") && ok;
+}
+
+// Damaged states are rejected rather than read past their end.
+static bool CheckInvalid() {
+    std::vector<uint8_t> state = Save(0);
+    bool ok = Check(!LoadStatesFromBuffer(state.data(), 8), "truncated header rejected");
+    std::vector<uint8_t> shortTotal = state;
+    // Total size field, smaller than the header.
+    memset(shortTotal.data() + 8, 0, 4);
+    shortTotal[8] = 4;
+    ok = Check(!LoadStatesFromBuffer(shortTotal.data(), shortTotal.size()), "total below header size rejected") && ok;
+    std::vector<uint8_t> flipped = state;
+    flipped[flipped.size() / 2] ^= 0x01;
+    return Check(!LoadStatesFromBuffer(flipped.data(), flipped.size()), "corrupt state rejected") && ok;
+}
+
+// Snapshots whose header points outside RAM or stops the clock are refused without touching the machine.
+static bool CheckSnapshot() {
+    std::vector<uint8_t> snapshot = TakeSnapshot();
+    std::vector<uint8_t> saved = Save(0);
+    bool ok = Check(Restore(snapshot.data(), snapshot.size()), "snapshot restored");
+
+    // Offsets of the CPU speed and the first memmap entry in the snapshot header.
+    const size_t offsets[] = {16, 16, 20};
+    const uint8_t values[][4] = {{0, 0, 0, 0}, {0xff, 0xff, 0xff, 0xff}, {0x01, 0x60, 0, 0}};
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        std::vector<uint8_t> bad = snapshot;
+        memcpy(bad.data() + offsets[i], values[i], 4);
+        ok = Check(!Restore(bad.data(), bad.size()), "snapshot with a bad header rejected") && ok;
+    }
+    return Check(Save(0) == saved, "machine untouched by rejected snapshots") && ok;
+}
+
+// Snapshots are byte for byte the same after the same runs, both for a fork and for a restored snapshot.
+static bool CheckIdentity() {
+    static MemoryHal childHal;
+    Machine child;
+    bool ok = Check(Fork(child, &childHal), "machine forked");
+    ok = Check(TakeSnapshot(child) == TakeSnapshot(), "fork snapshot matches") && ok;
+    RunTimeSlice(RUN_MS, false);
+    child.runTimeSlice(RUN_MS, false);
+    ok = Check(TakeSnapshot(child) == TakeSnapshot(), "fork runs the same") && ok;
+
+    std::vector<uint8_t> start = TakeSnapshot();
+    RunTimeSlice(RUN_MS, false);
+    std::vector<uint8_t> later = TakeSnapshot();
+    ok = Check(Restore(start.data(), start.size()) && TakeSnapshot() == start, "snapshot restores the same") && ok;
+    RunTimeSlice(RUN_MS, false);
+    return Check(TakeSnapshot() == later, "restored snapshot runs the same") && ok;
+}
+
+// A NOR page written by a fork is copied for it. The parent keeps its own page, and reaches the same state when it
+// runs the same code.
+static bool CheckForkNor(const MemoryHal &hal) {
+    static legacy_states_t legacy;
+    InitLegacy(legacy, 0x1000);
+    memcpy(legacy.ram + 0x1000, FLASH_PROGRAM, sizeof(FLASH_PROGRAM));
+    bool ok = Check(LoadStatesFromBuffer(reinterpret_cast<const uint8_t *>(&legacy), sizeof(legacy)),
+                    "flash program loaded");
+
+    static MemoryHal childHal;
+    Machine child;
+    ok = Check(Fork(child, &childHal), "machine forked for NOR writes") && ok;
+    std::vector<uint8_t> parent = TakeSnapshot();
+    child.runTimeSlice(RUN_MS, false);
+    uint8_t lcd[1600];
+    ok = Check(child.copyLcdBuffer(lcd) && lcd[0] == 0x5A, "fork reads back its NOR write") && ok;
+    ok = Check(TakeSnapshot(child) != parent, "fork snapshot carries its NOR write") && ok;
+    ok = Check(hal.norByte(0x123) == 0xFF && childHal.norByte(0x123) == 0xFF, "NOR images untouched by fork") && ok;
+    ok = Check(CopyLcdBuffer(lcd) && lcd[0] == 0x00, "parent NOR page untouched by fork") && ok;
+    ok = Check(TakeSnapshot() == parent, "parent snapshot untouched by fork") && ok;
+
+    RunTimeSlice(RUN_MS, false);
+    return Check(SameState(TakeSnapshot(), TakeSnapshot(child)), "parent runs the same as the fork") && ok;
+}
+
+// Stepping back restores the captured states newest first. The ring only holds a few snapshots, so the oldest
+// entries are dropped on the way and the ring runs out before all of them are stepped back to.
+static bool CheckRewind() {
+    static MemoryHal childHal;
+    Machine child;
+    bool ok = Check(Fork(child, &childHal), "machine forked for rewind");
+    RewindBuffer rewind;
+    ok = Check(rewind.begin(child.getSnapshotSize() * 3, 1, 4, &child), "rewind buffer allocated") && ok;
+
+    const size_t captures = 16;
+    std::vector<std::vector<uint8_t>> saved;
+    bool captured = true;
+    for (size_t i = 0; i < captures; i++) {
+        captured = rewind.capture() && captured;
+        saved.push_back(Save(child));
+        child.runTimeSlice(RUN_MS / 4, false);
+    }
+    ok = Check(captured, "rewind entries captured") && ok;
+    ok = Check(rewind.count() > 0 && rewind.count() < captures, "rewind ring wrapped") && ok;
+
+    size_t steps = 0;
+    bool same = true;
+    while (rewind.stepBack()) {
+        steps++;
+        same = same && Save(child) == saved[captures - steps];
+    }
+    ok = Check(steps > 0 && same, "rewind steps back to the captured states") && ok;
+    return Check(rewind.count() == 0, "rewind ring emptied") && ok;
+}
+
+int main() {
+    static MemoryHal hal;
+    Initialize(&hal, 0);
+    Reset();
+    RunTimeSlice(RUN_MS, false);
+
+    bool ok = CheckFull();
+    ok = CheckIncremental() && ok;
+    ok = CheckInvalid() && ok;
+    ok = CheckSnapshot() && ok;
+    ok = CheckIdentity() && ok;
+    ok = CheckLegacy() && ok;
+    ok = CheckForkNor(hal) && ok;
+    ok = CheckRewind() && ok;
+    return ok ? 0 : 1;
+}
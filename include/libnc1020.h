@@ -0,0 +1,156 @@
+#ifndef LIBNC1020_H_
+#define LIBNC1020_H_
+
+/**
+ * @file
+ * @brief C API of libnc1020.
+ * @details Each nc1020_t is an independent emulator session on its own ROM, NOR and BBS image files, so a host can run
+ * any number of them side by side, one thread per session at a time. Sessions opened on the same image files share
+ * their memory. Only the functions declared here are exported from the library.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NC1020_API __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Opaque emulator session.
+ */
+typedef struct nc1020 nc1020_t;
+
+/**
+ * @brief Settings for nc1020_create().
+ */
+typedef struct nc1020_config {
+    /**
+     * @brief ROM, NOR flash and BBS images in the simplified format made by `scripts/gen_simplified.py`.
+     */
+    const char *rom_path;
+    const char *nor_path;
+    const char *bbs_path;
+    /**
+     * @brief Guest CPU speed in Hz. 0 selects the default.
+     */
+    uint32_t cpu_speed;
+    /**
+     * @brief Write NOR flash changes back to the NOR image on nc1020_destroy() when non-zero.
+     */
+    int write_nor;
+    /**
+     * @brief Read image pages that aren't in memory yet in the background when non-zero.
+     * @details See wqx::SetAsyncPageLoads(). nc1020_run_cycles() then returns early while the guest waits for a page,
+     * so the thread can run other sessions meanwhile. nc1020_run_ms() still waits.
+     */
+    int async_pages;
+} nc1020_config_t;
+
+/**
+ * @brief Counters returned by nc1020_get_stats().
+ */
+typedef struct nc1020_stats {
+    /**
+     * @brief Guest cycle count.
+     */
+    uint64_t cycles;
+    /**
+     * @brief Guest CPU speed in Hz.
+     */
+    uint32_t cpu_speed;
+    /**
+     * @brief Run calls made on the session.
+     */
+    uint64_t run_calls;
+    /**
+     * @brief Guest cycles executed by run calls.
+     */
+    uint64_t run_cycles;
+    /**
+     * @brief Host time spent in run calls in microseconds.
+     */
+    uint64_t run_host_us;
+} nc1020_stats_t;
+
+/**
+ * @brief Create a session and reset the guest.
+ * @return Session, or null when an image can't be loaded or out of memory.
+ */
+NC1020_API nc1020_t *nc1020_create(const nc1020_config_t *config);
+/**
+ * @brief Create a copy of a session that runs independently of it.
+ * @details See wqx::Machine::fork(). Once forked, NOR writes of the original are no longer written back.
+ * @return Session, or null when out of memory.
+ */
+NC1020_API nc1020_t *nc1020_fork(nc1020_t *session);
+/**
+ * @brief Destroy a session. Null is ignored.
+ */
+NC1020_API void nc1020_destroy(nc1020_t *session);
+NC1020_API void nc1020_reset(nc1020_t *session);
+/**
+ * @brief Run the guest for `cycles` CPU cycles.
+ * @details Stops at the first instruction boundary at or past the target, or earlier when the guest waits for a page
+ * with nc1020_config_t::async_pages set.
+ * @return Cycles actually executed.
+ */
+NC1020_API uint64_t nc1020_run_cycles(nc1020_t *session, uint64_t cycles);
+/**
+ * @brief Check whether the guest waits for an image page. See nc1020_config_t::async_pages.
+ * @return Non-zero while waiting. Calls to nc1020_run_cycles() return without running until the page is in memory.
+ */
+NC1020_API int nc1020_waiting_for_page(nc1020_t *session);
+/**
+ * @brief Run the guest for `ms` milliseconds of guest time, as fast as the host allows.
+ */
+NC1020_API void nc1020_run_ms(nc1020_t *session, uint32_t ms);
+NC1020_API void nc1020_set_key(nc1020_t *session, uint8_t key_id, int down);
+NC1020_API void nc1020_release_all_keys(nc1020_t *session);
+/**
+ * @brief Type text as fast as the guest takes it. See wqx::TypeText().
+ * @return Non-zero when the text was queued.
+ */
+NC1020_API int nc1020_type_text(nc1020_t *session, const char *text);
+/**
+ * @brief Get the number of typed keys the guest hasn't taken yet.
+ */
+NC1020_API size_t nc1020_pending_keys(nc1020_t *session);
+/**
+ * @brief Get the 1600 byte LCD buffer in guest RAM without copying it.
+ * @details 20 bytes per row with the leftmost pixel in the most significant bit. The contents change when the session
+ * runs. Get the pointer again after nc1020_reset() and nc1020_restore().
+ * @return LCD buffer, or null when the guest hasn't set one up yet.
+ */
+NC1020_API const uint8_t *nc1020_lcd(nc1020_t *session);
+/**
+ * @brief Copy the last complete guest frame if it wasn't copied yet. See wqx::CopyLcdFrame().
+ * @param[out] buffer 1600 byte buffer.
+ * @param[out] cycle Optional. Guest cycle the frame completed at.
+ * @return Non-zero when a new frame was copied.
+ */
+NC1020_API int nc1020_lcd_frame(nc1020_t *session, uint8_t *buffer, uint64_t *cycle);
+/**
+ * @brief Get the size of the buffer nc1020_snapshot() needs.
+ */
+NC1020_API size_t nc1020_snapshot_size(nc1020_t *session);
+/**
+ * @brief Take an in-memory snapshot of the session. See wqx::Snapshot().
+ * @return Size of the snapshot, or 0 when `capacity` is too small.
+ */
+NC1020_API size_t nc1020_snapshot(nc1020_t *session, void *buffer, size_t capacity);
+/**
+ * @brief Restore a snapshot taken by nc1020_snapshot() on this session or one sharing its images.
+ * @details Snapshots with a header out of range are rejected, see wqx::Restore().
+ * @return Non-zero on success, 0 with the session unchanged otherwise.
+ */
+NC1020_API int nc1020_restore(nc1020_t *session, const void *buffer, size_t size);
+NC1020_API void nc1020_get_stats(nc1020_t *session, nc1020_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBNC1020_H_ */
@@ -5,10 +5,27 @@
 #include <stdint.h>
 #include <string>
 namespace wqx {
+/**
+ * @brief Results of IWqxHal::requestNorPage() and IWqxHal::requestRomPage().
+ */
+enum page_load_t {
+    /**
+     * @brief The page is mapped to IWqxHal::page.
+     */
+    PAGE_LOAD_READY = 0,
+    /**
+     * @brief The page is still loading. The request is repeated until it is ready.
+     */
+    PAGE_LOAD_PENDING,
+    PAGE_LOAD_FAILED,
+};
+
 /**
  * @brief Interface for HAL.
  * @details
  * Implement this for your OS/board and pass an instance to Initialize() to get started.
+ * @note Builds that define NC1020_HAL bind the core to that class at build time, and every HAL passed to the core must
+ * be one. See src/besta_hal.h.
  */
 class IWqxHal {
 public:
@@ -60,6 +77,23 @@ public:
      * @retval false Failure.
      */
     virtual bool loadRomPage(uint32_t volume, uint32_t page) = 0;
+    /**
+     * @brief Asynchronous variant of loadNorPage(), used for bank switches once enabled with SetAsyncPageLoads().
+     * @details Start loading the page if needed and return right away. While it returns PAGE_LOAD_PENDING, the guest
+     * stays stopped at an instruction boundary and the request is repeated on every run call. The default
+     * implementation calls loadNorPage().
+     * @param page Source page number. Same as in loadNorPage().
+     * @return PAGE_LOAD_READY once IWqxHal::page points to the page.
+     */
+    virtual page_load_t requestNorPage(uint32_t page);
+    /**
+     * @brief Asynchronous variant of loadRomPage(). See requestNorPage().
+     * @details The default implementation calls loadRomPage().
+     * @param volume Volume index. Same as in loadRomPage().
+     * @param page Page number. Same as in loadRomPage().
+     * @return PAGE_LOAD_READY once IWqxHal::page points to the page.
+     */
+    virtual page_load_t requestRomPage(uint32_t volume, uint32_t page);
     /**
      * @brief Map a page from BBS ROM image to the scratch pad buffer IWqxHal::bbs.
      * @param volume Volume index. Volume is defined as the first 128KiB of the 8MiB chunks within the simulator ROM
@@ -87,16 +121,624 @@ public:
      * @retval false Failure.
      */
     virtual bool loadState(char *states, size_t size) = 0;
+    /**
+     * @brief Append emulator states to the ones in persistent storage.
+     * @details Used by SaveNC1020() to add incremental states without rewriting the whole file. LoadNC1020() then
+     * reads up to 16KiB past the end of the first state with loadState(), so a short read there must still succeed
+     * with the rest of the buffer left untouched. The default implementation returns false, which makes every save
+     * rewrite the whole state.
+     * @param[in] states Serialized emulator states.
+     * @param size Size of serialized emulator states.
+     * @retval true Success.
+     * @retval false Failure or not supported.
+     */
+    virtual bool appendState(const char *states, size_t size);
+    /**
+     * @brief Get a monotonic host timestamp.
+     * @details Only used for reporting and pacing decisions, never for guest timing. The default implementation
+     * returns 0, which marks host timing as unavailable.
+     * @return Host time in microseconds.
+     */
+    virtual uint64_t getMonotonicMicros();
+    /**
+     * @brief Save the boot cache to persistent storage.
+     * @details Same contract as saveState(), but for the post-boot state kept by BootNC1020(). The default
+     * implementation returns false, which disables the boot cache.
+     * @param[in] states Serialized emulator states.
+     * @param size Size of serialized emulator states.
+     * @retval true Success.
+     * @retval false Failure or not supported.
+     */
+    virtual bool saveBootCache(const char *states, size_t size);
+    /**
+     * @brief Load the boot cache from persistent storage.
+     * @details Same contract as loadState(). The default implementation returns false.
+     * @param[out] states Serialized emulator states.
+     * @param size Size of serialized emulator states.
+     * @retval true Success.
+     * @retval false Failure or not supported.
+     */
+    virtual bool loadBootCache(char *states, size_t size);
+    /**
+     * @brief Start a new input log, replacing any previous one.
+     * @details Called by StartInputRecording() with the log header and the starting state. The default implementation
+     * returns false, which disables input recording.
+     * @param[in] data Log data.
+     * @param size Size of log data.
+     * @retval true Success.
+     * @retval false Failure or not supported.
+     */
+    virtual bool saveInputLog(const char *data, size_t size);
+    /**
+     * @brief Append records to the input log started by saveInputLog().
+     * @details The default implementation returns false.
+     * @param[in] data Log data.
+     * @param size Size of log data.
+     * @retval true Success.
+     * @retval false Failure or not supported.
+     */
+    virtual bool appendInputLog(const char *data, size_t size);
+};
+
+/**
+ * @brief Results of a RunTurbo() call.
+ */
+struct turbo_stats_t {
+    /**
+     * @brief Guest CPU cycles executed.
+     */
+    uint64_t guest_cycles;
+    /**
+     * @brief Guest time executed in milliseconds.
+     */
+    uint32_t guest_ms;
+    /**
+     * @brief Host time spent in microseconds. 0 when the HAL does not provide a clock.
+     */
+    uint64_t host_us;
+    /**
+     * @brief Achieved emulated clock in kHz. 0 when unknown.
+     */
+    uint32_t emulated_khz;
+    /**
+     * @brief Achieved speed relative to real time in percent. 0 when unknown.
+     */
+    uint32_t speed_percent;
+};
+
+/**
+ * @brief Condition flags for run_condition_t::flags.
+ */
+enum {
+    /**
+     * @brief Stop when the next instruction to execute is at run_condition_t::pc.
+     */
+    RUN_UNTIL_PC = 1 << 0,
+    /**
+     * @brief Stop at the first instruction boundary where GetCycleCount() reaches run_condition_t::cycle.
+     */
+    RUN_UNTIL_CYCLE = 1 << 1,
+    /**
+     * @brief Stop when the guest changes a byte in the LCD buffer.
+     */
+    RUN_UNTIL_LCD = 1 << 2,
+    /**
+     * @brief Stop when the RAM byte at run_condition_t::ram_addr masked by run_condition_t::ram_mask equals
+     * run_condition_t::ram_value.
+     * @details Like RUN_UNTIL_LCD, this sees every way the guest changes RAM: stores, stack pushes, I/O register
+     * writes and zp40 window swaps.
+     */
+    RUN_UNTIL_RAM = 1 << 3,
+    /**
+     * @brief Stop when the guest goes to sleep.
+     */
+    RUN_UNTIL_SLEEP = 1 << 4,
+    /**
+     * @brief Stop when a guest frame completes. See CopyLcdFrame().
+     */
+    RUN_UNTIL_FRAME = 1 << 5,
+    /**
+     * @brief Stop when the macro engine has typed every queued key. See QueueMacro().
+     */
+    RUN_UNTIL_MACRO = 1 << 6,
+};
+
+/**
+ * @brief Stop conditions for RunUntil(). Any of the conditions enabled in `flags` stops the run.
+ */
+struct run_condition_t {
+    uint32_t flags;
+    uint16_t pc;
+    /**
+     * @brief Bank (`ram_io[0x00]`) the PC condition is qualified with. -1 matches any bank.
+     */
+    int16_t pc_bank;
+    /**
+     * @brief Volume (`ram_io[0x0D]`) the PC condition is qualified with. -1 matches any volume.
+     */
+    int16_t pc_volume;
+    uint64_t cycle;
+    /**
+     * @brief Offset into the 32KiB guest RAM.
+     */
+    uint16_t ram_addr;
+    uint8_t ram_value;
+    uint8_t ram_mask;
+};
+
+/**
+ * @brief Results of ReplayInputLog().
+ */
+struct replay_result_t {
+    /**
+     * @brief Guest cycles replayed.
+     */
+    uint64_t guest_cycles;
+    /**
+     * @brief Host time the replay took, from IWqxHal::getMonotonicMicros(). 0 when unavailable.
+     */
+    uint64_t host_us;
+    /**
+     * @brief Key events replayed.
+     */
+    uint32_t events;
+    /**
+     * @brief State hash checkpoints checked.
+     */
+    uint32_t checkpoints;
+    /**
+     * @brief Set when a checkpoint didn't match the recording. The replay stops there.
+     */
+    bool diverged;
+    /**
+     * @brief Guest cycle of the checkpoint that didn't match.
+     */
+    uint64_t diverged_cycle;
+};
+
+enum stop_reason_t {
+    STOP_TIMEOUT = 0,
+    STOP_PC,
+    STOP_CYCLE,
+    STOP_LCD,
+    STOP_RAM,
+    STOP_SLEEP,
+    STOP_FRAME,
+    STOP_MACRO,
+    /**
+     * @brief The guest waits for a page load. See SetAsyncPageLoads().
+     */
+    STOP_PAGE,
+};
+
+/**
+ * @brief Speed governor state and decisions.
+ */
+struct governor_stats_t {
+    bool enabled;
+    /**
+     * @brief Current effective guest clock in Hz.
+     */
+    uint32_t current_hz;
+    uint32_t min_hz;
+    uint32_t max_hz;
+    /**
+     * @brief Smoothed host time spent per guest time in permille. Above 1000 means the host falls behind real time.
+     */
+    uint32_t load_permille;
+    /**
+     * @brief Number of sampling windows evaluated.
+     */
+    uint32_t samples;
+    /**
+     * @brief Number of times the guest clock was raised.
+     */
+    uint32_t raised;
+    /**
+     * @brief Number of times the guest clock was lowered.
+     */
+    uint32_t lowered;
+};
+
+/**
+ * @brief Core event counters. See GetStats().
+ * @details Counting is compiled in with NC1020_STATS (the `stats` build option), so builds without it pay nothing.
+ */
+struct machine_stats_t {
+    /**
+     * @brief Whether the counters are compiled in. All counters are 0 when they aren't.
+     */
+    bool enabled;
+    uint64_t instructions;
+    uint64_t cycles;
+    /**
+     * @brief Interrupts taken by the guest, not counting BRK.
+     */
+    uint64_t irqs;
+    /**
+     * @brief Banks mapped at 0x4000, by the guest or by loading a state.
+     */
+    uint64_t bank_switches;
+    uint64_t volume_switches;
+    /**
+     * @brief Swaps of the zero page window at 0x40.
+     */
+    uint64_t zp40_swaps;
+    /**
+     * @brief NOR flash command sequences the guest issued.
+     */
+    uint64_t flash_commands;
+    /**
+     * @brief NOR, ROM and BBS pages requested from the HAL.
+     */
+    uint64_t page_loads;
+    /**
+     * @brief Stores that missed RAM, which go through the flash command decoder.
+     */
+    uint64_t store_slow;
+};
+
+struct MachineState;
+
+/**
+ * @brief An emulated machine.
+ * @details The free functions below operate on a default machine set up by Initialize(). More machines can be
+ * created with begin() or fork() and run on separate threads, as long as each one has its own HAL. Methods behave
+ * like the free functions of the same name.
+ */
+class Machine {
+public:
+    Machine();
+    ~Machine();
+    /**
+     * @brief Set up the machine. Same as Initialize().
+     * @retval true Success.
+     * @retval false Out of memory.
+     */
+    bool begin(IWqxHal *hal, uint32_t cpu_speed);
+    /**
+     * @brief Tear down the machine.
+     */
+    void end();
+    /**
+     * @brief Create a copy of this machine that can run independently.
+     * @details RAM and device states are copied. NOR pages are shared copy-on-write between the machine and all its
+     * forks, so the cost of a fork grows with the NOR pages later written rather than with the size of the flash.
+     * Once a machine has been forked, its NOR writes are kept in memory and no longer reach IWqxHal::saveNorPage().
+     * @param[out] child Machine to set up as the copy. Anything it held before is released.
+     * @param hal HAL of the copy. Must serve the same ROM, BBS and NOR images as the HAL of this machine.
+     * @retval true Success.
+     * @retval false Out of memory, or this machine is not set up.
+     */
+    bool fork(Machine &child, IWqxHal *hal);
+
+    void reset();
+    void setKey(uint8_t key_id, bool down_or_up);
+    void releaseAllKeys();
+    bool queueKey(uint64_t cycle, uint8_t key_id, bool down_or_up);
+    void clearKeyQueue();
+    bool queueMacro(const uint8_t *keys, size_t count);
+    bool typeText(const char *text);
+    void setMacroTiming(uint8_t hold_scans, uint8_t release_scans);
+    size_t getMacroPending();
+    void cancelMacro();
+    bool startInputRecording(uint32_t checkpoint_ms);
+    bool stopInputRecording();
+    bool replayInputLog(const uint8_t *log, size_t size, replay_result_t *result);
+    void runTimeSlice(uint32_t time_slice, bool speed_up);
+    void runTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats);
+    stop_reason_t runTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats);
+    stop_reason_t runUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up);
+    void setAsyncPageLoads(bool enabled);
+    bool isWaitingForPage();
+    uint64_t getCycleCount();
+    void setCpuSpeed(uint32_t cpu_speed);
+    uint32_t getCpuSpeed();
+    void setGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz);
+    void getGovernorStats(governor_stats_t *stats);
+    void getStats(machine_stats_t *stats);
+    void resetStats();
+    bool copyLcdBuffer(uint8_t *buffer);
+    const uint8_t *getLcdBuffer();
+    uint32_t copyLcdDirtyRows(uint8_t *buffer, uint32_t *rows);
+    bool copyLcdFrame(uint8_t *buffer, uint64_t *cycle = nullptr);
+    size_t getStatesSizeBound(uint32_t flags);
+    size_t saveStatesToBuffer(uint8_t *buffer, size_t capacity, uint32_t flags);
+    bool loadStatesFromBuffer(const uint8_t *buffer, size_t size);
+    size_t getSnapshotSize();
+    size_t snapshot(void *buffer, size_t capacity);
+    bool restore(const void *buffer, size_t size);
+    bool load();
+    bool save(uint32_t flags = 0);
+    bool boot(uint32_t boot_ms);
+
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+private:
+    friend bool Fork(Machine &child, IWqxHal *hal);
+
+    MachineState *state;
 };
 
 extern void Initialize(IWqxHal *, uint32_t);
 extern void Reset();
 extern void SetKey(uint8_t, bool);
 extern void ReleaseAllKeys();
+/**
+ * @brief Press or release a key at a given guest cycle.
+ * @details The run functions stop at `cycle` and apply the change there, so input lands at the same guest cycle no
+ * matter how long the host's time slices are, and presses shorter than a slice aren't lost. Events are applied in the
+ * order they are queued. An event stamped before an earlier queued one is applied together with it, and one stamped at
+ * or before GetCycleCount() is applied when the next run starts. Any number of keys can be held at once. The queue is
+ * cleared by Reset(), by restoring a snapshot and by loading a state.
+ * @param cycle GetCycleCount() value to apply the change at.
+ * @param key_id Key ID, same as SetKey().
+ * @param down_or_up true to press the key, false to release it.
+ * @retval true The event was queued.
+ * @retval false The queue is full (64 events).
+ */
+extern bool QueueKey(uint64_t cycle, uint8_t key_id, bool down_or_up);
+/**
+ * @brief Drop all key events queued by QueueKey() without applying them.
+ */
+extern void ClearKeyQueue();
+/**
+ * @brief Type a sequence of keys as fast as the guest firmware takes them.
+ * @details Each key is pressed until the firmware has scanned its keypad row a number of times, then released until
+ * it has scanned the row a number of times again, before the next key is pressed. No fixed delays are involved, so
+ * typing keeps up with whatever rate the firmware scans at, including under RunTurbo(). Use RUN_UNTIL_MACRO to run
+ * exactly until the last key is typed. Key changes go through SetKey(), so they are recorded by
+ * StartInputRecording(). The macro is dropped on Reset(), a restore or a state load.
+ * @param[in] keys Key IDs to type, in order.
+ * @param count Number of keys.
+ * @retval true The keys were queued after the ones still pending.
+ * @retval false Not enough room for all of them. Nothing was queued.
+ */
+extern bool QueueMacro(const uint8_t *keys, size_t count);
+/**
+ * @brief Type text with QueueMacro().
+ * @details Letters (either case), space, `.` and `\n` (enter) are supported.
+ * @retval true The text was queued.
+ * @retval false The text contains other characters or doesn't fit. Nothing was queued.
+ */
+extern bool TypeText(const char *text);
+/**
+ * @brief Set how many keypad row scans a macro key is held down and released for.
+ * @details Lower is faster but may be too short for the firmware's debouncing. 0 selects the default of 2.
+ */
+extern void SetMacroTiming(uint8_t hold_scans, uint8_t release_scans);
+/**
+ * @brief Get the number of macro keys not typed yet, including the one being typed.
+ */
+extern size_t GetMacroPending();
+/**
+ * @brief Drop the pending macro keys and release the one being typed.
+ */
+extern void CancelMacro();
+/**
+ * @brief Start recording input for deterministic replay.
+ * @details Saves the current state including written NOR pages with IWqxHal::saveInputLog(), then logs every key
+ * change, clock change and `speed_up` change with the guest cycle it happened at through IWqxHal::appendInputLog().
+ * A hash of the guest state is logged every `checkpoint_ms` of guest time, so ReplayInputLog() can tell when a replay
+ * stops following the recording. Recording stops on StopInputRecording(), Reset(), a restore or a state load.
+ * @param checkpoint_ms Guest time between two state hash checkpoints in milliseconds. 0 selects 1000.
+ * @retval true Recording started.
+ * @retval false Out of memory or the HAL can't save input logs.
+ */
+extern bool StartInputRecording(uint32_t checkpoint_ms);
+/**
+ * @brief Finish the input log with a last checkpoint and write out the buffered records.
+ * @retval true Success.
+ * @retval false Not recording, or the HAL failed to append.
+ */
+extern bool StopInputRecording();
+/**
+ * @brief Replay an input log headless, as fast as the host allows.
+ * @details Loads the starting state, then runs the guest to the cycle of every record and applies it, which
+ * reproduces the recorded session exactly given the same ROM. Guest NOR writes go through the HAL like in a normal
+ * run, so replay against a scratch copy of the NOR image. The governor is disabled.
+ * @param[in] log Whole input log.
+ * @param size Size of the input log.
+ * @param[out] result Optional replay results, also filled when the replay diverged.
+ * @retval true The whole log was replayed and every checkpoint matched.
+ * @retval false The log is invalid or the replay diverged.
+ */
+extern bool ReplayInputLog(const uint8_t *log, size_t size, replay_result_t *result);
 extern void RunTimeSlice(uint32_t, bool);
+/**
+ * @brief Run the guest as fast as the host allows.
+ * @details Guest timers and the RTC advance by guest cycles exactly like RunTimeSlice() with `speed_up` unset, so
+ * guest time stays consistent no matter how fast the host is.
+ * @param guest_ms Guest time to run in milliseconds. 0 runs until `until` returns true. With no `until` either,
+ * nothing is run and `stats` reports an empty run.
+ * @param until Optional predicate checked between chunks of guest time. Stops the run when it returns true.
+ * @param context Opaque pointer passed to `until`.
+ * @param[out] stats Optional run statistics.
+ */
+extern void RunTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats);
+/**
+ * @brief Run the guest as fast as the host allows until a condition is met.
+ * @param guest_ms Guest time to run at most in milliseconds. 0 runs until the condition is met.
+ * @param cond Stop condition.
+ * @param[out] stats Optional run statistics.
+ * @return Reason the run stopped. STOP_TIMEOUT if `guest_ms` elapsed first.
+ */
+extern stop_reason_t RunTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats);
+/**
+ * @brief Run for at most one time slice, returning at the first instruction boundary where `cond` is met.
+ * @details Checks are only compiled into a separate copy of the interpreter, so RunTimeSlice() is unaffected.
+ * @param cond Stop condition.
+ * @param max_ms Maximum guest time to run in milliseconds.
+ * @param speed_up Same as in RunTimeSlice().
+ * @return Reason the run stopped. STOP_TIMEOUT if `max_ms` elapsed first.
+ */
+extern stop_reason_t RunUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up);
+/**
+ * @brief Let the HAL load ROM and NOR pages without blocking the run.
+ * @details When enabled, bank switches go through IWqxHal::requestNorPage() and IWqxHal::requestRomPage(). When a
+ * page isn't ready, the guest stops after the instruction that switched banks and RunTimeSlice() returns early, so the
+ * host thread can do other work while the HAL loads it. Later RunTimeSlice() and RunUntil() calls ask the HAL again
+ * and return straight away until the page is ready, then carry on from the same instruction. Guest state and timing
+ * are the same as with synchronous loads. RunTurbo(), BootNC1020() and ReplayInputLog() have nothing to yield to and
+ * still wait for pages. While enabled, runs use the interpreter copy of RunUntil(), which is a little slower.
+ * Builds with `NC1020_NO_ASYNC_PAGES` defined ignore this and always load synchronously.
+ * @param enabled Whether to load pages asynchronously. Disabling it loads a pending page synchronously.
+ */
+extern void SetAsyncPageLoads(bool enabled);
+/**
+ * @brief Check whether the guest is stopped waiting for a page load. See SetAsyncPageLoads().
+ */
+extern bool IsWaitingForPage();
+/**
+ * @brief Get the number of guest CPU cycles executed since the last reset.
+ */
+extern uint64_t GetCycleCount();
+/**
+ * @brief Change the effective guest clock without reinitializing.
+ * @details Timer periods are rescaled so the guest timers and RTC keep running at real time rate.
+ * @param cpu_speed Guest CPU clock in Hz.
+ */
+extern void SetCpuSpeed(uint32_t cpu_speed);
+extern uint32_t GetCpuSpeed();
+/**
+ * @brief Enable or disable the automatic speed governor.
+ * @details When enabled, RunTimeSlice() measures host time using IWqxHal::getMonotonicMicros() and lowers the
+ * guest clock when the host falls behind real time, then raises it back when there is headroom. After lowering the
+ * clock it is held for a while, so a host clock that is coarser than a time slice doesn't make it oscillate. RunTurbo()
+ * and RunUntil() are not paced by real time and are ignored by the governor.
+ * @param enabled Whether the governor is enabled.
+ * @param min_hz Lowest guest clock to use. 0 selects 1/8 of the default clock.
+ * @param max_hz Highest guest clock to use. 0 selects the default clock.
+ */
+extern void SetGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz);
+extern void GetGovernorStats(governor_stats_t *stats);
+/**
+ * @brief Get the core event counters accumulated since Initialize() or the last ResetStats().
+ * @details Counters keep running across Reset(), restores and state loads.
+ */
+extern void GetStats(machine_stats_t *stats);
+extern void ResetStats();
 extern bool CopyLcdBuffer(uint8_t*);
-extern void LoadNC1020();
-extern void SaveNC1020();
+/**
+ * @brief Get the LCD buffer in guest RAM without copying it.
+ * @details The 1600 bytes are laid out like CopyLcdBuffer() output and change as the guest runs, so read them between
+ * runs. The pointer stays valid until the machine is torn down, but the guest may move its LCD buffer on a reset or a
+ * restore, so get it again after those.
+ * @return LCD buffer, or null when the guest hasn't set one up yet.
+ */
+extern const uint8_t *GetLcdBuffer();
+/**
+ * @brief Copy the LCD rows that changed since the last call.
+ * @details Rows are 20 bytes each. Stores that leave the LCD buffer unchanged don't count, and every row counts as
+ * changed after a reset, a restore or a state load. When nothing changed this only checks a bitmask. Guest stores
+ * only track rows once this, CopyLcdFrame() or a RUN_UNTIL_FRAME run was used, so the first call reports every row.
+ * @param[in,out] buffer 1600 byte LCD buffer holding the frame of the previous call. Only changed rows are written.
+ * @param[out] rows Optional. 3 words receiving the rows copied, bit `row % 32` of word `row / 32`.
+ * @return Number of rows copied. 0 when the LCD is unchanged or not set up yet.
+ */
+extern uint32_t CopyLcdDirtyRows(uint8_t *buffer, uint32_t *rows);
+/**
+ * @brief Copy the last complete guest frame if it wasn't copied yet.
+ * @details Guest LCD writes are grouped into bursts, checked at every timer1 tick. A burst completes a frame once a
+ * whole timer1 period (1/256 s) passes without LCD writes, or after 1/20 s of continuous drawing. The frame is latched
+ * at that point, so it is never half drawn and later writes don't affect it until the next frame completes. When more
+ * than one frame completes between two calls, only the newest one is kept. Frames are only detected from the first
+ * call on, see CopyLcdDirtyRows().
+ * @param[out] buffer 1600 byte LCD buffer. Untouched when there is no new frame.
+ * @param[out] cycle Optional. GetCycleCount() at the timer1 tick that saw the last write of the frame.
+ * @retval true A new frame was copied.
+ * @retval false No frame completed since the last call.
+ */
+extern bool CopyLcdFrame(uint8_t *buffer, uint64_t *cycle = nullptr);
+/**
+ * @brief Flags for save states.
+ */
+enum {
+    /**
+     * @brief Include NOR pages written since Initialize() so a single state captures the whole session.
+     */
+    STATE_INCLUDE_NOR = 1 << 0,
+    /**
+     * @brief Only store the RAM and NOR blocks written since the last checkpoint.
+     * @details The checkpoint is the last state successfully saved with SaveStatesToBuffer() or loaded with
+     * LoadStatesFromBuffer(). The resulting state only loads when appended to the states since then. Without a
+     * checkpoint a full state is saved instead.
+     */
+    STATE_INCREMENTAL = 1 << 1,
+};
+
+/**
+ * @brief Get the largest possible size of a serialized state.
+ * @param flags Save state flags.
+ */
+extern size_t GetStatesSizeBound(uint32_t flags);
+/**
+ * @brief Serialize the emulator states into a versioned, compressed, chunked state.
+ * @details A successful call sets a new checkpoint for STATE_INCREMENTAL.
+ * @param[out] buffer Output buffer.
+ * @param capacity Size of the output buffer. GetStatesSizeBound() bytes are always enough.
+ * @param flags Save state flags.
+ * @return Size of the serialized state, or 0 if the buffer is too small.
+ */
+extern size_t SaveStatesToBuffer(uint8_t *buffer, size_t capacity, uint32_t flags);
+/**
+ * @brief Load emulator states from a chunked state or a legacy version 6 dump.
+ * @details The machine is reset first, and stays reset if the state is invalid. Incremental states appended after
+ * the first one are applied in order up to the first one that is truncated or doesn't belong to the chain.
+ * @retval true Success.
+ * @retval false Invalid or unsupported state.
+ */
+extern bool LoadStatesFromBuffer(const uint8_t *buffer, size_t size);
+/**
+ * @brief Get the size of a snapshot of the current machine.
+ * @details The size only changes when the set of written NOR pages changes.
+ */
+extern size_t GetSnapshotSize();
+/**
+ * @brief Capture the machine into a caller provided buffer.
+ * @details Captures CPU registers, RAM, memory mapping, device and flash states and the NOR pages written since
+ * Initialize(). Snapshots are raw copies only meant to be restored by the same build with the same HAL. Use
+ * SaveStatesToBuffer() for portable states.
+ * @param[out] buffer Output buffer.
+ * @param capacity Size of the output buffer. Must be at least GetSnapshotSize().
+ * @return Size of the snapshot, or 0 if the buffer is too small.
+ */
+extern size_t Snapshot(void *buffer, size_t capacity);
+/**
+ * @brief Restore the machine from a snapshot taken by Snapshot().
+ * @details Banks are only reloaded through the HAL when the snapshot maps different pages than the current state,
+ * and NOR is only touched when it changed since the snapshot. NOR writes made after the first Snapshot() call are
+ * undone. Snapshots with a memory mapping, LCD address or CPU speed out of range are rejected before anything is
+ * changed.
+ * @retval true Success.
+ * @retval false Not a valid snapshot. The machine is left as it was.
+ */
+extern bool Restore(const void *buffer, size_t size);
+extern bool LoadNC1020();
+/**
+ * @brief Save the emulator states through the HAL.
+ * @details With STATE_INCREMENTAL, the changes since the last save are appended with IWqxHal::appendState() when
+ * possible. The whole state is rewritten instead for the first save after LoadNC1020(), once the appended states
+ * reach 16KiB, or when appending fails.
+ * @param flags Save state flags.
+ */
+extern bool SaveNC1020(uint32_t flags = 0);
+/**
+ * @brief Cold boot the machine, resuming from the boot cache when possible.
+ * @details The boot cache holds the state `boot_ms` of guest time after reset, along with a hash of every ROM, BBS and
+ * NOR page the firmware read on the way there. When the cache was made with the same `boot_ms` and CPU speed and all
+ * those pages still match, the state is loaded straight away. Otherwise the machine is reset, the boot is run without
+ * pacing and a new cache is stored with IWqxHal::saveBootCache().
+ * @param boot_ms Guest time to run after reset. The cached state is taken at that point.
+ * @retval true Resumed from the boot cache.
+ * @retval false Booted from reset.
+ */
+extern bool BootNC1020(uint32_t boot_ms);
+/**
+ * @brief Fork the machine set up by Initialize(). See Machine::fork().
+ */
+extern bool Fork(Machine &child, IWqxHal *hal);
 }
 
 #endif /* NC1020_H_ */
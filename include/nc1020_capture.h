@@ -0,0 +1,85 @@
+#ifndef NC1020_CAPTURE_H_
+#define NC1020_CAPTURE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+
+namespace wqx {
+/**
+ * @brief Records LCD frames to a file on a background thread.
+ * @details Every frame that differs from the previous one is stored as the XOR against that frame, run-length encoded,
+ * along with its guest cycle count. Unchanged screens cost nothing, and typical UI updates cost a few dozen bytes. The
+ * emulation thread only copies frames into a fixed-size queue, so recording never waits on encoding or disk I/O. Frames
+ * that arrive while the queue is full are dropped and counted.
+ *
+ * File format, little endian: "NCLC", u32 version (1), u32 cpu speed in Hz at the start of the capture, u32 reserved.
+ * Each frame follows as a varint cycle delta from the previous frame (or from 0 for the first frame), then pairs of
+ * varints counting unchanged and changed bytes, each pair followed by the changed bytes XOR the previous frame, until
+ * all 1600 bytes are covered. The first frame is XORed against an all clear screen. `scripts/lcdcap2pbm.py` turns
+ * captures into PBM images.
+ */
+class LcdCapture {
+public:
+    LcdCapture();
+    ~LcdCapture();
+    /**
+     * @brief Create the capture file and start the encoder thread.
+     * @param path File to write. Truncated if it exists.
+     * @param queue_frames Number of frames the queue holds before frames are dropped.
+     * @retval true Success.
+     * @retval false The file can't be created or out of memory.
+     */
+    bool begin(const char *path, uint32_t queue_frames = 64);
+    /**
+     * @brief Encode the queued frames, stop the encoder thread and close the file.
+     */
+    void end();
+    /**
+     * @brief Queue a 1600 byte LCD frame taken at guest cycle `cycle`.
+     * @details Frames identical to the previously queued one are skipped. Frames usually come from CopyLcdFrame(),
+     * which hands each frame out once, so fetch it once and push it to every output.
+     * @retval true The frame was queued or skipped.
+     * @retval false The queue is full and the frame was dropped.
+     */
+    bool push(const uint8_t *lcd, uint64_t cycle);
+    /**
+     * @brief Get the number of frames written to the file so far.
+     */
+    uint32_t written() const;
+    /**
+     * @brief Get the number of frames dropped because the queue was full.
+     */
+    uint32_t dropped() const;
+
+private:
+    struct Frame {
+        uint64_t cycle;
+        uint8_t lcd[1600];
+    };
+
+    void run();
+    void encode(const Frame &frame);
+
+    FILE *file;
+    Frame *queue;
+    size_t queueSize;
+    // Frames pushed and frames encoded so far. The slot of frame `n` is `n % queueSize`.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<bool> stopping;
+    std::atomic<uint32_t> framesWritten;
+    std::atomic<uint32_t> framesDropped;
+    std::thread encoder;
+    // Owned by the emulation thread.
+    uint8_t lastPushed[1600];
+    bool hasLastPushed;
+    // Owned by the encoder thread.
+    uint8_t lastEncoded[1600];
+    uint64_t lastCycle;
+};
+}
+
+#endif /* NC1020_CAPTURE_H_ */
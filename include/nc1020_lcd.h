@@ -0,0 +1,103 @@
+#ifndef NC1020_LCD_H_
+#define NC1020_LCD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wqx {
+/**
+ * @brief Width of the LCD in pixels.
+ */
+static const uint32_t LCD_WIDTH = 160;
+/**
+ * @brief Height of the LCD in pixels.
+ */
+static const uint32_t LCD_HEIGHT = 80;
+/**
+ * @brief Largest scale factor accepted by the ConvertLcd functions.
+ */
+static const uint32_t LCD_MAX_SCALE = 8;
+
+/**
+ * @brief Expand the 1bpp LCD buffer to 8bpp pixels.
+ * @details The LCD buffer is the 1600 bytes filled by CopyLcdBuffer() or CopyLcdDirtyRows(), 20 bytes per row with the
+ * leftmost pixel in the most significant bit. Each LCD pixel becomes a `scale` by `scale` block of output pixels.
+ * @param[in] lcd LCD buffer.
+ * @param[out] out Top left output pixel. Must hold `LCD_HEIGHT * scale` rows of `LCD_WIDTH * scale` pixels.
+ * @param pitch Distance between two output rows in bytes.
+ * @param scale Scale factor from 1 to LCD_MAX_SCALE.
+ * @param palette Output values for cleared and set LCD pixels.
+ * @param rows Optional. Only convert the LCD rows set in this mask, in the format returned by CopyLcdDirtyRows().
+ * @retval true Success.
+ * @retval false Scale out of range.
+ */
+extern bool ConvertLcd8(const uint8_t *lcd, uint8_t *out, size_t pitch, uint32_t scale, const uint8_t palette[2],
+                        const uint32_t *rows = nullptr);
+/**
+ * @brief Expand the 1bpp LCD buffer to 16bpp pixels.
+ * @details Same as ConvertLcd8(), with 16 bit palette entries such as RGB565.
+ */
+extern bool ConvertLcd16(const uint8_t *lcd, uint16_t *out, size_t pitch, uint32_t scale, const uint16_t palette[2],
+                         const uint32_t *rows = nullptr);
+/**
+ * @brief Expand the 1bpp LCD buffer to 32bpp pixels.
+ * @details Same as ConvertLcd8(), with 32 bit palette entries such as the 0xRRGGBB values of a muteki surface palette.
+ */
+extern bool ConvertLcd32(const uint8_t *lcd, uint32_t *out, size_t pitch, uint32_t scale, const uint32_t palette[2],
+                         const uint32_t *rows = nullptr);
+/**
+ * @brief Name of the instruction set the conversion kernels were built for.
+ */
+extern const char *GetLcdKernelName();
+
+/**
+ * @brief Simulated LCD pixel response.
+ * @details The real LCD takes several frames to fully turn a pixel on or off, and some firmware animations rely on that
+ * by flickering pixels for grey shades. This keeps an 8-bit level per pixel, 0 for cleared and 255 for set, that moves
+ * toward every frame passed to blend() by a fraction of the remaining distance.
+ */
+class LcdPersistence {
+public:
+    LcdPersistence();
+    /**
+     * @brief Set how fast pixels follow the LCD.
+     * @param rise Fraction of the distance moved per frame by pixels that are set, in 1/256 units from 1 to 256.
+     * @param fall Same for pixels that are cleared.
+     */
+    void setResponse(uint32_t rise, uint32_t fall);
+    /**
+     * @brief Set every level to match an LCD buffer, or clear them all when `lcd` is null.
+     */
+    void reset(const uint8_t *lcd = nullptr);
+    /**
+     * @brief Move every level toward an LCD buffer filled by CopyLcdBuffer().
+     * @details Call this once per host frame, whether or not the LCD changed.
+     */
+    void blend(const uint8_t *lcd);
+    /**
+     * @brief Get the levels, LCD_WIDTH bytes per row.
+     */
+    const uint8_t *levels() const;
+    /**
+     * @brief Convert the levels to 8bpp pixels.
+     * @details Output pixels are interpolated between the two palette entries. Other parameters are the same as
+     * ConvertLcd8().
+     */
+    bool convert8(uint8_t *out, size_t pitch, uint32_t scale, const uint8_t palette[2]) const;
+    /**
+     * @brief Convert the levels to RGB565 pixels.
+     */
+    bool convert16(uint16_t *out, size_t pitch, uint32_t scale, const uint16_t palette[2]) const;
+    /**
+     * @brief Convert the levels to 32bpp pixels, interpolating each byte separately.
+     */
+    bool convert32(uint32_t *out, size_t pitch, uint32_t scale, const uint32_t palette[2]) const;
+
+private:
+    uint8_t levelBuffer[LCD_WIDTH * LCD_HEIGHT];
+    uint32_t rise;
+    uint32_t fall;
+};
+}
+
+#endif /* NC1020_LCD_H_ */
@@ -0,0 +1,86 @@
+#ifndef NC1020_POSIX_H_
+#define NC1020_POSIX_H_
+
+#include "nc1020.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wqx {
+/**
+ * @brief IWqxHal implementation on POSIX files.
+ * @details The ROM, NOR and BBS images are mapped into memory copy-on-write by open(), so page loads only move
+ * pointers and every instance opened on the same files shares their memory. This keeps host I/O out of emulation
+ * profiles. NOR writes stay in memory unless NOR write back is enabled, in which case they are written to the NOR image
+ * by close(), so benchmark runs don't modify the image by default. The optional state, boot cache and input log files
+ * are used when their paths are set.
+ *
+ * With SetAsyncPageLoads(), requestNorPage() and requestRomPage() check whether the page is in the page cache and, if
+ * not, have the kernel read it in the background instead of faulting it in on the emulation thread. Pages found
+ * resident are assumed to stay so.
+ */
+class PosixHal : public IWqxHal {
+public:
+    PosixHal();
+    virtual ~PosixHal();
+    /**
+     * @brief Load the ROM, NOR and BBS images in the simplified format made by `scripts/gen_simplified.py`.
+     * @retval true Success.
+     * @retval false A file is missing or too short, or out of memory.
+     */
+    bool open(const char *romPath, const char *norPath, const char *bbsPath);
+    /**
+     * @brief Write back the NOR image if enabled and release the images.
+     * @retval true Success.
+     * @retval false Writing the NOR image failed.
+     */
+    bool close();
+    /**
+     * @brief Write NOR changes back to the NOR image on close().
+     */
+    void setNorWriteBack(bool enabled);
+    /**
+     * @brief Set the file used by saveState(), loadState() and appendState(). Null disables states.
+     */
+    void setStatePath(const char *path);
+    /**
+     * @brief Set the file used by saveBootCache() and loadBootCache(). Null disables the boot cache.
+     */
+    void setBootCachePath(const char *path);
+    /**
+     * @brief Set the file used by saveInputLog() and appendInputLog(). Null disables input recording.
+     */
+    void setInputLogPath(const char *path);
+
+    virtual bool loadNorPage(uint32_t page) override;
+    virtual bool saveNorPage(uint32_t page) override;
+    virtual bool wipeNorFlash() override;
+    virtual bool loadRomPage(uint32_t volume, uint32_t page) override;
+    virtual page_load_t requestNorPage(uint32_t page) override;
+    virtual page_load_t requestRomPage(uint32_t volume, uint32_t page) override;
+    virtual bool loadBbsPage(uint32_t volume, uint32_t page) override;
+    virtual bool saveState(const char *states, size_t size) override;
+    virtual bool loadState(char *states, size_t size) override;
+    virtual bool appendState(const char *states, size_t size) override;
+    virtual uint64_t getMonotonicMicros() override;
+    virtual bool saveBootCache(const char *states, size_t size) override;
+    virtual bool loadBootCache(char *states, size_t size) override;
+    virtual bool saveInputLog(const char *data, size_t size) override;
+    virtual bool appendInputLog(const char *data, size_t size) override;
+
+private:
+    uint8_t *rom;
+    uint8_t *nor;
+    uint8_t *bbsImage;
+    const char *norPath;
+    const char *statePath;
+    const char *bootCachePath;
+    const char *inputLogPath;
+    bool norWriteBack;
+    bool norDirty;
+    // Image pages known to be resident, one bit each.
+    uint32_t romResident[0x80 * 3 / 32];
+    uint32_t norResident;
+};
+}
+
+#endif /* NC1020_POSIX_H_ */
@@ -0,0 +1,97 @@
+#ifndef NC1020_REWIND_H_
+#define NC1020_REWIND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wqx {
+class Machine;
+
+/**
+ * @brief Fixed-size ring of snapshots for stepping backwards in guest time.
+ * @details Every `interval_ms` of guest time a snapshot of the machine is taken. Most entries are stored as the
+ * XOR difference against the latest keyframe, run-length encoded over 16 byte blocks, so an entry usually only
+ * costs the RAM that changed. When the ring is full the oldest entries are dropped.
+ */
+class RewindBuffer {
+public:
+    RewindBuffer();
+    ~RewindBuffer();
+    /**
+     * @brief Allocate the ring.
+     * @param capacity Size of the ring in bytes.
+     * @param interval_ms Guest time between two entries in milliseconds.
+     * @param keyframe_interval Number of entries between two keyframes.
+     * @param machine Machine to record and restore. nullptr selects the machine set up by Initialize().
+     * @retval true Success.
+     * @retval false Out of memory.
+     */
+    bool begin(size_t capacity, uint32_t interval_ms, uint32_t keyframe_interval, Machine *machine = nullptr);
+    /**
+     * @brief Free the ring.
+     */
+    void end();
+    /**
+     * @brief Record an entry if `interval_ms` of guest time passed since the last one.
+     * @details Call this after every time slice run on the machine.
+     */
+    void tick();
+    /**
+     * @brief Record an entry now.
+     * @retval true Success.
+     * @retval false The snapshot doesn't fit in the ring.
+     */
+    bool capture();
+    /**
+     * @brief Restore the newest entry and drop it from the ring.
+     * @retval true Success.
+     * @retval false The ring is empty.
+     */
+    bool stepBack();
+    /**
+     * @brief Drop all entries.
+     */
+    void clear();
+    /**
+     * @brief Get the number of entries in the ring.
+     */
+    size_t count() const;
+    /**
+     * @brief Get the number of bytes used by entries in the ring.
+     */
+    size_t used() const;
+
+private:
+    struct Entry {
+        size_t offset;
+        size_t size;
+        size_t snapshotSize;
+        uint64_t cycle;
+        bool keyframe;
+    };
+
+    bool reserve(size_t size, size_t &offset);
+    void dropOldest();
+    bool decodeKeyframe();
+    uint64_t cycleCount();
+
+    Machine *machine;
+    uint8_t *ring;
+    size_t capacity;
+    Entry *entries;
+    size_t maxEntries;
+    size_t first;
+    size_t entryCount;
+    uint8_t *current;
+    uint8_t *keyframe;
+    size_t scratchSize;
+    size_t keyframeSize;
+    bool keyframeValid;
+    uint32_t intervalMs;
+    uint32_t keyframeInterval;
+    uint32_t sinceKeyframe;
+    uint64_t lastCycle;
+};
+}
+
+#endif /* NC1020_REWIND_H_ */
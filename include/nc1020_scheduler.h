@@ -0,0 +1,163 @@
+#ifndef NC1020_SCHEDULER_H_
+#define NC1020_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace wqx {
+/**
+ * @brief Scheduling statistics of a SchedulerTask.
+ */
+typedef struct scheduler_task_stats_s {
+    /**
+     * @brief Slices run.
+     */
+    uint32_t slices;
+    /**
+     * @brief Times the task was taken over by an idle worker.
+     */
+    uint32_t steals;
+    /**
+     * @brief Worker the task currently belongs to.
+     */
+    uint32_t worker;
+    /**
+     * @brief Time the last slice waited past its due time in microseconds.
+     */
+    uint64_t late_us;
+    /**
+     * @brief Longest such wait.
+     */
+    uint64_t max_late_us;
+} scheduler_task_stats_t;
+
+/**
+ * @brief Unit of work for Scheduler, typically one emulator session.
+ * @details A task is run by one worker at a time, one slice per run() call, so it needs no locking of its own.
+ */
+class SchedulerTask {
+public:
+    /**
+     * @brief Returned by run() to leave the scheduler.
+     */
+    static const uint64_t DONE = UINT64_MAX;
+
+    SchedulerTask();
+    virtual ~SchedulerTask();
+    /**
+     * @brief Run one slice of work.
+     * @param now_us Scheduler::NowUs() when the slice started.
+     * @return Scheduler::NowUs() time the next slice is due at, a time up to `now_us` to run again as soon as
+     * possible, 0 to wait for Scheduler::wake(), or DONE.
+     */
+    virtual uint64_t run(uint64_t now_us) = 0;
+    /**
+     * @brief Mark the task as interactive.
+     * @details Ready interactive tasks run before ready batch tasks on every worker, so a user waiting on a response
+     * preempts background work at the next slice boundary. Can be called from any thread.
+     */
+    void setInteractive(bool interactive);
+    bool isInteractive() const;
+    void getSchedulerStats(scheduler_task_stats_t *stats) const;
+
+private:
+    friend class Scheduler;
+    // Generation << 2 | state. The generation tells stale timer entries apart from the current one.
+    std::atomic<uint64_t> word;
+    std::atomic<bool> pending;
+    std::atomic<bool> interactive;
+    std::atomic<uint32_t> home;
+    std::atomic<uint32_t> slices;
+    std::atomic<uint32_t> steals;
+    std::atomic<uint64_t> lateUs;
+    std::atomic<uint64_t> maxLateUs;
+};
+
+/**
+ * @brief Runs SchedulerTask slices on a fixed pool of worker threads.
+ * @details Every task belongs to one worker, which keeps running it on the same core with warm caches. Each worker
+ * has a ready deque per class (interactive, batch) and a timer heap of tasks waiting for their due time. Workers run
+ * their own ready tasks oldest first and, when they run out, steal the newest ready task of another worker, which
+ * then belongs to the thief. Interactive tasks are taken before batch tasks, both locally and when stealing. Idle
+ * workers sleep until the earliest due time of any worker or until a task is woken.
+ */
+class Scheduler {
+public:
+    Scheduler();
+    ~Scheduler();
+    /**
+     * @brief Start `threads` workers.
+     */
+    void start(uint32_t threads);
+    /**
+     * @brief Stop the workers after their current slices and release all tasks.
+     */
+    void stop();
+    /**
+     * @brief Add a task and run it as soon as possible.
+     * @details Tasks are spread over the workers round-robin.
+     */
+    void add(const std::shared_ptr<SchedulerTask> &task);
+    /**
+     * @brief Run a task as soon as possible, even before its due time.
+     * @details If the task is running, it runs again right after the current slice. Can be called from any thread.
+     */
+    void wake(const std::shared_ptr<SchedulerTask> &task);
+    uint32_t getThreadCount() const;
+    /**
+     * @brief Get the number of tasks stolen between workers so far.
+     */
+    uint64_t getStealCount() const;
+    /**
+     * @brief Get the monotonic time used for due times in microseconds.
+     */
+    static uint64_t NowUs();
+
+private:
+    struct Ready {
+        std::shared_ptr<SchedulerTask> task;
+        uint64_t dueUs;
+    };
+    struct Timer {
+        uint64_t dueUs;
+        uint64_t generation;
+        std::shared_ptr<SchedulerTask> task;
+        bool operator<(const Timer &other) const {
+            return dueUs > other.dueUs;
+        }
+    };
+    struct Worker {
+        std::mutex mutex;
+        // Indexed by interactive, batch.
+        std::deque<Ready> ready[2];
+        std::priority_queue<Timer> timers;
+        std::atomic<uint64_t> nextDueUs;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> stopping;
+    std::atomic<uint32_t> nextHome;
+    std::atomic<uint64_t> stealCount;
+    std::mutex idleMutex;
+    std::condition_variable idleReady;
+    uint64_t signals;
+
+    void work(uint32_t index);
+    bool take(uint32_t index, uint32_t victim, int type, uint64_t nowUs, Ready *ready);
+    void promote(Worker &worker, uint64_t nowUs);
+    void runSlice(uint32_t index, Ready &ready, uint64_t nowUs);
+    void pushReady(const std::shared_ptr<SchedulerTask> &task, uint64_t dueUs);
+    uint64_t earliestDue();
+    void idle(uint64_t seen);
+};
+}
+
+#endif /* NC1020_SCHEDULER_H_ */
@@ -0,0 +1,144 @@
+#ifndef NC1020_SERVER_H_
+#define NC1020_SERVER_H_
+
+#include <stdint.h>
+
+/**
+ * @file
+ * @brief Protocol of `nc1020-server`.
+ * @details Clients talk to the server over a Unix domain stream socket. Every request and response is a
+ * server_message_t followed by `size` bytes of payload. All fields are in host byte order since both ends run on the
+ * same machine. Requests on a session are executed in order. Requests on different sessions run in parallel on the
+ * server's thread pool, so their responses can arrive in any order and are matched to requests by `tag`. A response
+ * echoes the op, session and tag of its request.
+ */
+
+namespace wqx {
+static const uint32_t SERVER_MAX_PAYLOAD = 0x100000;
+/**
+ * @brief Size of the row mask at the start of a SERVER_OP_LCD_DIFF response, one bit per LCD row.
+ */
+static const uint32_t SERVER_LCD_MASK_SIZE = 80 / 8;
+static const uint32_t SERVER_LCD_ROW_SIZE = 20;
+
+enum server_op_t {
+    /**
+     * @brief Response payload: u32 worker threads, u32 sessions.
+     */
+    SERVER_OP_INFO = 0,
+    /**
+     * @brief Create a session and reset it. Request payload: optional u32 CPU speed in Hz (0 for the default), then
+     * optional u32 SERVER_CREATE_* flags. The response carries the new session ID.
+     */
+    SERVER_OP_CREATE,
+    SERVER_OP_DESTROY,
+    /**
+     * @brief Request payload: u8 key ID, u8 non-zero for down.
+     */
+    SERVER_OP_KEY,
+    SERVER_OP_RELEASE_ALL,
+    /**
+     * @brief Type text with TypeText(). Request payload: the text, without a terminator.
+     */
+    SERVER_OP_TYPE,
+    /**
+     * @brief Run for a number of guest milliseconds as fast as possible. Request payload: u32 ms. Response payload:
+     * u64 guest cycle count afterwards.
+     */
+    SERVER_OP_RUN,
+    /**
+     * @brief Get the LCD rows that changed since the last SERVER_OP_LCD_DIFF on the session.
+     * @details The first request on a session compares against a blank screen.
+     * Response payload: SERVER_LCD_MASK_SIZE bytes with bit `row % 8` of byte `row / 8` set for each changed
+     * row, followed by SERVER_LCD_ROW_SIZE bytes for each changed row in order.
+     */
+    SERVER_OP_LCD_DIFF,
+    /**
+     * @brief Response payload: snapshot from Snapshot().
+     */
+    SERVER_OP_SNAPSHOT,
+    /**
+     * @brief Request payload: snapshot from SERVER_OP_SNAPSHOT.
+     * @details Snapshots that don't fit the session are answered with SERVER_ERROR_INVALID and leave it unchanged.
+     */
+    SERVER_OP_RESTORE,
+    /**
+     * @brief Response payload: server_session_stats_t.
+     */
+    SERVER_OP_STATS,
+};
+
+/**
+ * @brief SERVER_OP_CREATE flag: keep the session running at real-time speed on its own, like a real device.
+ * @details Other sessions only run for SERVER_OP_RUN.
+ */
+static const uint32_t SERVER_CREATE_REALTIME = 1 << 0;
+static const uint32_t SERVER_SESSION_REALTIME = 1 << 0;
+/**
+ * @brief Set while the session had input or screen requests in the last second. Interactive sessions are run ahead
+ * of the others.
+ */
+static const uint32_t SERVER_SESSION_INTERACTIVE = 1 << 1;
+/**
+ * @brief Set while the session waits for an image page read in the background. See `nc1020-server --async-pages`.
+ */
+static const uint32_t SERVER_SESSION_WAITING_PAGE = 1 << 2;
+
+enum server_status_t {
+    SERVER_OK = 0,
+    SERVER_ERROR_INVALID,
+    SERVER_ERROR_NO_SESSION,
+    SERVER_ERROR_FAILED,
+};
+
+typedef struct server_message_s {
+    /**
+     * @brief Payload size, at most SERVER_MAX_PAYLOAD.
+     */
+    uint32_t size;
+    uint8_t op;
+    /**
+     * @brief server_status_t in responses. 0 in requests.
+     */
+    uint8_t status;
+    uint16_t reserved;
+    uint32_t session;
+    /**
+     * @brief Chosen by the client.
+     */
+    uint32_t tag;
+} server_message_t;
+
+static_assert(sizeof(server_message_t) == 16, "server_message_t must be packed");
+
+typedef struct server_session_stats_s {
+    uint64_t cycles;
+    /**
+     * @brief How far a real-time session is behind host time after its last slice, in microseconds.
+     */
+    uint64_t lag_us;
+    uint64_t max_lag_us;
+    /**
+     * @brief How long the last slice waited for a worker past its due time, in microseconds.
+     */
+    uint64_t late_us;
+    uint64_t max_late_us;
+    uint32_t slices;
+    /**
+     * @brief Times the session moved to another worker.
+     */
+    uint32_t steals;
+    /**
+     * @brief Worker the session belongs to.
+     */
+    uint32_t worker;
+    /**
+     * @brief SERVER_SESSION_* flags.
+     */
+    uint32_t flags;
+} server_session_stats_t;
+
+static_assert(sizeof(server_session_stats_t) == 56, "server_session_stats_t must be packed");
+}
+
+#endif /* NC1020_SERVER_H_ */
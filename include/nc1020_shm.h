@@ -0,0 +1,151 @@
+#ifndef NC1020_SHM_H_
+#define NC1020_SHM_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wqx {
+static const uint32_t SHARED_DISPLAY_MAGIC = 0x4D53434E; // "NCSM"
+static const uint32_t SHARED_DISPLAY_VERSION = 1;
+/**
+ * @brief Entries in the key ring. A power of two.
+ */
+static const uint32_t SHARED_DISPLAY_KEYS = 256;
+/**
+ * @brief Key ring entry that releases all keys. Other entries are the key ID, plus 0x100 for key down.
+ */
+static const uint16_t SHARED_DISPLAY_RELEASE_ALL = 0xffff;
+
+/**
+ * @brief Layout of the POSIX shared memory region published by SharedDisplay.
+ * @details The display half is written by the emulator and guarded by `sequence`, a seqlock: it is odd while a frame
+ * is being written and advances by 2 for each published frame. The key ring is single producer (the viewer), single
+ * consumer (the emulator): the viewer fills entries and advances `key_head`, the emulator applies them and advances
+ * `key_tail`. Both counters run freely, the slot of entry `n` is `n % SHARED_DISPLAY_KEYS`. The atomics are lock-free
+ * and address-free on all supported hosts, so they work across processes.
+ */
+typedef struct shared_display_s {
+    /**
+     * @brief SHARED_DISPLAY_MAGIC, set last once the region is initialized.
+     */
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    std::atomic<uint32_t> sequence;
+    /**
+     * @brief Frames published so far.
+     */
+    uint32_t frames;
+    /**
+     * @brief GetCycleCount() when the frame completed. See CopyLcdFrame().
+     */
+    uint64_t frame_cycle;
+    uint32_t cpu_speed;
+    uint32_t reserved;
+    /**
+     * @brief LCD buffer as written by the guest, laid out like CopyLcdBuffer() output.
+     * @details This includes any bits the guest uses for the LCD segments, which viewers decode themselves.
+     */
+    uint8_t lcd[1600];
+    alignas(64) std::atomic<uint32_t> key_head;
+    alignas(64) std::atomic<uint32_t> key_tail;
+    alignas(64) uint16_t keys[SHARED_DISPLAY_KEYS];
+} shared_display_t;
+
+/**
+ * @brief Publishes the LCD of the default machine to viewers in other processes through POSIX shared memory, and
+ * applies the keys they send back.
+ * @details push() only copies frames into the shared region and tick() only drains the key ring, so neither makes
+ * system calls or waits on a viewer. Viewers poll the sequence counter at their own frame rate.
+ */
+class SharedDisplay {
+public:
+    SharedDisplay();
+    ~SharedDisplay();
+    /**
+     * @brief Create the shared memory object `name` (e.g. "/nc1020") and map it.
+     * @retval true Success.
+     * @retval false The object can't be created or mapped.
+     */
+    bool begin(const char *name);
+    /**
+     * @brief Unmap and remove the shared memory object.
+     */
+    void end();
+    /**
+     * @brief Publish a 1600 byte LCD frame taken at guest cycle `cycle`.
+     * @details Call this with each new frame from CopyLcdFrame(). See LcdCapture::push().
+     */
+    void push(const uint8_t *lcd, uint64_t cycle);
+    /**
+     * @brief Apply the keys viewers sent.
+     * @details Call this after every RunTimeSlice() or similar.
+     */
+    void tick();
+    uint32_t published() const;
+
+private:
+    shared_display_t *region;
+    char name[64];
+};
+
+/**
+ * @brief Reads a region published by SharedDisplay in another process.
+ * @details Frames can be read in place without copying:
+ * @code
+ * uint32_t sequence;
+ * do {
+ *     sequence = viewer.beginRead();
+ *     ConvertLcd32(viewer.region()->lcd, ...);
+ * } while (!viewer.endRead(sequence));
+ * @endcode
+ */
+class SharedDisplayViewer {
+public:
+    SharedDisplayViewer();
+    ~SharedDisplayViewer();
+    /**
+     * @retval true Success.
+     * @retval false The object doesn't exist, isn't initialized yet or has a different version.
+     */
+    bool open(const char *name);
+    void close();
+    const shared_display_t *region() const;
+    /**
+     * @brief Start reading the display. Waits while a frame is being written, which takes a 1600 byte copy.
+     * @return Sequence to pass to endRead().
+     */
+    uint32_t beginRead() const;
+    /**
+     * @retval true Nothing changed since beginRead(), so the data read in between is consistent.
+     * @retval false A frame was published meanwhile. Read again.
+     */
+    bool endRead(uint32_t sequence) const;
+    /**
+     * @brief Copy the latest frame if it differs from the last one copied.
+     * @param[out] lcd 1600 byte LCD buffer.
+     * @param[out] cycle Optional. Guest cycle the frame completed at.
+     * @retval true A new frame was copied.
+     * @retval false No new frame.
+     */
+    bool copyFrame(uint8_t *lcd, uint64_t *cycle = nullptr);
+    /**
+     * @brief Send a key event to the emulator, applied with SetKey(). Only one thread may send keys.
+     * @retval true Queued.
+     * @retval false The ring is full because the emulator isn't running.
+     */
+    bool sendKey(uint8_t key_id, bool down_or_up);
+    /**
+     * @brief Send ReleaseAllKeys() to the emulator. See sendKey().
+     */
+    bool sendReleaseAll();
+
+private:
+    shared_display_t *mapped;
+    uint32_t lastSequence;
+
+    bool push(uint16_t entry);
+};
+}
+
+#endif /* NC1020_SHM_H_ */
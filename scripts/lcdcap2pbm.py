@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+import argparse
+import pathlib
+import sys
+
+LCD_WIDTH = 160
+LCD_HEIGHT = 80
+LCD_SIZE = LCD_WIDTH * LCD_HEIGHT // 8
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description='Convert an LCD capture recorded by LcdCapture to PBM images.')
+    p.add_argument('capture', type=pathlib.Path,
+                   help='Path to the capture file')
+    p.add_argument('output',
+                   help='Path to output directory, or - to write all images to stdout as a single PBM stream')
+    p.add_argument('--fps', type=float,
+                   help='Output a constant frame rate, repeating frames to follow guest time. '
+                   'Without this each captured frame is output once.')
+    p.add_argument('--scale', type=int, default=1,
+                   help='Integer scale factor (default 1)')
+    return p, p.parse_args()
+
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def read_frames(data):
+    if data[:4] != b'NCLC':
+        raise RuntimeError('Not an LCD capture file.')
+    version = int.from_bytes(data[4:8], 'little')
+    if version != 1:
+        raise RuntimeError(f'Unsupported capture version {version}.')
+    cpu_speed = int.from_bytes(data[8:12], 'little')
+
+    frames = []
+    lcd = bytearray(LCD_SIZE)
+    cycle = 0
+    pos = 16
+    try:
+        while pos < len(data):
+            delta, pos = read_varint(data, pos)
+            cycle += delta
+            offset = 0
+            while offset < LCD_SIZE:
+                unchanged, pos = read_varint(data, pos)
+                changed, pos = read_varint(data, pos)
+                offset += unchanged
+                for i in range(offset, offset + changed):
+                    lcd[i] ^= data[pos]
+                    pos += 1
+                offset += changed
+            frames.append((cycle, bytes(lcd)))
+    except IndexError:
+        # The last frame was cut short, e.g. the emulator didn't exit cleanly.
+        print('Warning: capture is truncated.', file=sys.stderr)
+    return cpu_speed, frames
+
+
+def scale_frame(lcd, scale):
+    if scale == 1:
+        return lcd
+    row_bytes = LCD_WIDTH // 8
+    out = bytearray()
+    for row in range(LCD_HEIGHT):
+        bits = int.from_bytes(lcd[row * row_bytes:(row + 1) * row_bytes], 'big')
+        wide = 0
+        for x in range(LCD_WIDTH - 1, -1, -1):
+            pixel = (bits >> x) & 1
+            wide = (wide << scale) | (((1 << scale) - 1) if pixel else 0)
+        line = wide.to_bytes(row_bytes * scale, 'big')
+        out += line * scale
+    return bytes(out)
+
+
+def to_pbm(lcd, scale):
+    # PBM uses the same packing as the LCD buffer, MSB first with set bits drawn black.
+    return b'P4\n%d %d\n' % (LCD_WIDTH * scale, LCD_HEIGHT * scale) + scale_frame(lcd, scale)
+
+
+def resample(cpu_speed, frames, fps):
+    if not frames:
+        return []
+    step = cpu_speed / fps
+    out = []
+    index = 0
+    time = frames[0][0]
+    while True:
+        while index + 1 < len(frames) and frames[index + 1][0] <= time:
+            index += 1
+        out.append(frames[index][1])
+        if index + 1 == len(frames):
+            break
+        time += step
+    return out
+
+
+def main():
+    p, args = parse_args()
+    if args.scale < 1:
+        p.error('scale must be at least 1')
+    cpu_speed, frames = read_frames(args.capture.read_bytes())
+    if args.fps:
+        images = resample(cpu_speed, frames, args.fps)
+    else:
+        images = [lcd for _, lcd in frames]
+
+    if args.output == '-':
+        for lcd in images:
+            sys.stdout.buffer.write(to_pbm(lcd, args.scale))
+    else:
+        output = pathlib.Path(args.output)
+        output.mkdir(exist_ok=True)
+        for index, lcd in enumerate(images):
+            (output / f'frame{index:06d}.pbm').write_bytes(to_pbm(lcd, args.scale))
+    print(f'{len(frames)} frames captured, {len(images)} images written.', file=sys.stderr)
+
+if __name__ == '__main__':
+    main()
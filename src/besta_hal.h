@@ -0,0 +1,118 @@
+#ifndef BESTA_HAL_H_
+#define BESTA_HAL_H_
+
+#include "nc1020.h"
+#include <cstddef>
+#include <cstdint>
+
+static const uint8_t FLAG_ROM_VOLUME_0 = 0b000;
+static const uint8_t FLAG_ROM_VOLUME_1 = 0b001;
+static const uint8_t FLAG_ROM_VOLUME_2 = 0b010;
+static const uint8_t FLAG_NOR = 0b011;
+static const uint8_t FLAG_NOR_DIRTY = 0b100;
+
+struct CacheBlock {
+    uint8_t flags; // xxxxxdVV. d: NOR page dirty, V: Volume number, 3 means NOR.
+    uint8_t page;
+    uint8_t data[0x8000];
+};
+
+// The core is bound to this HAL at build time (NC1020_HAL in meson.build), so the page loads below are inlined into
+// its bank switching. Only cache misses take a call.
+class WqxHalBesta final : public wqx::IWqxHal {
+public:
+    WqxHalBesta();
+    virtual bool loadNorPage(uint32_t page) override;
+    virtual bool saveNorPage(uint32_t page) override;
+    virtual bool wipeNorFlash() override;
+    virtual bool loadRomPage(uint32_t volume, uint32_t page) override;
+    virtual bool loadBbsPage(uint32_t volume, uint32_t page) override;
+    virtual bool saveState(const char *states, size_t size) override;
+    virtual bool loadState(char *states, size_t size) override;
+    virtual bool appendState(const char *states, size_t size) override;
+    virtual uint64_t getMonotonicMicros() override;
+    virtual bool saveBootCache(const char *states, size_t size) override;
+    virtual bool loadBootCache(char *states, size_t size) override;
+    virtual bool saveInputLog(const char *data, size_t size) override;
+    virtual bool appendInputLog(const char *data, size_t size) override;
+    void closeAll();
+    bool ensureOpen();
+    bool begin(size_t cacheSize);
+private:
+    unsigned short getNorCacheIndex(uint32_t page);
+    void setNorCacheIndex(uint32_t page, unsigned short index);
+    unsigned short getRomCacheIndex(uint32_t volume, uint32_t page);
+    void setRomCacheIndex(uint32_t volume, uint32_t page, unsigned short index);
+    CacheBlock *claimPage(unsigned short cacheIndex);
+    bool loadNorPageMiss(uint32_t page);
+    bool loadRomPageMiss(uint32_t volume, uint32_t page);
+
+    void *romFile;
+    void *norFile;
+    void *bbsFile;
+    size_t firstOut;
+    size_t cacheSize;
+    int8_t currentMappedNorPage;
+    CacheBlock **cacheBlockTable;
+    CacheBlock *cacheBlock;
+    uint8_t romIndexLow[0x80 * 3];
+    uint32_t romIndexHigh[0x80 * 3 / 32];
+    uint8_t norIndexLow[0x20];
+    uint32_t norIndexHigh;
+    uint8_t bbsCache[0x20000];
+
+    static constexpr unsigned short CACHE_INDEX_UNUSED = 0x1ff;
+};
+
+inline unsigned short WqxHalBesta::getNorCacheIndex(uint32_t page) {
+    unsigned short result = norIndexLow[page] | ((norIndexHigh >> page) & 1) << 8;
+    //Printf("norcache %d -> %#x\n", page, result);
+    return result;
+}
+
+inline unsigned short WqxHalBesta::getRomCacheIndex(uint32_t volume, uint32_t page) {
+    uint32_t pageAddress = volume * 0x80 + page;
+    uint32_t romIndexHighOffset = pageAddress / 32;
+    uint32_t romIndexHighShift = pageAddress % 32;
+    unsigned short result = romIndexLow[pageAddress] | ((romIndexHigh[romIndexHighOffset] >> romIndexHighShift) & 1) << 8;
+    //Printf("romcache %d %d -> %#x\n", volume, page, result);
+    return result;
+}
+
+// The files are opened and closed together, so an open NOR file means ensureOpen() would succeed.
+inline bool WqxHalBesta::loadNorPage(uint32_t page) {
+    if (page <= 0x1f && norFile != nullptr) {
+        unsigned short cached = getNorCacheIndex(page);
+        if (cached < cacheSize) {
+            // Cache hit
+            this->page = cacheBlockTable[cached]->data;
+            currentMappedNorPage = page;
+            return true;
+        }
+    }
+    return loadNorPageMiss(page);
+}
+
+inline bool WqxHalBesta::loadRomPage(uint32_t volume, uint32_t page) {
+    if (page <= 0x7f && volume <= 2 && romFile != nullptr) {
+        unsigned short cached = getRomCacheIndex(volume, page);
+        if (cached < cacheSize) {
+            // Cache hit
+            this->page = cacheBlockTable[cached]->data;
+            return true;
+        }
+    }
+    return loadRomPageMiss(volume, page);
+}
+
+inline bool WqxHalBesta::loadBbsPage(uint32_t volume, uint32_t page) {
+    (void) volume;
+    if (page > 0xf || volume > 2 || (bbsFile == nullptr && !ensureOpen())) {
+        return false;
+    }
+    this->bbs = &bbsCache[page * 0x2000];
+    this->shadowBbs = &bbsCache[0x2000];
+    return true;
+}
+
+#endif /* BESTA_HAL_H_ */
@@ -0,0 +1,164 @@
+#include "nc1020_capture.h"
+#include "nc1020.h"
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+namespace wqx {
+
+static const size_t LCD_SIZE = 1600;
+static const uint32_t CAPTURE_VERSION = 1;
+// Worst case alternates single unchanged and changed bytes, plus the cycle delta.
+static const size_t ENCODED_SIZE_BOUND = LCD_SIZE / 2 * 3 + 16;
+
+static inline size_t PutVarint(uint8_t *out, uint64_t value) {
+    size_t pos = 0;
+    while (value >= 0x80) {
+        out[pos++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[pos++] = value;
+    return pos;
+}
+
+static inline size_t PutU32(uint8_t *out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+    return 4;
+}
+
+LcdCapture::LcdCapture() : file(nullptr), queue(nullptr), queueSize(0), head(0), tail(0), stopping(false),
+                           framesWritten(0), framesDropped(0), hasLastPushed(false), lastCycle(0) {}
+
+LcdCapture::~LcdCapture() {
+    end();
+}
+
+bool LcdCapture::begin(const char *path, uint32_t queue_frames) {
+    end();
+    queueSize = queue_frames == 0 ? 1 : queue_frames;
+    queue = reinterpret_cast<Frame *>(malloc(queueSize * sizeof(Frame)));
+    file = fopen(path, "wb");
+    if (queue == nullptr || file == nullptr) {
+        end();
+        return false;
+    }
+
+    uint8_t header[16];
+    memcpy(header, "NCLC", 4);
+    PutU32(header + 4, CAPTURE_VERSION);
+    PutU32(header + 8, GetCpuSpeed());
+    PutU32(header + 12, 0);
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        end();
+        return false;
+    }
+
+    head = 0;
+    tail = 0;
+    stopping = false;
+    framesWritten = 0;
+    framesDropped = 0;
+    hasLastPushed = false;
+    memset(lastEncoded, 0, sizeof(lastEncoded));
+    lastCycle = 0;
+    encoder = std::thread(&LcdCapture::run, this);
+    return true;
+}
+
+void LcdCapture::end() {
+    if (encoder.joinable()) {
+        stopping.store(true, std::memory_order_release);
+        encoder.join();
+    }
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+    free(queue);
+    queue = nullptr;
+    queueSize = 0;
+}
+
+bool LcdCapture::push(const uint8_t *lcd, uint64_t cycle) {
+    if (queue == nullptr) {
+        return false;
+    }
+    if (hasLastPushed && memcmp(lcd, lastPushed, LCD_SIZE) == 0) {
+        return true;
+    }
+    size_t pushed = head.load(std::memory_order_relaxed);
+    if (pushed - tail.load(std::memory_order_acquire) == queueSize) {
+        framesDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Frame &frame = queue[pushed % queueSize];
+    frame.cycle = cycle;
+    memcpy(frame.lcd, lcd, LCD_SIZE);
+    head.store(pushed + 1, std::memory_order_release);
+
+    // A dropped frame isn't remembered, so the next one is compared against what the file will actually have.
+    memcpy(lastPushed, lcd, LCD_SIZE);
+    hasLastPushed = true;
+    return true;
+}
+
+uint32_t LcdCapture::written() const {
+    return framesWritten.load(std::memory_order_relaxed);
+}
+
+uint32_t LcdCapture::dropped() const {
+    return framesDropped.load(std::memory_order_relaxed);
+}
+
+void LcdCapture::run() {
+    for (;;) {
+        size_t encoded = tail.load(std::memory_order_relaxed);
+        if (encoded == head.load(std::memory_order_acquire)) {
+            // Check for frames once more after seeing the stop request, so every frame pushed before end() is kept.
+            if (stopping.load(std::memory_order_acquire)) {
+                if (encoded == head.load(std::memory_order_acquire)) {
+                    break;
+                }
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+        encode(queue[encoded % queueSize]);
+        tail.store(encoded + 1, std::memory_order_release);
+    }
+    fflush(file);
+}
+
+void LcdCapture::encode(const Frame &frame) {
+    uint8_t out[ENCODED_SIZE_BOUND];
+    size_t pos = PutVarint(out, frame.cycle - lastCycle);
+    size_t i = 0;
+    while (i < LCD_SIZE) {
+        size_t unchanged = i;
+        while (i < LCD_SIZE && frame.lcd[i] == lastEncoded[i]) {
+            i++;
+        }
+        unchanged = i - unchanged;
+        size_t changed = i;
+        while (i < LCD_SIZE && frame.lcd[i] != lastEncoded[i]) {
+            i++;
+        }
+        changed = i - changed;
+        pos += PutVarint(out + pos, unchanged);
+        pos += PutVarint(out + pos, changed);
+        for (size_t j = i - changed; j < i; j++) {
+            out[pos++] = frame.lcd[j] ^ lastEncoded[j];
+        }
+    }
+    if (fwrite(out, pos, 1, file) == 1) {
+        framesWritten.fetch_add(1, std::memory_order_relaxed);
+    }
+    memcpy(lastEncoded, frame.lcd, LCD_SIZE);
+    lastCycle = frame.cycle;
+}
+
+}
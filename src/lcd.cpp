@@ -0,0 +1,430 @@
+#include "nc1020_lcd.h"
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace wqx {
+
+static const size_t LCD_ROW_BYTES = LCD_WIDTH / 8;
+
+// Move `level` toward 255 by `rise`/256 of the distance when `set`, or toward 0 by `fall`/256 otherwise. Rounding
+// toward the target makes sure the level always reaches it.
+static inline uint8_t BlendLevel(uint8_t level, bool set, uint32_t rise, uint32_t fall) {
+    if (set) {
+        return (level * (256 - rise) + 255 * rise + 255) >> 8;
+    }
+    return (level * (256 - fall)) >> 8;
+}
+
+// Expand `bytes` bytes of 1bpp pixels, most significant bit first, into `c0` and `c1` pixels.
+#if defined(__AVX2__)
+static inline long long Splat(uint8_t byte) {
+    return static_cast<long long>(byte * 0x0101010101010101ULL);
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint8_t *out, uint8_t c0, uint8_t c1) {
+    const __m256i mask = _mm256_set1_epi64x(0x0102040810204080LL);
+    const __m256i v0 = _mm256_set1_epi8(c0);
+    const __m256i v1 = _mm256_set1_epi8(c1);
+    size_t i = 0;
+    for (; i + 4 <= bytes; i += 4, out += 32) {
+        __m256i b = _mm256_setr_epi64x(Splat(bits[i]), Splat(bits[i + 1]), Splat(bits[i + 2]), Splat(bits[i + 3]));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(b, mask), mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_blendv_epi8(v0, v1, m));
+    }
+    for (; i < bytes; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            *out++ = (bits[i] >> bit) & 1 ? c1 : c0;
+        }
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint16_t *out, uint16_t c0, uint16_t c1) {
+    const __m256i mask = _mm256_setr_epi16(
+        static_cast<short>(0x8000), 0x4000, 0x2000, 0x1000, 0x0800, 0x0400, 0x0200, 0x0100,
+        0x0080, 0x0040, 0x0020, 0x0010, 0x0008, 0x0004, 0x0002, 0x0001);
+    const __m256i v0 = _mm256_set1_epi16(c0);
+    const __m256i v1 = _mm256_set1_epi16(c1);
+    size_t i = 0;
+    for (; i + 2 <= bytes; i += 2, out += 16) {
+        __m256i b = _mm256_set1_epi16(static_cast<short>((bits[i] << 8) | bits[i + 1]));
+        __m256i m = _mm256_cmpeq_epi16(_mm256_and_si256(b, mask), mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_blendv_epi8(v0, v1, m));
+    }
+    for (; i < bytes; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            *out++ = (bits[i] >> bit) & 1 ? c1 : c0;
+        }
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint32_t *out, uint32_t c0, uint32_t c1) {
+    const __m256i mask = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m256i v0 = _mm256_set1_epi32(static_cast<int>(c0));
+    const __m256i v1 = _mm256_set1_epi32(static_cast<int>(c1));
+    for (size_t i = 0; i < bytes; i++, out += 8) {
+        __m256i b = _mm256_set1_epi32(bits[i]);
+        __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(b, mask), mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_blendv_epi8(v0, v1, m));
+    }
+}
+
+// `mask` holds 0xFF for set pixels and 0 for cleared ones.
+static void BlendLevels(uint8_t *levels, const uint8_t *mask, size_t count, uint32_t rise, uint32_t fall) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i keep_set = _mm256_set1_epi16(static_cast<short>(256 - rise));
+    const __m256i keep_clear = _mm256_set1_epi16(static_cast<short>(256 - fall));
+    const __m256i target = _mm256_set1_epi16(static_cast<short>(255 * rise + 255));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i level = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(levels + i));
+        __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+        // Unpacking and packing both work within 128-bit lanes, so the bytes come back in order.
+        __m256i m_lo = _mm256_unpacklo_epi8(m, m);
+        __m256i m_hi = _mm256_unpackhi_epi8(m, m);
+        __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(level, zero),
+                                        _mm256_blendv_epi8(keep_clear, keep_set, m_lo));
+        __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(level, zero),
+                                        _mm256_blendv_epi8(keep_clear, keep_set, m_hi));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_and_si256(m_lo, target)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_and_si256(m_hi, target)), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(levels + i), _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < count; i++) {
+        levels[i] = BlendLevel(levels[i], mask[i] != 0, rise, fall);
+    }
+}
+
+const char *GetLcdKernelName() {
+    return "avx2";
+}
+#elif defined(__SSE2__)
+static inline __m128i Select(__m128i m, __m128i v0, __m128i v1) {
+    return _mm_or_si128(_mm_and_si128(m, v1), _mm_andnot_si128(m, v0));
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint8_t *out, uint8_t c0, uint8_t c1) {
+    const __m128i mask = _mm_set1_epi64x(0x0102040810204080LL);
+    const __m128i v0 = _mm_set1_epi8(static_cast<char>(c0));
+    const __m128i v1 = _mm_set1_epi8(static_cast<char>(c1));
+    size_t i = 0;
+    for (; i + 2 <= bytes; i += 2, out += 16) {
+        __m128i b = _mm_unpacklo_epi64(_mm_set1_epi8(static_cast<char>(bits[i])),
+                                       _mm_set1_epi8(static_cast<char>(bits[i + 1])));
+        __m128i m = _mm_cmpeq_epi8(_mm_and_si128(b, mask), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Select(m, v0, v1));
+    }
+    for (; i < bytes; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            *out++ = (bits[i] >> bit) & 1 ? c1 : c0;
+        }
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint16_t *out, uint16_t c0, uint16_t c1) {
+    const __m128i mask = _mm_setr_epi16(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i v0 = _mm_set1_epi16(static_cast<short>(c0));
+    const __m128i v1 = _mm_set1_epi16(static_cast<short>(c1));
+    for (size_t i = 0; i < bytes; i++, out += 8) {
+        __m128i b = _mm_set1_epi16(bits[i]);
+        __m128i m = _mm_cmpeq_epi16(_mm_and_si128(b, mask), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Select(m, v0, v1));
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint32_t *out, uint32_t c0, uint32_t c1) {
+    const __m128i mask_hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+    const __m128i mask_lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+    const __m128i v0 = _mm_set1_epi32(static_cast<int>(c0));
+    const __m128i v1 = _mm_set1_epi32(static_cast<int>(c1));
+    for (size_t i = 0; i < bytes; i++, out += 8) {
+        __m128i b = _mm_set1_epi32(bits[i]);
+        __m128i m_hi = _mm_cmpeq_epi32(_mm_and_si128(b, mask_hi), mask_hi);
+        __m128i m_lo = _mm_cmpeq_epi32(_mm_and_si128(b, mask_lo), mask_lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Select(m_hi, v0, v1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4), Select(m_lo, v0, v1));
+    }
+}
+
+// `mask` holds 0xFF for set pixels and 0 for cleared ones.
+static void BlendLevels(uint8_t *levels, const uint8_t *mask, size_t count, uint32_t rise, uint32_t fall) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i keep_set = _mm_set1_epi16(static_cast<short>(256 - rise));
+    const __m128i keep_clear = _mm_set1_epi16(static_cast<short>(256 - fall));
+    const __m128i target = _mm_set1_epi16(static_cast<short>(255 * rise + 255));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i level = _mm_loadu_si128(reinterpret_cast<const __m128i *>(levels + i));
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+        __m128i m_lo = _mm_unpacklo_epi8(m, m);
+        __m128i m_hi = _mm_unpackhi_epi8(m, m);
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(level, zero), Select(m_lo, keep_clear, keep_set));
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(level, zero), Select(m_hi, keep_clear, keep_set));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_and_si128(m_lo, target)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_and_si128(m_hi, target)), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(levels + i), _mm_packus_epi16(lo, hi));
+    }
+    for (; i < count; i++) {
+        levels[i] = BlendLevel(levels[i], mask[i] != 0, rise, fall);
+    }
+}
+
+const char *GetLcdKernelName() {
+    return "sse2";
+}
+#elif defined(__ARM_NEON)
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint8_t *out, uint8_t c0, uint8_t c1) {
+    static const uint8_t MASK[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+    };
+    const uint8x16_t mask = vld1q_u8(MASK);
+    const uint8x16_t v0 = vdupq_n_u8(c0);
+    const uint8x16_t v1 = vdupq_n_u8(c1);
+    size_t i = 0;
+    for (; i + 2 <= bytes; i += 2, out += 16) {
+        uint8x16_t b = vcombine_u8(vdup_n_u8(bits[i]), vdup_n_u8(bits[i + 1]));
+        vst1q_u8(out, vbslq_u8(vtstq_u8(b, mask), v1, v0));
+    }
+    for (; i < bytes; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            *out++ = (bits[i] >> bit) & 1 ? c1 : c0;
+        }
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint16_t *out, uint16_t c0, uint16_t c1) {
+    static const uint16_t MASK[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+    const uint16x8_t mask = vld1q_u16(MASK);
+    const uint16x8_t v0 = vdupq_n_u16(c0);
+    const uint16x8_t v1 = vdupq_n_u16(c1);
+    for (size_t i = 0; i < bytes; i++, out += 8) {
+        vst1q_u16(out, vbslq_u16(vtstq_u16(vdupq_n_u16(bits[i]), mask), v1, v0));
+    }
+}
+
+static void ExpandBits(const uint8_t *bits, size_t bytes, uint32_t *out, uint32_t c0, uint32_t c1) {
+    static const uint32_t MASK_HI[4] = {0x80, 0x40, 0x20, 0x10};
+    static const uint32_t MASK_LO[4] = {0x08, 0x04, 0x02, 0x01};
+    const uint32x4_t mask_hi = vld1q_u32(MASK_HI);
+    const uint32x4_t mask_lo = vld1q_u32(MASK_LO);
+    const uint32x4_t v0 = vdupq_n_u32(c0);
+    const uint32x4_t v1 = vdupq_n_u32(c1);
+    for (size_t i = 0; i < bytes; i++, out += 8) {
+        uint32x4_t b = vdupq_n_u32(bits[i]);
+        vst1q_u32(out, vbslq_u32(vtstq_u32(b, mask_hi), v1, v0));
+        vst1q_u32(out + 4, vbslq_u32(vtstq_u32(b, mask_lo), v1, v0));
+    }
+}
+
+// `mask` holds 0xFF for set pixels and 0 for cleared ones.
+static void BlendLevels(uint8_t *levels, const uint8_t *mask, size_t count, uint32_t rise, uint32_t fall) {
+    const uint8x16_t keep_set = vdupq_n_u8(256 - rise);
+    const uint8x16_t keep_clear = vdupq_n_u8(256 - fall);
+    const uint16x8_t target = vdupq_n_u16(255 * rise + 255);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t level = vld1q_u8(levels + i);
+        uint8x16_t m = vld1q_u8(mask + i);
+        uint8x16_t keep = vbslq_u8(m, keep_set, keep_clear);
+        // Sign extension turns 0xFF into 0xFFFF.
+        uint16x8_t m_lo = vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_low_u8(m))));
+        uint16x8_t m_hi = vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_high_u8(m))));
+        uint16x8_t lo = vaddq_u16(vmull_u8(vget_low_u8(level), vget_low_u8(keep)), vandq_u16(m_lo, target));
+        uint16x8_t hi = vaddq_u16(vmull_u8(vget_high_u8(level), vget_high_u8(keep)), vandq_u16(m_hi, target));
+        vst1q_u8(levels + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+    for (; i < count; i++) {
+        levels[i] = BlendLevel(levels[i], mask[i] != 0, rise, fall);
+    }
+}
+
+const char *GetLcdKernelName() {
+    return "neon";
+}
+#else
+template <typename T>
+static void ExpandBits(const uint8_t *bits, size_t bytes, T *out, T c0, T c1) {
+    for (size_t i = 0; i < bytes; i++) {
+        uint8_t byte = bits[i];
+        for (int bit = 7; bit >= 0; bit--) {
+            *out++ = (byte >> bit) & 1 ? c1 : c0;
+        }
+    }
+}
+
+// `mask` holds 0xFF for set pixels and 0 for cleared ones.
+static void BlendLevels(uint8_t *levels, const uint8_t *mask, size_t count, uint32_t rise, uint32_t fall) {
+    for (size_t i = 0; i < count; i++) {
+        levels[i] = BlendLevel(levels[i], mask[i] != 0, rise, fall);
+    }
+}
+
+const char *GetLcdKernelName() {
+    return "scalar";
+}
+#endif
+
+// Every byte of 8 pixels widened to `scale` bytes with each pixel repeated `scale` times, for scale 2 and up.
+struct ScaleTable {
+    uint8_t bytes[LCD_MAX_SCALE - 1][256][LCD_MAX_SCALE];
+
+    constexpr ScaleTable() : bytes() {
+        for (uint32_t scale = 2; scale <= LCD_MAX_SCALE; scale++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                for (uint32_t j = 0; j < 8 * scale; j++) {
+                    if (value & (0x80 >> (j / scale))) {
+                        bytes[scale - 2][value][j / 8] |= 0x80 >> (j % 8);
+                    }
+                }
+            }
+        }
+    }
+};
+
+static constexpr ScaleTable SCALE_TABLE;
+
+// Scaling is done on the packed bits first, so the kernels only ever expand whole bytes at 1:1.
+template <typename T>
+static bool ConvertLcd(const uint8_t *lcd, T *out, size_t pitch, uint32_t scale, const T palette[2],
+                       const uint32_t *rows) {
+    if (scale == 0 || scale > LCD_MAX_SCALE) {
+        return false;
+    }
+    uint8_t scaled[LCD_ROW_BYTES * LCD_MAX_SCALE];
+
+    size_t line_size = LCD_WIDTH * scale * sizeof(T);
+    for (uint32_t row = 0; row < LCD_HEIGHT; row++) {
+        if (rows != nullptr && !(rows[row >> 5] & (1u << (row & 0x1F)))) {
+            continue;
+        }
+        const uint8_t *bits = lcd + row * LCD_ROW_BYTES;
+        if (scale > 1) {
+            for (size_t i = 0; i < LCD_ROW_BYTES; i++) {
+                memcpy(scaled + i * scale, SCALE_TABLE.bytes[scale - 2][bits[i]], scale);
+            }
+            bits = scaled;
+        }
+        uint8_t *line = reinterpret_cast<uint8_t *>(out) + row * scale * pitch;
+        ExpandBits(bits, LCD_ROW_BYTES * scale, reinterpret_cast<T *>(line), palette[0], palette[1]);
+        for (uint32_t copy = 1; copy < scale; copy++) {
+            memcpy(line + copy * pitch, line, line_size);
+        }
+    }
+    return true;
+}
+
+bool ConvertLcd8(const uint8_t *lcd, uint8_t *out, size_t pitch, uint32_t scale, const uint8_t palette[2],
+                 const uint32_t *rows) {
+    return ConvertLcd(lcd, out, pitch, scale, palette, rows);
+}
+
+bool ConvertLcd16(const uint8_t *lcd, uint16_t *out, size_t pitch, uint32_t scale, const uint16_t palette[2],
+                  const uint32_t *rows) {
+    return ConvertLcd(lcd, out, pitch, scale, palette, rows);
+}
+
+bool ConvertLcd32(const uint8_t *lcd, uint32_t *out, size_t pitch, uint32_t scale, const uint32_t palette[2],
+                  const uint32_t *rows) {
+    return ConvertLcd(lcd, out, pitch, scale, palette, rows);
+}
+
+// Interpolate a `bits` wide field at `shift` between two colors.
+static inline uint32_t LerpField(uint32_t c0, uint32_t c1, uint32_t shift, uint32_t bits, uint32_t level) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t f0 = (c0 >> shift) & mask;
+    uint32_t f1 = (c1 >> shift) & mask;
+    return ((f0 * (255 - level) + f1 * level + 127) / 255) << shift;
+}
+
+static uint8_t LerpColor(uint8_t c0, uint8_t c1, uint32_t level) {
+    return LerpField(c0, c1, 0, 8, level);
+}
+
+static uint16_t LerpColor(uint16_t c0, uint16_t c1, uint32_t level) {
+    return LerpField(c0, c1, 11, 5, level) | LerpField(c0, c1, 5, 6, level) | LerpField(c0, c1, 0, 5, level);
+}
+
+static uint32_t LerpColor(uint32_t c0, uint32_t c1, uint32_t level) {
+    return LerpField(c0, c1, 24, 8, level) | LerpField(c0, c1, 16, 8, level) | LerpField(c0, c1, 8, 8, level) |
+           LerpField(c0, c1, 0, 8, level);
+}
+
+template <typename T>
+static bool ConvertLevels(const uint8_t *levels, T *out, size_t pitch, uint32_t scale, const T palette[2]) {
+    if (scale == 0 || scale > LCD_MAX_SCALE) {
+        return false;
+    }
+    T colors[256];
+    for (uint32_t level = 0; level < 256; level++) {
+        colors[level] = LerpColor(palette[0], palette[1], level);
+    }
+
+    size_t line_size = LCD_WIDTH * scale * sizeof(T);
+    for (uint32_t row = 0; row < LCD_HEIGHT; row++) {
+        const uint8_t *src = levels + row * LCD_WIDTH;
+        uint8_t *line = reinterpret_cast<uint8_t *>(out) + row * scale * pitch;
+        T *pixel = reinterpret_cast<T *>(line);
+        for (uint32_t x = 0; x < LCD_WIDTH; x++) {
+            T color = colors[src[x]];
+            for (uint32_t i = 0; i < scale; i++) {
+                *pixel++ = color;
+            }
+        }
+        for (uint32_t copy = 1; copy < scale; copy++) {
+            memcpy(line + copy * pitch, line, line_size);
+        }
+    }
+    return true;
+}
+
+LcdPersistence::LcdPersistence() : rise(128), fall(64) {
+    reset();
+}
+
+void LcdPersistence::setResponse(uint32_t rise, uint32_t fall) {
+    this->rise = rise < 1 ? 1 : rise > 256 ? 256 : rise;
+    this->fall = fall < 1 ? 1 : fall > 256 ? 256 : fall;
+}
+
+void LcdPersistence::reset(const uint8_t *lcd) {
+    if (lcd == nullptr) {
+        memset(levelBuffer, 0, sizeof(levelBuffer));
+        return;
+    }
+    for (uint32_t row = 0; row < LCD_HEIGHT; row++) {
+        ExpandBits(lcd + row * LCD_ROW_BYTES, LCD_ROW_BYTES, levelBuffer + row * LCD_WIDTH, static_cast<uint8_t>(0),
+                   static_cast<uint8_t>(0xFF));
+    }
+}
+
+void LcdPersistence::blend(const uint8_t *lcd) {
+    uint8_t mask[LCD_WIDTH];
+    for (uint32_t row = 0; row < LCD_HEIGHT; row++) {
+        ExpandBits(lcd + row * LCD_ROW_BYTES, LCD_ROW_BYTES, mask, static_cast<uint8_t>(0), static_cast<uint8_t>(0xFF));
+        BlendLevels(levelBuffer + row * LCD_WIDTH, mask, LCD_WIDTH, rise, fall);
+    }
+}
+
+const uint8_t *LcdPersistence::levels() const {
+    return levelBuffer;
+}
+
+bool LcdPersistence::convert8(uint8_t *out, size_t pitch, uint32_t scale, const uint8_t palette[2]) const {
+    return ConvertLevels(levelBuffer, out, pitch, scale, palette);
+}
+
+bool LcdPersistence::convert16(uint16_t *out, size_t pitch, uint32_t scale, const uint16_t palette[2]) const {
+    return ConvertLevels(levelBuffer, out, pitch, scale, palette);
+}
+
+bool LcdPersistence::convert32(uint32_t *out, size_t pitch, uint32_t scale, const uint32_t palette[2]) const {
+    return ConvertLevels(levelBuffer, out, pitch, scale, palette);
+}
+
+}
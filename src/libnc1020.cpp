@@ -0,0 +1,161 @@
+#include "libnc1020.h"
+#include "nc1020.h"
+#include "nc1020_posix.h"
+#include <new>
+#include <string>
+
+struct nc1020 {
+    wqx::PosixHal hal;
+    wqx::Machine machine;
+    std::string romPath;
+    std::string norPath;
+    std::string bbsPath;
+    nc1020_stats_t stats;
+};
+
+static nc1020_t *OpenSession(const char *romPath, const char *norPath, const char *bbsPath) {
+    nc1020_t *session = new (std::nothrow) nc1020_t();
+    if (session == nullptr) {
+        return nullptr;
+    }
+    session->romPath = romPath;
+    session->norPath = norPath;
+    session->bbsPath = bbsPath;
+    if (!session->hal.open(session->romPath.c_str(), session->norPath.c_str(), session->bbsPath.c_str())) {
+        delete session;
+        return nullptr;
+    }
+    return session;
+}
+
+static void BeginRun(nc1020_t *session, uint64_t *startCycles, uint64_t *startUs) {
+    *startCycles = session->machine.getCycleCount();
+    *startUs = session->hal.getMonotonicMicros();
+}
+
+static uint64_t EndRun(nc1020_t *session, uint64_t startCycles, uint64_t startUs) {
+    uint64_t done = session->machine.getCycleCount() - startCycles;
+    session->stats.run_calls++;
+    session->stats.run_cycles += done;
+    session->stats.run_host_us += session->hal.getMonotonicMicros() - startUs;
+    return done;
+}
+
+nc1020_t *nc1020_create(const nc1020_config_t *config) {
+    if (config == nullptr || config->rom_path == nullptr || config->nor_path == nullptr ||
+        config->bbs_path == nullptr) {
+        return nullptr;
+    }
+    nc1020_t *session = OpenSession(config->rom_path, config->nor_path, config->bbs_path);
+    if (session == nullptr) {
+        return nullptr;
+    }
+    session->hal.setNorWriteBack(config->write_nor != 0);
+    if (!session->machine.begin(&session->hal, config->cpu_speed)) {
+        delete session;
+        return nullptr;
+    }
+    session->machine.reset();
+    session->machine.setAsyncPageLoads(config->async_pages != 0);
+    return session;
+}
+
+nc1020_t *nc1020_fork(nc1020_t *session) {
+    nc1020_t *child = OpenSession(session->romPath.c_str(), session->norPath.c_str(), session->bbsPath.c_str());
+    if (child == nullptr) {
+        return nullptr;
+    }
+    if (!session->machine.fork(child->machine, &child->hal)) {
+        delete child;
+        return nullptr;
+    }
+    return child;
+}
+
+void nc1020_destroy(nc1020_t *session) {
+    if (session == nullptr) {
+        return;
+    }
+    // The machine may still flush NOR pages through the HAL.
+    session->machine.end();
+    session->hal.close();
+    delete session;
+}
+
+void nc1020_reset(nc1020_t *session) {
+    session->machine.reset();
+}
+
+uint64_t nc1020_run_cycles(nc1020_t *session, uint64_t cycles) {
+    uint64_t startCycles, startUs;
+    BeginRun(session, &startCycles, &startUs);
+    wqx::run_condition_t cond = {};
+    cond.flags = wqx::RUN_UNTIL_CYCLE;
+    cond.cycle = startCycles + cycles;
+    // RunUntil() takes a time limit. Give it a little more than the cycles need.
+    uint64_t speed = session->machine.getCpuSpeed();
+    while (session->machine.getCycleCount() < cond.cycle) {
+        uint64_t left = cond.cycle - session->machine.getCycleCount();
+        uint64_t ms = left * 1000 / speed + 1;
+        if (session->machine.runUntil(cond, ms > 1000 ? 1000 : ms, false) == wqx::STOP_PAGE) {
+            break;
+        }
+    }
+    return EndRun(session, startCycles, startUs);
+}
+
+int nc1020_waiting_for_page(nc1020_t *session) {
+    return session->machine.isWaitingForPage();
+}
+
+void nc1020_run_ms(nc1020_t *session, uint32_t ms) {
+    if (ms == 0) {
+        return;
+    }
+    uint64_t startCycles, startUs;
+    BeginRun(session, &startCycles, &startUs);
+    session->machine.runTurbo(ms, nullptr, nullptr, nullptr);
+    EndRun(session, startCycles, startUs);
+}
+
+void nc1020_set_key(nc1020_t *session, uint8_t key_id, int down) {
+    session->machine.setKey(key_id, down != 0);
+}
+
+void nc1020_release_all_keys(nc1020_t *session) {
+    session->machine.releaseAllKeys();
+}
+
+int nc1020_type_text(nc1020_t *session, const char *text) {
+    return session->machine.typeText(text);
+}
+
+size_t nc1020_pending_keys(nc1020_t *session) {
+    return session->machine.getMacroPending();
+}
+
+const uint8_t *nc1020_lcd(nc1020_t *session) {
+    return session->machine.getLcdBuffer();
+}
+
+int nc1020_lcd_frame(nc1020_t *session, uint8_t *buffer, uint64_t *cycle) {
+    return session->machine.copyLcdFrame(buffer, cycle);
+}
+
+size_t nc1020_snapshot_size(nc1020_t *session) {
+    return session->machine.getSnapshotSize();
+}
+
+size_t nc1020_snapshot(nc1020_t *session, void *buffer, size_t capacity) {
+    return session->machine.snapshot(buffer, capacity);
+}
+
+int nc1020_restore(nc1020_t *session, const void *buffer, size_t size) {
+    return session->machine.restore(buffer, size);
+}
+
+void nc1020_get_stats(nc1020_t *session, nc1020_stats_t *stats) {
+    *stats = session->stats;
+    stats->cycles = session->machine.getCycleCount();
+    stats->cpu_speed = session->machine.getCpuSpeed();
+}
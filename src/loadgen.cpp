@@ -0,0 +1,356 @@
+// Load generator for nc1020-server. Drives many sessions as fast as the server takes them and reports how many
+// real-time sessions it could host per core and the latency of the requests. With --realtime, the sessions run at
+// real-time speed on the server and only get input, and the report shows how far they fell behind.
+
+#include "nc1020_server.h"
+#include <algorithm>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using wqx::server_message_t;
+
+struct Options {
+    const char *socket = "nc1020.sock";
+    uint32_t sessions = 64;
+    uint32_t clients = 4;
+    uint32_t seconds = 10;
+    uint32_t runMs = 20;
+    uint32_t key = 0x1d;
+    uint32_t intervalMs = 100;
+    bool realtime = false;
+};
+
+struct ClientResult {
+    bool ok = false;
+    uint32_t errors = 0;
+    uint64_t guestMs = 0;
+    std::vector<uint32_t> runUs;
+    std::vector<uint32_t> otherUs;
+    std::vector<wqx::server_session_stats_t> sessions;
+};
+
+class Client {
+public:
+    ~Client() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool connect(const char *path) {
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path)) {
+            return false;
+        }
+        strcpy(address.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        return fd >= 0 && ::connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0;
+    }
+
+    // Queue a request to be sent by flush().
+    void add(uint8_t op, uint32_t session, const void *payload, uint32_t size) {
+        server_message_t header = {size, op, 0, 0, session, static_cast<uint32_t>(sentUs.size())};
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+        output.insert(output.end(), bytes, bytes + sizeof(header));
+        bytes = static_cast<const uint8_t *>(payload);
+        output.insert(output.end(), bytes, bytes + size);
+        sentUs.push_back(0);
+    }
+
+    bool flush() {
+        uint64_t now = NowUs();
+        for (size_t i = flushed; i < sentUs.size(); i++) {
+            sentUs[i] = now;
+        }
+        flushed = sentUs.size();
+        size_t offset = 0;
+        while (offset < output.size()) {
+            ssize_t size = send(fd, &output[offset], output.size() - offset, MSG_NOSIGNAL);
+            if (size < 0) {
+                return false;
+            }
+            offset += size;
+        }
+        output.clear();
+        return true;
+    }
+
+    // Receive one response. Its latency is measured from the flush() that sent the request.
+    bool receive(server_message_t *header, std::vector<uint8_t> *payload, uint32_t *latencyUs) {
+        if (!readAll(header, sizeof(*header)) || header->size > wqx::SERVER_MAX_PAYLOAD ||
+            header->tag >= sentUs.size()) {
+            return false;
+        }
+        payload->resize(header->size);
+        if (!readAll(payload->data(), header->size)) {
+            return false;
+        }
+        *latencyUs = NowUs() - sentUs[header->tag];
+        return true;
+    }
+
+    // Send a single request and wait for its response.
+    bool call(uint8_t op, uint32_t session, const void *payload, uint32_t size, server_message_t *header,
+              std::vector<uint8_t> *response) {
+        uint32_t latencyUs;
+        add(op, session, payload, size);
+        return flush() && receive(header, response, &latencyUs) && header->status == wqx::SERVER_OK;
+    }
+
+    void reset() {
+        sentUs.clear();
+        flushed = 0;
+    }
+
+    static uint64_t NowUs() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+    }
+
+private:
+    int fd = -1;
+    std::vector<uint8_t> output;
+    std::vector<uint64_t> sentUs;
+    size_t flushed = 0;
+
+    bool readAll(void *data, size_t size) {
+        uint8_t *bytes = static_cast<uint8_t *>(data);
+        while (size != 0) {
+            ssize_t done = recv(fd, bytes, size, 0);
+            if (done <= 0) {
+                return false;
+            }
+            bytes += done;
+            size -= done;
+        }
+        return true;
+    }
+};
+
+static bool ParseUint(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || parsed > UINT32_MAX) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+// Each round taps a key and fetches the screen on every session of the client, like a user interacting with the UI.
+static void RunClient(const Options &options, uint32_t sessionCount, uint64_t deadlineUs, ClientResult *result) {
+    Client client;
+    if (!client.connect(options.socket)) {
+        fprintf(stderr, "Can't connect to %s.\n", options.socket);
+        return;
+    }
+    server_message_t header;
+    std::vector<uint8_t> payload;
+    std::vector<uint32_t> sessions;
+    uint32_t create[2] = {0, options.realtime ? wqx::SERVER_CREATE_REALTIME : 0};
+    for (uint32_t i = 0; i < sessionCount; i++) {
+        if (!client.call(wqx::SERVER_OP_CREATE, 0, create, sizeof(create), &header, &payload)) {
+            fprintf(stderr, "Can't create a session.\n");
+            return;
+        }
+        sessions.push_back(header.session);
+    }
+
+    uint8_t down[2] = {static_cast<uint8_t>(options.key), 1};
+    uint8_t up[2] = {static_cast<uint8_t>(options.key), 0};
+    // Real-time sessions run on their own, so they only get a round per interval.
+    uint32_t perSession = options.realtime ? 3 : 5;
+    bool ok = true;
+    while (ok && Client::NowUs() < deadlineUs) {
+        uint64_t roundUs = Client::NowUs();
+        client.reset();
+        for (uint32_t session : sessions) {
+            client.add(wqx::SERVER_OP_KEY, session, down, sizeof(down));
+            if (!options.realtime) {
+                client.add(wqx::SERVER_OP_RUN, session, &options.runMs, sizeof(options.runMs));
+            }
+            client.add(wqx::SERVER_OP_KEY, session, up, sizeof(up));
+            if (!options.realtime) {
+                client.add(wqx::SERVER_OP_RUN, session, &options.runMs, sizeof(options.runMs));
+            }
+            client.add(wqx::SERVER_OP_LCD_DIFF, session, nullptr, 0);
+        }
+        ok = client.flush();
+        for (size_t i = 0; ok && i < sessions.size() * perSession; i++) {
+            uint32_t latencyUs;
+            ok = client.receive(&header, &payload, &latencyUs);
+            if (!ok) {
+                break;
+            }
+            if (header.status != wqx::SERVER_OK) {
+                result->errors++;
+            } else if (header.op == wqx::SERVER_OP_RUN) {
+                result->guestMs += options.runMs;
+            }
+            (header.op == wqx::SERVER_OP_RUN ? result->runUs : result->otherUs).push_back(latencyUs);
+        }
+        uint64_t nextUs = roundUs + options.intervalMs * 1000ull;
+        uint64_t nowUs = Client::NowUs();
+        if (options.realtime && nowUs < nextUs && nextUs < deadlineUs) {
+            usleep(nextUs - nowUs);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Lost the connection to the server.\n");
+        return;
+    }
+    client.reset();
+    for (uint32_t session : sessions) {
+        if (client.call(wqx::SERVER_OP_STATS, session, nullptr, 0, &header, &payload) &&
+            payload.size() == sizeof(wqx::server_session_stats_t)) {
+            wqx::server_session_stats_t stats;
+            memcpy(&stats, payload.data(), sizeof(stats));
+            result->sessions.push_back(stats);
+        }
+        client.reset();
+        if (!client.call(wqx::SERVER_OP_DESTROY, session, nullptr, 0, &header, &payload)) {
+            result->errors++;
+        }
+        client.reset();
+    }
+    result->ok = true;
+}
+
+static void PrintLatency(const char *name, std::vector<uint32_t> &samples, const char *unit = "requests") {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t count = samples.size();
+    printf("%-6s %zu %s, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, count, unit,
+           samples[count / 2] / 1000.0, samples[std::min(count - 1, count * 99 / 100)] / 1000.0,
+           samples[count - 1] / 1000.0);
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --socket PATH     server socket (default nc1020.sock)\n"
+            "  --sessions N      sessions to create (default 64)\n"
+            "  --clients N       client connections, each on its own thread (default 4)\n"
+            "  --seconds N       test duration (default 10)\n"
+            "  --run-ms MS       guest time per run request (default 20)\n"
+            "  --key KEY         key ID to tap (default 0x1d)\n"
+            "  --realtime        create real-time sessions and only send input\n"
+            "  --interval-ms MS  time between input rounds with --realtime (default 100)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPT_SOCKET = 0x100, OPT_SESSIONS, OPT_CLIENTS, OPT_SECONDS, OPT_RUN_MS, OPT_KEY, OPT_REALTIME,
+        OPT_INTERVAL_MS, OPT_HELP,
+    };
+    static const struct option longOptions[] = {
+        {"socket", required_argument, nullptr, OPT_SOCKET},
+        {"sessions", required_argument, nullptr, OPT_SESSIONS},
+        {"clients", required_argument, nullptr, OPT_CLIENTS},
+        {"seconds", required_argument, nullptr, OPT_SECONDS},
+        {"run-ms", required_argument, nullptr, OPT_RUN_MS},
+        {"key", required_argument, nullptr, OPT_KEY},
+        {"realtime", no_argument, nullptr, OPT_REALTIME},
+        {"interval-ms", required_argument, nullptr, OPT_INTERVAL_MS},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Options options;
+    int opt;
+    bool valid = true;
+    while (valid && (opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case OPT_SOCKET: options.socket = optarg; break;
+        case OPT_SESSIONS: valid = ParseUint(optarg, &options.sessions); break;
+        case OPT_CLIENTS: valid = ParseUint(optarg, &options.clients); break;
+        case OPT_SECONDS: valid = ParseUint(optarg, &options.seconds); break;
+        case OPT_RUN_MS: valid = ParseUint(optarg, &options.runMs); break;
+        case OPT_KEY: valid = ParseUint(optarg, &options.key) && options.key <= 0x3f; break;
+        case OPT_REALTIME: options.realtime = true; break;
+        case OPT_INTERVAL_MS: valid = ParseUint(optarg, &options.intervalMs); break;
+        default: valid = false; break;
+        }
+    }
+    if (!valid || optind != argc || options.clients == 0 || options.sessions < options.clients ||
+        options.runMs == 0) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    Client info;
+    server_message_t header;
+    std::vector<uint8_t> payload;
+    if (!info.connect(options.socket) || !info.call(wqx::SERVER_OP_INFO, 0, nullptr, 0, &header, &payload) ||
+        payload.size() != 8) {
+        fprintf(stderr, "Can't query the server on %s.\n", options.socket);
+        return 1;
+    }
+    uint32_t threads;
+    memcpy(&threads, payload.data(), sizeof(threads));
+
+    std::vector<ClientResult> results(options.clients);
+    std::vector<std::thread> clients;
+    uint64_t startUs = Client::NowUs();
+    uint64_t deadlineUs = startUs + options.seconds * 1000000ull;
+    for (uint32_t i = 0; i < options.clients; i++) {
+        uint32_t count = options.sessions / options.clients + (i < options.sessions % options.clients ? 1 : 0);
+        clients.emplace_back(RunClient, std::cref(options), count, deadlineUs, &results[i]);
+    }
+    for (std::thread &client : clients) {
+        client.join();
+    }
+    uint64_t hostUs = Client::NowUs() - startUs;
+
+    bool ok = true;
+    uint32_t errors = 0;
+    uint64_t guestMs = 0;
+    std::vector<uint32_t> runUs;
+    std::vector<uint32_t> otherUs;
+    std::vector<uint32_t> maxLagUs;
+    std::vector<uint32_t> maxLateUs;
+    uint64_t steals = 0;
+    for (ClientResult &result : results) {
+        ok = ok && result.ok;
+        errors += result.errors;
+        guestMs += result.guestMs;
+        runUs.insert(runUs.end(), result.runUs.begin(), result.runUs.end());
+        otherUs.insert(otherUs.end(), result.otherUs.begin(), result.otherUs.end());
+        for (const wqx::server_session_stats_t &stats : result.sessions) {
+            maxLagUs.push_back(stats.max_lag_us > UINT32_MAX ? UINT32_MAX : stats.max_lag_us);
+            maxLateUs.push_back(stats.max_late_us > UINT32_MAX ? UINT32_MAX : stats.max_late_us);
+            steals += stats.steals;
+        }
+    }
+    // Guest time emulated per host time is the number of sessions the server could keep at real-time speed.
+    double realTime = guestMs * 1000.0 / hostUs;
+    printf("sessions: %u over %u connections, server on %u threads, %.1f s\n", options.sessions, options.clients,
+           threads, hostUs / 1e6);
+    if (!options.realtime) {
+        printf("guest:  %llu ms, %.1f real-time sessions, %.1f per core\n", static_cast<unsigned long long>(guestMs),
+               realTime, realTime / threads);
+    }
+    PrintLatency("run:", runUs);
+    PrintLatency("other:", otherUs);
+    // Per session worst cases, so p99 is the 99th percentile session.
+    PrintLatency("lag:", maxLagUs, "sessions");
+    PrintLatency("late:", maxLateUs, "sessions");
+    printf("steals: %llu\n", static_cast<unsigned long long>(steals));
+    if (errors != 0) {
+        printf("errors: %u\n", errors);
+    }
+    return ok && errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+#include "lz.h"
+#include <string.h>
+
+namespace wqx {
+
+// Kept small so the table fits comfortably on the stack of small targets.
+static const uint32_t HASH_BITS = 11;
+static const size_t MIN_MATCH = 4;
+// Table entries are 16 bit, which also bounds back reference offsets.
+static const size_t MAX_INPUT = 0xFFFF;
+
+static inline uint32_t Read32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint32_t Hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline bool WriteLength(uint8_t *dst, size_t capacity, size_t &pos, size_t length) {
+    while (length >= 0xFF) {
+        if (pos >= capacity) {
+            return false;
+        }
+        dst[pos++] = 0xFF;
+        length -= 0xFF;
+    }
+    if (pos >= capacity) {
+        return false;
+    }
+    dst[pos++] = length;
+    return true;
+}
+
+static inline bool ReadLength(const uint8_t *src, size_t size, size_t &pos, size_t &length) {
+    uint8_t value;
+    do {
+        if (pos >= size) {
+            return false;
+        }
+        value = src[pos++];
+        length += value;
+    } while (value == 0xFF);
+    return true;
+}
+
+size_t LzCompressBound(size_t size) {
+    return size + size / 0xFF + 16;
+}
+
+size_t LzCompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    if (size >= MAX_INPUT) {
+        return 0;
+    }
+
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t pos = 0;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + MIN_MATCH <= size) {
+        uint32_t sequence = Read32(src + i);
+        uint32_t h = Hash(sequence);
+        // Positions are stored offset by one so that 0 marks an empty slot.
+        size_t candidate = table[h];
+        table[h] = i + 1;
+        if (candidate == 0 || Read32(src + candidate - 1) != sequence) {
+            i++;
+            continue;
+        }
+        candidate--;
+
+        size_t match = MIN_MATCH;
+        while (i + match < size && src[candidate + match] == src[i + match]) {
+            match++;
+        }
+
+        size_t literals = i - anchor;
+        if (pos >= capacity) {
+            return 0;
+        }
+        size_t token = pos++;
+        dst[token] = ((literals < 15 ? literals : 15) << 4) | (match - MIN_MATCH < 15 ? match - MIN_MATCH : 15);
+        if (literals >= 15 && !WriteLength(dst, capacity, pos, literals - 15)) {
+            return 0;
+        }
+        if (pos + literals + 2 > capacity) {
+            return 0;
+        }
+        memcpy(dst + pos, src + anchor, literals);
+        pos += literals;
+        dst[pos++] = (i - candidate) & 0xFF;
+        dst[pos++] = (i - candidate) >> 8;
+        if (match - MIN_MATCH >= 15 && !WriteLength(dst, capacity, pos, match - MIN_MATCH - 15)) {
+            return 0;
+        }
+
+        i += match;
+        anchor = i;
+    }
+
+    // Trailing literals. A sequence without a back reference ends the stream.
+    size_t literals = size - anchor;
+    if (pos >= capacity) {
+        return 0;
+    }
+    dst[pos++] = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15 && !WriteLength(dst, capacity, pos, literals - 15)) {
+        return 0;
+    }
+    if (pos + literals > capacity) {
+        return 0;
+    }
+    memcpy(dst + pos, src + anchor, literals);
+    pos += literals;
+    return pos;
+}
+
+bool LzDecompress(const uint8_t *src, size_t size, uint8_t *dst, size_t out_size) {
+    size_t pos = 0;
+    size_t out = 0;
+    while (pos < size) {
+        uint8_t token = src[pos++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !ReadLength(src, size, pos, literals)) {
+            return false;
+        }
+        if (literals > size - pos || literals > out_size - out) {
+            return false;
+        }
+        memcpy(dst + out, src + pos, literals);
+        pos += literals;
+        out += literals;
+        if (pos == size) {
+            break;
+        }
+
+        if (size - pos < 2) {
+            return false;
+        }
+        size_t offset = src[pos] | (src[pos + 1] << 8);
+        pos += 2;
+        size_t match = token & 0x0F;
+        if (match == 15 && !ReadLength(src, size, pos, match)) {
+            return false;
+        }
+        match += MIN_MATCH;
+        if (offset == 0 || offset > out || match > out_size - out) {
+            return false;
+        }
+        // Byte by byte since the reference may overlap the output.
+        const uint8_t *ref = dst + out - offset;
+        for (size_t i = 0; i < match; i++) {
+            dst[out + i] = ref[i];
+        }
+        out += match;
+    }
+    return out == out_size;
+}
+
+}
@@ -0,0 +1,35 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace wqx {
+/**
+ * @brief Get the worst case compressed size of `size` bytes of input.
+ */
+extern size_t LzCompressBound(size_t size);
+/**
+ * @brief Compress a buffer with a small byte oriented LZ77 variant.
+ * @details The format is a sequence of literal runs followed by back references of at least 4 bytes. It favors
+ * speed over ratio, which suits the mostly empty guest RAM.
+ * @param[in] src Input buffer.
+ * @param size Size of the input buffer. Must be smaller than 64KiB.
+ * @param[out] dst Output buffer.
+ * @param capacity Size of the output buffer.
+ * @return Compressed size, or 0 if the output buffer is too small.
+ */
+extern size_t LzCompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+/**
+ * @brief Decompress a buffer produced by LzCompress().
+ * @param[in] src Compressed buffer.
+ * @param size Size of the compressed buffer.
+ * @param[out] dst Output buffer.
+ * @param out_size Exact expected size of the decompressed data.
+ * @retval true Success.
+ * @retval false Malformed input or size mismatch.
+ */
+extern bool LzDecompress(const uint8_t *src, size_t size, uint8_t *dst, size_t out_size);
+}
+
+#endif /* LZ_H_ */
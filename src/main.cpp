@@ -1,4 +1,4 @@
-#include "nc1020.h"
+#include "besta_hal.h"
 
 #include <cstring>
 #include <cstdint>
@@ -18,12 +18,30 @@ const char ROM_FILE[] = "rom.bin";
 const char NOR_FILE[] = "nor.bin";
 const char BBS_FILE[] = "bbs.bin";
 const char STATE_FILE[] = "nc1020.sts";
+const char BOOT_CACHE_FILE[] = "nc1020.bts";
+const char INPUT_LOG_FILE[] = "nc1020.inp";
 const char CONFIG_FILE[] = "nc1020.ini";
+const char STATS_FILE[] = "nc1020.log";
+
+// Period of the timer1 interrupt handler registered with SetTimer1IntHandler(&ext_ticker, 3).
+constexpr uint32_t TICKER_PERIOD_US = 30000;
 
 // Reserve 1MB on the heap so we don't get an OOM in case OS is allocating short-lived objects on heap.
 // 1MiB seems reasonable but this may needs to be adjusted further if it's proven to not be enough.
 constexpr size_t HEAP_RESERVED = 1024 * 1024;
 
+// Core counters shown by the overlay and written to STATS_FILE, in this order.
+constexpr size_t STATS_COUNT = 9;
+const char *const STATS_NAMES[STATS_COUNT] = {
+    "instructions", "cycles", "irqs", "bank_switches", "volume_switches", "zp40_swaps", "flash_commands", "page_loads",
+    "store_slow",
+};
+// Each counter is a 2 pixel bar and a 1 pixel gap.
+constexpr short STATS_ROWS = 3;
+constexpr short STATS_HEIGHT = STATS_COUNT * STATS_ROWS;
+// Frames of 30ms between overlay updates.
+constexpr uint32_t STATS_FRAMES = 33;
+
 const uint8_t KEYMAP_0x01[7] = {0x3b, 0x3f, 0x1a, 0x1f, 0x1b, 0x37, 0x1e}; // KEY_ESC - KEY_PGDN
 const uint8_t KEYMAP_ALPHABETS[26] = {
     0x28, 0x34, 0x32, 0x2a, 0x22, 0x2b, 0x2c, 0x2d, 0x27, 0x2e, 0x2f, 0x19, 0x36,
@@ -34,60 +52,11 @@ const uint8_t KEYMAP_NUMBERS[10] = {
     // time, F1, F2, F3, F4, dict, vcard, calc, calendar, exam
 }; // KEY_0 - KEY_9
 
-static const uint8_t FLAG_ROM_VOLUME_0 = 0b000;
-static const uint8_t FLAG_ROM_VOLUME_1 = 0b001;
-static const uint8_t FLAG_ROM_VOLUME_2 = 0b010;
-static const uint8_t FLAG_NOR = 0b011;
-static const uint8_t FLAG_NOR_DIRTY = 0b100;
-
-struct CacheBlock {
-    uint8_t flags; // xxxxxdVV. d: NOR page dirty, V: Volume number, 3 means NOR.
-    uint8_t page;
-    uint8_t data[0x8000];
-};
-
 // 1 cache block and a pointer.
 constexpr size_t CACHE_OVERHEAD_UNIT = sizeof(CacheBlock) + 4;
 // 3 ROM volumes and NOR pages
 constexpr size_t MAX_CACHE_SIZE = 0x80 * 3 + 0x20;
 
-class WqxHalBesta : public wqx::IWqxHal {
-public:
-    WqxHalBesta();
-    virtual bool loadNorPage(uint32_t page) override;
-    virtual bool saveNorPage(uint32_t page) override;
-    virtual bool wipeNorFlash() override;
-    virtual bool loadRomPage(uint32_t volume, uint32_t page) override;
-    virtual bool loadBbsPage(uint32_t volume, uint32_t page) override;
-    virtual bool saveState(const char *states, size_t size) override;
-    virtual bool loadState(char *states, size_t size) override;
-    void closeAll();
-    bool ensureOpen();
-    bool begin(size_t cacheSize);
-private:
-    unsigned short getNorCacheIndex(uint32_t page);
-    void setNorCacheIndex(uint32_t page, unsigned short index);
-    unsigned short getRomCacheIndex(uint32_t volume, uint32_t page);
-    void setRomCacheIndex(uint32_t volume, uint32_t page, unsigned short index);
-    CacheBlock *claimPage(unsigned short cacheIndex);
-
-    void *romFile;
-    void *norFile;
-    void *bbsFile;
-    size_t firstOut;
-    size_t cacheSize;
-    int8_t currentMappedNorPage;
-    CacheBlock **cacheBlockTable;
-    CacheBlock *cacheBlock;
-    uint8_t romIndexLow[0x80 * 3];
-    uint32_t romIndexHigh[0x80 * 3 / 32];
-    uint8_t norIndexLow[0x20];
-    uint32_t norIndexHigh;
-    uint8_t bbsCache[0x20000];
-
-    static constexpr unsigned short CACHE_INDEX_UNUSED = 0x1ff;
-};
-
 WqxHalBesta::WqxHalBesta(): romFile(nullptr), norFile(nullptr), bbsFile(nullptr), firstOut(0), cacheSize(0),
                             currentMappedNorPage(-1), cacheBlockTable(nullptr), cacheBlock(nullptr), romIndexLow{0},
                             romIndexHigh{0}, norIndexLow{0}, norIndexHigh(0xffffffff), bbsCache{0} {}
@@ -102,12 +71,6 @@ bool WqxHalBesta::begin(size_t cacheSize) {
     return true;
 }
 
-unsigned short WqxHalBesta::getNorCacheIndex(uint32_t page) {
-    unsigned short result = norIndexLow[page] | ((norIndexHigh >> page) & 1) << 8;
-    //Printf("norcache %d -> %#x\n", page, result);
-    return result;
-}
-
 void WqxHalBesta::setNorCacheIndex(uint32_t page, unsigned short index) {
     //Printf("norcache %d <- %#x\n", page, index);
     uint8_t newHigh = (index >> 8) & 1;
@@ -116,15 +79,6 @@ void WqxHalBesta::setNorCacheIndex(uint32_t page, unsigned short index) {
     norIndexHigh |= (newHigh << page);
 }
 
-unsigned short WqxHalBesta::getRomCacheIndex(uint32_t volume, uint32_t page) {
-    uint32_t pageAddress = volume * 0x80 + page;
-    uint32_t romIndexHighOffset = pageAddress / 32;
-    uint32_t romIndexHighShift = pageAddress % 32;
-    unsigned short result = romIndexLow[pageAddress] | ((romIndexHigh[romIndexHighOffset] >> romIndexHighShift) & 1) << 8;
-    //Printf("romcache %d %d -> %#x\n", volume, page, result);
-    return result;
-}
-
 void WqxHalBesta::setRomCacheIndex(uint32_t volume, uint32_t page, unsigned short index) {
     //Printf("romcache %d %d <- %#x\n", volume, page, index);
     uint8_t newHigh = (index >> 8) & 1;
@@ -166,7 +120,7 @@ CacheBlock *WqxHalBesta::claimPage(unsigned short cacheIndex) {
     return cachedPage;
 }
 
-bool WqxHalBesta::loadNorPage(uint32_t page) {
+bool WqxHalBesta::loadNorPageMiss(uint32_t page) {
     if (page > 0x1f || !ensureOpen()) {
         return false;
     }
@@ -242,7 +196,7 @@ bool WqxHalBesta::wipeNorFlash() {
     return true;
 }
 
-bool WqxHalBesta::loadRomPage(uint32_t volume, uint32_t page) {
+bool WqxHalBesta::loadRomPageMiss(uint32_t volume, uint32_t page) {
     if (page > 0x7f || volume > 2 || !ensureOpen()) {
         return false;
     }
@@ -280,16 +234,6 @@ bool WqxHalBesta::loadRomPage(uint32_t volume, uint32_t page) {
     return true;
 }
 
-bool WqxHalBesta::loadBbsPage(uint32_t volume, uint32_t page) {
-    (void) volume;
-    if (page > 0xf || volume > 2 || !ensureOpen()) {
-        return false;
-    }
-    this->bbs = &bbsCache[page * 0x2000];
-    this->shadowBbs = &bbsCache[0x2000];
-    return true;
-}
-
 bool WqxHalBesta::saveState(const char *states, size_t size) {
     void *statesFile = _afopen(STATE_FILE, "wb+");
     if (statesFile == nullptr) {
@@ -310,6 +254,44 @@ bool WqxHalBesta::loadState(char *states, size_t size) {
     return true;
 }
 
+bool WqxHalBesta::appendState(const char *states, size_t size) {
+    void *statesFile = _afopen(STATE_FILE, "ab");
+    if (statesFile == nullptr) {
+        return false;
+    }
+    bool result = _fwrite(states, 1, size, statesFile) == size;
+    _fclose(statesFile);
+    return result;
+}
+
+bool WqxHalBesta::saveBootCache(const char *states, size_t size) {
+    void *cacheFile = _afopen(BOOT_CACHE_FILE, "wb+");
+    if (cacheFile == nullptr) {
+        return false;
+    }
+    bool result = _fwrite(states, 1, size, cacheFile) == size;
+    _fclose(cacheFile);
+    return result;
+}
+
+bool WqxHalBesta::loadBootCache(char *states, size_t size) {
+    void *cacheFile = _afopen(BOOT_CACHE_FILE, "rb");
+    if (cacheFile == nullptr) {
+        return false;
+    }
+    _fread(states, 1, size, cacheFile);
+    _fclose(cacheFile);
+    return true;
+}
+
+volatile uint32_t ticker_count = 0;
+
+uint64_t WqxHalBesta::getMonotonicMicros() {
+    // Only ticks, and slices start right after one. A slice that keeps up measures 0 and one that falls behind measures
+    // whole ticks, so the governor can only see the host falling behind.
+    return static_cast<uint64_t>(ticker_count) * TICKER_PERIOD_US;
+}
+
 bool WqxHalBesta::ensureOpen() {
     if (norFile == nullptr) {
         norFile = _afopen(NOR_FILE, "rb+");
@@ -372,6 +354,8 @@ void WqxHalBesta::closeAll() {
 
 event_t *ticker_event = nullptr;
 short pressing0 = 0, pressing1 = 0;
+// Last key that went down since the main loop looked, so a tap shorter than a time slice still gets through.
+short tapped = 0;
 
 static inline bool test_events_no_shift(ui_event_t *uievent) {
     // Deactivate shift key because it may cause the keycode to change.
@@ -384,12 +368,17 @@ void ext_ticker() {
     static auto uievent = ui_event_t();
     bool hit = false;
 
+    ticker_count++;
+
     // TODO this still seem to lose track presses on BA110. Find out why.
     while (test_events_no_shift(&uievent)) {
         hit = true;
         if (GetEvent(&uievent) && uievent.event_type == 0x10) {
             pressing0 = uievent.key_code0;
             pressing1 = uievent.key_code1;
+            if (pressing0 != 0) {
+                tapped = pressing0;
+            }
         } else {
             ClearEvent(&uievent);
         }
@@ -450,16 +439,113 @@ short map_key_binding(short key) {
     return -1;
 }
 
+bool get_stats(uint64_t *values) {
+    auto stats = wqx::machine_stats_t();
+    wqx::GetStats(&stats);
+    values[0] = stats.instructions;
+    values[1] = stats.cycles;
+    values[2] = stats.irqs;
+    values[3] = stats.bank_switches;
+    values[4] = stats.volume_switches;
+    values[5] = stats.zp40_swaps;
+    values[6] = stats.flash_commands;
+    values[7] = stats.page_loads;
+    values[8] = stats.store_slow;
+    return stats.enabled;
+}
+
+// Draw a bar per counter, 5 pixels long per doubling of its count since the last update, so rates from a few per
+// second to millions per second all fit on one screen.
+void draw_stats(lcd_surface_t *surface, const uint64_t *values, const uint64_t *last) {
+    uint8_t *buffer = reinterpret_cast<uint8_t *>(surface->buffer);
+    size_t stride = surface->width / 8;
+    std::memset(buffer, 0, stride * surface->height);
+    for (size_t i = 0; i < STATS_COUNT; i++) {
+        uint8_t *row = buffer + i * STATS_ROWS * stride;
+        short length = 0;
+        for (uint64_t delta = values[i] - last[i]; delta != 0 && length < surface->width; delta >>= 1) {
+            length += 5;
+        }
+        for (short x = 0; x < length && x < surface->width; x++) {
+            row[x / 8] |= 0x80 >> (x % 8);
+        }
+        std::memcpy(row + stride, row, stride);
+    }
+}
+
+// One counter per line, like the --stats output of nc1020-run.
+bool save_stats() {
+    uint64_t values[STATS_COUNT];
+    if (!get_stats(values)) {
+        return false;
+    }
+    void *statsFile = _afopen(STATS_FILE, "wb+");
+    if (statsFile == nullptr) {
+        return false;
+    }
+    bool result = true;
+    for (size_t i = 0; i < STATS_COUNT; i++) {
+        char line[64];
+        size_t size = std::strlen(STATS_NAMES[i]);
+        std::memcpy(line, STATS_NAMES[i], size);
+        line[size++] = ' ';
+        char digits[20];
+        size_t count = 0;
+        uint64_t value = values[i];
+        do {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value != 0);
+        while (count > 0) {
+            line[size++] = digits[--count];
+        }
+        line[size++] = '\n';
+        result = result && _fwrite(line, 1, size, statsFile) == size;
+    }
+    _fclose(statsFile);
+    return result;
+}
+
+bool WqxHalBesta::saveInputLog(const char *data, size_t size) {
+    void *logFile = _afopen(INPUT_LOG_FILE, "wb+");
+    if (logFile == nullptr) {
+        return false;
+    }
+    bool result = _fwrite(data, 1, size, logFile) == size;
+    _fclose(logFile);
+    return result;
+}
+
+bool WqxHalBesta::appendInputLog(const char *data, size_t size) {
+    void *logFile = _afopen(INPUT_LOG_FILE, "ab");
+    if (logFile == nullptr) {
+        return false;
+    }
+    bool result = _fwrite(data, 1, size, logFile) == size;
+    _fclose(logFile);
+    return result;
+}
+
 int main() {
     auto old_hold_cfg = key_press_event_config_t();
     uint32_t quit_ticks = 0;
+    short held[2] = {-1, -1};
 
     rgbSetBkColor(0xffffff);
     ClearScreen(false);
 
     // Parse config file
     auto cpu_speed = _GetPrivateProfileInt("Hacks", "CPUSpeed", 0, CONFIG_FILE);
+    auto governor = _GetPrivateProfileInt("Hacks", "Governor", 0, CONFIG_FILE);
+    auto governor_min_speed = _GetPrivateProfileInt("Hacks", "GovernorMinSpeed", 0, CONFIG_FILE);
     auto cache_size_conf = _GetPrivateProfileInt("Hacks", "CacheSizeLimit", 0, CONFIG_FILE);
+    auto autosave = _GetPrivateProfileInt("Hacks", "AutoSave", 0, CONFIG_FILE);
+    auto boot_cache = _GetPrivateProfileInt("Hacks", "BootCache", 3000, CONFIG_FILE);
+    auto record_input = _GetPrivateProfileInt("Hacks", "RecordInput", 0, CONFIG_FILE);
+    auto show_stats = _GetPrivateProfileInt("Hacks", "Stats", 0, CONFIG_FILE);
+    // Frames of 30ms between autosaves.
+    uint32_t autosave_frames = autosave > 0 ? autosave * 1000 / 30 : 0;
+    uint32_t frames_since_save = 0;
 
     ticker_event = OSCreateEvent(0, 0);
 
@@ -504,7 +590,29 @@ int main() {
     }
 
     wqx::Initialize(&hal, cpu_speed);
-    wqx::LoadNC1020();
+    if (!wqx::LoadNC1020() && boot_cache > 0) {
+        wqx::BootNC1020(boot_cache);
+    }
+    wqx::SetGovernor(governor != 0, governor_min_speed, 0);
+    if (record_input > 0) {
+        wqx::StartInputRecording(record_input);
+    }
+
+    // Counter overlay below the LCD, when the core counts and there is room for it.
+    uint64_t stats_last[STATS_COUNT] = {};
+    uint32_t frames_since_stats = 0;
+    lcd_surface_t *stats_fb = nullptr;
+    short stats_offsety = offsety + fb->height + 2;
+    if (show_stats != 0 && get_stats(stats_last) && stats_offsety + STATS_HEIGHT <= lcd->height) {
+        stats_fb = reinterpret_cast<lcd_surface_t *>(lcalloc(1, GetImageSizeExt(160, STATS_HEIGHT, 1)));
+    }
+    if (stats_fb != nullptr) {
+        InitGraphic(stats_fb, 160, STATS_HEIGHT, 1);
+        if (stats_fb->palette != nullptr) {
+            stats_fb->palette[0] = 0xffffff;
+            stats_fb->palette[1] = 0x000000;
+        }
+    }
 
     // Set up "spam key press as key down" handler
     GetSysKeyState(&old_hold_cfg);
@@ -515,11 +623,13 @@ int main() {
         if (OSWaitForEvent(ticker_event, 10000) != WAIT_RESULT_RESOLVED) {
             OSCloseEvent(ticker_event);
             hal.closeAll();
+            if (stats_fb != nullptr) {
+                _lfree(stats_fb);
+            }
             _lfree(fb);
             return 1;
         }
 
-        // TODO draw a bar for the tick counter
         if (pressing0 == KEY_HOME) {
             quit_ticks++;
             // 20 (~600ms) seems to be (somewhat) reliable. More than this and the quit condition may never be
@@ -531,20 +641,49 @@ int main() {
             quit_ticks = 0;
         }
 
-        // Handle key presses
-        // TODO handle pressing1 as well
-        short target_key_code = map_key_binding(pressing0);
-        if (target_key_code >= 0) {
-            wqx::SetKey(target_key_code, true);
-        } else {
-            wqx::ReleaseAllKeys();
+        // Handle key presses. Changes are queued at the current guest cycle.
+        short keys[2] = {map_key_binding(pressing0), map_key_binding(pressing1)};
+        short tap = map_key_binding(tapped);
+        tapped = 0;
+        uint64_t now = wqx::GetCycleCount();
+        for (short key : held) {
+            if (key >= 0 && key != keys[0] && key != keys[1]) {
+                wqx::QueueKey(now, key, false);
+            }
+        }
+        for (short key : keys) {
+            if (key >= 0 && key != held[0] && key != held[1]) {
+                wqx::QueueKey(now, key, true);
+            }
         }
+        if (tap >= 0 && tap != keys[0] && tap != keys[1] && tap != held[0] && tap != held[1]) {
+            // Pressed and released since the last slice. Give it a 50ms press so the guest's scan sees it.
+            wqx::QueueKey(now, tap, true);
+            wqx::QueueKey(now + wqx::GetCpuSpeed() / 20, tap, false);
+        }
+        held[0] = keys[0];
+        held[1] = keys[1];
 
         // Run emulator and draw LCD
         wqx::RunTimeSlice(30, false);
-        wqx::CopyLcdBuffer(reinterpret_cast<uint8_t *>(fb->buffer));
-        // TODO handle the LCD graphic segments (the 7seg counter, icons, scroll bar, etc.)
-        ShowGraphic(offsetx, offsety, fb, BLIT_NONE);
+        // Blit each complete guest frame once, never a half drawn one.
+        if (wqx::CopyLcdFrame(reinterpret_cast<uint8_t *>(fb->buffer))) {
+            // TODO handle the LCD graphic segments (the 7seg counter, icons, scroll bar, etc.)
+            ShowGraphic(offsetx, offsety, fb, BLIT_NONE);
+        }
+        if (stats_fb != nullptr && ++frames_since_stats >= STATS_FRAMES) {
+            uint64_t values[STATS_COUNT];
+            get_stats(values);
+            draw_stats(stats_fb, values, stats_last);
+            ShowGraphic(offsetx, stats_offsety, stats_fb, BLIT_NONE);
+            std::memcpy(stats_last, values, sizeof(stats_last));
+            frames_since_stats = 0;
+        }
+
+        if (autosave_frames != 0 && ++frames_since_save >= autosave_frames) {
+            wqx::SaveNC1020(wqx::STATE_INCREMENTAL);
+            frames_since_save = 0;
+        }
     }
 
     // Drain all problematic events that might raise and revert to normal key press behavior
@@ -553,9 +692,16 @@ int main() {
     drain_all_events();
     SetSysKeyState(&old_hold_cfg);
 
+    wqx::StopInputRecording();
     wqx::SaveNC1020();
+    if (show_stats != 0) {
+        save_stats();
+    }
     OSCloseEvent(ticker_event);
     hal.closeAll();
+    if (stats_fb != nullptr) {
+        _lfree(stats_fb);
+    }
     _lfree(fb);
     return 0;
 }
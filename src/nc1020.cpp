@@ -1,8 +1,19 @@
 #include "nc1020.h"
+#include "lz.h"
 #include <string>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <new>
+
+// Page loads run on every bank switch. Builds with a single HAL define NC1020_HAL as its class and NC1020_HAL_HEADER
+// as its header to bind the core to it, so calls to a final HAL are devirtualized and its inline cache hits are
+// inlined. Other builds call through the IWqxHal interface.
+#ifdef NC1020_HAL
+#include NC1020_HAL_HEADER
+#include <type_traits>
+#endif
 
 namespace wqx {
     using std::string;
@@ -17,8 +28,27 @@ namespace wqx {
     
     static const uint16_t IO_LIMIT = 0x40;
 #define IO_API
-    typedef uint8_t (IO_API *io_read_func_t)(uint8_t);
-    typedef void (IO_API *io_write_func_t)(uint8_t, uint8_t);
+    struct MachineState;
+    typedef uint8_t (IO_API MachineState::*io_read_func_t)(uint8_t);
+    typedef void (IO_API MachineState::*io_write_func_t)(uint8_t, uint8_t);
+#ifdef NC1020_HAL
+    typedef NC1020_HAL page_hal_t;
+    static_assert(std::is_base_of<IWqxHal, page_hal_t>::value, "NC1020_HAL must implement IWqxHal");
+#else
+    typedef IWqxHal page_hal_t;
+#endif
+// Event counters for GetStats(). Builds without NC1020_STATS compile them out.
+#ifdef NC1020_STATS
+#define COUNT_STAT(name) (stats.name++)
+#else
+#define COUNT_STAT(name) ((void) 0)
+#endif
+// Builds whose HAL only loads pages synchronously define NC1020_NO_ASYNC_PAGES to leave SetAsyncPageLoads() out.
+#ifdef NC1020_NO_ASYNC_PAGES
+    static const bool ASYNC_PAGES = false;
+#else
+    static const bool ASYNC_PAGES = true;
+#endif
     
     const uint16_t NMI_VEC = 0xFFFA;
     const uint16_t RESET_VEC = 0xFFFC;
@@ -26,15 +56,55 @@ namespace wqx {
     
     const uint32_t VERSION = 0x06;
 
-    // Runtime timing settings
-    // cpu cycles per timer0 period (1/2 s).
-    uint32_t cycles_timer0 = 0;
-    // cpu cycles per timer1 period (1/256 s).
-    uint32_t cycles_timer1 = 0;
-    // speed up
-    uint32_t cycles_timer1_speed_up = 0;
-    // cpu cycles per ms (1/1000 s).
-    uint32_t cycles_ms = 0;
+    // guest ms executed per RunTurbo() chunk between predicate checks.
+    static const uint32_t TURBO_CHUNK_MS = 10;
+
+    // cpu speeds accepted from callers and snapshots.
+    static const uint32_t CPU_SPEED_MIN = 1000;
+    static const uint32_t CPU_SPEED_MAX = CYCLES_SECOND * 100;
+
+    // Speed governor settings
+    // guest ms of RunTimeSlice() calls sampled before each decision.
+    static const uint32_t GOVERNOR_WINDOW_MS = 1000;
+    // host time per guest time (in permille) the governor aims for.
+    static const uint32_t GOVERNOR_TARGET_LOAD = 800;
+    // lower the clock above this load.
+    static const uint32_t GOVERNOR_HIGH_LOAD = 950;
+    // raise the clock below this load.
+    static const uint32_t GOVERNOR_LOW_LOAD = 600;
+    // windows after lowering the clock before it may be raised again.
+    static const uint32_t GOVERNOR_HOLD_WINDOWS = 30;
+
+    // Dirty tracking for incremental save states
+    // log2 of the block size RAM and NOR writes are tracked at.
+    static const uint32_t DIRTY_BLOCK_SHIFT = 8;
+    // 32-bit words in a dirty bitmap covering 32KiB.
+    static const uint32_t DIRTY_WORDS = 0x8000 >> DIRTY_BLOCK_SHIFT >> 5;
+    // What guest RAM stores keep dirty bits for.
+    static const uint8_t DIRTY_TRACK_RAM = 0x01;
+    static const uint8_t DIRTY_TRACK_LCD = 0x02;
+
+    // LCD buffer layout. 160x80 at 1bpp.
+    static const uint32_t LCD_ROW_BYTES = 20;
+    static const uint32_t LCD_ROWS = 80;
+    static const uint32_t LCD_DIRTY_WORDS = (LCD_ROWS + 31) / 32;
+    // A burst of LCD writes still going on after 1/LCD_FRAME_MAX_DIV s is cut into a frame anyway.
+    static const uint32_t LCD_FRAME_MAX_DIV = 20;
+
+    // Highest lcd_addr a loaded state may carry, so the whole buffer stays in RAM.
+    static const uint32_t LCD_ADDR_LIMIT = 0x8000 - LCD_ROWS * LCD_ROW_BYTES;
+
+    // Key events QueueKey() holds at a time.
+    static const uint32_t KEY_QUEUE_SIZE = 64;
+    // Keys QueueMacro() holds at a time.
+    static const uint32_t MACRO_SIZE = 256;
+    // Default keypad scans a macro key is held down and released for.
+    static const uint8_t MACRO_HOLD_SCANS = 2;
+    static const uint8_t MACRO_RELEASE_SCANS = 2;
+
+    // Input recording
+    // Records buffered before they are passed to IWqxHal::appendInputLog().
+    static const uint32_t INPUT_LOG_BUFFER_RECORDS = 256;
 
 typedef struct {
 	uint16_t reg_pc;
@@ -52,12 +122,12 @@ struct nc1020_states_t {
 
 	uint8_t bak_40[0x40];
 
-	uint8_t clock_data[80];
+	uint8_t clock_buff[80];
 	uint8_t clock_flags;
 
-	uint8_t jg_wav_data[0x20];
+	uint8_t jg_wav_buff[0x20];
 	uint8_t jg_wav_flags;
-	uint8_t jg_wav_idx;
+	uint8_t jg_wav_index;
 	bool jg_wav_playing;
 
 	uint8_t fp_step;
@@ -69,8 +139,8 @@ struct nc1020_states_t {
 
 	bool slept;
 	bool should_wake_up;
-	bool pending_wake_up;
-	uint8_t wake_up_flags;
+	bool wake_up_pending;
+	uint8_t wake_up_key;
 
 	bool timer0_toggle;
 	uint32_t cycles;
@@ -82,78 +152,510 @@ struct nc1020_states_t {
 	uint8_t keypad_matrix[8];
 };
 
-static IWqxHal *hal = nullptr;
-
-static uint8_t* memmap[8];
-static nc1020_states_t nc1020_states;
-
-static uint32_t& version = nc1020_states.version;
-
-static uint16_t& reg_pc = nc1020_states.cpu.reg_pc;
-static uint8_t& reg_a = nc1020_states.cpu.reg_a;
-static uint8_t& reg_ps = nc1020_states.cpu.reg_ps;
-static uint8_t& reg_x = nc1020_states.cpu.reg_x;
-static uint8_t& reg_y = nc1020_states.cpu.reg_y;
-static uint8_t& reg_sp = nc1020_states.cpu.reg_sp;
-
-static uint8_t* ram_buff = nc1020_states.ram;
-static uint8_t* stack = ram_buff + 0x100;
-static uint8_t* ram_io = ram_buff;
-static uint8_t* ram_40 = ram_buff + 0x40;
-static uint8_t* ram_page0 = ram_buff;
-static uint8_t* ram_page1 = ram_buff + 0x2000;
-static uint8_t* ram_page2 = ram_buff + 0x4000;
-static uint8_t* ram_page3 = ram_buff + 0x6000;
-
-static uint8_t* clock_buff = nc1020_states.clock_data;
-static uint8_t& clock_flags = nc1020_states.clock_flags;
-
-static uint8_t* jg_wav_buff = nc1020_states.jg_wav_data;
-static uint8_t& jg_wav_flags = nc1020_states.jg_wav_flags;
-static uint8_t& jg_wav_index = nc1020_states.jg_wav_idx;
-static bool& jg_wav_playing = nc1020_states.jg_wav_playing;
-
-static uint8_t* bak_40 = nc1020_states.bak_40;
-static uint8_t& fp_step = nc1020_states.fp_step;
-static uint8_t& fp_type = nc1020_states.fp_type;
-static uint8_t& fp_bank_idx = nc1020_states.fp_bank_idx;
-static uint8_t& fp_bak1 = nc1020_states.fp_bak1;
-static uint8_t& fp_bak2 = nc1020_states.fp_bak2;
-static uint8_t* fp_buff = nc1020_states.fp_buff;
-
-static bool& slept = nc1020_states.slept;
-static bool& should_wake_up = nc1020_states.should_wake_up;
-static bool& wake_up_pending = nc1020_states.pending_wake_up;
-static uint8_t& wake_up_key = nc1020_states.wake_up_flags;
-
-static bool& should_irq = nc1020_states.should_irq;
-static bool& timer0_toggle = nc1020_states.timer0_toggle;
-static uint32_t& cycles = nc1020_states.cycles;
-static uint32_t& timer0_cycles = nc1020_states.timer0_cycles;
-static uint32_t& timer1_cycles = nc1020_states.timer1_cycles;
-
-static uint8_t* keypad_matrix = nc1020_states.keypad_matrix;
-static uint32_t& lcd_addr = nc1020_states.lcd_addr;
-
-static io_read_func_t io_read[0x40];
-static io_write_func_t io_write[0x40];
+// A key change applied by the run loop once GetCycleCount() reaches `cycle`.
+struct key_event_t {
+	uint64_t cycle;
+	uint8_t key_id;
+	bool down;
+};
+
+struct section_t;
+struct state_record_t;
+struct snapshot_header_t;
+struct boot_trace_t;
+
+// A NOR page held in memory once the machine has been forked. Shared between machines until one of them writes it.
+struct nor_page_t {
+	uint32_t refs;
+	uint8_t data[0x8000];
+};
+
+// Pages the boot cache depends on.
+static const uint8_t BOOT_PAGE_ROM = 0;
+static const uint8_t BOOT_PAGE_BBS = 1;
+static const uint8_t BOOT_PAGE_NOR = 2;
+static const uint8_t BOOT_PAGE_SHADOW = 3;
+// 3 ROM volumes of 0x80 pages, 3 BBS volumes of 0x10 pages, the NOR pages and the shadowed BBS.
+static const uint32_t BOOT_PAGE_LIMIT = 0x180 + 0x30 + 0x20 + 1;
+
+struct boot_page_t {
+	uint8_t kind;
+	uint8_t volume;
+	uint8_t page;
+	uint32_t hash;
+};
+
+struct boot_trace_t {
+	uint32_t boot_ms;
+	// Cleared when the boot reads a page outside the layout above. Such a boot is not cached.
+	bool complete;
+	uint32_t count;
+	uint32_t seen[(BOOT_PAGE_LIMIT + 31) / 32];
+	boot_page_t pages[BOOT_PAGE_LIMIT];
+};
+
+// Everything one emulated machine owns. The free functions and Machine forward here.
+struct MachineState : nc1020_states_t {
+	IWqxHal *hal;
+
+	uint8_t* memmap[8];
+
+	uint8_t* ram_buff;
+	uint8_t* stack;
+	uint8_t* ram_io;
+	uint8_t* ram_40;
+	uint8_t* ram_page0;
+	uint8_t* ram_page1;
+	uint8_t* ram_page2;
+	uint8_t* ram_page3;
+
+	// Runtime timing settings
+	// cpu cycles per timer0 period (1/2 s).
+	uint32_t cycles_timer0;
+	// cpu cycles per timer1 period (1/256 s).
+	uint32_t cycles_timer1;
+	// speed up
+	uint32_t cycles_timer1_speed_up;
+	// cpu cycles per ms (1/1000 s).
+	uint32_t cycles_ms;
+	// effective cpu cycles per second.
+	uint32_t cycles_second;
+
+	// guest cycles executed before the start of the current time slice.
+	uint64_t cycles_base;
+
+	// active RunUntil() condition. Only consulted by the watched interpreter.
+	run_condition_t run_cond;
+	stop_reason_t stop_reason;
+
+	// NOR pages written since Initialize().
+	uint32_t nor_dirty_mask;
+	// Identifies the current NOR contents. Changes on every NOR write so Restore() can skip unchanged NOR.
+	uint32_t nor_generation;
+	// Copies of NOR pages from before their first write, kept once snapshots are in use so Restore() can undo writes
+	// made after a snapshot.
+	bool nor_pristine_enabled;
+	nor_page_t* nor_pristine[0x20];
+	// Set once the machine has been forked. NOR is then read through nor_pages and written to private copies instead
+	// of the HAL.
+	bool nor_cow;
+	nor_page_t* nor_pages[0x20];
+
+	// RAM and NOR blocks written since the last checkpoint, i.e. the last successful save.
+	uint32_t ram_dirty[DIRTY_WORDS];
+	uint32_t nor_dirty_blocks[0x20][DIRTY_WORDS];
+	uint32_t nor_checkpoint_mask;
+	// Checksum of the state saved or loaded at the checkpoint. 0 when there is none to build a delta on.
+	uint32_t checkpoint_checksum;
+	// DIRTY_TRACK_* flags for what StoreRam() marks. RAM blocks only while there is a checkpoint, as the next save is
+	// a full one otherwise. LCD rows and frames once CopyLcdDirtyRows(), CopyLcdFrame() or a frame watch used them.
+	uint8_t dirty_tracking;
+	// The states SaveNC1020() keeps through the HAL: checksum of the last one written, bytes written since the last
+	// full state and how far that may grow before the whole state is rewritten.
+	uint32_t state_log_checksum;
+	size_t state_log_size;
+	size_t state_log_limit;
+
+	governor_stats_t governor;
+	uint64_t governor_host_us;
+	uint32_t governor_guest_ms;
+	uint32_t governor_hold;
+
+	machine_stats_t stats;
+
+	io_read_func_t io_read[0x40];
+	io_write_func_t io_write[0x40];
+
+	// Pages read so far while BootNC1020() runs the boot from reset.
+	boot_trace_t* boot_trace;
+
+	// LCD rows changed since the last CopyLcdDirtyRows(), one bit per row.
+	uint32_t lcd_dirty_rows[LCD_DIRTY_WORDS];
+
+	// Frame detection. LCD writes are gathered into bursts at every timer1 tick, and a burst followed by a full timer1
+	// period without LCD writes is a complete frame.
+	// LCD changed since the last timer1 tick.
+	bool lcd_writing;
+	bool lcd_burst;
+	uint64_t lcd_burst_start;
+	uint64_t lcd_burst_last;
+	// Last complete frame, not yet taken by CopyLcdFrame() when lcd_frame_ready is set.
+	bool lcd_frame_ready;
+	uint64_t lcd_frame_cycle;
+	uint8_t lcd_frame[LCD_ROWS * LCD_ROW_BYTES];
+
+	// Pending key events in cycle order, starting at key_queue_head.
+	key_event_t key_queue[KEY_QUEUE_SIZE];
+	uint32_t key_queue_head;
+	uint32_t key_queue_count;
+
+	// Keys typed by the macro engine, starting at macro_head. The first one is down while macro_down is set.
+	uint8_t macro_keys[MACRO_SIZE];
+	uint32_t macro_head;
+	uint32_t macro_count;
+	bool macro_down;
+	// Scans of the current key's row since it was last pressed or released. Write09 sets macro_step once there were
+	// enough of them, and the run stops at the next instruction boundary to move on.
+	uint8_t macro_scans;
+	uint8_t macro_hold_scans;
+	uint8_t macro_release_scans;
+	uint8_t macro_select;
+	bool macro_step;
+
+	// Set by SetAsyncPageLoads(). While a page load is pending, the bank maps pending_page and the run stops at the
+	// next instruction boundary until SwitchBank() gets the page.
+	bool async_pages;
+	bool page_pending;
+
+	// Input recording started by StartInputRecording(). Records not yet passed to the HAL, null when not recording.
+	uint8_t* input_log;
+	uint32_t input_log_count;
+	bool input_speed_up;
+	uint64_t input_checkpoint_cycles;
+	uint64_t input_next_checkpoint;
+
+	MachineState();
+	~MachineState();
+
+	void MarkRamDirty(uint32_t offset);
+	void SetCheckpoint(uint32_t checksum);
+	void MarkNorDirty(uint8_t page, uint32_t offset, uint32_t size);
+	void ClearDirty(bool nor);
+
+	page_hal_t* PageHal();
+	uint8_t* GetBank(uint8_t bank_idx);
+	void SwitchBank();
+	void SetAsyncPageLoads(bool enabled);
+	bool IsWaitingForPage();
+	bool SuspendAsyncPages();
+	void SwitchVolume();
+	void GenerateAndPlayJGWav();
+	uint8_t* GetPtr40(uint8_t index);
+
+	uint8_t IO_API ReadXX(uint8_t addr);
+	uint8_t IO_API Read06(uint8_t addr);
+	uint8_t IO_API Read3B(uint8_t addr);
+	uint8_t IO_API Read3F(uint8_t addr);
+	void IO_API WriteXX(uint8_t addr, uint8_t value);
+	void IO_API Write00(uint8_t addr, uint8_t value);
+	void IO_API Write05(uint8_t addr, uint8_t value);
+	void IO_API Write06(uint8_t addr, uint8_t value);
+	void IO_API Write08(uint8_t addr, uint8_t value);
+	void IO_API Write09(uint8_t addr, uint8_t value);
+	void IO_API Write0A(uint8_t addr, uint8_t value);
+	void IO_API Write0D(uint8_t addr, uint8_t value);
+	void IO_API Write0F(uint8_t addr, uint8_t value);
+	void IO_API Write20(uint8_t addr, uint8_t value);
+	void IO_API Write23(uint8_t addr, uint8_t value);
+	void IO_API Write3F(uint8_t addr, uint8_t value);
+
+	void AdjustTime();
+	bool IsCountDown();
+
+	void TouchNorPage(uint8_t page, const uint8_t* data);
+	void TouchAllNorPages();
+	uint8_t* LoadNorPage(uint8_t page);
+	uint8_t* WritableNorPage(uint8_t page);
+	void SaveNorPage(uint8_t page);
+	void WipeNorFlash();
+	void ReleaseNor();
+	bool ForkInto(MachineState& child, IWqxHal *child_hal);
+
+	uint8_t & Peek(uint8_t addr);
+	uint8_t & Peek(uint16_t addr);
+	uint16_t PeekW(uint16_t addr);
+	uint8_t Load(uint16_t addr);
+	void WatchRamWrite(uint8_t* ptr);
+	void CopyRam(uint8_t* dest, const uint8_t* src, uint32_t size);
+	void MarkLcdDirty(uint32_t offset, uint8_t value);
+	void TrackLcd();
+	void ResetLcdFrame();
+	void CheckLcdFrame(uint64_t now);
+	template <bool kWatch>
+	void StoreRam(uint8_t* ptr, uint8_t value);
+	template <bool kWatch>
+	void StoreStack(uint8_t sp, uint8_t value);
+	template <bool kWatch>
+	void Store(uint16_t addr, uint8_t value);
+
+	void ApplyCpuSpeed(uint32_t cpu_speed);
+	void Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override);
+	void ResetStates();
+	void Reset();
+
+	uint32_t GetNorDirtyCount(uint32_t flags);
+	uint32_t GetNorDeltaCount(uint32_t flags);
+	size_t GetStatesSizeBound(uint32_t flags);
+	size_t SaveStatesToBuffer(uint8_t* buffer, size_t capacity, uint32_t flags);
+	bool LoadSection(const section_t& section);
+	bool ApplyRecord(const state_record_t& record);
+	bool LoadStatesFromBuffer(const uint8_t* buffer, size_t size);
+	bool LoadNC1020();
+	bool SaveNC1020(uint32_t flags);
+	void TraceBootPage(uint8_t kind, uint8_t volume, uint8_t page, const uint8_t* data);
+	bool CheckBootSection(const section_t& section, uint32_t boot_ms);
+	bool LoadBootCache(uint32_t boot_ms);
+	bool BootNC1020(uint32_t boot_ms);
+
+	uint32_t GetMemmapRamOffset(uint8_t index);
+	size_t GetSnapshotSize();
+	size_t Snapshot(void* buffer, size_t capacity);
+	void RestoreNorPage(uint32_t page, const uint8_t* data);
+	void RestoreNor(const snapshot_header_t& header, const uint8_t* pages);
+	bool Restore(const void* buffer, size_t size);
+
+	void SetKey(uint8_t key_id, bool down_or_up);
+	void ReleaseAllKeys();
+	bool QueueKey(uint64_t cycle, uint8_t key_id, bool down_or_up);
+	void ClearKeyQueue();
+	void ApplyDueKeys();
+	bool QueueMacro(const uint8_t* keys, size_t count);
+	bool TypeText(const char* text);
+	void SetMacroTiming(uint8_t hold_scans, uint8_t release_scans);
+	size_t GetMacroPending();
+	void ClearMacro();
+	void CancelMacro();
+	void PressMacroKey();
+	void StepMacro();
+	uint32_t GetStateHash();
+	void RecordInput(uint8_t type, uint8_t key_id, bool down, uint32_t value);
+	void RecordCheckpointIfDue();
+	bool FlushInputLog();
+	bool StartInputRecording(uint32_t checkpoint_ms);
+	bool StopInputRecording();
+	void RunToCycle(uint64_t target, bool speed_up);
+	bool ReplayInputLog(const uint8_t* log, size_t size, replay_result_t* result);
+	bool CopyLcdBuffer(uint8_t* buffer);
+	const uint8_t* GetLcdBuffer();
+	uint32_t CopyLcdDirtyRows(uint8_t* buffer, uint32_t* rows);
+	bool CopyLcdFrame(uint8_t* buffer, uint64_t* cycle);
+
+	template <bool kWatch>
+	void RunCycles(uint32_t end_cycles, bool speed_up);
+	template <bool kWatch>
+	void RunCyclesWithKeys(uint32_t end_cycles, bool speed_up);
+	void SetCpuSpeed(uint32_t cpu_speed);
+	uint32_t GetCpuSpeed();
+	void SetGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz);
+	void GetGovernorStats(governor_stats_t *stats);
+	void GetStats(machine_stats_t *stats);
+	void ResetStats();
+	void UpdateGovernor(uint32_t time_slice, uint64_t host_us);
+	void RunTimeSlice(uint32_t time_slice, bool speed_up);
+	bool IsConditionMet(const run_condition_t &cond);
+	stop_reason_t RunUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up);
+	stop_reason_t RunTurboChunks(uint32_t guest_ms, const run_condition_t *cond, bool (*until)(void *),
+		void *context, turbo_stats_t *stats);
+	void RunTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats);
+	stop_reason_t RunTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats);
+	uint64_t GetCycleCount();
+};
+
+MachineState::MachineState() :
+	hal(nullptr), ram_buff(ram), stack(ram + 0x100), ram_io(ram), ram_40(ram + 0x40), ram_page0(ram),
+	ram_page1(ram + 0x2000), ram_page2(ram + 0x4000), ram_page3(ram + 0x6000), cycles_timer0(0), cycles_timer1(0),
+	cycles_timer1_speed_up(0), cycles_ms(0), cycles_second(0), cycles_base(0), stop_reason(STOP_TIMEOUT),
+	nor_dirty_mask(0), nor_generation(0), nor_pristine_enabled(false), nor_cow(false),
+	nor_checkpoint_mask(0), checkpoint_checksum(0), dirty_tracking(0), state_log_checksum(0), state_log_size(0), state_log_limit(0),
+	governor_host_us(0), governor_guest_ms(0), governor_hold(0), boot_trace(nullptr), key_queue_head(0), key_queue_count(0),
+	macro_head(0), macro_count(0), macro_down(false), macro_scans(0), macro_hold_scans(MACRO_HOLD_SCANS),
+	macro_release_scans(MACRO_RELEASE_SCANS), macro_select(0xFF), macro_step(false),
+	async_pages(false), page_pending(false),
+	input_log(nullptr), input_log_count(0), input_speed_up(false), input_checkpoint_cycles(0), input_next_checkpoint(0) {
+	memset(static_cast<nc1020_states_t*>(this), 0, sizeof(nc1020_states_t));
+	memset(memmap, 0, sizeof(memmap));
+	memset(&run_cond, 0, sizeof(run_cond));
+	memset(nor_pristine, 0, sizeof(nor_pristine));
+	memset(nor_pages, 0, sizeof(nor_pages));
+	memset(ram_dirty, 0, sizeof(ram_dirty));
+	memset(nor_dirty_blocks, 0, sizeof(nor_dirty_blocks));
+	memset(&governor, 0, sizeof(governor));
+	memset(&stats, 0, sizeof(stats));
+	memset(lcd_dirty_rows, 0xFF, sizeof(lcd_dirty_rows));
+	memset(lcd_frame, 0, sizeof(lcd_frame));
+	ResetLcdFrame();
+}
+
+MachineState::~MachineState() {
+	free(input_log);
+	ReleaseNor();
+	free(boot_trace);
+}
 
 IWqxHal::IWqxHal() : page{0}, bbs{0} {}
 
-uint8_t* GetBank(uint8_t bank_idx){
+bool IWqxHal::appendState(const char *states, size_t size) {
+    (void) states;
+    (void) size;
+    return false;
+}
+
+uint64_t IWqxHal::getMonotonicMicros() {
+    return 0;
+}
+
+bool IWqxHal::saveInputLog(const char *data, size_t size) {
+    (void) data;
+    (void) size;
+    return false;
+}
+
+bool IWqxHal::appendInputLog(const char *data, size_t size) {
+    (void) data;
+    (void) size;
+    return false;
+}
+
+bool IWqxHal::saveBootCache(const char *states, size_t size) {
+    (void) states;
+    (void) size;
+    return false;
+}
+
+bool IWqxHal::loadBootCache(char *states, size_t size) {
+    (void) states;
+    (void) size;
+    return false;
+}
+
+page_load_t IWqxHal::requestNorPage(uint32_t page) {
+    return loadNorPage(page) ? PAGE_LOAD_READY : PAGE_LOAD_FAILED;
+}
+
+page_load_t IWqxHal::requestRomPage(uint32_t volume, uint32_t page) {
+    return loadRomPage(volume, page) ? PAGE_LOAD_READY : PAGE_LOAD_FAILED;
+}
+
+// Machines forked from each other may run on different threads and share NOR pages and generation numbers. Targets
+// without atomics only ever run a single machine at a time.
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+static inline uint32_t AtomicAdd(uint32_t* value, uint32_t delta) {
+	return __atomic_add_fetch(value, delta, __ATOMIC_ACQ_REL);
+}
+static inline uint32_t AtomicLoad(const uint32_t* value) {
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+#else
+static inline uint32_t AtomicAdd(uint32_t* value, uint32_t delta) {
+	return *value += delta;
+}
+static inline uint32_t AtomicLoad(const uint32_t* value) {
+	return *value;
+}
+#endif
+
+// Shared by all machines so that equal generations always mean equal NOR contents, even across forks.
+static uint32_t nor_generation_counter;
+
+static uint32_t NextNorGeneration() {
+	return AtomicAdd(&nor_generation_counter, 1);
+}
+
+static nor_page_t* NewNorPage(const uint8_t* data) {
+	nor_page_t* page = reinterpret_cast<nor_page_t*>(malloc(sizeof(nor_page_t)));
+	if (page != nullptr) {
+		page->refs = 1;
+		memcpy(page->data, data, 0x8000);
+	}
+	return page;
+}
+
+static nor_page_t* RetainNorPage(nor_page_t* page) {
+	if (page != nullptr) {
+		AtomicAdd(&page->refs, 1);
+	}
+	return page;
+}
+
+static void ReleaseNorPage(nor_page_t* page) {
+	if (page != nullptr && AtomicAdd(&page->refs, static_cast<uint32_t>(-1)) == 0) {
+		free(page);
+	}
+}
+
+static void MarkBlocksDirty(uint32_t* bitmap, uint32_t offset, uint32_t size) {
+	uint32_t last = (offset + size - 1) >> DIRTY_BLOCK_SHIFT;
+	for (uint32_t block = offset >> DIRTY_BLOCK_SHIFT; block <= last; block++) {
+		bitmap[block >> 5] |= 1u << (block & 0x1F);
+	}
+}
+
+inline void MachineState::MarkRamDirty(uint32_t offset) {
+	ram_dirty[offset >> (DIRTY_BLOCK_SHIFT + 5)] |= 1u << ((offset >> DIRTY_BLOCK_SHIFT) & 0x1F);
+}
+
+void MachineState::MarkNorDirty(uint8_t page, uint32_t offset, uint32_t size) {
+	nor_checkpoint_mask |= 1u << page;
+	MarkBlocksDirty(nor_dirty_blocks[page], offset, size);
+}
+
+void MachineState::SetCheckpoint(uint32_t checksum) {
+	checkpoint_checksum = checksum;
+	if (checksum != 0) {
+		dirty_tracking |= DIRTY_TRACK_RAM;
+	} else {
+		dirty_tracking &= ~DIRTY_TRACK_RAM;
+	}
+}
+
+void MachineState::ClearDirty(bool nor) {
+	memset(ram_dirty, 0, sizeof(ram_dirty));
+	if (nor) {
+		memset(nor_dirty_blocks, 0, sizeof(nor_dirty_blocks));
+		nor_checkpoint_mask = 0;
+	}
+}
+
+// The HAL as the type bound at build time. Every HAL given to the core is one when NC1020_HAL is defined.
+inline page_hal_t* MachineState::PageHal() {
+	return static_cast<page_hal_t*>(hal);
+}
+
+// Mapped in place of a bank whose page is still loading. The guest never runs while it is mapped. Never mapped
+// without ASYNC_PAGES, so it shrinks to a byte there.
+static uint8_t pending_page[ASYNC_PAGES ? 0x8000 : 1];
+
+uint8_t* MachineState::GetBank(uint8_t bank_idx){
 	uint8_t volume_idx = ram_io[0x0D] & 0x0f;
     if (bank_idx < 0x20) {
-        hal->loadNorPage(bank_idx);
-    	return hal->page;
+        uint8_t* page;
+        if (async_pages && nor_pages[bank_idx] == nullptr) {
+            page_load_t result = PageHal()->requestNorPage(bank_idx);
+            if (result == PAGE_LOAD_PENDING) {
+                page_pending = true;
+                return pending_page;
+            }
+            // Counted once the load completes, not on every retry.
+            COUNT_STAT(page_loads);
+            page = result == PAGE_LOAD_READY ? PageHal()->page : nullptr;
+        } else {
+            page = LoadNorPage(bank_idx);
+        }
+        page = page != nullptr ? page : PageHal()->page;
+        if (boot_trace != nullptr) {
+            TraceBootPage(BOOT_PAGE_NOR, 0, bank_idx, page);
+        }
+        return page;
     } else if (bank_idx >= 0x80) {
-        hal->loadRomPage(volume_idx, bank_idx - 0x80);
-        return hal->page;
+        if (!async_pages) {
+            PageHal()->loadRomPage(volume_idx, bank_idx - 0x80);
+        } else if (PageHal()->requestRomPage(volume_idx, bank_idx - 0x80) == PAGE_LOAD_PENDING) {
+            page_pending = true;
+            return pending_page;
+        }
+        COUNT_STAT(page_loads);
+        if (boot_trace != nullptr) {
+            TraceBootPage(BOOT_PAGE_ROM, volume_idx, bank_idx - 0x80, PageHal()->page);
+        }
+        return PageHal()->page;
     }
     return NULL;
 }
 
-void SwitchBank(){
+void MachineState::SwitchBank(){
 	uint8_t bank_idx = ram_io[0x00];
+	COUNT_STAT(bank_switches);
+	page_pending = false;
 	uint8_t* bank = GetBank(bank_idx);
     memmap[2] = bank;
     memmap[3] = bank + 0x2000;
@@ -161,9 +663,29 @@ void SwitchBank(){
     memmap[5] = bank + 0x6000;
 }
 
-void SwitchVolume(){
+void MachineState::SetAsyncPageLoads(bool enabled) {
+	async_pages = ASYNC_PAGES && enabled;
+	if (!enabled && page_pending) {
+		SwitchBank();
+	}
+}
+
+bool MachineState::IsWaitingForPage() {
+	return page_pending;
+}
+
+// Turbo runs, boots and replays have no slices to yield from, so they wait for pages. Returns whether async loads
+// were enabled, for the caller to restore.
+bool MachineState::SuspendAsyncPages() {
+	bool enabled = async_pages;
+	SetAsyncPageLoads(false);
+	return enabled;
+}
+
+void MachineState::SwitchVolume(){
 	uint8_t volume_idx = ram_io[0x0D];
 	volume_idx = volume_idx > 2 ? 0 : volume_idx;
+	COUNT_STAT(volume_switches);
 
     // Load normal bbs (except when hitting the shadowed page then we map ram_page3) to 0xc000 and shadowed bbs to 0xe000
     uint8_t roa_bbs = ram_io[0x0A] & 0x0f;
@@ -171,19 +693,23 @@ void SwitchVolume(){
     if (volume_idx == 0 && roa_bbs == 1) {
         memmap[6] = ram_page3;
     } else {
-        hal->loadBbsPage(volume_idx, roa_bbs);
-        memmap[6] = hal->bbs;
+        COUNT_STAT(page_loads);
+        PageHal()->loadBbsPage(volume_idx, roa_bbs);
+        memmap[6] = PageHal()->bbs;
+        if (boot_trace != nullptr) {
+            TraceBootPage(BOOT_PAGE_BBS, volume_idx, roa_bbs, PageHal()->bbs);
+        }
     }
-    memmap[7] = hal->shadowBbs;
+    memmap[7] = PageHal()->shadowBbs;
 
     SwitchBank();
 }
 
-void GenerateAndPlayJGWav(){
+void MachineState::GenerateAndPlayJGWav(){
 
 }
 
-uint8_t* GetPtr40(uint8_t index){
+uint8_t* MachineState::GetPtr40(uint8_t index){
     if (index < 4) {
         return ram_io;
     } else {
@@ -191,34 +717,34 @@ uint8_t* GetPtr40(uint8_t index){
     }
 }
 
-uint8_t IO_API ReadXX(uint8_t addr){
+uint8_t IO_API MachineState::ReadXX(uint8_t addr){
 	return ram_io[addr];
 }
 
-uint8_t IO_API Read06(uint8_t addr){
+uint8_t IO_API MachineState::Read06(uint8_t addr){
 	return ram_io[addr];
 }
 
-uint8_t IO_API Read3B(uint8_t addr){
+uint8_t IO_API MachineState::Read3B(uint8_t addr){
     if (!(ram_io[0x3D] & 0x03)) {
         return clock_buff[0x3B] & 0xFE;
     }
     return ram_io[addr];
 }
 
-uint8_t IO_API Read3F(uint8_t addr){
+uint8_t IO_API MachineState::Read3F(uint8_t addr){
     (void) addr;
     uint8_t idx = ram_io[0x3E];
     return idx < 80 ? clock_buff[idx] : 0;
 }
 
-void IO_API WriteXX(uint8_t addr, uint8_t value){
+void IO_API MachineState::WriteXX(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
 }
 
 
 // switch bank.
-void IO_API Write00(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write00(uint8_t addr, uint8_t value){
     uint8_t old_value = ram_io[addr];
     ram_io[addr] = value;
     if (value != old_value) {
@@ -226,30 +752,45 @@ void IO_API Write00(uint8_t addr, uint8_t value){
     }
 }
 
-void IO_API Write05(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write05(uint8_t addr, uint8_t value){
 	uint8_t old_value = ram_io[addr];
 	ram_io[addr] = value;
 	if ((old_value ^ value) & 0x08) {
 		slept = !(value & 0x08);
+		if (slept && (run_cond.flags & RUN_UNTIL_SLEEP)) {
+			stop_reason = STOP_SLEEP;
+		}
 	}
 }
 
-void IO_API Write06(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write06(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
     if (!lcd_addr) {
     	lcd_addr = ((ram_io[0x0C] & 0x03) << 12) | (value << 4);
+    	memset(lcd_dirty_rows, 0xFF, sizeof(lcd_dirty_rows));
+    	lcd_writing = true;
     }
     ram_io[0x09] &= 0xFE;
 }
 
-void IO_API Write08(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write08(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
     ram_io[0x0B] &= 0xFE;
 }
 
 // keypad matrix.
-void IO_API Write09(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write09(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
+    if (macro_count != 0) {
+        // The row is latched below, so this scan has seen the key. Selecting the same row again back to back counts
+        // once.
+        uint8_t row_bit = 1 << (macro_keys[macro_head] % 8);
+        if (value == row_bit && macro_select != row_bit &&
+            ++macro_scans >= (macro_down ? macro_hold_scans : macro_release_scans)) {
+            macro_step = true;
+        }
+        macro_select = value;
+    }
     switch (value){
     case 0x01: ram_io[0x08] = keypad_matrix[0]; break;
     case 0x02: ram_io[0x08] = keypad_matrix[1]; break;
@@ -283,19 +824,23 @@ void IO_API Write09(uint8_t addr, uint8_t value){
 }
 
 // roabbs
-void IO_API Write0A(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write0A(uint8_t addr, uint8_t value){
     uint8_t old_value = ram_io[addr];
     ram_io[addr] = value;
     if (value != old_value) {
         uint8_t volume_idx = ram_io[0x0D];
         volume_idx = volume_idx > 2 ? 0 : volume_idx;
-        hal->loadBbsPage(volume_idx, value & 0x0f);
-        memmap[6] = hal->bbs;
+        COUNT_STAT(page_loads);
+        PageHal()->loadBbsPage(volume_idx, value & 0x0f);
+        memmap[6] = PageHal()->bbs;
+        if (boot_trace != nullptr) {
+            TraceBootPage(BOOT_PAGE_BBS, volume_idx, value & 0x0f, PageHal()->bbs);
+        }
     }
 }
 
 // switch volume
-void IO_API Write0D(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write0D(uint8_t addr, uint8_t value){
 	uint8_t old_value = ram_io[addr];
     ram_io[addr] = value;
     if (value != old_value) {
@@ -304,24 +849,27 @@ void IO_API Write0D(uint8_t addr, uint8_t value){
 }
 
 // zp40 switch
-void IO_API Write0F(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write0F(uint8_t addr, uint8_t value){
 	uint8_t old_value = ram_io[addr];
     ram_io[addr] = value;
     old_value &= 0x07;
     value &= 0x07;
     if (value != old_value) {
+        COUNT_STAT(zp40_swaps);
         uint8_t* ptr_new = GetPtr40(value);
         if (old_value) {
-            memcpy(GetPtr40(old_value), ram_40, 0x40);
-            memcpy(ram_40, value ? ptr_new : bak_40, 0x40);
+            uint8_t* ptr_old = GetPtr40(old_value);
+            CopyRam(ptr_old, ram_40, 0x40);
+            MarkBlocksDirty(ram_dirty, ptr_old - ram_buff, 0x40);
+            CopyRam(ram_40, value ? ptr_new : bak_40, 0x40);
         } else {
             memcpy(bak_40, ram_40, 0x40);
-            memcpy(ram_40, ptr_new, 0x40);
+            CopyRam(ram_40, ptr_new, 0x40);
         }
     }
 }
 
-void IO_API Write20(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write20(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
     if (value == 0x80 || value == 0x40) {
         memset(jg_wav_buff, 0, 0x20);
@@ -331,7 +879,7 @@ void IO_API Write20(uint8_t addr, uint8_t value){
     }
 }
 
-void IO_API Write23(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write23(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
     if (value == 0xC2) {
         jg_wav_buff[jg_wav_index] = ram_io[0x22];
@@ -356,7 +904,7 @@ void IO_API Write23(uint8_t addr, uint8_t value){
 }
 
 // clock.
-void IO_API Write3F(uint8_t addr, uint8_t value){
+void IO_API MachineState::Write3F(uint8_t addr, uint8_t value){
     ram_io[addr] = value;
     uint8_t idx = ram_io[0x3E];
     if (idx >= 0x07) {
@@ -377,7 +925,7 @@ void IO_API Write3F(uint8_t addr, uint8_t value){
     }
 }
 
-void AdjustTime(){
+void MachineState::AdjustTime(){
     if (++ clock_buff[0] >= 60) {
         clock_buff[0] = 0;
         if (++ clock_buff[1] >= 60) {
@@ -390,7 +938,7 @@ void AdjustTime(){
     }
 }
 
-bool IsCountDown(){
+bool MachineState::IsCountDown(){
     if (!(clock_buff[10] & 0x02) ||
         !(clock_flags & 0x02)) {
         return false;
@@ -402,18 +950,104 @@ bool IsCountDown(){
         );
 }
 
-inline uint8_t & Peek(uint8_t addr) {
+// Called right before the guest modifies a NOR page.
+void MachineState::TouchNorPage(uint8_t page, const uint8_t* data) {
+	uint32_t bit = 1u << page;
+	if (nor_pristine_enabled && !(nor_dirty_mask & bit) && nor_pristine[page] == nullptr) {
+		nor_pristine[page] = NewNorPage(data);
+	}
+	nor_dirty_mask |= bit;
+	nor_generation = NextNorGeneration();
+}
+
+// Called right before the guest wipes the whole NOR flash.
+void MachineState::TouchAllNorPages() {
+	if (nor_pristine_enabled) {
+		for (uint8_t page = 0; page < 0x20; page++) {
+			uint8_t* data = (nor_dirty_mask & (1u << page)) ? nullptr : LoadNorPage(page);
+			if (data != nullptr) {
+				TouchNorPage(page, data);
+			}
+		}
+		SwitchBank();
+	}
+	nor_dirty_mask = 0xFFFFFFFF;
+	nor_generation = NextNorGeneration();
+	memset(nor_dirty_blocks, 0xFF, sizeof(nor_dirty_blocks));
+	nor_checkpoint_mask = 0xFFFFFFFF;
+}
+
+uint8_t* MachineState::LoadNorPage(uint8_t page) {
+	if (nor_pages[page] != nullptr) {
+		return nor_pages[page]->data;
+	}
+	COUNT_STAT(page_loads);
+	return PageHal()->loadNorPage(page) ? PageHal()->page : nullptr;
+}
+
+// Get a NOR page the guest is about to modify. After a fork the page is first copied if other machines still
+// share it.
+uint8_t* MachineState::WritableNorPage(uint8_t page) {
+	if (!nor_cow) {
+		COUNT_STAT(page_loads);
+		return PageHal()->loadNorPage(page) ? PageHal()->page : nullptr;
+	}
+	nor_page_t* owned = nor_pages[page];
+	if (owned == nullptr || AtomicLoad(&owned->refs) > 1) {
+		uint8_t* data = LoadNorPage(page);
+		owned = data != nullptr ? NewNorPage(data) : nullptr;
+		if (owned == nullptr) {
+			return nullptr;
+		}
+		ReleaseNorPage(nor_pages[page]);
+		nor_pages[page] = owned;
+		// The bank may have been mapped to the old copy, or the HAL page may have been evicted.
+		SwitchBank();
+	}
+	return owned->data;
+}
+
+void MachineState::SaveNorPage(uint8_t page) {
+	if (!nor_cow) {
+		PageHal()->saveNorPage(page);
+	}
+}
+
+void MachineState::WipeNorFlash() {
+	if (!nor_cow) {
+		PageHal()->wipeNorFlash();
+		return;
+	}
+	for (uint8_t page = 0; page < 0x20; page++) {
+		uint8_t* data = WritableNorPage(page);
+		if (data != nullptr) {
+			memset(data, 0xFF, 0x8000);
+		}
+	}
+}
+
+void MachineState::ReleaseNor() {
+	for (uint32_t i = 0; i < 0x20; i++) {
+		ReleaseNorPage(nor_pristine[i]);
+		ReleaseNorPage(nor_pages[i]);
+		nor_pristine[i] = nullptr;
+		nor_pages[i] = nullptr;
+	}
+	nor_cow = false;
+}
+
+inline uint8_t & MachineState::Peek(uint8_t addr) {
 	return ram_buff[addr];
 }
-inline uint8_t & Peek(uint16_t addr) {
+inline uint8_t & MachineState::Peek(uint16_t addr) {
 	return memmap[addr >> 13][addr & 0x1FFF];
 }
-inline uint16_t PeekW(uint16_t addr) {
+inline uint16_t MachineState::PeekW(uint16_t addr) {
 	return Peek(addr) | (Peek((uint16_t) (addr + 1)) << 8);
 }
-inline uint8_t Load(uint16_t addr) {
+inline uint8_t MachineState::Load(uint16_t addr) {
 	if (addr < IO_LIMIT) {
-		return io_read[addr](addr);
+		return (this->*io_read[addr])(addr);
 	}
 	if (((fp_step == 4 && fp_type == 2) ||
 		(fp_step == 6 && fp_type == 3)) &&
@@ -423,24 +1057,153 @@ inline uint8_t Load(uint16_t addr) {
 	}
 	if (addr == 0x45F && wake_up_pending) {
 		wake_up_pending = false;
+		uint8_t old_value = memmap[0][0x45F];
 		memmap[0][0x45F] = wake_up_key;
+		MarkRamDirty(0x45F);
+		if (old_value != wake_up_key) {
+			WatchRamWrite(&memmap[0][0x45F]);
+		}
 	}
 	return Peek(addr);
 }
-inline void Store(uint16_t addr, uint8_t value) {
+// Check the RAM side of the active RunUntil() condition after a byte in RAM changed.
+inline void MachineState::WatchRamWrite(uint8_t* ptr) {
+	uint32_t offset = ptr - ram_buff;
+	if ((run_cond.flags & RUN_UNTIL_LCD) && lcd_addr && offset - lcd_addr < 1600) {
+		stop_reason = STOP_LCD;
+	}
+	if ((run_cond.flags & RUN_UNTIL_RAM) && offset == run_cond.ram_addr &&
+		(*ptr & run_cond.ram_mask) == run_cond.ram_value) {
+		stop_reason = STOP_RAM;
+	}
+}
+// Copy a block into RAM on the guest's behalf. Watched like guest stores while RunUntil() watches RAM.
+void MachineState::CopyRam(uint8_t* dest, const uint8_t* src, uint32_t size) {
+	if (!(run_cond.flags & (RUN_UNTIL_LCD | RUN_UNTIL_RAM))) {
+		memcpy(dest, src, size);
+		return;
+	}
+	for (uint32_t i = 0; i < size; i++) {
+		if (dest[i] != src[i]) {
+			dest[i] = src[i];
+			WatchRamWrite(&dest[i]);
+		}
+	}
+}
+// Note a write that changes a byte in the LCD buffer in the row it lands in.
+inline void MachineState::MarkLcdDirty(uint32_t offset, uint8_t value) {
+	uint32_t lcd_offset = offset - lcd_addr;
+	if (lcd_offset < LCD_ROWS * LCD_ROW_BYTES && ram_buff[offset] != value) {
+		uint32_t row = lcd_offset / LCD_ROW_BYTES;
+		lcd_dirty_rows[row >> 5] |= 1u << (row & 0x1F);
+		lcd_writing = true;
+	}
+}
+// Start marking LCD rows for the first consumer. Nothing was tracked before, so the whole LCD counts as changed.
+void MachineState::TrackLcd() {
+	if (!(dirty_tracking & DIRTY_TRACK_LCD)) {
+		dirty_tracking |= DIRTY_TRACK_LCD;
+		memset(lcd_dirty_rows, 0xFF, sizeof(lcd_dirty_rows));
+		ResetLcdFrame();
+	}
+}
+// Start over after the LCD buffer changed behind the guest's back. The whole LCD becomes the next frame.
+void MachineState::ResetLcdFrame() {
+	lcd_writing = true;
+	lcd_burst = false;
+	lcd_burst_start = 0;
+	lcd_burst_last = 0;
+	lcd_frame_ready = false;
+	lcd_frame_cycle = 0;
+}
+// Called on every timer1 tick. `now` is the current GetCycleCount().
+void MachineState::CheckLcdFrame(uint64_t now) {
+	if (lcd_writing) {
+		lcd_writing = false;
+		if (!lcd_burst) {
+			lcd_burst = true;
+			lcd_burst_start = now;
+		}
+		lcd_burst_last = now;
+		// Firmware that redraws without pausing still gets frames presented.
+		if (now - lcd_burst_start < cycles_second / LCD_FRAME_MAX_DIV) {
+			return;
+		}
+	} else if (!lcd_burst || now - lcd_burst_last < cycles_timer1) {
+		return;
+	}
+
+	lcd_burst = false;
+	if (lcd_addr == 0) {
+		return;
+	}
+	memcpy(lcd_frame, ram_buff + lcd_addr, sizeof(lcd_frame));
+	lcd_frame_ready = true;
+	lcd_frame_cycle = lcd_burst_last;
+	if (run_cond.flags & RUN_UNTIL_FRAME) {
+		stop_reason = STOP_FRAME;
+	}
+}
+template <bool kWatch>
+inline void MachineState::StoreRam(uint8_t* ptr, uint8_t value) {
+	if (dirty_tracking != 0) {
+		uint32_t offset = ptr - ram_buff;
+		if (dirty_tracking & DIRTY_TRACK_RAM) {
+			MarkRamDirty(offset);
+		}
+		if (dirty_tracking & DIRTY_TRACK_LCD) {
+			MarkLcdDirty(offset, value);
+		}
+	}
+	if (kWatch) {
+		uint8_t old_value = *ptr;
+		*ptr = value;
+		if (old_value != value) {
+			WatchRamWrite(ptr);
+		}
+	} else {
+		*ptr = value;
+	}
+}
+// Pushes. The stack isn't tracked for incremental states, but it is watched.
+template <bool kWatch>
+inline void MachineState::StoreStack(uint8_t sp, uint8_t value) {
+	if (kWatch && stack[sp] != value) {
+		stack[sp] = value;
+		WatchRamWrite(&stack[sp]);
+	} else {
+		stack[sp] = value;
+	}
+}
+template <bool kWatch>
+inline void MachineState::Store(uint16_t addr, uint8_t value) {
 	if (addr < IO_LIMIT) {
-		io_write[addr](addr, value);
+		if (kWatch) {
+			// Handlers may change other registers or swap the zp40 window, so the watched byte is compared as well.
+			uint8_t old_value = ram_io[addr];
+			uint8_t old_watched = ram_buff[run_cond.ram_addr];
+			(this->*io_write[addr])(addr, value);
+			if (ram_io[addr] != old_value) {
+				WatchRamWrite(&ram_io[addr]);
+			}
+			if (run_cond.ram_addr != addr && ram_buff[run_cond.ram_addr] != old_watched) {
+				WatchRamWrite(&ram_buff[run_cond.ram_addr]);
+			}
+		} else {
+			(this->*io_write[addr])(addr, value);
+		}
 		return;
 	}
 	if (addr < 0x4000) {
-		Peek(addr) = value;
+		StoreRam<kWatch>(&Peek(addr), value);
 		return;
 	}
 	uint8_t* page = memmap[addr >> 13];
 	if (page == ram_page2 || page == ram_page3) {
-		page[addr & 0x1FFF] = value;
+		StoreRam<kWatch>(&page[addr & 0x1FFF], value);
 		return;
 	}
+	COUNT_STAT(store_slow);
 	if (addr >= 0xE000) {
 		return;
 	}
@@ -453,7 +1216,7 @@ inline void Store(uint16_t addr, uint8_t value) {
         return;
     }
 
-    uint8_t* bank = hal->page;
+    uint8_t* bank = memmap[2];
 
     if (fp_step == 0) {
         if (addr == 0x5555 && value == 0xAA) {
@@ -477,6 +1240,7 @@ inline void Store(uint16_t addr, uint8_t value) {
         	case 0x78: fp_type = 6; break;
         	}
             if (fp_type) {
+                COUNT_STAT(flash_commands);
                 if (fp_type == 1) {
                     fp_bank_idx = bank_idx;
                     fp_bak1 = bank[0x4000];
@@ -489,15 +1253,25 @@ inline void Store(uint16_t addr, uint8_t value) {
     } else if (fp_step == 3) {
         if (fp_type == 1) {
             if (value == 0xF0) {
-                bank[0x4000] = fp_bak1;
-                bank[0x4001] = fp_bak2;
-                hal->saveNorPage(bank_idx);
+                bank = WritableNorPage(bank_idx);
+                if (bank != nullptr) {
+                    TouchNorPage(bank_idx, bank);
+                    MarkNorDirty(bank_idx, 0x4000, 2);
+                    bank[0x4000] = fp_bak1;
+                    bank[0x4001] = fp_bak2;
+                    SaveNorPage(bank_idx);
+                }
                 fp_step = 0;
                 return;
             }
         } else if (fp_type == 2) {
-            bank[addr - 0x4000] &= value;
-            hal->saveNorPage(bank_idx);
+            bank = WritableNorPage(bank_idx);
+            if (bank != nullptr) {
+                TouchNorPage(bank_idx, bank);
+                MarkNorDirty(bank_idx, addr - 0x4000, 1);
+                bank[addr - 0x4000] &= value;
+                SaveNorPage(bank_idx);
+            }
             fp_step = 4;
             return;
         } else if (fp_type == 4) {
@@ -520,7 +1294,8 @@ inline void Store(uint16_t addr, uint8_t value) {
     } else if (fp_step == 5) {
         // Nuke the entire flash (and optionally NVRAM)
         if (addr == 0x5555 && value == 0x10) {
-            hal->wipeNorFlash();
+            TouchAllNorPages();
+            WipeNorFlash();
             if (fp_type == 5) {
                 memset(fp_buff, 0xFF, 0x100);
             }
@@ -529,8 +1304,13 @@ inline void Store(uint16_t addr, uint8_t value) {
         }
         if (fp_type == 3) {
             if (value == 0x30) {
-                memset(bank + (addr - (addr % 0x800) - 0x4000), 0xFF, 0x800);
-                hal->saveNorPage(bank_idx);
+                bank = WritableNorPage(bank_idx);
+                if (bank != nullptr) {
+                    TouchNorPage(bank_idx, bank);
+                    MarkNorDirty(bank_idx, addr - (addr % 0x800) - 0x4000, 0x800);
+                    memset(bank + (addr - (addr % 0x800) - 0x4000), 0xFF, 0x800);
+                    SaveNorPage(bank_idx);
+                }
                 fp_step = 6;
                 return;
             }
@@ -549,28 +1329,8 @@ inline void Store(uint16_t addr, uint8_t value) {
     //printf("error occurs when operate in flash!");
 }
 
-void Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override) {
-	hal = halImpl;
-	for (uint32_t i=0; i<0x40; i++) {
-		io_read[i] = ReadXX;
-		io_write[i] = WriteXX;
-	}
-	io_read[0x06] = Read06;
-	io_read[0x3B] = Read3B;
-	io_read[0x3F] = Read3F;
-	io_write[0x00] = Write00;
-	io_write[0x05] = Write05;
-	io_write[0x06] = Write06;
-	io_write[0x08] = Write08;
-	io_write[0x09] = Write09;
-	io_write[0x0A] = Write0A;
-	io_write[0x0D] = Write0D;
-	io_write[0x0F] = Write0F;
-	io_write[0x20] = Write20;
-	io_write[0x23] = Write23;
-	io_write[0x3F] = Write3F;
-
-        uint32_t cpu_speed = (cpu_speed_override == 0) ? CYCLES_SECOND : cpu_speed_override;
+void MachineState::ApplyCpuSpeed(uint32_t cpu_speed) {
+        cycles_second = cpu_speed;
         cycles_timer0 = cpu_speed / TIMER0_FREQ;
         // cpu cycles per timer1 period (1/256 s).
         cycles_timer1 = cpu_speed / TIMER1_FREQ;
@@ -578,6 +1338,40 @@ void Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override) {
         cycles_timer1_speed_up = cpu_speed / TIMER1_FREQ / 20;
         // cpu cycles per ms (1/1000 s).
         cycles_ms = cpu_speed / 1000;
+}
+
+void MachineState::Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override) {
+	hal = halImpl;
+	for (uint32_t i=0; i<0x40; i++) {
+		io_read[i] = &MachineState::ReadXX;
+		io_write[i] = &MachineState::WriteXX;
+	}
+	io_read[0x06] = &MachineState::Read06;
+	io_read[0x3B] = &MachineState::Read3B;
+	io_read[0x3F] = &MachineState::Read3F;
+	io_write[0x00] = &MachineState::Write00;
+	io_write[0x05] = &MachineState::Write05;
+	io_write[0x06] = &MachineState::Write06;
+	io_write[0x08] = &MachineState::Write08;
+	io_write[0x09] = &MachineState::Write09;
+	io_write[0x0A] = &MachineState::Write0A;
+	io_write[0x0D] = &MachineState::Write0D;
+	io_write[0x0F] = &MachineState::Write0F;
+	io_write[0x20] = &MachineState::Write20;
+	io_write[0x23] = &MachineState::Write23;
+	io_write[0x3F] = &MachineState::Write3F;
+
+        uint32_t cpu_speed = (cpu_speed_override == 0) ? CYCLES_SECOND : cpu_speed_override;
+        ApplyCpuSpeed(cpu_speed);
+        memset(&governor, 0, sizeof(governor));
+        governor.current_hz = cpu_speed;
+        memset(&stats, 0, sizeof(stats));
+        nor_dirty_mask = 0;
+        nor_generation = NextNorGeneration();
+        nor_pristine_enabled = false;
+        ReleaseNor();
+        ClearDirty(true);
+        SetCheckpoint(0);
 
 //#ifdef DEBUG
 //	FILE* file = fopen((nc1020_dir + "/wqxsimlogs.bin").c_str(), "rb");
@@ -596,15 +1390,22 @@ void Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override) {
 //#endif
 }
 
-void ResetStates(){
+void MachineState::ResetStates(){
+	// The recorded timeline ends here.
+	StopInputRecording();
 	version = VERSION;
 
 	memset(ram_buff, 0, 0x8000);
+	memset(ram_dirty, 0xFF, sizeof(ram_dirty));
+	memset(lcd_dirty_rows, 0xFF, sizeof(lcd_dirty_rows));
+	ResetLcdFrame();
 	memmap[0] = ram_page0;
 	memmap[2] = ram_page2;
 	SwitchVolume();
 
 	memset(keypad_matrix, 0, 8);
+	ClearKeyQueue();
+	ClearMacro();
 
 	memset(clock_buff, 0, 80);
 	clock_flags = 0;
@@ -624,12 +1425,13 @@ void ResetStates(){
 	should_irq = false;
 
 	cycles = 0;
-	reg_a = 0;
-	reg_ps = 0x24;
-	reg_x = 0;
-	reg_y = 0;
-	reg_sp = 0xFF;
-	reg_pc = PeekW(RESET_VEC);
+	cycles_base = 0;
+	cpu.reg_a = 0;
+	cpu.reg_ps = 0x24;
+	cpu.reg_x = 0;
+	cpu.reg_y = 0;
+	cpu.reg_sp = 0xFF;
+	cpu.reg_pc = PeekW(RESET_VEC);
 	timer0_cycles = cycles_timer0;
 	timer1_cycles = cycles_timer1;
 
@@ -639,322 +1441,1690 @@ void ResetStates(){
 //#endif
 }
 
-void Reset() {
+void MachineState::Reset() {
 	ResetStates();
 }
 
-void LoadStates(){
-	ResetStates();
-        hal->loadState(reinterpret_cast<char *>(&nc1020_states), sizeof(nc1020_states));
-	if (version != VERSION) {
-		return;
-	}
-	SwitchVolume();
-}
+// Chunked save state format. A header is followed by tagged sections that each carry their own version, so
+// sections can evolve independently and unknown ones can be skipped. All values are little endian.
+static const uint32_t STATE_MAGIC = 0x5453434E; // "NCST"
+static const uint16_t STATE_FORMAT = 1;
+static const size_t STATE_HEADER_SIZE = 16;
+static const size_t SECTION_HEADER_SIZE = 16;
+// Sanity limit for state files read through the HAL.
+static const size_t STATE_SIZE_LIMIT = 0x200000;
+// Deltas SaveNC1020() appends after a full state before it rewrites the whole state instead.
+static const size_t STATE_LOG_SLACK = 0x4000;
 
-void SaveStates(){
-	hal->saveState(reinterpret_cast<const char *>(&nc1020_states), sizeof(nc1020_states));
-}
+static const uint8_t SECTION_RAW = 0;
+static const uint8_t SECTION_LZ = 1;
 
-void LoadNC1020(){
-	LoadStates();
+static constexpr uint32_t Tag(const char (&name)[5]) {
+	return name[0] | (name[1] << 8) | (name[2] << 16) | (static_cast<uint32_t>(name[3]) << 24);
 }
+static const uint32_t TAG_CPU = Tag("CPU ");
+static const uint32_t TAG_RAM = Tag("RAM ");
+static const uint32_t TAG_IO = Tag("IO  ");
+static const uint32_t TAG_TIME = Tag("TIME");
+static const uint32_t TAG_NOR_PAGE = Tag("NORP");
+// Incremental states start with a DLTA section naming the checksum of the state they apply on top of, and carry
+// RAM and NOR as bitmaps of changed blocks followed by the blocks.
+static const uint32_t TAG_DELTA = Tag("DLTA");
+static const uint32_t TAG_RAM_DELTA = Tag("RAMD");
+static const uint32_t TAG_NOR_DELTA = Tag("NORD");
+// Boot caches start with a BOOT section listing the pages the boot read and their hashes. Ignored when loaded as a
+// regular state.
+static const uint32_t TAG_BOOT = Tag("BOOT");
 
-void SaveNC1020(){
-	SaveStates();
-}
+// Input logs written by StartInputRecording() start with a header holding the magic, format, clock and state size,
+// followed by the state and fixed size records of type, key, down flag, padding, u32 value and u64 cycle.
+static const uint32_t INPUT_LOG_MAGIC = 0x5249434E; // "NCIR"
+static const uint32_t INPUT_LOG_FORMAT = 1;
+static const size_t INPUT_LOG_HEADER_SIZE = 16;
+static const size_t INPUT_RECORD_SIZE = 16;
 
-void SetKey(uint8_t key_id, bool down_or_up){
-	uint8_t row = key_id % 8;
-	uint8_t col = key_id / 8;
-	uint8_t bits = 1 << col;
-	if (key_id == 0x0F) {
-		bits = 0xFE;
-	}
-	if (down_or_up) {
-		keypad_matrix[row] |= bits;
-	} else {
-		keypad_matrix[row] &= ~bits;
-	}
+enum {
+	INPUT_KEY = 1,
+	INPUT_RELEASE_ALL,
+	INPUT_SPEED,
+	INPUT_SPEED_UP,
+	// value is GetStateHash().
+	INPUT_CHECKPOINT,
+	INPUT_END,
+};
 
-	if (down_or_up) {
-		if (slept) {
-			if (key_id >= 0x08 && key_id <= 0x0F && key_id != 0x0E) {
-				switch (key_id) {
-				case 0x08: wake_up_key = 0x00; break;
-				case 0x09: wake_up_key = 0x0A; break;
-				case 0x0A: wake_up_key = 0x08; break;
-				case 0x0B: wake_up_key = 0x06; break;
-				case 0x0C: wake_up_key = 0x04; break;
-				case 0x0D: wake_up_key = 0x02; break;
-				case 0x0E: wake_up_key = 0x0C; break;
-				case 0x0F: wake_up_key = 0x00; break;
-				}
-				should_wake_up = true;
-				wake_up_pending = true;
-				slept = false;
-			}
-		} else {
-			if (key_id == 0x0F) {
-				slept = true;
-			}
-		}
+static void PutLe(uint8_t* out, uint64_t value, uint32_t bytes) {
+	for (uint32_t i = 0; i < bytes; i++) {
+		out[i] = (value >> (i * 8)) & 0xFF;
 	}
 }
 
-void ReleaseAllKeys() {
-    memset(keypad_matrix, 0, 8);
-}
+static const size_t IO_SECTION_SIZE = 0x40 + 80 + 1 + 0x20 + 3 + 5 + 0x100 + 5 + 4 + 8;
+static const size_t TIME_SECTION_SIZE = 4 + 8 + 4 + 4 + 4 + 1;
 
-bool CopyLcdBuffer(uint8_t* buffer){
-	if (lcd_addr == 0) return false;
-	memcpy(buffer, ram_buff + lcd_addr, 1600);
-	return true;
+static uint32_t Fnv1a(const uint8_t* data, size_t size) {
+	uint32_t hash = 0x811C9DC5;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x01000193;
+	}
+	return hash;
 }
 
-void RunTimeSlice(uint32_t time_slice, bool speed_up) {
-	uint32_t end_cycles = time_slice * cycles_ms;
-	register uint32_t cycles = wqx::cycles;
-	register uint16_t reg_pc = wqx::reg_pc;
-	register uint8_t reg_a = wqx::reg_a;
-	register uint8_t reg_ps = wqx::reg_ps;
-	register uint8_t reg_x = wqx::reg_x;
-	register uint8_t reg_y = wqx::reg_y;
-	register uint8_t reg_sp = wqx::reg_sp;
+class StateWriter {
+public:
+	StateWriter(uint8_t* buffer, size_t capacity) :
+		buffer(buffer), capacity(capacity), pos(STATE_HEADER_SIZE), section(0), sections(0),
+		ok(capacity >= STATE_HEADER_SIZE) {}
 
-	while (cycles < end_cycles) {
-//#ifdef DEBUG
-//		if (executed_insts == 2792170) {
-//			printf("debug start!\n");
-//		}
-//		if (executed_insts >= debug_logs.insts_start &&
-//			executed_insts < debug_logs.insts_start + debug_logs.insts_count) {
-//			log_rec_t& log = debug_logs.logs[executed_insts - debug_logs.insts_start];
-//			string debug_info;
-//			if (log.reg_pc != reg_pc) {
-//				debug_info += " pc ";
-//			}
-//			if (log.reg_a != reg_a) {
-//				debug_info += " a ";
-//			}
-//			if (log.reg_ps != reg_ps) {
-//				debug_info += " ps ";
-//			}
-//			if (log.reg_x != reg_x) {
-//				debug_info += " x ";
-//			}
-//			if (log.reg_y != reg_y) {
-//				debug_info += " y ";
-//			}
-//			if (log.reg_sp != reg_sp) {
-//				debug_info += " sp ";
-//			}
-//			if (debug_logs.peek_addr != -1) {
-//				if (log.peeked != Peek((uint16_t)debug_logs.peek_addr)) {
-//					debug_info += " mem ";
-//				}
-//			} else {
-//				if (log.peeked != Peek(reg_pc)) {
-//					debug_info += " op ";
-//				}
-//			}
-//			if (debug_info.length()) {
-//				printf("%d: %s\n", executed_insts, debug_info.c_str());
-//				exit(-1);
-//			}
-//		}
-//		if (executed_insts >= debug_logs.insts_start + debug_logs.insts_count) {
-//			printf("ok\n");
-//		}
-//#endif
-		switch (Peek(reg_pc++)) {
-		case 0x00: {
-			reg_pc++;
-			stack[reg_sp--] = reg_pc >> 8;
-			stack[reg_sp--] = reg_pc & 0xFF;
-			reg_ps |= 0x10;
-			stack[reg_sp--] = reg_ps;
-			reg_ps |= 0x04;
-			reg_pc = PeekW(IRQ_VEC);
-			cycles += 7;
-		}
-			break;
-		case 0x01: {
-			uint16_t addr = PeekW((Peek(reg_pc++) + reg_x) & 0xFF);
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 6;
+	void U8(uint8_t value) {
+		if (Reserve(1)) {
+			buffer[pos++] = value;
 		}
-			break;
-		case 0x02: {
+	}
+	void U16(uint16_t value) {
+		U8(value & 0xFF);
+		U8(value >> 8);
+	}
+	void U32(uint32_t value) {
+		U16(value & 0xFFFF);
+		U16(value >> 16);
+	}
+	void U64(uint64_t value) {
+		U32(value & 0xFFFFFFFF);
+		U32(value >> 32);
+	}
+	void Bytes(const uint8_t* data, size_t size) {
+		if (Reserve(size)) {
+			memcpy(buffer + pos, data, size);
+			pos += size;
 		}
-			break;
-		case 0x03: {
+	}
+	void BeginSection(uint32_t tag, uint16_t version, uint8_t index) {
+		section = pos;
+		U32(tag);
+		U16(version);
+		U8(SECTION_RAW);
+		U8(index);
+		U32(0);
+		U32(0);
+	}
+	void EndSection() {
+		size_t size = pos - section - SECTION_HEADER_SIZE;
+		Patch32(section + 8, size);
+		Patch32(section + 12, size);
+		sections++;
+	}
+	// Stores data LZ compressed, or raw when it doesn't compress.
+	void CompressedSection(uint32_t tag, uint16_t version, uint8_t index, const uint8_t* data, size_t size) {
+		BeginSection(tag, version, index);
+		if (!ok) {
+			return;
+		}
+		size_t packed = LzCompress(data, size, buffer + pos, capacity - pos);
+		if (packed == 0 || packed >= size) {
+			Bytes(data, size);
+			EndSection();
+			return;
+		}
+		pos += packed;
+		buffer[section + 6] = SECTION_LZ;
+		Patch32(section + 8, size);
+		Patch32(section + 12, packed);
+		sections++;
+	}
+	size_t Finish() {
+		if (!ok) {
+			return 0;
+		}
+		Patch32(0, STATE_MAGIC);
+		buffer[4] = STATE_FORMAT & 0xFF;
+		buffer[5] = STATE_FORMAT >> 8;
+		buffer[6] = sections & 0xFF;
+		buffer[7] = sections >> 8;
+		Patch32(8, pos);
+		Patch32(12, Fnv1a(buffer + STATE_HEADER_SIZE, pos - STATE_HEADER_SIZE));
+		return pos;
+	}
+
+private:
+	bool Reserve(size_t size) {
+		ok = ok && size <= capacity - pos;
+		return ok;
+	}
+	void Patch32(size_t offset, uint32_t value) {
+		buffer[offset] = value & 0xFF;
+		buffer[offset + 1] = (value >> 8) & 0xFF;
+		buffer[offset + 2] = (value >> 16) & 0xFF;
+		buffer[offset + 3] = value >> 24;
+	}
+
+	uint8_t* buffer;
+	size_t capacity;
+	size_t pos;
+	size_t section;
+	uint16_t sections;
+	bool ok;
+};
+
+class StateReader {
+public:
+	StateReader(const uint8_t* data, size_t size) : data(data), size(size), pos(0), ok(true) {}
+
+	uint8_t U8() {
+		if (!Take(1)) {
+			return 0;
 		}
-			break;
-		case 0x04: {
+		return data[pos++];
+	}
+	uint16_t U16() {
+		uint16_t low = U8();
+		return low | (U8() << 8);
+	}
+	uint32_t U32() {
+		uint32_t low = U16();
+		return low | (static_cast<uint32_t>(U16()) << 16);
+	}
+	uint64_t U64() {
+		uint64_t low = U32();
+		return low | (static_cast<uint64_t>(U32()) << 32);
+	}
+	bool Bool() {
+		return U8() != 0;
+	}
+	void Bytes(uint8_t* out, size_t count) {
+		if (Take(count)) {
+			memcpy(out, data + pos, count);
+			pos += count;
 		}
-			break;
-		case 0x05: {
-			uint16_t addr = Peek(reg_pc++);
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 3;
+	}
+	bool Ok() const {
+		return ok && pos == size;
+	}
+
+private:
+	bool Take(size_t count) {
+		ok = ok && count <= size - pos;
+		return ok;
+	}
+
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+	bool ok;
+};
+
+struct section_t {
+	uint32_t tag;
+	uint16_t version;
+	uint8_t encoding;
+	uint8_t index;
+	uint32_t raw_size;
+	const uint8_t* data;
+	uint32_t stored_size;
+};
+
+uint32_t MachineState::GetNorDirtyCount(uint32_t flags) {
+	if (!(flags & STATE_INCLUDE_NOR)) {
+		return 0;
+	}
+	uint32_t count = 0;
+	for (uint32_t mask = nor_dirty_mask; mask; mask &= mask - 1) {
+		count++;
+	}
+	return count;
+}
+
+// NOR pages only written since the checkpoint. Restore() may have dropped them from nor_dirty_mask.
+uint32_t MachineState::GetNorDeltaCount(uint32_t flags) {
+	if ((flags & (STATE_INCLUDE_NOR | STATE_INCREMENTAL)) != (STATE_INCLUDE_NOR | STATE_INCREMENTAL)) {
+		return 0;
+	}
+	uint32_t count = 0;
+	for (uint32_t mask = nor_checkpoint_mask & ~nor_dirty_mask; mask; mask &= mask - 1) {
+		count++;
+	}
+	return count;
+}
+
+static uint32_t CountBlocks(const uint32_t* bitmap) {
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < DIRTY_WORDS; i++) {
+		for (uint32_t word = bitmap[i]; word; word &= word - 1) {
+			count++;
 		}
-			break;
-		case 0x06: {
-			uint16_t addr = Peek(reg_pc++);
-			uint8_t tmp1 = Load(addr);
-			reg_ps &= 0x7C;
-			reg_ps |= (tmp1 >> 7);
-			tmp1 <<= 1;
-			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
-			Store(addr, tmp1);
-			cycles += 5;
+	}
+	return count;
+}
+
+static void WriteBlocks(StateWriter& writer, uint32_t tag, uint8_t index, const uint32_t* bitmap,
+	const uint8_t* data) {
+	writer.BeginSection(tag, 1, index);
+	for (uint32_t i = 0; i < DIRTY_WORDS; i++) {
+		writer.U32(bitmap[i]);
+	}
+	for (uint32_t block = 0; block < (DIRTY_WORDS << 5); block++) {
+		if (bitmap[block >> 5] & (1u << (block & 0x1F))) {
+			writer.Bytes(data + (block << DIRTY_BLOCK_SHIFT), 1 << DIRTY_BLOCK_SHIFT);
 		}
-			break;
-		case 0x07: {
+	}
+	writer.EndSection();
+}
+
+// Checks the whole section up front so a NOR page is never left half patched.
+static bool ReadBlocks(StateReader& reader, size_t size, uint8_t* data) {
+	uint32_t bitmap[DIRTY_WORDS];
+	for (uint32_t i = 0; i < DIRTY_WORDS; i++) {
+		bitmap[i] = reader.U32();
+	}
+	if (size != sizeof(bitmap) + (CountBlocks(bitmap) << DIRTY_BLOCK_SHIFT)) {
+		return false;
+	}
+	for (uint32_t block = 0; block < (DIRTY_WORDS << 5); block++) {
+		if (bitmap[block >> 5] & (1u << (block & 0x1F))) {
+			reader.Bytes(data + (block << DIRTY_BLOCK_SHIFT), 1 << DIRTY_BLOCK_SHIFT);
 		}
-			break;
-		case 0x08: {
-			stack[reg_sp--] = reg_ps;
-			cycles += 3;
+	}
+	return true;
+}
+
+size_t MachineState::GetStatesSizeBound(uint32_t flags) {
+	return STATE_HEADER_SIZE +
+		(boot_trace != nullptr ? SECTION_HEADER_SIZE + 10 + boot_trace->count * 7 : 0) +
+		SECTION_HEADER_SIZE + 7 +
+		SECTION_HEADER_SIZE + LzCompressBound(0x8000) +
+		SECTION_HEADER_SIZE + IO_SECTION_SIZE +
+		SECTION_HEADER_SIZE + TIME_SECTION_SIZE +
+		GetNorDirtyCount(flags) * (SECTION_HEADER_SIZE + LzCompressBound(0x8000)) +
+		SECTION_HEADER_SIZE + 4 + GetNorDeltaCount(flags) * (SECTION_HEADER_SIZE + sizeof(ram_dirty) + 0x8000);
+}
+
+size_t MachineState::SaveStatesToBuffer(uint8_t* buffer, size_t capacity, uint32_t flags) {
+	StateWriter writer(buffer, capacity);
+	bool delta = (flags & STATE_INCREMENTAL) && checkpoint_checksum != 0;
+
+	if (delta) {
+		writer.BeginSection(TAG_DELTA, 1, 0);
+		writer.U32(checkpoint_checksum);
+		writer.EndSection();
+	}
+
+	if (boot_trace != nullptr) {
+		writer.BeginSection(TAG_BOOT, 1, 0);
+		writer.U32(boot_trace->boot_ms);
+		writer.U32(cycles_second);
+		writer.U16(boot_trace->count);
+		for (uint32_t i = 0; i < boot_trace->count; i++) {
+			writer.U8(boot_trace->pages[i].kind);
+			writer.U8(boot_trace->pages[i].volume);
+			writer.U8(boot_trace->pages[i].page);
+			writer.U32(boot_trace->pages[i].hash);
+		}
+		writer.EndSection();
+	}
+
+	writer.BeginSection(TAG_CPU, 1, 0);
+	writer.U16(cpu.reg_pc);
+	writer.U8(cpu.reg_a);
+	writer.U8(cpu.reg_ps);
+	writer.U8(cpu.reg_x);
+	writer.U8(cpu.reg_y);
+	writer.U8(cpu.reg_sp);
+	writer.EndSection();
+
+	if (delta) {
+		// The zero page (including the I/O registers) and the stack change all the time and aren't tracked.
+		uint32_t bitmap[DIRTY_WORDS];
+		memcpy(bitmap, ram_dirty, sizeof(bitmap));
+		bitmap[0] |= 0x03;
+		WriteBlocks(writer, TAG_RAM_DELTA, 0, bitmap, ram_buff);
+	} else {
+		writer.CompressedSection(TAG_RAM, 1, 0, ram_buff, 0x8000);
+	}
+
+	writer.BeginSection(TAG_IO, 1, 0);
+	writer.Bytes(bak_40, 0x40);
+	writer.Bytes(clock_buff, 80);
+	writer.U8(clock_flags);
+	writer.Bytes(jg_wav_buff, 0x20);
+	writer.U8(jg_wav_flags);
+	writer.U8(jg_wav_index);
+	writer.U8(jg_wav_playing);
+	writer.U8(fp_step);
+	writer.U8(fp_type);
+	writer.U8(fp_bank_idx);
+	writer.U8(fp_bak1);
+	writer.U8(fp_bak2);
+	writer.Bytes(fp_buff, 0x100);
+	writer.U8(slept);
+	writer.U8(should_wake_up);
+	writer.U8(wake_up_pending);
+	writer.U8(wake_up_key);
+	writer.U8(should_irq);
+	writer.U32(lcd_addr);
+	writer.Bytes(keypad_matrix, 8);
+	writer.EndSection();
+
+	writer.BeginSection(TAG_TIME, 1, 0);
+	writer.U32(cycles_second);
+	writer.U64(cycles_base);
+	writer.U32(cycles);
+	writer.U32(timer0_cycles);
+	writer.U32(timer1_cycles);
+	writer.U8(timer0_toggle);
+	writer.EndSection();
+
+	if (flags & STATE_INCLUDE_NOR) {
+		for (uint32_t page = 0; page < 0x20; page++) {
+			uint32_t mask = delta ? nor_checkpoint_mask : nor_dirty_mask;
+			uint8_t* data = (mask & (1u << page)) ? LoadNorPage(page) : nullptr;
+			if (data == nullptr) {
+				continue;
+			}
+			if (delta) {
+				WriteBlocks(writer, TAG_NOR_DELTA, page, nor_dirty_blocks[page], data);
+			} else {
+				writer.CompressedSection(TAG_NOR_PAGE, 1, page, data, 0x8000);
+			}
 		}
-			break;
-		case 0x09: {
-			uint16_t addr = reg_pc++;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 2;
+		// Loading NOR pages may have remapped or evicted the current bank.
+		SwitchBank();
+	}
+
+	size_t size = writer.Finish();
+	if (size != 0) {
+		StateReader header(buffer + 12, 4);
+		SetCheckpoint(header.U32());
+		// NOR blocks stay dirty until a state that includes NOR is taken.
+		ClearDirty(flags & STATE_INCLUDE_NOR);
+	}
+	return size;
+}
+
+// Apply one section of a chunked state. Unknown sections are skipped, but a known section with a version this build
+// can't read fails the load rather than leaving the machine half restored.
+bool MachineState::LoadSection(const section_t& section) {
+	if (section.tag != TAG_CPU && section.tag != TAG_RAM && section.tag != TAG_IO && section.tag != TAG_TIME &&
+		section.tag != TAG_NOR_PAGE && section.tag != TAG_DELTA && section.tag != TAG_RAM_DELTA &&
+		section.tag != TAG_NOR_DELTA) {
+		return true;
+	}
+	if (section.version != 1) {
+		return false;
+	}
+
+	uint8_t* unpacked = nullptr;
+	const uint8_t* data = section.data;
+	if (section.encoding == SECTION_LZ) {
+		if (section.raw_size > 0x8000) {
+			return false;
+		}
+		unpacked = reinterpret_cast<uint8_t*>(malloc(section.raw_size));
+		if (unpacked == nullptr || !LzDecompress(section.data, section.stored_size, unpacked, section.raw_size)) {
+			free(unpacked);
+			return false;
+		}
+		data = unpacked;
+	} else if (section.encoding != SECTION_RAW || section.raw_size != section.stored_size) {
+		return false;
+	}
+
+	StateReader reader(data, section.raw_size);
+	if (section.tag == TAG_CPU) {
+		cpu.reg_pc = reader.U16();
+		cpu.reg_a = reader.U8();
+		cpu.reg_ps = reader.U8();
+		cpu.reg_x = reader.U8();
+		cpu.reg_y = reader.U8();
+		cpu.reg_sp = reader.U8();
+	} else if (section.tag == TAG_RAM) {
+		reader.Bytes(ram_buff, 0x8000);
+	} else if (section.tag == TAG_RAM_DELTA) {
+		if (!ReadBlocks(reader, section.raw_size, ram_buff)) {
+			free(unpacked);
+			return false;
+		}
+	} else if (section.tag == TAG_DELTA) {
+		// Chaining is checked by LoadStatesFromBuffer().
+		reader.U32();
+	} else if (section.tag == TAG_IO) {
+		reader.Bytes(bak_40, 0x40);
+		reader.Bytes(clock_buff, 80);
+		clock_flags = reader.U8();
+		reader.Bytes(jg_wav_buff, 0x20);
+		jg_wav_flags = reader.U8();
+		jg_wav_index = reader.U8();
+		jg_wav_playing = reader.Bool();
+		fp_step = reader.U8();
+		fp_type = reader.U8();
+		fp_bank_idx = reader.U8();
+		fp_bak1 = reader.U8();
+		fp_bak2 = reader.U8();
+		reader.Bytes(fp_buff, 0x100);
+		slept = reader.Bool();
+		should_wake_up = reader.Bool();
+		wake_up_pending = reader.Bool();
+		wake_up_key = reader.U8();
+		should_irq = reader.Bool();
+		lcd_addr = reader.U32();
+		reader.Bytes(keypad_matrix, 8);
+		if (lcd_addr > LCD_ADDR_LIMIT) {
+			free(unpacked);
+			return false;
+		}
+	} else if (section.tag == TAG_TIME) {
+		uint32_t saved_speed = reader.U32();
+		cycles_base = reader.U64();
+		cycles = reader.U32();
+		// Queued events were stamped on the old timeline.
+		ClearKeyQueue();
+		ClearMacro();
+		timer0_cycles = reader.U32();
+		timer1_cycles = reader.U32();
+		timer0_toggle = reader.Bool();
+		if (reader.Ok() && saved_speed >= CPU_SPEED_MIN && saved_speed != cycles_second) {
+			// Saved with another clock. Rescale the pending timers to the current one.
+			uint32_t current_speed = cycles_second;
+			ApplyCpuSpeed(saved_speed);
+			SetCpuSpeed(current_speed);
+		}
+	} else if (section.tag == TAG_NOR_PAGE) {
+		uint8_t* data = nullptr;
+		if (section.index >= 0x20 || section.raw_size != 0x8000 ||
+			(data = WritableNorPage(section.index)) == nullptr) {
+			free(unpacked);
+			return false;
+		}
+		TouchNorPage(section.index, data);
+		reader.Bytes(data, 0x8000);
+		SaveNorPage(section.index);
+	} else if (section.tag == TAG_NOR_DELTA) {
+		uint8_t* data = section.index < 0x20 ? WritableNorPage(section.index) : nullptr;
+		if (data == nullptr) {
+			free(unpacked);
+			return false;
+		}
+		TouchNorPage(section.index, data);
+		if (!ReadBlocks(reader, section.raw_size, data)) {
+			free(unpacked);
+			return false;
+		}
+		SaveNorPage(section.index);
+	}
+
+	free(unpacked);
+	return reader.Ok();
+}
+
+struct state_record_t {
+	const uint8_t* data;
+	uint32_t total;
+	uint16_t count;
+	uint32_t checksum;
+	// Checksum of the state this one applies on top of, for incremental states.
+	uint32_t base;
+	bool delta;
+};
+
+static bool ReadSectionHeader(const state_record_t& record, size_t& pos, section_t& section) {
+	if (record.total - pos < SECTION_HEADER_SIZE) {
+		return false;
+	}
+	StateReader reader(record.data + pos, SECTION_HEADER_SIZE);
+	section.tag = reader.U32();
+	section.version = reader.U16();
+	section.encoding = reader.U8();
+	section.index = reader.U8();
+	section.raw_size = reader.U32();
+	section.stored_size = reader.U32();
+	section.data = record.data + pos + SECTION_HEADER_SIZE;
+	pos += SECTION_HEADER_SIZE;
+	if (section.stored_size > record.total - pos) {
+		return false;
+	}
+	pos += section.stored_size;
+	return true;
+}
+
+// Check the header, checksum and section bounds of the state at the start of `buffer` without touching the machine.
+static bool ReadRecord(const uint8_t* buffer, size_t size, state_record_t& record) {
+	StateReader header(buffer, size < STATE_HEADER_SIZE ? size : STATE_HEADER_SIZE);
+	if (header.U32() != STATE_MAGIC || header.U16() != STATE_FORMAT) {
+		return false;
+	}
+	record.data = buffer;
+	record.count = header.U16();
+	record.total = header.U32();
+	record.checksum = header.U32();
+	record.base = 0;
+	record.delta = false;
+	if (!header.Ok() || record.total < STATE_HEADER_SIZE || record.total > size ||
+		Fnv1a(buffer + STATE_HEADER_SIZE, record.total - STATE_HEADER_SIZE) != record.checksum) {
+		return false;
+	}
+
+	size_t pos = STATE_HEADER_SIZE;
+	for (uint16_t i = 0; i < record.count; i++) {
+		section_t section;
+		if (!ReadSectionHeader(record, pos, section)) {
+			return false;
 		}
-			break;
-		case 0x0A: {
-			reg_ps &= 0x7C;
-			reg_ps |= reg_a >> 7;
-			reg_a <<= 1;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 2;
+		if (i == 0 && section.tag == TAG_DELTA) {
+			StateReader reader(section.data, section.stored_size);
+			record.base = reader.U32();
+			record.delta = true;
 		}
-			break;
-		case 0x0B: {
+	}
+	return true;
+}
+
+bool MachineState::ApplyRecord(const state_record_t& record) {
+	size_t pos = STATE_HEADER_SIZE;
+	for (uint16_t i = 0; i < record.count; i++) {
+		section_t section;
+		if (!ReadSectionHeader(record, pos, section) || !LoadSection(section)) {
+			return false;
 		}
-			break;
-		case 0x0C: {
+	}
+	return true;
+}
+
+bool MachineState::LoadStatesFromBuffer(const uint8_t* buffer, size_t size) {
+	ResetStates();
+	SetCheckpoint(0);
+
+	// Legacy raw dump of nc1020_states_t.
+	uint32_t legacy_version = 0;
+	uint32_t legacy_lcd_addr = 0;
+	if (size == sizeof(nc1020_states_t)) {
+		memcpy(&legacy_version, buffer, sizeof(legacy_version));
+		memcpy(&legacy_lcd_addr, buffer + offsetof(nc1020_states_t, lcd_addr), sizeof(legacy_lcd_addr));
+	}
+	if (legacy_version == VERSION) {
+		if (legacy_lcd_addr > LCD_ADDR_LIMIT) {
+			return false;
 		}
-			break;
-		case 0x0D: {
-			uint16_t addr = PeekW(reg_pc);
-			reg_pc += 2;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 4;
+		memcpy(static_cast<nc1020_states_t*>(this), buffer, sizeof(nc1020_states_t));
+		SwitchVolume();
+		return true;
+	}
+
+	state_record_t record;
+	if (!ReadRecord(buffer, size, record) || record.delta) {
+		return false;
+	}
+	if (!ApplyRecord(record)) {
+		ResetStates();
+		return false;
+	}
+
+	// Apply the incremental states chained after it. A torn or unrelated one ends the chain and the machine is left
+	// at the last complete state.
+	size_t pos = record.total;
+	uint32_t checksum = record.checksum;
+	while (ReadRecord(buffer + pos, size - pos, record) && record.delta && record.base == checksum) {
+		if (!ApplyRecord(record)) {
+			ResetStates();
+			return false;
+		}
+		pos += record.total;
+		checksum = record.checksum;
+	}
+
+	// NOR pages may have been loaded above, so remap everything.
+	SwitchVolume();
+	ClearDirty(true);
+	SetCheckpoint(checksum);
+	return true;
+}
+
+bool MachineState::LoadNC1020(){
+	uint8_t header[STATE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	if (!hal->loadState(reinterpret_cast<char *>(header), sizeof(header))) {
+		ResetStates();
+		return false;
+	}
+
+	size_t size = sizeof(nc1020_states_t);
+	size_t capacity = size;
+	StateReader reader(header, sizeof(header));
+	if (reader.U32() == STATE_MAGIC) {
+		reader.U32();
+		size = reader.U32();
+		if (size < STATE_HEADER_SIZE || size > STATE_SIZE_LIMIT) {
+			ResetStates();
+			return false;
+		}
+		// Incremental states may follow. Read as far as SaveNC1020() lets the file grow.
+		capacity = size + STATE_LOG_SLACK;
+	}
+
+	char* buffer = reinterpret_cast<char*>(malloc(capacity));
+	if (buffer == nullptr) {
+		ResetStates();
+		return false;
+	}
+	memset(buffer, 0, capacity);
+	bool loaded = hal->loadState(buffer, capacity);
+	if (!loaded && capacity != size) {
+		// The HAL refuses to read past the end of the file. Fall back to the first state only.
+		capacity = size;
+		loaded = hal->loadState(buffer, size);
+	}
+	bool result = loaded && LoadStatesFromBuffer(reinterpret_cast<const uint8_t*>(buffer), capacity);
+	free(buffer);
+	// The file may end with a torn append, so the first save after loading rewrites it.
+	state_log_checksum = 0;
+	return result;
+}
+
+bool MachineState::SaveNC1020(uint32_t flags){
+	// Incremental states are only appended on top of the state written here last.
+	bool append = (flags & STATE_INCREMENTAL) && state_log_checksum != 0 && state_log_checksum == checkpoint_checksum;
+	if (!append) {
+		flags &= ~STATE_INCREMENTAL;
+	}
+	size_t capacity = GetStatesSizeBound(flags);
+	uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(capacity));
+	if (buffer == nullptr) {
+		return false;
+	}
+	size_t size = SaveStatesToBuffer(buffer, capacity, flags);
+	bool result = false;
+	if (size != 0 && append && size <= state_log_limit - state_log_size) {
+		result = hal->appendState(reinterpret_cast<const char*>(buffer), size);
+		if (result) {
+			state_log_size += size;
 		}
-			break;
-		case 0x0E: {
-			uint16_t addr = PeekW(reg_pc);
-			reg_pc += 2;
-			uint8_t tmp1 = Load(addr);
-			reg_ps &= 0x7C;
-			reg_ps |= (tmp1 >> 7);
-			tmp1 <<= 1;
-			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
-			Store(addr, tmp1);
-			cycles += 6;
+	}
+	if (size != 0 && !result) {
+		// Rewrite the whole state when the log is full or the HAL can't append.
+		if (append) {
+			size = SaveStatesToBuffer(buffer, capacity, flags & ~STATE_INCREMENTAL);
+		}
+		result = size != 0 && hal->saveState(reinterpret_cast<const char*>(buffer), size);
+		state_log_size = size;
+		state_log_limit = size + STATE_LOG_SLACK;
+	}
+	state_log_checksum = result ? checkpoint_checksum : 0;
+	free(buffer);
+	return result;
+}
+
+static uint32_t GetBootPageIndex(uint8_t kind, uint8_t volume, uint8_t page) {
+	switch (kind) {
+	case BOOT_PAGE_ROM:
+		return (volume < 3 && page < 0x80) ? volume * 0x80 + page : BOOT_PAGE_LIMIT;
+	case BOOT_PAGE_BBS:
+		return (volume < 3 && page < 0x10) ? 0x180 + volume * 0x10 + page : BOOT_PAGE_LIMIT;
+	case BOOT_PAGE_NOR:
+		return page < 0x20 ? 0x1B0 + page : BOOT_PAGE_LIMIT;
+	case BOOT_PAGE_SHADOW:
+		return 0x1D0;
+	}
+	return BOOT_PAGE_LIMIT;
+}
+
+static size_t GetBootPageSize(uint8_t kind) {
+	return (kind == BOOT_PAGE_ROM || kind == BOOT_PAGE_NOR) ? 0x8000 : 0x2000;
+}
+
+// Record a page the boot reads, hashed as it was when first read.
+void MachineState::TraceBootPage(uint8_t kind, uint8_t volume, uint8_t page, const uint8_t* data) {
+	uint32_t index = GetBootPageIndex(kind, volume, page);
+	if (index >= BOOT_PAGE_LIMIT) {
+		boot_trace->complete = false;
+		return;
+	}
+	uint32_t bit = 1u << (index & 0x1F);
+	if (boot_trace->seen[index >> 5] & bit) {
+		return;
+	}
+	boot_trace->seen[index >> 5] |= bit;
+	boot_page_t& entry = boot_trace->pages[boot_trace->count++];
+	entry.kind = kind;
+	entry.volume = volume;
+	entry.page = page;
+	entry.hash = Fnv1a(data, GetBootPageSize(kind));
+}
+
+// Check that a boot cache was made for the same boot and that every page it read is unchanged.
+bool MachineState::CheckBootSection(const section_t& section, uint32_t boot_ms) {
+	if (section.version != 1 || section.encoding != SECTION_RAW) {
+		return false;
+	}
+	StateReader reader(section.data, section.stored_size);
+	if (reader.U32() != boot_ms || reader.U32() != cycles_second) {
+		return false;
+	}
+	uint16_t count = reader.U16();
+	for (uint16_t i = 0; i < count; i++) {
+		uint8_t kind = reader.U8();
+		uint8_t volume = reader.U8();
+		uint8_t page = reader.U8();
+		uint32_t hash = reader.U32();
+		const uint8_t* data = nullptr;
+		if (kind == BOOT_PAGE_ROM) {
+			data = PageHal()->loadRomPage(volume, page) ? PageHal()->page : nullptr;
+		} else if (kind == BOOT_PAGE_BBS) {
+			data = PageHal()->loadBbsPage(volume, page) ? PageHal()->bbs : nullptr;
+		} else if (kind == BOOT_PAGE_NOR) {
+			data = page < 0x20 ? LoadNorPage(page) : nullptr;
+		} else if (kind == BOOT_PAGE_SHADOW) {
+			data = PageHal()->shadowBbs;
+		}
+		if (data == nullptr || Fnv1a(data, GetBootPageSize(kind)) != hash) {
+			return false;
 		}
-			break;
-		case 0x0F: {
-		}
-			break;
-		case 0x10: {
-			int8_t tmp4 = (int8_t) (Peek(reg_pc++));
-			uint16_t addr = reg_pc + tmp4;
-			if (!(reg_ps & 0x80)) {
-				cycles += !((reg_pc ^ addr) & 0xFF00) << 1;
-				reg_pc = addr;
+	}
+	return reader.Ok();
+}
+
+bool MachineState::LoadBootCache(uint32_t boot_ms) {
+	uint8_t header[STATE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	if (!hal->loadBootCache(reinterpret_cast<char *>(header), sizeof(header))) {
+		return false;
+	}
+	StateReader reader(header, sizeof(header));
+	reader.U32();
+	reader.U32();
+	size_t size = reader.U32();
+	if (size < STATE_HEADER_SIZE || size > STATE_SIZE_LIMIT) {
+		return false;
+	}
+
+	uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(size));
+	if (buffer == nullptr) {
+		return false;
+	}
+	state_record_t record;
+	section_t section;
+	size_t pos = STATE_HEADER_SIZE;
+	bool result = hal->loadBootCache(reinterpret_cast<char *>(buffer), size) &&
+		ReadRecord(buffer, size, record) && !record.delta && record.count > 0 &&
+		ReadSectionHeader(record, pos, section) && section.tag == TAG_BOOT &&
+		CheckBootSection(section, boot_ms) && LoadStatesFromBuffer(buffer, record.total);
+	free(buffer);
+	return result;
+}
+
+bool MachineState::BootNC1020(uint32_t boot_ms) {
+	if (LoadBootCache(boot_ms)) {
+		return true;
+	}
+
+	// Without memory for the trace the boot still runs, it just isn't cached.
+	boot_trace = reinterpret_cast<boot_trace_t*>(malloc(sizeof(boot_trace_t)));
+	if (boot_trace != nullptr) {
+		memset(boot_trace, 0, sizeof(boot_trace_t));
+		boot_trace->boot_ms = boot_ms;
+		boot_trace->complete = true;
+		TraceBootPage(BOOT_PAGE_SHADOW, 0, 0, PageHal()->shadowBbs);
+	}
+	ResetStates();
+	RunTurboChunks(boot_ms, nullptr, nullptr, nullptr, nullptr);
+
+	if (boot_trace != nullptr && boot_trace->complete) {
+		size_t capacity = GetStatesSizeBound(STATE_INCLUDE_NOR);
+		uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(capacity));
+		if (buffer != nullptr) {
+			size_t size = SaveStatesToBuffer(buffer, capacity, STATE_INCLUDE_NOR);
+			if (size != 0) {
+				hal->saveBootCache(reinterpret_cast<const char*>(buffer), size);
 			}
-			cycles += 2;
-		}
-			break;
-		case 0x11: {
-			uint16_t addr = PeekW(Peek(reg_pc));
-			cycles += !!(((addr & 0xFF) + reg_y) & 0xFF00);
-			addr += reg_y;
-			reg_pc++;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 5;
-		}
-			break;
-		case 0x12: {
+			free(buffer);
 		}
-			break;
-		case 0x13: {
+	}
+	free(boot_trace);
+	boot_trace = nullptr;
+	return false;
+}
+
+// In-memory snapshots. Unlike save states these are raw copies tied to the running build and HAL, which is what
+// makes them cheap enough to take and restore thousands of times per second.
+static const uint32_t SNAPSHOT_MAGIC = 0x4E534E4E; // "NNSN"
+// memmap entry that points at a HAL page rather than into RAM.
+static const uint32_t SNAPSHOT_MAP_HAL = 0xFFFFFFFF;
+
+struct snapshot_header_t {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t nor_mask;
+	uint32_t nor_generation;
+	uint32_t cycles_second;
+	uint32_t memmap_ram[8];
+	// Always 0. Spelled out so that no padding leaks into snapshots, which are compared byte for byte.
+	uint32_t reserved;
+	uint64_t cycles_base;
+};
+static_assert(sizeof(snapshot_header_t) == 64, "snapshot_header_t must not have padding");
+
+uint32_t MachineState::GetMemmapRamOffset(uint8_t index) {
+	uint8_t* ptr = memmap[index];
+	if (ptr >= ram_buff && ptr < ram_buff + 0x8000) {
+		return ptr - ram_buff;
+	}
+	return SNAPSHOT_MAP_HAL;
+}
+
+size_t MachineState::GetSnapshotSize() {
+	return sizeof(snapshot_header_t) + sizeof(nc1020_states_t) + GetNorDirtyCount(STATE_INCLUDE_NOR) * 0x8000;
+}
+
+size_t MachineState::Snapshot(void* buffer, size_t capacity) {
+	size_t size = GetSnapshotSize();
+	if (capacity < size) {
+		return 0;
+	}
+	nor_pristine_enabled = true;
+
+	uint8_t* out = reinterpret_cast<uint8_t*>(buffer);
+	snapshot_header_t header = {};
+	header.magic = SNAPSHOT_MAGIC;
+	header.size = size;
+	header.nor_mask = nor_dirty_mask;
+	header.nor_generation = nor_generation;
+	header.cycles_second = cycles_second;
+	for (uint8_t i = 0; i < 8; i++) {
+		header.memmap_ram[i] = GetMemmapRamOffset(i);
+	}
+	header.cycles_base = cycles_base;
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+	memcpy(out, static_cast<nc1020_states_t*>(this), sizeof(nc1020_states_t));
+	out += sizeof(nc1020_states_t);
+
+	if (nor_dirty_mask) {
+		for (uint32_t page = 0; page < 0x20; page++) {
+			if (!(nor_dirty_mask & (1u << page))) {
+				continue;
+			}
+			uint8_t* data = LoadNorPage(page);
+			if (data != nullptr) {
+				memcpy(out, data, 0x8000);
+			} else {
+				memset(out, 0xFF, 0x8000);
+			}
+			out += 0x8000;
 		}
-			break;
-		case 0x14: {
+		SwitchBank();
+	}
+	return size;
+}
+
+void MachineState::RestoreNorPage(uint32_t page, const uint8_t* data) {
+	uint8_t* current = LoadNorPage(page);
+	if (current == nullptr || memcmp(current, data, 0x8000) == 0) {
+		return;
+	}
+	current = WritableNorPage(page);
+	if (current != nullptr) {
+		MarkNorDirty(page, 0, 0x8000);
+		memcpy(current, data, 0x8000);
+		SaveNorPage(page);
+	}
+}
+
+// Bring NOR back to the contents captured in a snapshot. Pages written after the snapshot are reverted from their
+// pristine copies where one was kept.
+void MachineState::RestoreNor(const snapshot_header_t& header, const uint8_t* pages) {
+	uint32_t mask = header.nor_mask;
+	bool exact = true;
+	for (uint32_t page = 0; page < 0x20; page++) {
+		uint32_t bit = 1u << page;
+		if (header.nor_mask & bit) {
+			RestoreNorPage(page, pages);
+			pages += 0x8000;
+		} else if (nor_dirty_mask & bit) {
+			if (nor_pristine[page] != nullptr) {
+				RestoreNorPage(page, nor_pristine[page]->data);
+			} else {
+				mask |= bit;
+				exact = false;
+			}
 		}
-			break;
-		case 0x15: {
-			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 4;
+	}
+	nor_dirty_mask = mask;
+	nor_generation = exact ? header.nor_generation : NextNorGeneration();
+}
+
+bool MachineState::Restore(const void* buffer, size_t size) {
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(buffer);
+	snapshot_header_t header;
+	if (size < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, in, sizeof(header));
+	uint32_t nor_pages = 0;
+	for (uint32_t mask = header.nor_mask; mask; mask &= mask - 1) {
+		nor_pages++;
+	}
+	if (header.magic != SNAPSHOT_MAGIC || header.size != size ||
+		size != sizeof(header) + sizeof(nc1020_states_t) + nor_pages * 0x8000) {
+		return false;
+	}
+	// Snapshots may come from outside the process. Nothing in them may point past RAM or stall the clock.
+	if (header.cycles_second < CPU_SPEED_MIN || header.cycles_second > CPU_SPEED_MAX) {
+		return false;
+	}
+	for (uint8_t i = 0; i < 8; i++) {
+		if (header.memmap_ram[i] != SNAPSHOT_MAP_HAL && header.memmap_ram[i] > 0x8000 - 0x2000) {
+			return false;
 		}
-			break;
-		case 0x16: {
-			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
-			uint8_t tmp1 = Load(addr);
-			reg_ps &= 0x7C;
-			reg_ps |= (tmp1 >> 7);
-			tmp1 <<= 1;
-			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
-			Store(addr, tmp1);
-			cycles += 6;
+	}
+	uint32_t lcd_addr_in;
+	memcpy(&lcd_addr_in, in + sizeof(header) + offsetof(nc1020_states_t, lcd_addr), sizeof(lcd_addr_in));
+	if (lcd_addr_in > LCD_ADDR_LIMIT ||
+		in[sizeof(header) + offsetof(nc1020_states_t, jg_wav_index)] > sizeof(jg_wav_buff)) {
+		return false;
+	}
+
+	// memmap only depends on these registers and the HAL. If they match, the current mapping is still valid and
+	// no bank needs to be reloaded.
+	bool remap = ram_io[0x00] != in[sizeof(header) + offsetof(nc1020_states_t, ram) + 0x00] ||
+		ram_io[0x0A] != in[sizeof(header) + offsetof(nc1020_states_t, ram) + 0x0A] ||
+		ram_io[0x0D] != in[sizeof(header) + offsetof(nc1020_states_t, ram) + 0x0D];
+	for (uint8_t i = 0; i < 8 && !remap; i++) {
+		remap = GetMemmapRamOffset(i) != header.memmap_ram[i];
+	}
+
+	memcpy(static_cast<nc1020_states_t*>(this), in + sizeof(header), sizeof(nc1020_states_t));
+	memset(ram_dirty, 0xFF, sizeof(ram_dirty));
+	memset(lcd_dirty_rows, 0xFF, sizeof(lcd_dirty_rows));
+	ResetLcdFrame();
+	ClearKeyQueue();
+	ClearMacro();
+	StopInputRecording();
+	cycles_base = header.cycles_base;
+	if (header.cycles_second != cycles_second) {
+		ApplyCpuSpeed(header.cycles_second);
+		governor.current_hz = header.cycles_second;
+	}
+	if (header.nor_generation != nor_generation) {
+		RestoreNor(header, in + sizeof(header) + sizeof(nc1020_states_t));
+		remap = true;
+	}
+
+	if (remap) {
+		SwitchVolume();
+		for (uint8_t i = 0; i < 8; i++) {
+			if (header.memmap_ram[i] != SNAPSHOT_MAP_HAL) {
+				memmap[i] = ram_buff + header.memmap_ram[i];
+			}
 		}
-			break;
-		case 0x17: {
+	}
+	return true;
+}
+
+void MachineState::SetKey(uint8_t key_id, bool down_or_up){
+	uint8_t row = key_id % 8;
+	uint8_t col = key_id / 8;
+	uint8_t bits = 1 << col;
+	if (key_id == 0x0F) {
+		bits = 0xFE;
+	}
+	if (down_or_up) {
+		keypad_matrix[row] |= bits;
+	} else {
+		keypad_matrix[row] &= ~bits;
+	}
+	if (input_log != nullptr) {
+		RecordInput(INPUT_KEY, key_id, down_or_up, 0);
+	}
+
+	if (down_or_up) {
+		if (slept) {
+			if (key_id >= 0x08 && key_id <= 0x0F && key_id != 0x0E) {
+				switch (key_id) {
+				case 0x08: wake_up_key = 0x00; break;
+				case 0x09: wake_up_key = 0x0A; break;
+				case 0x0A: wake_up_key = 0x08; break;
+				case 0x0B: wake_up_key = 0x06; break;
+				case 0x0C: wake_up_key = 0x04; break;
+				case 0x0D: wake_up_key = 0x02; break;
+				case 0x0E: wake_up_key = 0x0C; break;
+				case 0x0F: wake_up_key = 0x00; break;
+				}
+				should_wake_up = true;
+				wake_up_pending = true;
+				slept = false;
+			}
+		} else {
+			if (key_id == 0x0F) {
+				slept = true;
+			}
 		}
-			break;
-		case 0x18: {
-			reg_ps &= 0xFE;
-			cycles += 2;
+	}
+}
+
+void MachineState::ReleaseAllKeys() {
+    memset(keypad_matrix, 0, 8);
+    if (input_log != nullptr) {
+        RecordInput(INPUT_RELEASE_ALL, 0, false, 0);
+    }
+}
+
+bool MachineState::QueueKey(uint64_t cycle, uint8_t key_id, bool down_or_up) {
+	if (key_queue_count == KEY_QUEUE_SIZE) {
+		return false;
+	}
+	// Keep the queue in order. An event stamped before the last one happens together with it.
+	if (key_queue_count != 0) {
+		const key_event_t& last = key_queue[(key_queue_head + key_queue_count - 1) % KEY_QUEUE_SIZE];
+		if (cycle < last.cycle) {
+			cycle = last.cycle;
 		}
-			break;
-		case 0x19: {
-			uint16_t addr = PeekW(reg_pc);
-			cycles += !!(((addr & 0xFF) + reg_y) & 0xFF00);
-			addr += reg_y;
-			reg_pc += 2;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 4;
+	}
+	key_event_t& event = key_queue[(key_queue_head + key_queue_count) % KEY_QUEUE_SIZE];
+	event.cycle = cycle;
+	event.key_id = key_id;
+	event.down = down_or_up;
+	key_queue_count++;
+	return true;
+}
+
+void MachineState::ClearKeyQueue() {
+	key_queue_head = 0;
+	key_queue_count = 0;
+}
+
+void MachineState::ApplyDueKeys() {
+	uint64_t now = GetCycleCount();
+	while (key_queue_count != 0 && key_queue[key_queue_head].cycle <= now) {
+		SetKey(key_queue[key_queue_head].key_id, key_queue[key_queue_head].down);
+		key_queue_head = (key_queue_head + 1) % KEY_QUEUE_SIZE;
+		key_queue_count--;
+	}
+}
+
+bool MachineState::QueueMacro(const uint8_t* keys, size_t count) {
+	if (count > MACRO_SIZE - macro_count) {
+		return false;
+	}
+	bool idle = macro_count == 0;
+	for (size_t i = 0; i < count; i++) {
+		macro_keys[(macro_head + macro_count) % MACRO_SIZE] = keys[i];
+		macro_count++;
+	}
+	if (idle && macro_count != 0) {
+		PressMacroKey();
+	}
+	return true;
+}
+
+bool MachineState::TypeText(const char* text) {
+	// Keys of 'a' to 'z'. Digits share keys with letters and depend on the input mode, so they aren't mapped.
+	static const uint8_t ALPHABET_KEYS[26] = {
+		0x28, 0x34, 0x32, 0x2a, 0x22, 0x2b, 0x2c, 0x2d, 0x27, 0x2e, 0x2f, 0x19, 0x36,
+		0x35, 0x18, 0x1c, 0x20, 0x23, 0x29, 0x24, 0x26, 0x33, 0x21, 0x31, 0x25, 0x30,
+	};
+	uint8_t keys[MACRO_SIZE];
+	size_t count = 0;
+	for (const char* c = text; *c != '\0'; c++) {
+		if (count == MACRO_SIZE) {
+			return false;
+		}
+		if (*c >= 'a' && *c <= 'z') {
+			keys[count++] = ALPHABET_KEYS[*c - 'a'];
+		} else if (*c >= 'A' && *c <= 'Z') {
+			keys[count++] = ALPHABET_KEYS[*c - 'A'];
+		} else if (*c == ' ') {
+			keys[count++] = 0x3E;
+		} else if (*c == '\n') {
+			keys[count++] = 0x1D;
+		} else if (*c == '.') {
+			keys[count++] = 0x3D;
+		} else {
+			return false;
 		}
+	}
+	return QueueMacro(keys, count);
+}
+
+void MachineState::SetMacroTiming(uint8_t hold_scans, uint8_t release_scans) {
+	macro_hold_scans = hold_scans != 0 ? hold_scans : MACRO_HOLD_SCANS;
+	macro_release_scans = release_scans != 0 ? release_scans : MACRO_RELEASE_SCANS;
+}
+
+size_t MachineState::GetMacroPending() {
+	return macro_count;
+}
+
+void MachineState::ClearMacro() {
+	macro_head = 0;
+	macro_count = 0;
+	macro_down = false;
+	macro_scans = 0;
+	macro_step = false;
+}
+
+void MachineState::CancelMacro() {
+	if (macro_count != 0 && macro_down) {
+		SetKey(macro_keys[macro_head], false);
+	}
+	ClearMacro();
+}
+
+void MachineState::PressMacroKey() {
+	SetKey(macro_keys[macro_head], true);
+	macro_down = true;
+	macro_scans = 0;
+	macro_select = 0xFF;
+}
+
+// Called between instructions once Write09 saw enough scans for the current step.
+void MachineState::StepMacro() {
+	macro_step = false;
+	if (macro_count == 0) {
+		return;
+	}
+	if (macro_down) {
+		SetKey(macro_keys[macro_head], false);
+		macro_down = false;
+		macro_scans = 0;
+		macro_select = 0xFF;
+		return;
+	}
+	macro_head = (macro_head + 1) % MACRO_SIZE;
+	if (--macro_count != 0) {
+		PressMacroKey();
+	} else if (run_cond.flags & RUN_UNTIL_MACRO) {
+		stop_reason = STOP_MACRO;
+	}
+}
+
+// Hash of the guest visible state, for checking that a replay follows the recording.
+uint32_t MachineState::GetStateHash() {
+	// Timer deadlines are relative to cycles_base, which depends on how the run was sliced, so hash absolute ones.
+	uint8_t extra[40];
+	uint8_t* out = extra;
+	uint64_t cycle = GetCycleCount();
+	uint64_t timer0_at = cycles_base + timer0_cycles;
+	uint64_t timer1_at = cycles_base + timer1_cycles;
+	memcpy(out, &cycle, 8); out += 8;
+	memcpy(out, &timer0_at, 8); out += 8;
+	memcpy(out, &timer1_at, 8); out += 8;
+	*out++ = cpu.reg_pc & 0xFF;
+	*out++ = cpu.reg_pc >> 8;
+	*out++ = cpu.reg_a;
+	*out++ = cpu.reg_ps;
+	*out++ = cpu.reg_x;
+	*out++ = cpu.reg_y;
+	*out++ = cpu.reg_sp;
+	*out++ = should_irq;
+	memcpy(out, keypad_matrix, 8); out += 8;
+	return Fnv1a(ram_buff, 0x8000) ^ Fnv1a(extra, out - extra);
+}
+
+void MachineState::RecordInput(uint8_t type, uint8_t key_id, bool down, uint32_t value) {
+	uint8_t* record = input_log + input_log_count * INPUT_RECORD_SIZE;
+	record[0] = type;
+	record[1] = key_id;
+	record[2] = down;
+	record[3] = 0;
+	PutLe(record + 4, value, 4);
+	PutLe(record + 8, GetCycleCount(), 8);
+	if (++input_log_count == INPUT_LOG_BUFFER_RECORDS && !FlushInputLog()) {
+		// The log can't be completed anymore.
+		free(input_log);
+		input_log = nullptr;
+	}
+}
+
+void MachineState::RecordCheckpointIfDue() {
+	uint64_t now = GetCycleCount();
+	if (now >= input_next_checkpoint) {
+		// Keep to the schedule rather than the end of the slice, so slices of about the checkpoint interval don't skip every
+		// other one.
+		input_next_checkpoint += input_checkpoint_cycles;
+		if (input_next_checkpoint <= now) {
+			input_next_checkpoint = now + input_checkpoint_cycles;
+		}
+		RecordInput(INPUT_CHECKPOINT, 0, false, GetStateHash());
+	}
+}
+
+bool MachineState::FlushInputLog() {
+	bool result = input_log_count == 0 ||
+		hal->appendInputLog(reinterpret_cast<const char*>(input_log), input_log_count * INPUT_RECORD_SIZE);
+	input_log_count = 0;
+	return result;
+}
+
+bool MachineState::StartInputRecording(uint32_t checkpoint_ms) {
+	StopInputRecording();
+	size_t capacity = GetStatesSizeBound(STATE_INCLUDE_NOR);
+	uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(INPUT_LOG_HEADER_SIZE + capacity));
+	input_log = reinterpret_cast<uint8_t*>(malloc(INPUT_LOG_BUFFER_RECORDS * INPUT_RECORD_SIZE));
+	if (buffer == nullptr || input_log == nullptr) {
+		free(buffer);
+		free(input_log);
+		input_log = nullptr;
+		return false;
+	}
+
+	// The log starts with a full state so it can be replayed on its own.
+	size_t size = SaveStatesToBuffer(buffer + INPUT_LOG_HEADER_SIZE, capacity, STATE_INCLUDE_NOR);
+	PutLe(buffer, INPUT_LOG_MAGIC, 4);
+	PutLe(buffer + 4, INPUT_LOG_FORMAT, 4);
+	PutLe(buffer + 8, cycles_second, 4);
+	PutLe(buffer + 12, size, 4);
+	bool result = size != 0 &&
+		hal->saveInputLog(reinterpret_cast<const char*>(buffer), INPUT_LOG_HEADER_SIZE + size);
+	free(buffer);
+	if (!result) {
+		free(input_log);
+		input_log = nullptr;
+		return false;
+	}
+
+	input_log_count = 0;
+	input_speed_up = false;
+	input_checkpoint_cycles = static_cast<uint64_t>(checkpoint_ms == 0 ? 1000 : checkpoint_ms) * cycles_ms;
+	input_next_checkpoint = GetCycleCount();
+	RecordCheckpointIfDue();
+	return true;
+}
+
+bool MachineState::StopInputRecording() {
+	if (input_log == nullptr) {
+		return false;
+	}
+	RecordInput(INPUT_END, 0, false, GetStateHash());
+	bool result = input_log != nullptr && FlushInputLog();
+	free(input_log);
+	input_log = nullptr;
+	return result;
+}
+
+// Run until GetCycleCount() reaches `target`, stopping on the same instruction boundary the recording was made on.
+void MachineState::RunToCycle(uint64_t target, bool speed_up) {
+	bool async = SuspendAsyncPages();
+	while (GetCycleCount() < target) {
+		uint64_t left = target - cycles_base;
+		RunCycles<false>(left < cycles_second ? left : cycles_second, speed_up);
+	}
+	async_pages = async;
+}
+
+bool MachineState::ReplayInputLog(const uint8_t* log, size_t size, replay_result_t* result) {
+	replay_result_t stats;
+	memset(&stats, 0, sizeof(stats));
+	StateReader header(log, size < INPUT_LOG_HEADER_SIZE ? size : INPUT_LOG_HEADER_SIZE);
+	uint32_t magic = header.U32();
+	uint32_t format = header.U32();
+	uint32_t speed = header.U32();
+	uint32_t states_size = header.U32();
+	if (!header.Ok() || magic != INPUT_LOG_MAGIC || format != INPUT_LOG_FORMAT ||
+		states_size > size - INPUT_LOG_HEADER_SIZE) {
+		return false;
+	}
+	StopInputRecording();
+	// Timers are rescaled when a state is loaded at another clock, so load it at the recorded one.
+	governor.enabled = false;
+	SetCpuSpeed(speed);
+	if (!LoadStatesFromBuffer(log + INPUT_LOG_HEADER_SIZE, states_size)) {
+		return false;
+	}
+
+	uint64_t start_cycles = GetCycleCount();
+	uint64_t start_us = hal->getMonotonicMicros();
+	bool speed_up = false;
+	bool ended = false;
+	for (size_t pos = INPUT_LOG_HEADER_SIZE + states_size; pos + INPUT_RECORD_SIZE <= size && !ended;
+		 pos += INPUT_RECORD_SIZE) {
+		StateReader record(log + pos, INPUT_RECORD_SIZE);
+		uint8_t type = record.U8();
+		uint8_t key_id = record.U8();
+		bool down = record.Bool();
+		record.U8();
+		uint32_t value = record.U32();
+		uint64_t cycle = record.U64();
+		RunToCycle(cycle, speed_up);
+		switch (type) {
+		case INPUT_KEY:
+			SetKey(key_id, down);
+			stats.events++;
+			break;
+		case INPUT_RELEASE_ALL:
+			ReleaseAllKeys();
+			stats.events++;
+			break;
+		case INPUT_SPEED:
+			SetCpuSpeed(value);
+			break;
+		case INPUT_SPEED_UP:
+			speed_up = down;
+			break;
+		case INPUT_END:
+			ended = true;
+			// fall through
+		case INPUT_CHECKPOINT:
+			stats.checkpoints++;
+			if (GetStateHash() != value) {
+				stats.diverged = true;
+				stats.diverged_cycle = cycle;
+				ended = true;
+			}
 			break;
-		case 0x1A: {
-		}
+		default:
 			break;
-		case 0x1B: {
 		}
-			break;
-		case 0x1C: {
+	}
+	uint64_t end_us = hal->getMonotonicMicros();
+	stats.guest_cycles = GetCycleCount() - start_cycles;
+	stats.host_us = (start_us != 0 && end_us != 0) ? end_us - start_us : 0;
+	if (result != nullptr) {
+		*result = stats;
+	}
+	return !stats.diverged;
+}
+
+const uint8_t* MachineState::GetLcdBuffer() {
+	return lcd_addr != 0 ? ram_buff + lcd_addr : nullptr;
+}
+
+bool MachineState::CopyLcdBuffer(uint8_t* buffer){
+	if (lcd_addr == 0) return false;
+	memcpy(buffer, ram_buff + lcd_addr, 1600);
+	return true;
+}
+
+uint32_t MachineState::CopyLcdDirtyRows(uint8_t* buffer, uint32_t* rows) {
+	TrackLcd();
+	uint32_t any = 0;
+	for (uint32_t i = 0; i < LCD_DIRTY_WORDS; i++) {
+		any |= lcd_dirty_rows[i];
+	}
+	if (any == 0 || lcd_addr == 0) {
+		if (rows != nullptr) {
+			memset(rows, 0, LCD_DIRTY_WORDS * sizeof(uint32_t));
 		}
-			break;
-		case 0x1D: {
-			uint16_t addr = PeekW(reg_pc);
-			cycles += !!(((addr & 0xFF) + reg_x) & 0xFF00);
-			addr += reg_x;
-			reg_pc += 2;
-			reg_a |= Load(addr);
-			reg_ps &= 0x7D;
-			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
-			cycles += 4;
+		return 0;
+	}
+
+	uint32_t count = 0;
+	uint32_t copied[LCD_DIRTY_WORDS] = {0};
+	for (uint32_t row = 0; row < LCD_ROWS; row++) {
+		uint32_t bit = 1u << (row & 0x1F);
+		if (lcd_dirty_rows[row >> 5] & bit) {
+			memcpy(buffer + row * LCD_ROW_BYTES, ram_buff + lcd_addr + row * LCD_ROW_BYTES, LCD_ROW_BYTES);
+			copied[row >> 5] |= bit;
+			count++;
+		}
+	}
+	if (rows != nullptr) {
+		memcpy(rows, copied, sizeof(copied));
+	}
+	memset(lcd_dirty_rows, 0, sizeof(lcd_dirty_rows));
+	return count;
+}
+
+bool MachineState::CopyLcdFrame(uint8_t* buffer, uint64_t* cycle) {
+	TrackLcd();
+	if (!lcd_frame_ready) {
+		return false;
+	}
+	memcpy(buffer, lcd_frame, sizeof(lcd_frame));
+	if (cycle != nullptr) {
+		*cycle = lcd_frame_cycle;
+	}
+	lcd_frame_ready = false;
+	return true;
+}
+
+// Run until the slice-relative cycle count reaches end_cycles. The watched variant additionally stops at the first
+// instruction boundary where run_cond is met, so the unwatched one pays nothing for RunUntil() support.
+template <bool kWatch>
+void MachineState::RunCycles(uint32_t end_cycles, bool speed_up) {
+	register uint32_t cycles = this->cycles;
+	register uint16_t reg_pc = cpu.reg_pc;
+	register uint8_t reg_a = cpu.reg_a;
+	register uint8_t reg_ps = cpu.reg_ps;
+	register uint8_t reg_x = cpu.reg_x;
+	register uint8_t reg_y = cpu.reg_y;
+	register uint8_t reg_sp = cpu.reg_sp;
+#ifdef NC1020_STATS
+	uint32_t instructions = 0;
+#endif
+
+	while (cycles < end_cycles) {
+//#ifdef DEBUG
+//		if (executed_insts == 2792170) {
+//			printf("debug start!\n");
+//		}
+//		if (executed_insts >= debug_logs.insts_start &&
+//			executed_insts < debug_logs.insts_start + debug_logs.insts_count) {
+//			log_rec_t& log = debug_logs.logs[executed_insts - debug_logs.insts_start];
+//			string debug_info;
+//			if (log.reg_pc != reg_pc) {
+//				debug_info += " pc ";
+//			}
+//			if (log.reg_a != reg_a) {
+//				debug_info += " a ";
+//			}
+//			if (log.reg_ps != reg_ps) {
+//				debug_info += " ps ";
+//			}
+//			if (log.reg_x != reg_x) {
+//				debug_info += " x ";
+//			}
+//			if (log.reg_y != reg_y) {
+//				debug_info += " y ";
+//			}
+//			if (log.reg_sp != reg_sp) {
+//				debug_info += " sp ";
+//			}
+//			if (debug_logs.peek_addr != -1) {
+//				if (log.peeked != Peek((uint16_t)debug_logs.peek_addr)) {
+//					debug_info += " mem ";
+//				}
+//			} else {
+//				if (log.peeked != Peek(reg_pc)) {
+//					debug_info += " op ";
+//				}
+//			}
+//			if (debug_info.length()) {
+//				printf("%d: %s\n", executed_insts, debug_info.c_str());
+//				exit(-1);
+//			}
+//		}
+//		if (executed_insts >= debug_logs.insts_start + debug_logs.insts_count) {
+//			printf("ok\n");
+//		}
+//#endif
+#ifdef NC1020_STATS
+		instructions++;
+#endif
+		switch (Peek(reg_pc++)) {
+		case 0x00: {
+			reg_pc++;
+			StoreStack<kWatch>(reg_sp--, reg_pc >> 8);
+			StoreStack<kWatch>(reg_sp--, reg_pc & 0xFF);
+			reg_ps |= 0x10;
+			StoreStack<kWatch>(reg_sp--, reg_ps);
+			reg_ps |= 0x04;
+			reg_pc = PeekW(IRQ_VEC);
+			cycles += 7;
+		}
+			break;
+		case 0x01: {
+			uint16_t addr = PeekW((Peek(reg_pc++) + reg_x) & 0xFF);
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 6;
+		}
+			break;
+		case 0x02: {
+		}
+			break;
+		case 0x03: {
+		}
+			break;
+		case 0x04: {
+		}
+			break;
+		case 0x05: {
+			uint16_t addr = Peek(reg_pc++);
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 3;
+		}
+			break;
+		case 0x06: {
+			uint16_t addr = Peek(reg_pc++);
+			uint8_t tmp1 = Load(addr);
+			reg_ps &= 0x7C;
+			reg_ps |= (tmp1 >> 7);
+			tmp1 <<= 1;
+			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
+			Store<kWatch>(addr, tmp1);
+			cycles += 5;
+		}
+			break;
+		case 0x07: {
+		}
+			break;
+		case 0x08: {
+			StoreStack<kWatch>(reg_sp--, reg_ps);
+			cycles += 3;
+		}
+			break;
+		case 0x09: {
+			uint16_t addr = reg_pc++;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 2;
+		}
+			break;
+		case 0x0A: {
+			reg_ps &= 0x7C;
+			reg_ps |= reg_a >> 7;
+			reg_a <<= 1;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 2;
+		}
+			break;
+		case 0x0B: {
+		}
+			break;
+		case 0x0C: {
+		}
+			break;
+		case 0x0D: {
+			uint16_t addr = PeekW(reg_pc);
+			reg_pc += 2;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 4;
+		}
+			break;
+		case 0x0E: {
+			uint16_t addr = PeekW(reg_pc);
+			reg_pc += 2;
+			uint8_t tmp1 = Load(addr);
+			reg_ps &= 0x7C;
+			reg_ps |= (tmp1 >> 7);
+			tmp1 <<= 1;
+			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
+			Store<kWatch>(addr, tmp1);
+			cycles += 6;
+		}
+			break;
+		case 0x0F: {
+		}
+			break;
+		case 0x10: {
+			int8_t tmp4 = (int8_t) (Peek(reg_pc++));
+			uint16_t addr = reg_pc + tmp4;
+			if (!(reg_ps & 0x80)) {
+				cycles += !((reg_pc ^ addr) & 0xFF00) << 1;
+				reg_pc = addr;
+			}
+			cycles += 2;
+		}
+			break;
+		case 0x11: {
+			uint16_t addr = PeekW(Peek(reg_pc));
+			cycles += !!(((addr & 0xFF) + reg_y) & 0xFF00);
+			addr += reg_y;
+			reg_pc++;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 5;
+		}
+			break;
+		case 0x12: {
+		}
+			break;
+		case 0x13: {
+		}
+			break;
+		case 0x14: {
+		}
+			break;
+		case 0x15: {
+			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 4;
+		}
+			break;
+		case 0x16: {
+			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
+			uint8_t tmp1 = Load(addr);
+			reg_ps &= 0x7C;
+			reg_ps |= (tmp1 >> 7);
+			tmp1 <<= 1;
+			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
+			Store<kWatch>(addr, tmp1);
+			cycles += 6;
+		}
+			break;
+		case 0x17: {
+		}
+			break;
+		case 0x18: {
+			reg_ps &= 0xFE;
+			cycles += 2;
+		}
+			break;
+		case 0x19: {
+			uint16_t addr = PeekW(reg_pc);
+			cycles += !!(((addr & 0xFF) + reg_y) & 0xFF00);
+			addr += reg_y;
+			reg_pc += 2;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 4;
+		}
+			break;
+		case 0x1A: {
+		}
+			break;
+		case 0x1B: {
+		}
+			break;
+		case 0x1C: {
+		}
+			break;
+		case 0x1D: {
+			uint16_t addr = PeekW(reg_pc);
+			cycles += !!(((addr & 0xFF) + reg_x) & 0xFF00);
+			addr += reg_x;
+			reg_pc += 2;
+			reg_a |= Load(addr);
+			reg_ps &= 0x7D;
+			reg_ps |= (reg_a & 0x80) | (!reg_a << 1);
+			cycles += 4;
 		}
 			break;
 		case 0x1E: {
@@ -966,7 +3136,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			reg_ps |= (tmp1 >> 7);
 			tmp1 <<= 1;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			cycles += 6;
 		}
 			break;
@@ -977,8 +3147,8 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
 			reg_pc--;
-			stack[reg_sp--] = reg_pc >> 8;
-			stack[reg_sp--] = reg_pc & 0xFF;
+			StoreStack<kWatch>(reg_sp--, reg_pc >> 8);
+			StoreStack<kWatch>(reg_sp--, reg_pc & 0xFF);
 			reg_pc = addr;
 			cycles += 6;
 		}
@@ -1019,7 +3189,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 << 1) | (reg_ps & 0x01);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 >> 7);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 5;
 		}
 			break;
@@ -1075,7 +3245,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 << 1) | (reg_ps & 0x01);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 >> 7);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1126,7 +3296,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 << 1) | (reg_ps & 0x01);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 >> 7);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1177,7 +3347,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 << 1) | (reg_ps & 0x01);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 >> 7);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1223,7 +3393,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			reg_ps |= (tmp1 & 0x01);
 			tmp1 >>= 1;
 			reg_ps |= (!tmp1 << 1);
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			cycles += 5;
 		}
 			break;
@@ -1231,7 +3401,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		}
 			break;
 		case 0x48: {
-			stack[reg_sp--] = reg_a;
+			StoreStack<kWatch>(reg_sp--, reg_a);
 			cycles += 3;
 		}
 			break;
@@ -1278,7 +3448,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			reg_ps |= (tmp1 & 0x01);
 			tmp1 >>= 1;
 			reg_ps |= (!tmp1 << 1);
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			cycles += 6;
 		}
 			break;
@@ -1330,7 +3500,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			reg_ps |= (tmp1 & 0x01);
 			tmp1 >>= 1;
 			reg_ps |= (!tmp1 << 1);
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			cycles += 6;
 		}
 			break;
@@ -1382,7 +3552,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			reg_ps |= (tmp1 & 0x01);
 			tmp1 >>= 1;
 			reg_ps |= (!tmp1 << 1);
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			cycles += 6;
 		}
 			break;
@@ -1435,7 +3605,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 >> 1) | ((reg_ps & 0x01) << 7);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 & 0x01);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 5;
 		}
 			break;
@@ -1499,7 +3669,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 >> 1) | ((reg_ps & 0x01) << 7);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 & 0x01);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1558,7 +3728,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 >> 1) | ((reg_ps & 0x01) << 7);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 & 0x01);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1617,7 +3787,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint8_t tmp2 = (tmp1 >> 1) | ((reg_ps & 0x01) << 7);
 			reg_ps &= 0x7C;
 			reg_ps |= (tmp2 & 0x80) | (!tmp2 << 1) | (tmp1 & 0x01);
-			Store(addr, tmp2);
+			Store<kWatch>(addr, tmp2);
 			cycles += 6;
 		}
 			break;
@@ -1629,7 +3799,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			break;
 		case 0x81: {
 			uint16_t addr = PeekW((Peek(reg_pc++) + reg_x) & 0xFF);
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 6;
 		}
 			break;
@@ -1641,19 +3811,19 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			break;
 		case 0x84: {
 			uint16_t addr = Peek(reg_pc++);
-			Store(addr, reg_y);
+			Store<kWatch>(addr, reg_y);
 			cycles += 3;
 		}
 			break;
 		case 0x85: {
 			uint16_t addr = Peek(reg_pc++);
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 3;
 		}
 			break;
 		case 0x86: {
 			uint16_t addr = Peek(reg_pc++);
-			Store(addr, reg_x);
+			Store<kWatch>(addr, reg_x);
 			cycles += 3;
 		}
 			break;
@@ -1683,21 +3853,21 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		case 0x8C: {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
-			Store(addr, reg_y);
+			Store<kWatch>(addr, reg_y);
 			cycles += 4;
 		}
 			break;
 		case 0x8D: {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 4;
 		}
 			break;
 		case 0x8E: {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
-			Store(addr, reg_x);
+			Store<kWatch>(addr, reg_x);
 			cycles += 4;
 		}
 			break;
@@ -1718,7 +3888,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(Peek(reg_pc));
 			addr += reg_y;
 			reg_pc++;
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 6;
 		}
 			break;
@@ -1730,19 +3900,19 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			break;
 		case 0x94: {
 			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
-			Store(addr, reg_y);
+			Store<kWatch>(addr, reg_y);
 			cycles += 4;
 		}
 			break;
 		case 0x95: {
 			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 4;
 		}
 			break;
 		case 0x96: {
 			uint16_t addr = (Peek(reg_pc++) + reg_y) & 0xFF;
-			Store(addr, reg_x);
+			Store<kWatch>(addr, reg_x);
 			cycles += 4;
 		}
 			break;
@@ -1760,7 +3930,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(reg_pc);
 			addr += reg_y;
 			reg_pc += 2;
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 5;
 		}
 			break;
@@ -1779,7 +3949,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(reg_pc);
 			addr += reg_x;
 			reg_pc += 2;
-			Store(addr, reg_a);
+			Store<kWatch>(addr, reg_a);
 			cycles += 5;
 		}
 			break;
@@ -2059,7 +4229,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		case 0xC6: {
 			uint16_t addr = Peek(reg_pc++);
 			uint8_t tmp1 = Load(addr) - 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 5;
@@ -2118,7 +4288,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
 			uint8_t tmp1 = Load(addr) - 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2170,7 +4340,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		case 0xD6: {
 			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
 			uint8_t tmp1 = Load(addr) - 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2222,7 +4392,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			addr += reg_x;
 			reg_pc += 2;
 			uint8_t tmp1 = Load(addr) - 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2282,7 +4452,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		case 0xE6: {
 			uint16_t addr = Peek(reg_pc++);
 			uint8_t tmp1 = Load(addr) + 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 5;
@@ -2344,7 +4514,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			uint16_t addr = PeekW(reg_pc);
 			reg_pc += 2;
 			uint8_t tmp1 = Load(addr) + 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2402,7 +4572,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		case 0xF6: {
 			uint16_t addr = (Peek(reg_pc++) + reg_x) & 0xFF;
 			uint8_t tmp1 = Load(addr) + 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2460,7 +4630,7 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 			addr += reg_x;
 			reg_pc += 2;
 			uint8_t tmp1 = Load(addr) + 1;
-			Store(addr, tmp1);
+			Store<kWatch>(addr, tmp1);
 			reg_ps &= 0x7D;
 			reg_ps |= (tmp1 & 0x80) | (!tmp1 << 1);
 			cycles += 6;
@@ -2512,13 +4682,14 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 		}
 		if (should_irq && !(reg_ps & 0x04)) {
 			should_irq = false;
-			stack[reg_sp --] = reg_pc >> 8;
-			stack[reg_sp --] = reg_pc & 0xFF;
+			StoreStack<kWatch>(reg_sp--, reg_pc >> 8);
+			StoreStack<kWatch>(reg_sp--, reg_pc & 0xFF);
 			reg_ps &= 0xEF;
-			stack[reg_sp --] = reg_ps;
+			StoreStack<kWatch>(reg_sp--, reg_ps);
 			reg_pc = PeekW(IRQ_VEC);
 			reg_ps |= 0x04;
 			cycles += 7;
+			COUNT_STAT(irqs);
 		}
 		if (cycles >= timer1_cycles) {
 			if (speed_up) {
@@ -2536,20 +4707,746 @@ void RunTimeSlice(uint32_t time_slice, bool speed_up) {
 				ram_io[0x01] |= 0x08;
 				should_irq = true;
 			}
+			if (lcd_writing || lcd_burst) {
+				CheckLcdFrame(cycles_base + cycles);
+			}
 		}
 //#endif
+		if (kWatch) {
+			if (stop_reason != STOP_TIMEOUT || macro_step || page_pending) {
+				break;
+			}
+			if ((run_cond.flags & RUN_UNTIL_PC) && reg_pc == run_cond.pc &&
+				(run_cond.pc_bank < 0 || ram_io[0x00] == run_cond.pc_bank) &&
+				(run_cond.pc_volume < 0 || ram_io[0x0D] == run_cond.pc_volume)) {
+				stop_reason = STOP_PC;
+				break;
+			}
+		}
 	}
 
-	cycles -= end_cycles;
-	timer0_cycles = (end_cycles > timer0_cycles) ? 0 : (timer0_cycles - end_cycles);
-	timer1_cycles = (end_cycles > timer1_cycles) ? 0 : (timer1_cycles - end_cycles);
+	// Stopped early on a condition. Rebase on what was actually executed.
+	uint32_t done_cycles = cycles < end_cycles ? cycles : end_cycles;
+	cycles -= done_cycles;
+	timer0_cycles = (done_cycles > timer0_cycles) ? 0 : (timer0_cycles - done_cycles);
+	timer1_cycles = (done_cycles > timer1_cycles) ? 0 : (timer1_cycles - done_cycles);
+
+	// Carry the overshoot of the last instruction into the next slice.
+	this->cycles = cycles;
+	cycles_base += done_cycles;
+#ifdef NC1020_STATS
+	stats.instructions += instructions;
+	stats.cycles += done_cycles;
+#endif
+	cpu.reg_pc = reg_pc;
+	cpu.reg_a = reg_a;
+	cpu.reg_ps = reg_ps;
+	cpu.reg_x = reg_x;
+	cpu.reg_y = reg_y;
+	cpu.reg_sp = reg_sp;
+}
+
+// Same as RunCycles(), but stops at the cycle of every queued key event to apply it.
+template <bool kWatch>
+void MachineState::RunCyclesWithKeys(uint32_t end_cycles, bool speed_up) {
+	if (input_log != nullptr && speed_up != input_speed_up) {
+		input_speed_up = speed_up;
+		RecordInput(INPUT_SPEED_UP, 0, speed_up, 0);
+	}
+	if (page_pending) {
+		// Parked on a page load. Ask the HAL again and resume at the same instruction once it's there.
+		SwitchBank();
+		if (page_pending) {
+			return;
+		}
+	}
+	uint64_t end = cycles_base + end_cycles;
+	ApplyDueKeys();
+	for (;;) {
+		bool key_due = key_queue_count != 0 && key_queue[key_queue_head].cycle < end;
+		uint32_t stop_cycles = (key_due ? key_queue[key_queue_head].cycle : end) - cycles_base;
+		if (!kWatch && (macro_count != 0 || async_pages)) {
+			// Macro steps and pending page loads need the watched loop to stop between instructions. Nothing else is
+			// watched here.
+			stop_reason_t reason = stop_reason;
+			stop_reason = STOP_TIMEOUT;
+			RunCycles<true>(stop_cycles, speed_up);
+			stop_reason = reason;
+		} else {
+			RunCycles<kWatch>(stop_cycles, speed_up);
+		}
+		bool stepped = macro_step;
+		if (stepped) {
+			StepMacro();
+		}
+		if (page_pending || (kWatch && stop_reason != STOP_TIMEOUT)) {
+			break;
+		}
+		ApplyDueKeys();
+		if (!key_due && !stepped) {
+			break;
+		}
+	}
+	if (input_log != nullptr) {
+		RecordCheckpointIfDue();
+	}
+}
+
+void MachineState::SetCpuSpeed(uint32_t cpu_speed) {
+	if (cpu_speed < CPU_SPEED_MIN || cpu_speed == cycles_second) {
+		return;
+	}
+	// Keep pending timer periods at the same fraction of guest time.
+	uint64_t timer0_left = timer0_cycles > cycles ? timer0_cycles - cycles : 0;
+	uint64_t timer1_left = timer1_cycles > cycles ? timer1_cycles - cycles : 0;
+	timer0_cycles = cycles + timer0_left * cpu_speed / cycles_second;
+	timer1_cycles = cycles + timer1_left * cpu_speed / cycles_second;
+	ApplyCpuSpeed(cpu_speed);
+	governor.current_hz = cpu_speed;
+	if (input_log != nullptr) {
+		RecordInput(INPUT_SPEED, 0, false, cpu_speed);
+	}
+}
+
+uint32_t MachineState::GetCpuSpeed() {
+	return cycles_second;
+}
+
+void MachineState::SetGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz) {
+	governor.enabled = enabled;
+	governor.min_hz = (min_hz == 0) ? CYCLES_SECOND / 8 : min_hz;
+	governor.max_hz = (max_hz == 0) ? CYCLES_SECOND : max_hz;
+	if (governor.min_hz > governor.max_hz) {
+		governor.min_hz = governor.max_hz;
+	}
+	governor_host_us = 0;
+	governor_guest_ms = 0;
+	governor_hold = 0;
+	if (enabled) {
+		if (cycles_second < governor.min_hz) {
+			SetCpuSpeed(governor.min_hz);
+		} else if (cycles_second > governor.max_hz) {
+			SetCpuSpeed(governor.max_hz);
+		}
+	}
+}
+
+void MachineState::GetGovernorStats(governor_stats_t *stats) {
+	*stats = governor;
+}
+
+void MachineState::GetStats(machine_stats_t *stats) {
+	*stats = this->stats;
+#ifdef NC1020_STATS
+	stats->enabled = true;
+#endif
+}
+
+void MachineState::ResetStats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+// Called after every real time paced slice. Decides on a new guest clock once per window.
+void MachineState::UpdateGovernor(uint32_t time_slice, uint64_t host_us) {
+	governor_host_us += host_us;
+	governor_guest_ms += time_slice;
+	if (governor_guest_ms < GOVERNOR_WINDOW_MS) {
+		return;
+	}
+
+	uint32_t load = governor_host_us / governor_guest_ms;
+	governor_host_us = 0;
+	governor_guest_ms = 0;
+	governor.load_permille = (governor.samples == 0) ? load : (governor.load_permille * 3 + load) / 4;
+	governor.samples++;
+
+	// The window was measured at the current clock, so decide on it rather than the smoothed value.
+	uint64_t target_hz = static_cast<uint64_t>(cycles_second) * GOVERNOR_TARGET_LOAD / (load ? load : 1);
+	uint32_t new_hz = cycles_second;
+	if (load > GOVERNOR_HIGH_LOAD) {
+		// Falling behind real time. Drop straight to the clock the host can sustain.
+		new_hz = target_hz < governor.min_hz ? governor.min_hz : target_hz;
+		// Then stay there for a while. With a host clock coarser than a slice, slices that keep up measure no time
+		// at all, so the load only shows when falling behind and stepping up would soon overshoot again.
+		governor_hold = GOVERNOR_HOLD_WINDOWS;
+	} else if (governor_hold > 0) {
+		governor_hold--;
+	} else if (load < GOVERNOR_LOW_LOAD) {
+		// Headroom. Step up gradually so a transient idle window doesn't cause oscillation.
+		uint64_t step_hz = cycles_second + cycles_second / 8;
+		if (step_hz > target_hz) {
+			step_hz = target_hz;
+		}
+		new_hz = step_hz > governor.max_hz ? governor.max_hz : step_hz;
+	}
+
+	if (new_hz < cycles_second) {
+		governor.lowered++;
+	} else if (new_hz > cycles_second) {
+		governor.raised++;
+	}
+	SetCpuSpeed(new_hz);
+}
+
+void MachineState::RunTimeSlice(uint32_t time_slice, bool speed_up) {
+	if (!governor.enabled) {
+		RunCyclesWithKeys<false>(time_slice * cycles_ms, speed_up);
+		return;
+	}
+	uint64_t start_us = hal->getMonotonicMicros();
+	RunCyclesWithKeys<false>(time_slice * cycles_ms, speed_up);
+	uint64_t end_us = hal->getMonotonicMicros();
+	// A slice cut short by a page load says nothing about the host's speed.
+	if (end_us != 0 && time_slice != 0 && !page_pending) {
+		UpdateGovernor(time_slice, end_us - start_us);
+	}
+}
+
+bool MachineState::IsConditionMet(const run_condition_t &cond) {
+	if ((cond.flags & RUN_UNTIL_SLEEP) && slept) {
+		stop_reason = STOP_SLEEP;
+	} else if ((cond.flags & RUN_UNTIL_CYCLE) && GetCycleCount() >= cond.cycle) {
+		stop_reason = STOP_CYCLE;
+	} else if ((cond.flags & RUN_UNTIL_RAM) && (ram_buff[cond.ram_addr & 0x7FFF] & cond.ram_mask) == cond.ram_value) {
+		stop_reason = STOP_RAM;
+	} else if ((cond.flags & RUN_UNTIL_MACRO) && macro_count == 0) {
+		stop_reason = STOP_MACRO;
+	}
+	return stop_reason != STOP_TIMEOUT;
+}
+
+stop_reason_t MachineState::RunUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up) {
+	if (cond.flags & RUN_UNTIL_FRAME) {
+		TrackLcd();
+	}
+	stop_reason = STOP_TIMEOUT;
+	if (IsConditionMet(cond)) {
+		return stop_reason;
+	}
+
+	uint32_t end_cycles = max_ms * cycles_ms;
+	if (cond.flags & RUN_UNTIL_CYCLE) {
+		uint64_t target = cycles + (cond.cycle - GetCycleCount());
+		if (target < end_cycles) {
+			end_cycles = target;
+		}
+	}
+
+	run_cond = cond;
+	run_cond.ram_addr &= 0x7FFF;
+	RunCyclesWithKeys<true>(end_cycles, speed_up);
+	run_cond.flags = 0;
+
+	if (stop_reason == STOP_TIMEOUT && (cond.flags & RUN_UNTIL_CYCLE) && GetCycleCount() >= cond.cycle) {
+		stop_reason = STOP_CYCLE;
+	}
+	if (stop_reason == STOP_TIMEOUT && page_pending) {
+		stop_reason = STOP_PAGE;
+	}
+	return stop_reason;
+}
+
+stop_reason_t MachineState::RunTurboChunks(uint32_t guest_ms, const run_condition_t *cond, bool (*until)(void *),
+                                           void *context, turbo_stats_t *stats) {
+	if (guest_ms == 0 && cond == nullptr && until == nullptr) {
+		// Nothing would ever stop the run.
+		if (stats != nullptr) {
+			memset(stats, 0, sizeof(*stats));
+		}
+		return STOP_TIMEOUT;
+	}
+	uint64_t start_cycles = GetCycleCount();
+	uint64_t start_us = hal->getMonotonicMicros();
+	uint32_t done_ms = 0;
+	stop_reason_t reason = STOP_TIMEOUT;
+	bool async = SuspendAsyncPages();
+
+	// No wall clock pacing here. Timers are driven by guest cycles so the RTC stays in sync with guest time.
+	while (guest_ms == 0 || done_ms < guest_ms) {
+		uint32_t chunk = TURBO_CHUNK_MS;
+		if (guest_ms != 0 && guest_ms - done_ms < chunk) {
+			chunk = guest_ms - done_ms;
+		}
+		if (cond != nullptr) {
+			uint64_t chunk_start = GetCycleCount();
+			reason = RunUntil(*cond, chunk, false);
+			if (reason != STOP_TIMEOUT) {
+				done_ms += (GetCycleCount() - chunk_start) / cycles_ms;
+				break;
+			}
+		} else {
+			RunCyclesWithKeys<false>(chunk * cycles_ms, false);
+		}
+		done_ms += chunk;
+		if (until != nullptr && until(context)) {
+			break;
+		}
+	}
+	async_pages = async;
+
+	if (stats == nullptr) {
+		return reason;
+	}
+	uint64_t end_us = hal->getMonotonicMicros();
+	stats->guest_cycles = GetCycleCount() - start_cycles;
+	stats->guest_ms = done_ms;
+	stats->host_us = (start_us == 0 && end_us == 0) ? 0 : end_us - start_us;
+	if (stats->host_us != 0) {
+		stats->emulated_khz = stats->guest_cycles * 1000 / stats->host_us;
+		stats->speed_percent = static_cast<uint64_t>(done_ms) * 1000 * 100 / stats->host_us;
+	} else {
+		stats->emulated_khz = 0;
+		stats->speed_percent = 0;
+	}
+	return reason;
+}
+
+void MachineState::RunTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats) {
+	RunTurboChunks(guest_ms, nullptr, until, context, stats);
+}
+
+stop_reason_t MachineState::RunTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats) {
+	return RunTurboChunks(guest_ms, &cond, nullptr, nullptr, stats);
+}
+
+uint64_t MachineState::GetCycleCount() {
+	return cycles_base + cycles;
+}
+
+// RAM and device states are small and written all the time, so they are copied. NOR is shared copy-on-write.
+bool MachineState::ForkInto(MachineState& child, IWqxHal *child_hal) {
+	if (hal == nullptr || &child == this) {
+		return false;
+	}
+	if (!nor_cow) {
+		// Pages written since Initialize() may only exist in this machine's HAL. Keep them in memory for all forks.
+		for (uint8_t page = 0; page < 0x20; page++) {
+			if (!(nor_dirty_mask & (1u << page))) {
+				continue;
+			}
+			uint8_t* data = LoadNorPage(page);
+			if (data != nullptr && (nor_pages[page] = NewNorPage(data)) == nullptr) {
+				for (uint8_t i = 0; i < page; i++) {
+					ReleaseNorPage(nor_pages[i]);
+					nor_pages[i] = nullptr;
+				}
+				SwitchBank();
+				return false;
+			}
+		}
+		nor_cow = true;
+		SwitchBank();
+	}
+
+	child.ReleaseNor();
+	memcpy(static_cast<nc1020_states_t*>(&child), static_cast<nc1020_states_t*>(this), sizeof(nc1020_states_t));
+	child.hal = child_hal;
+	memcpy(child.io_read, io_read, sizeof(io_read));
+	memcpy(child.io_write, io_write, sizeof(io_write));
+	child.ApplyCpuSpeed(cycles_second);
+	child.cycles_base = cycles_base;
+	child.run_cond.flags = 0;
+	child.stop_reason = STOP_TIMEOUT;
+
+	child.nor_dirty_mask = nor_dirty_mask;
+	child.nor_generation = nor_generation;
+	child.nor_pristine_enabled = nor_pristine_enabled;
+	child.nor_cow = true;
+	for (uint32_t i = 0; i < 0x20; i++) {
+		child.nor_pristine[i] = RetainNorPage(nor_pristine[i]);
+		child.nor_pages[i] = RetainNorPage(nor_pages[i]);
+	}
+
+	// The fork has no save of its own yet to build deltas on.
+	memset(child.ram_dirty, 0xFF, sizeof(child.ram_dirty));
+	memset(child.lcd_dirty_rows, 0xFF, sizeof(child.lcd_dirty_rows));
+	child.ResetLcdFrame();
+	child.ClearKeyQueue();
+	child.ClearMacro();
+	memcpy(child.nor_dirty_blocks, nor_dirty_blocks, sizeof(nor_dirty_blocks));
+	child.nor_checkpoint_mask = nor_checkpoint_mask;
+	child.SetCheckpoint(0);
+	child.state_log_checksum = 0;
+	child.state_log_size = 0;
+	child.state_log_limit = 0;
+
+	child.governor = governor;
+	child.governor_host_us = 0;
+	child.governor_guest_ms = 0;
+	child.async_pages = async_pages;
+	memset(&child.stats, 0, sizeof(child.stats));
+
+	child.SwitchVolume();
+	for (uint8_t i = 0; i < 8; i++) {
+		uint32_t offset = GetMemmapRamOffset(i);
+		if (offset != SNAPSHOT_MAP_HAL) {
+			child.memmap[i] = child.ram_buff + offset;
+		}
+	}
+	return true;
+}
+
+// The machine behind the free functions. Statically allocated so it works without a heap and before Initialize().
+static MachineState default_machine;
+
+static bool AllocateState(MachineState*& state) {
+	if (state == nullptr) {
+		void* memory = malloc(sizeof(MachineState));
+		if (memory == nullptr) {
+			return false;
+		}
+		state = new (memory) MachineState();
+	}
+	return true;
+}
+
+Machine::Machine() : state(nullptr) {}
+
+Machine::~Machine() {
+	end();
+}
+
+bool Machine::begin(IWqxHal *hal, uint32_t cpu_speed) {
+	if (!AllocateState(state)) {
+		return false;
+	}
+	state->Initialize(hal, cpu_speed);
+	return true;
+}
+
+void Machine::end() {
+	if (state != nullptr) {
+		state->~MachineState();
+		free(state);
+		state = nullptr;
+	}
+}
+
+bool Machine::fork(Machine &child, IWqxHal *hal) {
+	if (state == nullptr || &child == this) {
+		return false;
+	}
+	return AllocateState(child.state) && state->ForkInto(*child.state, hal);
+}
+
+void Machine::reset() {
+	state->Reset();
+}
+
+void Machine::setKey(uint8_t key_id, bool down_or_up) {
+	state->SetKey(key_id, down_or_up);
+}
+
+void Machine::releaseAllKeys() {
+	state->ReleaseAllKeys();
+}
+
+bool Machine::queueKey(uint64_t cycle, uint8_t key_id, bool down_or_up) {
+	return state->QueueKey(cycle, key_id, down_or_up);
+}
+
+void Machine::clearKeyQueue() {
+	state->ClearKeyQueue();
+}
+
+bool Machine::queueMacro(const uint8_t *keys, size_t count) {
+	return state->QueueMacro(keys, count);
+}
+
+bool Machine::typeText(const char *text) {
+	return state->TypeText(text);
+}
+
+void Machine::setMacroTiming(uint8_t hold_scans, uint8_t release_scans) {
+	state->SetMacroTiming(hold_scans, release_scans);
+}
+
+size_t Machine::getMacroPending() {
+	return state->GetMacroPending();
+}
+
+void Machine::cancelMacro() {
+	state->CancelMacro();
+}
+
+bool Machine::startInputRecording(uint32_t checkpoint_ms) {
+	return state->StartInputRecording(checkpoint_ms);
+}
+
+bool Machine::stopInputRecording() {
+	return state->StopInputRecording();
+}
+
+bool Machine::replayInputLog(const uint8_t *log, size_t size, replay_result_t *result) {
+	return state->ReplayInputLog(log, size, result);
+}
+
+void Machine::runTimeSlice(uint32_t time_slice, bool speed_up) {
+	state->RunTimeSlice(time_slice, speed_up);
+}
+
+void Machine::runTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats) {
+	state->RunTurbo(guest_ms, until, context, stats);
+}
+
+stop_reason_t Machine::runTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats) {
+	return state->RunTurbo(guest_ms, cond, stats);
+}
+
+stop_reason_t Machine::runUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up) {
+	return state->RunUntil(cond, max_ms, speed_up);
+}
+
+void Machine::setAsyncPageLoads(bool enabled) {
+	state->SetAsyncPageLoads(enabled);
+}
+
+bool Machine::isWaitingForPage() {
+	return state->IsWaitingForPage();
+}
+
+uint64_t Machine::getCycleCount() {
+	return state->GetCycleCount();
+}
+
+void Machine::setCpuSpeed(uint32_t cpu_speed) {
+	state->SetCpuSpeed(cpu_speed);
+}
+
+uint32_t Machine::getCpuSpeed() {
+	return state->GetCpuSpeed();
+}
+
+void Machine::setGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz) {
+	state->SetGovernor(enabled, min_hz, max_hz);
+}
+
+void Machine::getGovernorStats(governor_stats_t *stats) {
+	state->GetGovernorStats(stats);
+}
+
+void Machine::getStats(machine_stats_t *stats) {
+	state->GetStats(stats);
+}
+
+void Machine::resetStats() {
+	state->ResetStats();
+}
+
+bool Machine::copyLcdBuffer(uint8_t *buffer) {
+	return state->CopyLcdBuffer(buffer);
+}
+
+const uint8_t *Machine::getLcdBuffer() {
+	return state->GetLcdBuffer();
+}
+
+uint32_t Machine::copyLcdDirtyRows(uint8_t *buffer, uint32_t *rows) {
+	return state->CopyLcdDirtyRows(buffer, rows);
+}
+
+bool Machine::copyLcdFrame(uint8_t *buffer, uint64_t *cycle) {
+	return state->CopyLcdFrame(buffer, cycle);
+}
+
+size_t Machine::getStatesSizeBound(uint32_t flags) {
+	return state->GetStatesSizeBound(flags);
+}
+
+size_t Machine::saveStatesToBuffer(uint8_t *buffer, size_t capacity, uint32_t flags) {
+	return state->SaveStatesToBuffer(buffer, capacity, flags);
+}
+
+bool Machine::loadStatesFromBuffer(const uint8_t *buffer, size_t size) {
+	return state->LoadStatesFromBuffer(buffer, size);
+}
+
+size_t Machine::getSnapshotSize() {
+	return state->GetSnapshotSize();
+}
+
+size_t Machine::snapshot(void *buffer, size_t capacity) {
+	return state->Snapshot(buffer, capacity);
+}
+
+bool Machine::restore(const void *buffer, size_t size) {
+	return state->Restore(buffer, size);
+}
+
+bool Machine::load() {
+	return state->LoadNC1020();
+}
+
+bool Machine::save(uint32_t flags) {
+	return state->SaveNC1020(flags);
+}
+
+bool Machine::boot(uint32_t boot_ms) {
+	return state->BootNC1020(boot_ms);
+}
+
+void Initialize(IWqxHal *halImpl, uint32_t cpu_speed_override) {
+	default_machine.Initialize(halImpl, cpu_speed_override);
+}
+
+void Reset() {
+	default_machine.Reset();
+}
+
+void SetKey(uint8_t key_id, bool down_or_up) {
+	default_machine.SetKey(key_id, down_or_up);
+}
+
+void ReleaseAllKeys() {
+	default_machine.ReleaseAllKeys();
+}
+
+bool QueueKey(uint64_t cycle, uint8_t key_id, bool down_or_up) {
+	return default_machine.QueueKey(cycle, key_id, down_or_up);
+}
+
+void ClearKeyQueue() {
+	default_machine.ClearKeyQueue();
+}
+
+bool QueueMacro(const uint8_t* keys, size_t count) {
+	return default_machine.QueueMacro(keys, count);
+}
+
+bool TypeText(const char* text) {
+	return default_machine.TypeText(text);
+}
+
+void SetMacroTiming(uint8_t hold_scans, uint8_t release_scans) {
+	default_machine.SetMacroTiming(hold_scans, release_scans);
+}
+
+size_t GetMacroPending() {
+	return default_machine.GetMacroPending();
+}
+
+void CancelMacro() {
+	default_machine.CancelMacro();
+}
+
+bool StartInputRecording(uint32_t checkpoint_ms) {
+	return default_machine.StartInputRecording(checkpoint_ms);
+}
+
+bool StopInputRecording() {
+	return default_machine.StopInputRecording();
+}
+
+bool ReplayInputLog(const uint8_t* log, size_t size, replay_result_t* result) {
+	return default_machine.ReplayInputLog(log, size, result);
+}
+
+void RunTimeSlice(uint32_t time_slice, bool speed_up) {
+	default_machine.RunTimeSlice(time_slice, speed_up);
+}
+
+void RunTurbo(uint32_t guest_ms, bool (*until)(void *), void *context, turbo_stats_t *stats) {
+	default_machine.RunTurbo(guest_ms, until, context, stats);
+}
+
+stop_reason_t RunTurbo(uint32_t guest_ms, const run_condition_t &cond, turbo_stats_t *stats) {
+	return default_machine.RunTurbo(guest_ms, cond, stats);
+}
+
+stop_reason_t RunUntil(const run_condition_t &cond, uint32_t max_ms, bool speed_up) {
+	return default_machine.RunUntil(cond, max_ms, speed_up);
+}
+
+void SetAsyncPageLoads(bool enabled) {
+	default_machine.SetAsyncPageLoads(enabled);
+}
+
+bool IsWaitingForPage() {
+	return default_machine.IsWaitingForPage();
+}
+
+uint64_t GetCycleCount() {
+	return default_machine.GetCycleCount();
+}
+
+void SetCpuSpeed(uint32_t cpu_speed) {
+	default_machine.SetCpuSpeed(cpu_speed);
+}
+
+uint32_t GetCpuSpeed() {
+	return default_machine.GetCpuSpeed();
+}
+
+void SetGovernor(bool enabled, uint32_t min_hz, uint32_t max_hz) {
+	default_machine.SetGovernor(enabled, min_hz, max_hz);
+}
+
+void GetGovernorStats(governor_stats_t *stats) {
+	default_machine.GetGovernorStats(stats);
+}
+
+void GetStats(machine_stats_t *stats) {
+	default_machine.GetStats(stats);
+}
+
+void ResetStats() {
+	default_machine.ResetStats();
+}
+
+bool CopyLcdBuffer(uint8_t* buffer) {
+	return default_machine.CopyLcdBuffer(buffer);
+}
+
+const uint8_t* GetLcdBuffer() {
+	return default_machine.GetLcdBuffer();
+}
+
+uint32_t CopyLcdDirtyRows(uint8_t* buffer, uint32_t* rows) {
+	return default_machine.CopyLcdDirtyRows(buffer, rows);
+}
+
+bool CopyLcdFrame(uint8_t* buffer, uint64_t* cycle) {
+	return default_machine.CopyLcdFrame(buffer, cycle);
+}
+
+size_t GetStatesSizeBound(uint32_t flags) {
+	return default_machine.GetStatesSizeBound(flags);
+}
+
+size_t SaveStatesToBuffer(uint8_t* buffer, size_t capacity, uint32_t flags) {
+	return default_machine.SaveStatesToBuffer(buffer, capacity, flags);
+}
+
+bool LoadStatesFromBuffer(const uint8_t* buffer, size_t size) {
+	return default_machine.LoadStatesFromBuffer(buffer, size);
+}
+
+size_t GetSnapshotSize() {
+	return default_machine.GetSnapshotSize();
+}
+
+size_t Snapshot(void* buffer, size_t capacity) {
+	return default_machine.Snapshot(buffer, capacity);
+}
+
+bool Restore(const void* buffer, size_t size) {
+	return default_machine.Restore(buffer, size);
+}
+
+bool LoadNC1020() {
+	return default_machine.LoadNC1020();
+}
+
+bool SaveNC1020(uint32_t flags) {
+	return default_machine.SaveNC1020(flags);
+}
+
+bool BootNC1020(uint32_t boot_ms) {
+	return default_machine.BootNC1020(boot_ms);
+}
 
-	wqx::reg_pc = reg_pc;
-	wqx::reg_a = reg_a;
-	wqx::reg_ps = reg_ps;
-	wqx::reg_x = reg_x;
-	wqx::reg_y = reg_y;
-	wqx::reg_sp = reg_sp;
+bool Fork(Machine &child, IWqxHal *hal) {
+	return AllocateState(child.state) && default_machine.ForkInto(*child.state, hal);
 }
 
 }
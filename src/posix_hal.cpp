@@ -0,0 +1,244 @@
+#include "nc1020_posix.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace wqx {
+
+static const size_t IMAGE_PAGE_SIZE = 0x8000;
+static const size_t ROM_SIZE = IMAGE_PAGE_SIZE * 0x80 * 3;
+static const size_t NOR_SIZE = IMAGE_PAGE_SIZE * 0x20;
+static const size_t BBS_SIZE = 0x2000 * 0x10;
+
+// Private writable mappings share the file's pages with every other session until a page is written.
+static uint8_t *MapImage(const char *path, size_t size) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= size) {
+        image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    return image == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t *>(image);
+}
+
+static void UnmapImage(uint8_t *image, size_t size) {
+    if (image != nullptr) {
+        munmap(image, size);
+    }
+}
+
+static bool WriteFile(const char *path, const char *mode, const void *data, size_t size) {
+    if (path == nullptr) {
+        return false;
+    }
+    FILE *file = fopen(path, mode);
+    if (file == nullptr) {
+        return false;
+    }
+    bool result = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && result;
+}
+
+// Short reads succeed with the rest of the buffer untouched, as LoadNC1020() expects.
+static bool ReadFile(const char *path, void *data, size_t size) {
+    if (path == nullptr) {
+        return false;
+    }
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool result = fread(data, 1, size, file) != 0 || !ferror(file);
+    fclose(file);
+    return result;
+}
+
+// Starts reading an image page that isn't in memory yet. mincore() and readahead only cost a system call each, and
+// only until the page is seen resident.
+static page_load_t Prefetch(uint32_t *resident, uint32_t index, uint8_t *data) {
+    uint32_t bit = 1u << (index % 32);
+    if (resident[index / 32] & bit) {
+        return PAGE_LOAD_READY;
+    }
+    static const uintptr_t hostPageMask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~hostPageMask;
+    size_t length = (reinterpret_cast<uintptr_t>(data) + IMAGE_PAGE_SIZE - start + hostPageMask) & ~hostPageMask;
+    unsigned char pages[IMAGE_PAGE_SIZE / 4096 + 1];
+    size_t count = length / (hostPageMask + 1);
+    if (count > sizeof(pages) || mincore(reinterpret_cast<void *>(start), length, pages) != 0) {
+        // Can't tell. Let the guest fault it in.
+        resident[index / 32] |= bit;
+        return PAGE_LOAD_READY;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!(pages[i] & 1)) {
+            madvise(reinterpret_cast<void *>(start), length, MADV_WILLNEED);
+            return PAGE_LOAD_PENDING;
+        }
+    }
+    resident[index / 32] |= bit;
+    return PAGE_LOAD_READY;
+}
+
+PosixHal::PosixHal() : rom(nullptr), nor(nullptr), bbsImage(nullptr), norPath(nullptr), statePath(nullptr),
+                       bootCachePath(nullptr), inputLogPath(nullptr), norWriteBack(false), norDirty(false),
+                       romResident{0}, norResident(0) {}
+
+PosixHal::~PosixHal() {
+    close();
+}
+
+bool PosixHal::open(const char *romPath, const char *norPath, const char *bbsPath) {
+    close();
+    rom = MapImage(romPath, ROM_SIZE);
+    nor = MapImage(norPath, NOR_SIZE);
+    bbsImage = MapImage(bbsPath, BBS_SIZE);
+    if (rom == nullptr || nor == nullptr || bbsImage == nullptr) {
+        close();
+        return false;
+    }
+    this->norPath = norPath;
+    norDirty = false;
+    memset(romResident, 0, sizeof(romResident));
+    norResident = 0;
+    page = rom;
+    bbs = bbsImage;
+    shadowBbs = &bbsImage[0x2000];
+    return true;
+}
+
+bool PosixHal::close() {
+    bool result = true;
+    if (nor != nullptr && norWriteBack && norDirty) {
+        result = WriteFile(norPath, "wb", nor, NOR_SIZE);
+    }
+    UnmapImage(rom, ROM_SIZE);
+    UnmapImage(nor, NOR_SIZE);
+    UnmapImage(bbsImage, BBS_SIZE);
+    rom = nullptr;
+    nor = nullptr;
+    bbsImage = nullptr;
+    page = nullptr;
+    bbs = nullptr;
+    shadowBbs = nullptr;
+    return result;
+}
+
+void PosixHal::setNorWriteBack(bool enabled) {
+    norWriteBack = enabled;
+}
+
+void PosixHal::setStatePath(const char *path) {
+    statePath = path;
+}
+
+void PosixHal::setBootCachePath(const char *path) {
+    bootCachePath = path;
+}
+
+void PosixHal::setInputLogPath(const char *path) {
+    inputLogPath = path;
+}
+
+bool PosixHal::loadNorPage(uint32_t page) {
+    if (page > 0x1f || nor == nullptr) {
+        return false;
+    }
+    this->page = &nor[page * IMAGE_PAGE_SIZE];
+    return true;
+}
+
+bool PosixHal::saveNorPage(uint32_t page) {
+    // The page was written in place.
+    (void) page;
+    norDirty = true;
+    return nor != nullptr;
+}
+
+bool PosixHal::wipeNorFlash() {
+    if (nor == nullptr) {
+        return false;
+    }
+    memset(nor, 0xff, NOR_SIZE);
+    norDirty = true;
+    return true;
+}
+
+bool PosixHal::loadRomPage(uint32_t volume, uint32_t page) {
+    if (page > 0x7f || volume > 2 || rom == nullptr) {
+        return false;
+    }
+    this->page = &rom[(volume * 0x80 + page) * IMAGE_PAGE_SIZE];
+    return true;
+}
+
+page_load_t PosixHal::requestNorPage(uint32_t page) {
+    if (!loadNorPage(page)) {
+        return PAGE_LOAD_FAILED;
+    }
+    return Prefetch(&norResident, page, this->page);
+}
+
+page_load_t PosixHal::requestRomPage(uint32_t volume, uint32_t page) {
+    if (!loadRomPage(volume, page)) {
+        return PAGE_LOAD_FAILED;
+    }
+    return Prefetch(romResident, volume * 0x80 + page, this->page);
+}
+
+bool PosixHal::loadBbsPage(uint32_t volume, uint32_t page) {
+    (void) volume;
+    if (page > 0xf || volume > 2 || bbsImage == nullptr) {
+        return false;
+    }
+    this->bbs = &bbsImage[page * 0x2000];
+    this->shadowBbs = &bbsImage[0x2000];
+    return true;
+}
+
+bool PosixHal::saveState(const char *states, size_t size) {
+    return WriteFile(statePath, "wb", states, size);
+}
+
+bool PosixHal::loadState(char *states, size_t size) {
+    return ReadFile(statePath, states, size);
+}
+
+bool PosixHal::appendState(const char *states, size_t size) {
+    return WriteFile(statePath, "ab", states, size);
+}
+
+uint64_t PosixHal::getMonotonicMicros() {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+bool PosixHal::saveBootCache(const char *states, size_t size) {
+    return WriteFile(bootCachePath, "wb", states, size);
+}
+
+bool PosixHal::loadBootCache(char *states, size_t size) {
+    return ReadFile(bootCachePath, states, size);
+}
+
+bool PosixHal::saveInputLog(const char *data, size_t size) {
+    return WriteFile(inputLogPath, "wb", data, size);
+}
+
+bool PosixHal::appendInputLog(const char *data, size_t size) {
+    return WriteFile(inputLogPath, "ab", data, size);
+}
+
+}
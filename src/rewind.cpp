@@ -0,0 +1,351 @@
+#include "nc1020_rewind.h"
+#include "nc1020.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace wqx {
+
+// Runs are counted in blocks of this many bytes.
+static const size_t BLOCK_SIZE = 16;
+static const uint8_t ZERO_BLOCK[BLOCK_SIZE] = {0};
+
+#if defined(__SSE2__)
+static inline bool BlockDiffers(const uint8_t *a, const uint8_t *b) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF;
+}
+
+static inline void XorBlock(uint8_t *out, const uint8_t *a, const uint8_t *b) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_xor_si128(va, vb));
+}
+#elif defined(__ARM_NEON)
+static inline bool BlockDiffers(const uint8_t *a, const uint8_t *b) {
+    uint64x2_t x = vreinterpretq_u64_u8(veorq_u8(vld1q_u8(a), vld1q_u8(b)));
+    return (vgetq_lane_u64(x, 0) | vgetq_lane_u64(x, 1)) != 0;
+}
+
+static inline void XorBlock(uint8_t *out, const uint8_t *a, const uint8_t *b) {
+    vst1q_u8(out, veorq_u8(vld1q_u8(a), vld1q_u8(b)));
+}
+#else
+static inline bool BlockDiffers(const uint8_t *a, const uint8_t *b) {
+    uint32_t wa[BLOCK_SIZE / 4];
+    uint32_t wb[BLOCK_SIZE / 4];
+    memcpy(wa, a, BLOCK_SIZE);
+    memcpy(wb, b, BLOCK_SIZE);
+    return ((wa[0] ^ wb[0]) | (wa[1] ^ wb[1]) | (wa[2] ^ wb[2]) | (wa[3] ^ wb[3])) != 0;
+}
+
+static inline void XorBlock(uint8_t *out, const uint8_t *a, const uint8_t *b) {
+    uint32_t wa[BLOCK_SIZE / 4];
+    uint32_t wb[BLOCK_SIZE / 4];
+    memcpy(wa, a, BLOCK_SIZE);
+    memcpy(wb, b, BLOCK_SIZE);
+    for (size_t i = 0; i < BLOCK_SIZE / 4; i++) {
+        wa[i] ^= wb[i];
+    }
+    memcpy(out, wa, BLOCK_SIZE);
+}
+#endif
+
+static inline size_t PutVarint(uint8_t *out, size_t value) {
+    size_t pos = 0;
+    while (value >= 0x80) {
+        out[pos++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[pos++] = value;
+    return pos;
+}
+
+static inline size_t GetVarint(const uint8_t *in, size_t &value) {
+    size_t pos = 0;
+    unsigned shift = 0;
+    value = 0;
+    uint8_t byte;
+    do {
+        byte = in[pos++];
+        value |= static_cast<size_t>(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return pos;
+}
+
+static size_t EncodedSizeBound(size_t size) {
+    // Worst case alternates single changed and unchanged blocks.
+    return size + (size / BLOCK_SIZE) * 2 + 16;
+}
+
+// Encode `current` XOR `base` (or XOR zero when `base` is null) as runs of unchanged and changed blocks.
+static size_t Encode(const uint8_t *current, const uint8_t *base, size_t size, uint8_t *out) {
+    size_t blocks = size / BLOCK_SIZE;
+    size_t stride = base != nullptr ? BLOCK_SIZE : 0;
+    const uint8_t *ref = base != nullptr ? base : ZERO_BLOCK;
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < blocks) {
+        size_t unchanged = i;
+        while (i < blocks && !BlockDiffers(current + i * BLOCK_SIZE, ref + i * stride)) {
+            i++;
+        }
+        unchanged = i - unchanged;
+        size_t changed = i;
+        while (i < blocks && BlockDiffers(current + i * BLOCK_SIZE, ref + i * stride)) {
+            i++;
+        }
+        changed = i - changed;
+        pos += PutVarint(out + pos, unchanged);
+        pos += PutVarint(out + pos, changed);
+        for (size_t j = i - changed; j < i; j++) {
+            XorBlock(out + pos, current + j * BLOCK_SIZE, ref + j * stride);
+            pos += BLOCK_SIZE;
+        }
+    }
+    for (size_t j = blocks * BLOCK_SIZE; j < size; j++) {
+        out[pos++] = current[j] ^ (base != nullptr ? base[j] : 0);
+    }
+    return pos;
+}
+
+static void Decode(const uint8_t *in, const uint8_t *base, size_t size, uint8_t *out) {
+    if (base != nullptr) {
+        memcpy(out, base, size);
+    } else {
+        memset(out, 0, size);
+    }
+    size_t blocks = size / BLOCK_SIZE;
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < blocks) {
+        size_t unchanged;
+        size_t changed;
+        pos += GetVarint(in + pos, unchanged);
+        pos += GetVarint(in + pos, changed);
+        i += unchanged;
+        for (size_t j = 0; j < changed; j++, i++) {
+            XorBlock(out + i * BLOCK_SIZE, out + i * BLOCK_SIZE, in + pos);
+            pos += BLOCK_SIZE;
+        }
+    }
+    for (size_t j = blocks * BLOCK_SIZE; j < size; j++) {
+        out[j] ^= in[pos++];
+    }
+}
+
+RewindBuffer::RewindBuffer() : machine(nullptr), ring(nullptr), capacity(0), entries(nullptr), maxEntries(0), first(0), entryCount(0),
+                               current(nullptr), keyframe(nullptr), scratchSize(0), keyframeSize(0),
+                               keyframeValid(false), intervalMs(0), keyframeInterval(0), sinceKeyframe(0),
+                               lastCycle(0) {}
+
+RewindBuffer::~RewindBuffer() {
+    end();
+}
+
+bool RewindBuffer::begin(size_t capacity, uint32_t interval_ms, uint32_t keyframe_interval, Machine *machine) {
+    end();
+    this->machine = machine;
+    // A fully unchanged RAM delta is a few bytes, so entry metadata is what limits the count.
+    maxEntries = capacity / 64 + 1;
+    ring = reinterpret_cast<uint8_t *>(malloc(capacity));
+    entries = reinterpret_cast<Entry *>(malloc(maxEntries * sizeof(Entry)));
+    if (ring == nullptr || entries == nullptr) {
+        end();
+        return false;
+    }
+    this->capacity = capacity;
+    intervalMs = interval_ms;
+    keyframeInterval = keyframe_interval == 0 ? 1 : keyframe_interval;
+    clear();
+    return true;
+}
+
+void RewindBuffer::end() {
+    free(ring);
+    free(entries);
+    free(current);
+    free(keyframe);
+    ring = nullptr;
+    entries = nullptr;
+    current = nullptr;
+    keyframe = nullptr;
+    capacity = 0;
+    maxEntries = 0;
+    scratchSize = 0;
+    machine = nullptr;
+    clear();
+}
+
+void RewindBuffer::clear() {
+    first = 0;
+    entryCount = 0;
+    keyframeValid = false;
+    sinceKeyframe = 0;
+    lastCycle = cycleCount();
+}
+
+uint64_t RewindBuffer::cycleCount() {
+    return machine != nullptr ? machine->getCycleCount() : GetCycleCount();
+}
+
+size_t RewindBuffer::count() const {
+    return entryCount;
+}
+
+size_t RewindBuffer::used() const {
+    size_t total = 0;
+    for (size_t i = 0; i < entryCount; i++) {
+        total += entries[(first + i) % maxEntries].size;
+    }
+    return total;
+}
+
+void RewindBuffer::tick() {
+    if (ring == nullptr) {
+        return;
+    }
+    uint32_t speed = machine != nullptr ? machine->getCpuSpeed() : GetCpuSpeed();
+    uint64_t interval = static_cast<uint64_t>(intervalMs) * speed / 1000;
+    uint64_t now = cycleCount();
+    if (now < lastCycle || now - lastCycle >= interval) {
+        capture();
+    }
+}
+
+void RewindBuffer::dropOldest() {
+    // Deltas are useless without their keyframe, so they go together.
+    do {
+        first = (first + 1) % maxEntries;
+        entryCount--;
+    } while (entryCount > 0 && !entries[first].keyframe);
+    if (entryCount == 0) {
+        keyframeValid = false;
+    }
+}
+
+bool RewindBuffer::reserve(size_t size, size_t &offset) {
+    if (size > capacity) {
+        return false;
+    }
+    if (entryCount == maxEntries) {
+        dropOldest();
+    }
+    offset = 0;
+    if (entryCount > 0) {
+        const Entry &newest = entries[(first + entryCount - 1) % maxEntries];
+        offset = newest.offset + newest.size;
+    }
+    if (offset + size > capacity) {
+        // Wrap around. Entries past the old head are the oldest ones and are given up with the unused tail.
+        while (entryCount > 0 && entries[first].offset >= offset) {
+            dropOldest();
+        }
+        offset = 0;
+    }
+    while (entryCount > 0 && entries[first].offset < offset + size &&
+           entries[first].offset + entries[first].size > offset) {
+        dropOldest();
+    }
+    return true;
+}
+
+bool RewindBuffer::capture() {
+    if (ring == nullptr) {
+        return false;
+    }
+    lastCycle = cycleCount();
+
+    size_t size = machine != nullptr ? machine->getSnapshotSize() : GetSnapshotSize();
+    if (size > scratchSize) {
+        uint8_t *newCurrent = reinterpret_cast<uint8_t *>(realloc(current, size));
+        if (newCurrent == nullptr) {
+            return false;
+        }
+        current = newCurrent;
+        uint8_t *newKeyframe = reinterpret_cast<uint8_t *>(realloc(keyframe, size));
+        if (newKeyframe == nullptr) {
+            return false;
+        }
+        keyframe = newKeyframe;
+        scratchSize = size;
+    }
+    size = machine != nullptr ? machine->snapshot(current, scratchSize) : Snapshot(current, scratchSize);
+    if (size == 0) {
+        return false;
+    }
+
+    // NOR pages written since the keyframe change the snapshot size. Those need a new keyframe.
+    bool isKeyframe = !keyframeValid || size != keyframeSize || sinceKeyframe + 1 >= keyframeInterval;
+    size_t offset;
+    if (!reserve(EncodedSizeBound(size), offset)) {
+        return false;
+    }
+    // Reserving may have evicted the keyframe this entry would refer to.
+    isKeyframe = isKeyframe || !keyframeValid;
+
+    Entry &entry = entries[(first + entryCount) % maxEntries];
+    entry.offset = offset;
+    entry.size = Encode(current, isKeyframe ? nullptr : keyframe, size, ring + offset);
+    entry.snapshotSize = size;
+    entry.cycle = lastCycle;
+    entry.keyframe = isKeyframe;
+    entryCount++;
+
+    if (isKeyframe) {
+        memcpy(keyframe, current, size);
+        keyframeSize = size;
+        keyframeValid = true;
+        sinceKeyframe = 0;
+    } else {
+        sinceKeyframe++;
+    }
+    return true;
+}
+
+bool RewindBuffer::decodeKeyframe() {
+    keyframeValid = false;
+    sinceKeyframe = 0;
+    for (size_t i = entryCount; i > 0; i--) {
+        const Entry &entry = entries[(first + i - 1) % maxEntries];
+        if (entry.keyframe) {
+            Decode(ring + entry.offset, nullptr, entry.snapshotSize, keyframe);
+            keyframeSize = entry.snapshotSize;
+            keyframeValid = true;
+            return true;
+        }
+        sinceKeyframe++;
+    }
+    return false;
+}
+
+bool RewindBuffer::stepBack() {
+    if (entryCount == 0) {
+        return false;
+    }
+    const Entry &entry = entries[(first + entryCount - 1) % maxEntries];
+    Decode(ring + entry.offset, entry.keyframe ? nullptr : keyframe, entry.snapshotSize, current);
+    bool wasKeyframe = entry.keyframe;
+    size_t size = entry.snapshotSize;
+    entryCount--;
+    if (wasKeyframe) {
+        decodeKeyframe();
+    } else {
+        sinceKeyframe--;
+    }
+
+    if (!(machine != nullptr ? machine->restore(current, size) : Restore(current, size))) {
+        return false;
+    }
+    lastCycle = cycleCount();
+    return true;
+}
+
+}
@@ -0,0 +1,515 @@
+// Headless runner for profiling and benchmarking the core on a normal host.
+
+#include "nc1020.h"
+#include "nc1020_capture.h"
+#include "nc1020_posix.h"
+#include "nc1020_rewind.h"
+#include "nc1020_shm.h"
+#include <algorithm>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const uint32_t TAP_MS = 50;
+static const uint32_t CHECKPOINT_MS = 1000;
+// Rewind benchmark settings. Slices default to what a frontend at 100 Hz runs, and each mode runs a few times with
+// the fastest run kept, since one run is easily skewed by the host.
+static const uint32_t REWIND_SLICE_MS = 10;
+static const uint32_t REWIND_ROUNDS = 3;
+static const size_t REWIND_CAPACITY = 32 << 20;
+static const uint32_t REWIND_KEYFRAME_INTERVAL = 50;
+
+enum EventType {
+    EVENT_DOWN,
+    EVENT_UP,
+    EVENT_RELEASE_ALL,
+    EVENT_TYPE,
+};
+
+struct Event {
+    uint32_t ms;
+    EventType type;
+    uint8_t key;
+    std::string text;
+};
+
+struct Options {
+    const char *rom = "rom.bin";
+    const char *nor = "nor.bin";
+    const char *bbs = "bbs.bin";
+    const char *state = nullptr;
+    const char *script = nullptr;
+    const char *lcd = nullptr;
+    const char *capture = nullptr;
+    const char *record = nullptr;
+    const char *replay = nullptr;
+    const char *bootCache = nullptr;
+    const char *shm = nullptr;
+    const char *stats = nullptr;
+    uint32_t ms = 10000;
+    uint32_t slice = 0;
+    uint32_t speed = 0;
+    uint32_t boot = 0;
+    uint32_t rewind = 0;
+    bool writeNor = false;
+};
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --rom FILE         ROM image (default rom.bin)\n"
+            "  --nor FILE         NOR flash image (default nor.bin)\n"
+            "  --bbs FILE         BBS image (default bbs.bin)\n"
+            "  --ms MS            guest time to run (default 10000)\n"
+            "  --slice MS         run in RunTimeSlice() slices of MS instead of turbo chunks\n"
+            "  --speed HZ         guest CPU speed\n"
+            "  --state FILE       load the state from FILE if it exists and save it on exit\n"
+            "  --boot MS          boot from reset with BootNC1020() when there is no state\n"
+            "  --boot-cache FILE  boot cache file for --boot\n"
+            "  --input FILE       input script\n"
+            "  --record FILE      record input for replay\n"
+            "  --replay FILE      replay an input log instead of running\n"
+            "  --lcd FILE         write the final screen as PBM\n"
+            "  --capture FILE     record every frame with LcdCapture\n"
+            "  --shm NAME         publish the screen to viewers through shared memory NAME\n"
+            "  --stats FILE       write the core counters of the run to FILE, - for stdout\n"
+            "  --rewind MS        time RunTimeSlice() with and without a rewind entry every MS instead of running\n"
+            "  --write-nor        write NOR changes back to the NOR image\n"
+            "\n"
+            "Input scripts have one event per line, at a guest time in ms from the start:\n"
+            "  MS down KEY | MS up KEY | MS tap KEY | MS release | MS type TEXT\n"
+            "KEY is a key ID such as 0x1d. Lines starting with # are ignored.\n",
+            name);
+}
+
+static bool ParseUint(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || parsed > UINT32_MAX) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+static bool LoadScript(const char *path, std::vector<Event> *events) {
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) {
+        fprintf(stderr, "Can't open input script %s.\n", path);
+        return false;
+    }
+    char line[512];
+    uint32_t lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != nullptr) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\0') {
+            continue;
+        }
+        char command[16];
+        unsigned ms;
+        int consumed = 0;
+        if (sscanf(text, "%u %15s %n", &ms, command, &consumed) != 2) {
+            ok = false;
+            break;
+        }
+        const char *arg = text + consumed;
+        Event event = {ms, EVENT_DOWN, 0, std::string()};
+        uint32_t key = 0;
+        bool needsKey = strcmp(command, "down") == 0 || strcmp(command, "up") == 0 || strcmp(command, "tap") == 0;
+        if (needsKey && (!ParseUint(arg, &key) || key > 0x3f)) {
+            ok = false;
+            break;
+        }
+        event.key = key;
+        if (strcmp(command, "down") == 0) {
+            events->push_back(event);
+        } else if (strcmp(command, "up") == 0) {
+            event.type = EVENT_UP;
+            events->push_back(event);
+        } else if (strcmp(command, "tap") == 0) {
+            events->push_back(event);
+            event.type = EVENT_UP;
+            event.ms += TAP_MS;
+            events->push_back(event);
+        } else if (strcmp(command, "release") == 0) {
+            event.type = EVENT_RELEASE_ALL;
+            events->push_back(event);
+        } else if (strcmp(command, "type") == 0) {
+            event.type = EVENT_TYPE;
+            event.text = arg;
+            events->push_back(event);
+        } else {
+            ok = false;
+        }
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s:%u: invalid event.\n", path, lineNumber);
+        return false;
+    }
+    std::stable_sort(events->begin(), events->end(), [](const Event &a, const Event &b) { return a.ms < b.ms; });
+    return true;
+}
+
+static bool ApplyEvent(const Event &event) {
+    switch (event.type) {
+    case EVENT_DOWN:
+        wqx::SetKey(event.key, true);
+        break;
+    case EVENT_UP:
+        wqx::SetKey(event.key, false);
+        break;
+    case EVENT_RELEASE_ALL:
+        wqx::ReleaseAllKeys();
+        break;
+    case EVENT_TYPE:
+        if (!wqx::TypeText(event.text.c_str())) {
+            fprintf(stderr, "Can't type \"%s\".\n", event.text.c_str());
+            return false;
+        }
+        break;
+    }
+    return true;
+}
+
+static bool ReadFile(const char *path, std::vector<uint8_t> *data) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint8_t buffer[0x10000];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+        data->insert(data->end(), buffer, buffer + size);
+    }
+    bool result = !ferror(file);
+    fclose(file);
+    return result;
+}
+
+static bool WriteLcd(const char *path) {
+    uint8_t lcd[1600];
+    if (!wqx::CopyLcdBuffer(lcd)) {
+        memset(lcd, 0, sizeof(lcd));
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    // PBM uses the same packing as the LCD buffer, MSB first with set bits drawn black.
+    fprintf(file, "P4\n160 80\n");
+    bool result = fwrite(lcd, 1, sizeof(lcd), file) == sizeof(lcd);
+    return fclose(file) == 0 && result;
+}
+
+static void PrintStats(uint32_t guestMs, uint64_t guestCycles, uint64_t hostUs) {
+    printf("guest: %u ms, %llu cycles\n", guestMs, static_cast<unsigned long long>(guestCycles));
+    if (hostUs == 0) {
+        hostUs = 1;
+    }
+    printf("host:  %.1f ms\n", hostUs / 1000.0);
+    printf("speed: %.0f%% of real time, %.2f MHz emulated, %.2f ns per guest cycle\n",
+           guestMs * 1000.0 * 100 / hostUs, static_cast<double>(guestCycles) / hostUs,
+           guestCycles != 0 ? hostUs * 1000.0 / guestCycles : 0.0);
+}
+
+// One counter per line, so dumps are easy to diff and to feed to other tools.
+static bool WriteStats(const char *path) {
+    wqx::machine_stats_t stats;
+    wqx::GetStats(&stats);
+    if (!stats.enabled) {
+        fprintf(stderr, "The core counters are not compiled in. Build with -Dstats=true.\n");
+        return false;
+    }
+    const struct {
+        const char *name;
+        uint64_t value;
+    } counters[] = {
+        {"instructions", stats.instructions},
+        {"cycles", stats.cycles},
+        {"irqs", stats.irqs},
+        {"bank_switches", stats.bank_switches},
+        {"volume_switches", stats.volume_switches},
+        {"zp40_swaps", stats.zp40_swaps},
+        {"flash_commands", stats.flash_commands},
+        {"page_loads", stats.page_loads},
+        {"store_slow", stats.store_slow},
+    };
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (file == nullptr) {
+        fprintf(stderr, "Can't write %s.\n", path);
+        return false;
+    }
+    for (const auto &counter : counters) {
+        fprintf(file, "%-16s %llu\n", counter.name, static_cast<unsigned long long>(counter.value));
+    }
+    if (file == stdout ? fflush(file) != 0 : fclose(file) != 0) {
+        fprintf(stderr, "Can't write %s.\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Runs the same guest time from the same snapshot with and without RewindBuffer capture and compares the host time.
+static bool RewindBench(const Options &options, wqx::PosixHal &hal) {
+    std::vector<uint8_t> start(wqx::GetSnapshotSize());
+    if (wqx::Snapshot(start.data(), start.size()) == 0) {
+        fprintf(stderr, "Can't take a snapshot.\n");
+        return false;
+    }
+    wqx::RewindBuffer rewind;
+    if (!rewind.begin(REWIND_CAPACITY, options.rewind, REWIND_KEYFRAME_INTERVAL)) {
+        fprintf(stderr, "Can't allocate the rewind buffer.\n");
+        return false;
+    }
+    uint32_t slice = options.slice != 0 ? options.slice : REWIND_SLICE_MS;
+    uint64_t bestUs[2] = {UINT64_MAX, UINT64_MAX};
+    uint64_t guestCycles = 0;
+    for (uint32_t round = 0; round < REWIND_ROUNDS; round++) {
+        for (int capture = 0; capture < 2; capture++) {
+            if (!wqx::Restore(start.data(), start.size())) {
+                fprintf(stderr, "Can't restore the snapshot.\n");
+                return false;
+            }
+            rewind.clear();
+            uint64_t startCycles = wqx::GetCycleCount();
+            uint64_t startUs = hal.getMonotonicMicros();
+            for (uint32_t doneMs = 0; doneMs < options.ms;) {
+                uint32_t step = std::min(slice, options.ms - doneMs);
+                wqx::RunTimeSlice(step, false);
+                if (capture) {
+                    rewind.tick();
+                }
+                doneMs += step;
+            }
+            uint64_t hostUs = hal.getMonotonicMicros() - startUs;
+            bestUs[capture] = std::min(bestUs[capture], hostUs);
+            guestCycles = wqx::GetCycleCount() - startCycles;
+        }
+    }
+
+    // The stats are those of the run without rewind.
+    PrintStats(options.ms, guestCycles, bestUs[0]);
+    uint64_t plainUs = std::max<uint64_t>(bestUs[0], 1);
+    printf("rewind: %.1f ms host, %.2f MHz emulated, %+.1f%% host time\n", bestUs[1] / 1000.0,
+           static_cast<double>(guestCycles) / std::max<uint64_t>(bestUs[1], 1),
+           (static_cast<double>(bestUs[1]) - plainUs) * 100 / plainUs);
+    printf("rewind: an entry every %u ms in %u ms slices, %zu entries, %zu bytes in the ring\n", options.rewind, slice,
+           rewind.count(), rewind.used());
+    return true;
+}
+
+static bool Replay(const Options &options) {
+    std::vector<uint8_t> log;
+    if (!ReadFile(options.replay, &log)) {
+        fprintf(stderr, "Can't read input log %s.\n", options.replay);
+        return false;
+    }
+    wqx::replay_result_t result = {};
+    bool ok = wqx::ReplayInputLog(log.data(), log.size(), &result);
+    if (!ok && !result.diverged) {
+        fprintf(stderr, "Invalid input log %s.\n", options.replay);
+        return false;
+    }
+    uint32_t guestMs = result.guest_cycles * 1000 / wqx::GetCpuSpeed();
+    PrintStats(guestMs, result.guest_cycles, result.host_us);
+    printf("replay: %u events, %u checkpoints", result.events, result.checkpoints);
+    if (result.diverged) {
+        printf(", diverged at cycle %llu\n", static_cast<unsigned long long>(result.diverged_cycle));
+    } else {
+        printf(", no divergence\n");
+    }
+    return ok;
+}
+
+struct Outputs {
+    wqx::LcdCapture capture;
+    wqx::SharedDisplay display;
+    bool frames = false;
+};
+
+static bool TickOutputs(void *context) {
+    Outputs *outputs = static_cast<Outputs *>(context);
+    // CopyLcdFrame() hands each frame out once, so every output gets the same copy.
+    uint8_t lcd[1600];
+    uint64_t cycle;
+    if (outputs->frames && wqx::CopyLcdFrame(lcd, &cycle)) {
+        outputs->capture.push(lcd, cycle);
+        outputs->display.push(lcd, cycle);
+    }
+    outputs->display.tick();
+    return false;
+}
+
+static bool Run(const Options &options, wqx::PosixHal &hal) {
+    std::vector<Event> events;
+    if (options.script != nullptr && !LoadScript(options.script, &events)) {
+        return false;
+    }
+    Outputs outputs;
+    if (options.capture != nullptr && !outputs.capture.begin(options.capture)) {
+        fprintf(stderr, "Can't create capture %s.\n", options.capture);
+        return false;
+    }
+    if (options.shm != nullptr && !outputs.display.begin(options.shm)) {
+        fprintf(stderr, "Can't create shared memory %s.\n", options.shm);
+        return false;
+    }
+    outputs.frames = options.capture != nullptr || options.shm != nullptr;
+    if (options.record != nullptr) {
+        hal.setInputLogPath(options.record);
+        if (!wqx::StartInputRecording(CHECKPOINT_MS)) {
+            fprintf(stderr, "Can't record input to %s.\n", options.record);
+            return false;
+        }
+    }
+
+    // Events land exactly on guest ms boundaries in both modes, so a script runs the same in either.
+    uint64_t startCycles = wqx::GetCycleCount();
+    uint64_t startUs = hal.getMonotonicMicros();
+    size_t next = 0;
+    uint32_t doneMs = 0;
+    bool ok = true;
+    while (ok && doneMs < options.ms) {
+        while (ok && next < events.size() && events[next].ms <= doneMs) {
+            ok = ApplyEvent(events[next++]);
+        }
+        uint32_t untilMs = options.ms;
+        if (next < events.size() && events[next].ms < untilMs) {
+            untilMs = events[next].ms;
+        }
+        if (options.slice != 0) {
+            uint32_t step = std::min(options.slice, untilMs - doneMs);
+            wqx::RunTimeSlice(step, false);
+            TickOutputs(&outputs);
+            doneMs += step;
+        } else {
+            wqx::RunTurbo(untilMs - doneMs, TickOutputs, &outputs, nullptr);
+            doneMs = untilMs;
+        }
+    }
+    uint64_t hostUs = hal.getMonotonicMicros() - startUs;
+    PrintStats(doneMs, wqx::GetCycleCount() - startCycles, hostUs);
+
+    if (options.record != nullptr) {
+        wqx::StopInputRecording();
+    }
+    if (options.capture != nullptr) {
+        outputs.capture.end();
+        printf("capture: %u frames written, %u dropped\n", outputs.capture.written(), outputs.capture.dropped());
+    }
+    if (options.shm != nullptr) {
+        printf("shm: %u frames published\n", outputs.display.published());
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPT_ROM = 0x100, OPT_NOR, OPT_BBS, OPT_MS, OPT_SLICE, OPT_SPEED, OPT_STATE, OPT_BOOT, OPT_BOOT_CACHE,
+        OPT_INPUT, OPT_RECORD, OPT_REPLAY, OPT_LCD, OPT_CAPTURE, OPT_SHM, OPT_STATS, OPT_REWIND, OPT_WRITE_NOR,
+        OPT_HELP,
+    };
+    static const struct option longOptions[] = {
+        {"rom", required_argument, nullptr, OPT_ROM},
+        {"nor", required_argument, nullptr, OPT_NOR},
+        {"bbs", required_argument, nullptr, OPT_BBS},
+        {"ms", required_argument, nullptr, OPT_MS},
+        {"slice", required_argument, nullptr, OPT_SLICE},
+        {"speed", required_argument, nullptr, OPT_SPEED},
+        {"state", required_argument, nullptr, OPT_STATE},
+        {"boot", required_argument, nullptr, OPT_BOOT},
+        {"boot-cache", required_argument, nullptr, OPT_BOOT_CACHE},
+        {"input", required_argument, nullptr, OPT_INPUT},
+        {"record", required_argument, nullptr, OPT_RECORD},
+        {"replay", required_argument, nullptr, OPT_REPLAY},
+        {"lcd", required_argument, nullptr, OPT_LCD},
+        {"capture", required_argument, nullptr, OPT_CAPTURE},
+        {"shm", required_argument, nullptr, OPT_SHM},
+        {"stats", required_argument, nullptr, OPT_STATS},
+        {"rewind", required_argument, nullptr, OPT_REWIND},
+        {"write-nor", no_argument, nullptr, OPT_WRITE_NOR},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Options options;
+    int opt;
+    bool valid = true;
+    while (valid && (opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case OPT_ROM: options.rom = optarg; break;
+        case OPT_NOR: options.nor = optarg; break;
+        case OPT_BBS: options.bbs = optarg; break;
+        case OPT_MS: valid = ParseUint(optarg, &options.ms); break;
+        case OPT_SLICE: valid = ParseUint(optarg, &options.slice); break;
+        case OPT_SPEED: valid = ParseUint(optarg, &options.speed); break;
+        case OPT_STATE: options.state = optarg; break;
+        case OPT_BOOT: valid = ParseUint(optarg, &options.boot); break;
+        case OPT_BOOT_CACHE: options.bootCache = optarg; break;
+        case OPT_INPUT: options.script = optarg; break;
+        case OPT_RECORD: options.record = optarg; break;
+        case OPT_REPLAY: options.replay = optarg; break;
+        case OPT_LCD: options.lcd = optarg; break;
+        case OPT_CAPTURE: options.capture = optarg; break;
+        case OPT_SHM: options.shm = optarg; break;
+        case OPT_STATS: options.stats = optarg; break;
+        case OPT_REWIND: valid = ParseUint(optarg, &options.rewind) && options.rewind != 0; break;
+        case OPT_WRITE_NOR: options.writeNor = true; break;
+        default: valid = false; break;
+        }
+    }
+    if (!valid || optind != argc) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    wqx::PosixHal hal;
+    if (!hal.open(options.rom, options.nor, options.bbs)) {
+        fprintf(stderr, "Can't load %s, %s and %s.\n", options.rom, options.nor, options.bbs);
+        return 1;
+    }
+    hal.setNorWriteBack(options.writeNor);
+    hal.setStatePath(options.state);
+    hal.setBootCachePath(options.bootCache);
+
+    wqx::Initialize(&hal, options.speed);
+    bool ok;
+    if (options.replay != nullptr) {
+        wqx::ResetStats();
+        ok = Replay(options);
+    } else {
+        if (options.state == nullptr || !wqx::LoadNC1020()) {
+            if (options.boot != 0) {
+                wqx::BootNC1020(options.boot);
+            } else {
+                wqx::Reset();
+            }
+        }
+        // Only count the run itself, not the boot.
+        wqx::ResetStats();
+        ok = options.rewind != 0 ? RewindBench(options, hal) : Run(options, hal);
+        if (options.state != nullptr && !wqx::SaveNC1020()) {
+            fprintf(stderr, "Can't save the state to %s.\n", options.state);
+            ok = false;
+        }
+    }
+    if (options.stats != nullptr && !WriteStats(options.stats)) {
+        ok = false;
+    }
+    if (options.lcd != nullptr && !WriteLcd(options.lcd)) {
+        fprintf(stderr, "Can't write %s.\n", options.lcd);
+        ok = false;
+    }
+    if (!hal.close()) {
+        fprintf(stderr, "Can't write back %s.\n", options.nor);
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#include "nc1020_scheduler.h"
+#include <chrono>
+
+namespace wqx {
+
+enum {
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_SLEEPING,
+    TASK_DONE,
+};
+enum {
+    CLASS_INTERACTIVE,
+    CLASS_BATCH,
+};
+
+// Longest idle sleep. Only bounds how long stop() waits, since every other event signals idle workers.
+static const uint64_t MAX_IDLE_US = 100000;
+
+static inline uint64_t TaskWord(uint64_t generation, uint32_t state) {
+    return generation << 2 | state;
+}
+
+static inline uint32_t TaskState(uint64_t word) {
+    return word & 3;
+}
+
+SchedulerTask::SchedulerTask() : word(TaskWord(0, TASK_READY)), pending(false), interactive(false), home(0),
+                                 slices(0), steals(0), lateUs(0), maxLateUs(0) {}
+
+SchedulerTask::~SchedulerTask() {}
+
+void SchedulerTask::setInteractive(bool interactive) {
+    this->interactive.store(interactive, std::memory_order_relaxed);
+}
+
+bool SchedulerTask::isInteractive() const {
+    return interactive.load(std::memory_order_relaxed);
+}
+
+void SchedulerTask::getSchedulerStats(scheduler_task_stats_t *stats) const {
+    stats->slices = slices.load(std::memory_order_relaxed);
+    stats->steals = steals.load(std::memory_order_relaxed);
+    stats->worker = home.load(std::memory_order_relaxed);
+    stats->late_us = lateUs.load(std::memory_order_relaxed);
+    stats->max_late_us = maxLateUs.load(std::memory_order_relaxed);
+}
+
+Scheduler::Scheduler() : stopping(false), nextHome(0), stealCount(0), signals(0) {}
+
+Scheduler::~Scheduler() {
+    stop();
+}
+
+uint64_t Scheduler::NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Scheduler::start(uint32_t threads) {
+    stop();
+    stopping = false;
+    for (uint32_t i = 0; i < threads; i++) {
+        workers.emplace_back(new Worker());
+        workers.back()->nextDueUs = UINT64_MAX;
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&Scheduler::work, this, i);
+    }
+}
+
+void Scheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        stopping = true;
+        signals++;
+    }
+    idleReady.notify_all();
+    for (std::unique_ptr<Worker> &worker : workers) {
+        worker->thread.join();
+    }
+    workers.clear();
+}
+
+uint32_t Scheduler::getThreadCount() const {
+    return workers.size();
+}
+
+uint64_t Scheduler::getStealCount() const {
+    return stealCount.load(std::memory_order_relaxed);
+}
+
+void Scheduler::add(const std::shared_ptr<SchedulerTask> &task) {
+    task->home = nextHome.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    task->word = TaskWord(0, TASK_READY);
+    pushReady(task, NowUs());
+}
+
+void Scheduler::wake(const std::shared_ptr<SchedulerTask> &task) {
+    // The runner checks pending after it goes to sleep, so either it or this call sees the other.
+    task->pending = true;
+    uint64_t word = task->word.load();
+    if (TaskState(word) == TASK_SLEEPING && task->word.compare_exchange_strong(word, TaskWord(word >> 2, TASK_READY))) {
+        pushReady(task, NowUs());
+    }
+}
+
+void Scheduler::pushReady(const std::shared_ptr<SchedulerTask> &task, uint64_t dueUs) {
+    Worker &worker = *workers[task->home.load(std::memory_order_relaxed)];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.ready[task->isInteractive() ? CLASS_INTERACTIVE : CLASS_BATCH].push_back({task, dueUs});
+    }
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        signals++;
+    }
+    idleReady.notify_one();
+}
+
+// Moves the timers that are due to the ready deques. Called with the worker locked.
+void Scheduler::promote(Worker &worker, uint64_t nowUs) {
+    if (worker.nextDueUs.load(std::memory_order_relaxed) > nowUs) {
+        return;
+    }
+    while (!worker.timers.empty() && worker.timers.top().dueUs <= nowUs) {
+        Timer timer = worker.timers.top();
+        worker.timers.pop();
+        uint64_t word = TaskWord(timer.generation, TASK_SLEEPING);
+        // Fails when the task was woken since, which leaves a stale timer behind.
+        if (timer.task->word.compare_exchange_strong(word, TaskWord(timer.generation, TASK_READY))) {
+            worker.ready[timer.task->isInteractive() ? CLASS_INTERACTIVE : CLASS_BATCH].push_back(
+                {std::move(timer.task), timer.dueUs});
+        }
+    }
+    worker.nextDueUs = worker.timers.empty() ? UINT64_MAX : worker.timers.top().dueUs;
+}
+
+// Takes a ready task of a class from a worker. Owners take the oldest task, thieves the newest.
+bool Scheduler::take(uint32_t index, uint32_t victim, int type, uint64_t nowUs, Ready *ready) {
+    Worker &worker = *workers[victim];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    promote(worker, nowUs);
+    std::deque<Ready> &queue = worker.ready[type];
+    if (queue.empty()) {
+        return false;
+    }
+    if (victim == index) {
+        *ready = std::move(queue.front());
+        queue.pop_front();
+    } else {
+        *ready = std::move(queue.back());
+        queue.pop_back();
+        ready->task->home = index;
+        ready->task->steals.fetch_add(1, std::memory_order_relaxed);
+        stealCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void Scheduler::work(uint32_t index) {
+    uint32_t count = workers.size();
+    while (!stopping) {
+        uint64_t seen;
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            seen = signals;
+        }
+        uint64_t nowUs = NowUs();
+        Ready ready;
+        bool found = false;
+        for (int type = CLASS_INTERACTIVE; !found && type <= CLASS_BATCH; type++) {
+            for (uint32_t i = 0; !found && i < count; i++) {
+                found = take(index, (index + i) % count, type, nowUs, &ready);
+            }
+        }
+        if (found) {
+            runSlice(index, ready, nowUs);
+        } else {
+            idle(seen);
+        }
+    }
+}
+
+void Scheduler::runSlice(uint32_t index, Ready &ready, uint64_t nowUs) {
+    SchedulerTask &task = *ready.task;
+    uint64_t generation = task.word.load() >> 2;
+    task.word = TaskWord(generation, TASK_RUNNING);
+    task.pending = false;
+    uint64_t late = nowUs > ready.dueUs ? nowUs - ready.dueUs : 0;
+    task.lateUs.store(late, std::memory_order_relaxed);
+    if (late > task.maxLateUs.load(std::memory_order_relaxed)) {
+        task.maxLateUs.store(late, std::memory_order_relaxed);
+    }
+    task.slices.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t dueUs = task.run(nowUs);
+    if (dueUs == SchedulerTask::DONE) {
+        task.word = TaskWord(generation, TASK_DONE);
+        return;
+    }
+    nowUs = NowUs();
+    if (task.pending.exchange(false) || (dueUs != 0 && dueUs <= nowUs)) {
+        task.word = TaskWord(generation, TASK_READY);
+        pushReady(ready.task, dueUs != 0 && dueUs <= nowUs ? dueUs : nowUs);
+        return;
+    }
+
+    generation++;
+    task.word = TaskWord(generation, TASK_SLEEPING);
+    bool earliest = false;
+    if (dueUs != 0) {
+        earliest = dueUs < earliestDue();
+        Worker &worker = *workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.timers.push({dueUs, generation, ready.task});
+        if (dueUs < worker.nextDueUs.load(std::memory_order_relaxed)) {
+            worker.nextDueUs = dueUs;
+        }
+    }
+    if (task.pending.load()) {
+        wake(ready.task);
+    }
+    if (earliest) {
+        // Idle workers are sleeping past the new due time.
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            signals++;
+        }
+        idleReady.notify_one();
+    }
+}
+
+uint64_t Scheduler::earliestDue() {
+    uint64_t dueUs = UINT64_MAX;
+    for (std::unique_ptr<Worker> &worker : workers) {
+        uint64_t next = worker->nextDueUs.load(std::memory_order_relaxed);
+        dueUs = next < dueUs ? next : dueUs;
+    }
+    return dueUs;
+}
+
+void Scheduler::idle(uint64_t seen) {
+    uint64_t dueUs = earliestDue();
+    uint64_t nowUs = NowUs();
+    uint64_t waitUs = dueUs <= nowUs ? 0 : dueUs - nowUs;
+    if (waitUs == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(idleMutex);
+    idleReady.wait_for(lock, std::chrono::microseconds(waitUs < MAX_IDLE_US ? waitUs : MAX_IDLE_US),
+                       [this, seen] { return stopping || signals != seen; });
+}
+
+}
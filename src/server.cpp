@@ -0,0 +1,734 @@
+// Hosts many emulator sessions in one process and serves them over a Unix domain socket. See nc1020_server.h for the
+// protocol.
+
+#include "libnc1020.h"
+#include "nc1020_scheduler.h"
+#include "nc1020_server.h"
+#include <atomic>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using wqx::server_message_t;
+
+// Long runs are split so that one busy session can't hold a worker while others wait.
+static const uint32_t RUN_SLICE_MS = 100;
+// Requests a worker executes on a session before giving the other sessions a turn.
+static const uint32_t SESSION_BATCH = 16;
+// Guest time real-time sessions run per slice, and the most they catch up in one slice when behind.
+static const uint32_t REALTIME_SLICE_MS = 20;
+static const uint32_t REALTIME_CATCH_UP_SLICES = 4;
+// Sessions stay interactive this long after their last input or screen request.
+static const uint64_t INTERACTIVE_US = 1000000;
+// How often a session waiting for an image page checks whether the kernel has read it.
+static const uint64_t PAGE_POLL_US = 200;
+static const uint32_t LCD_SIZE = 1600;
+// Responses a connection may have waiting before the client is considered gone.
+static const size_t OUTPUT_LIMIT = 64 << 20;
+
+struct Options {
+    const char *rom = "rom.bin";
+    const char *nor = "nor.bin";
+    const char *bbs = "bbs.bin";
+    const char *socket = "nc1020.sock";
+    uint32_t threads = 0;
+    uint32_t maxSessions = 1024;
+    bool asyncPages = false;
+};
+
+// Workers only queue responses. The socket thread sends them when the socket has room, so a client that stops
+// reading never holds up a worker.
+struct Connection {
+    int fd;
+    std::vector<uint8_t> input;
+    std::mutex outputMutex;
+    std::vector<uint8_t> output;
+    // Set once the responses can't be delivered. Later ones are dropped.
+    bool broken = false;
+    // Only used by the socket thread.
+    bool readClosed = false;
+
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() {
+        close(fd);
+    }
+};
+
+struct Request {
+    std::shared_ptr<Connection> connection;
+    server_message_t header;
+    std::vector<uint8_t> payload;
+    // Guest time left to run for SERVER_OP_RUN, in cycles with asynchronous page loads, since slices may end early.
+    uint32_t runMs;
+    uint64_t runCycles;
+};
+
+class Server;
+
+// The scheduler runs a session on one worker at a time, which keeps its requests in order without locking the
+// machine. Only the request queue is shared with the socket thread.
+struct Session : public wqx::SchedulerTask, public std::enable_shared_from_this<Session> {
+    Server &server;
+    uint32_t id = 0;
+    nc1020_t *machine = nullptr;
+    uint8_t lastLcd[LCD_SIZE] = {};
+    std::atomic<uint64_t> lastInputUs{0};
+    // Real-time sessions run on their own, keeping guest time in step with host time from baseUs and baseCycles.
+    bool realtime = false;
+    uint64_t baseUs = 0;
+    uint64_t baseCycles = 0;
+    uint64_t lagUs = 0;
+    uint64_t maxLagUs = 0;
+    std::mutex mutex;
+    std::deque<Request> requests;
+    bool destroyed = false;
+
+    explicit Session(Server &server) : server(server) {}
+    ~Session() {
+        nc1020_destroy(machine);
+    }
+    virtual uint64_t run(uint64_t nowUs) override;
+};
+
+static volatile sig_atomic_t stopRequested;
+
+static void OnSignal(int signal) {
+    (void) signal;
+    stopRequested = 1;
+}
+
+static bool ParseUint(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || parsed > UINT32_MAX) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+static uint32_t ReadU32(const std::vector<uint8_t> &payload) {
+    uint32_t value;
+    memcpy(&value, payload.data(), sizeof(value));
+    return value;
+}
+
+class Server {
+public:
+    Server(const Options &options, int wakeFd) : options(options), wakeFd(wakeFd) {}
+
+    void start(uint32_t threads) {
+        scheduler.start(threads);
+    }
+
+    void stop() {
+        scheduler.stop();
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        sessions.clear();
+    }
+
+    // Called by the socket thread for each complete request.
+    void dispatch(const std::shared_ptr<Connection> &connection, const server_message_t &header,
+                  std::vector<uint8_t> &&payload) {
+        Request request;
+        request.connection = connection;
+        request.header = header;
+        request.payload = std::move(payload);
+        request.runMs = 0;
+        request.runCycles = 0;
+        if (header.op == wqx::SERVER_OP_INFO) {
+            uint32_t info[2] = {scheduler.getThreadCount(), 0};
+            {
+                std::lock_guard<std::mutex> lock(sessionsMutex);
+                info[1] = sessions.size();
+            }
+            reply(request, wqx::SERVER_OK, info, sizeof(info));
+            return;
+        }
+        if (header.op == wqx::SERVER_OP_CREATE) {
+            // Creating maps the images and resets the guest, which is too slow for the socket thread.
+            std::shared_ptr<Session> session = std::make_shared<Session>(*this);
+            session->requests.push_back(std::move(request));
+            session->lastInputUs = wqx::Scheduler::NowUs();
+            session->setInteractive(true);
+            scheduler.add(session);
+            return;
+        }
+        std::shared_ptr<Session> session = find(header.session);
+        if (!session) {
+            reply(request, wqx::SERVER_ERROR_NO_SESSION, nullptr, 0);
+            return;
+        }
+        if (header.op != wqx::SERVER_OP_RUN && header.op != wqx::SERVER_OP_SNAPSHOT &&
+            header.op != wqx::SERVER_OP_RESTORE) {
+            // Someone is waiting on the screen.
+            session->lastInputUs = wqx::Scheduler::NowUs();
+            session->setInteractive(true);
+        }
+        bool destroyed;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            destroyed = session->destroyed;
+            if (!destroyed) {
+                session->requests.push_back(std::move(request));
+            }
+        }
+        if (destroyed) {
+            reply(request, wqx::SERVER_ERROR_NO_SESSION, nullptr, 0);
+            return;
+        }
+        scheduler.wake(session);
+    }
+
+    uint64_t runSession(Session &session, uint64_t nowUs) {
+        for (uint32_t i = 0; i < SESSION_BATCH; i++) {
+            Request request;
+            {
+                std::lock_guard<std::mutex> lock(session.mutex);
+                if (session.requests.empty()) {
+                    break;
+                }
+                request = std::move(session.requests.front());
+                session.requests.pop_front();
+            }
+            if (!execute(session, request)) {
+                // Give the other sessions a turn before the rest of the run.
+                std::lock_guard<std::mutex> lock(session.mutex);
+                session.requests.push_front(std::move(request));
+                return nc1020_waiting_for_page(session.machine) ? nowUs + PAGE_POLL_US : nowUs;
+            }
+            if (session.machine == nullptr) {
+                return wqx::SchedulerTask::DONE;
+            }
+        }
+        if (session.isInteractive() && nowUs - session.lastInputUs > INTERACTIVE_US) {
+            session.setInteractive(false);
+        }
+        uint64_t dueUs = session.realtime ? pace(session, nowUs) : 0;
+        {
+            std::lock_guard<std::mutex> lock(session.mutex);
+            if (!session.requests.empty()) {
+                dueUs = nowUs;
+            }
+        }
+        if (dueUs != 0 && nc1020_waiting_for_page(session.machine)) {
+            // Other sessions get the worker while the kernel reads the page.
+            return nowUs + PAGE_POLL_US;
+        }
+        return dueUs;
+    }
+
+private:
+    const Options &options;
+    // Written to when a connection gets its first queued response, to wake up the socket thread.
+    int wakeFd;
+    wqx::Scheduler scheduler;
+    std::mutex sessionsMutex;
+    std::unordered_map<uint32_t, std::shared_ptr<Session>> sessions;
+    // Sessions still being created. They count towards maxSessions so that concurrent creates can't overshoot it.
+    uint32_t pendingCreates = 0;
+    uint32_t nextId = 1;
+
+    std::shared_ptr<Session> find(uint32_t id) {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        auto it = sessions.find(id);
+        return it == sessions.end() ? nullptr : it->second;
+    }
+
+    void reply(const Request &request, uint8_t status, const void *payload, uint32_t size) {
+        server_message_t header = request.header;
+        header.size = size;
+        header.status = status;
+        header.reserved = 0;
+        Connection &connection = *request.connection;
+        bool wake;
+        {
+            // Responses from different workers must not interleave on the stream.
+            std::lock_guard<std::mutex> lock(connection.outputMutex);
+            if (connection.broken) {
+                return;
+            }
+            if (connection.output.size() + sizeof(header) + size > OUTPUT_LIMIT) {
+                connection.broken = true;
+                connection.output.clear();
+            } else {
+                const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+                connection.output.insert(connection.output.end(), bytes, bytes + sizeof(header));
+                bytes = static_cast<const uint8_t *>(payload);
+                connection.output.insert(connection.output.end(), bytes, bytes + size);
+            }
+            wake = connection.broken || connection.output.size() == sizeof(header) + size;
+        }
+        if (wake) {
+            uint8_t byte = 0;
+            // Only fails when the pipe is full, which wakes the socket thread just the same.
+            ssize_t written = write(wakeFd, &byte, sizeof(byte));
+            (void) written;
+        }
+    }
+
+    // Returns false when the request isn't finished yet.
+    bool execute(Session &session, Request &request) {
+        const server_message_t &header = request.header;
+        const std::vector<uint8_t> &payload = request.payload;
+        if (header.op == wqx::SERVER_OP_CREATE) {
+            create(session, request);
+            return true;
+        }
+        switch (header.op) {
+        case wqx::SERVER_OP_DESTROY:
+            destroy(session);
+            reply(request, wqx::SERVER_OK, nullptr, 0);
+            break;
+        case wqx::SERVER_OP_KEY:
+            if (payload.size() != 2 || payload[0] > 0x3f) {
+                reply(request, wqx::SERVER_ERROR_INVALID, nullptr, 0);
+                break;
+            }
+            nc1020_set_key(session.machine, payload[0], payload[1]);
+            reply(request, wqx::SERVER_OK, nullptr, 0);
+            break;
+        case wqx::SERVER_OP_RELEASE_ALL:
+            nc1020_release_all_keys(session.machine);
+            reply(request, wqx::SERVER_OK, nullptr, 0);
+            break;
+        case wqx::SERVER_OP_TYPE: {
+            std::string text(payload.begin(), payload.end());
+            bool ok = text.find('\0') == std::string::npos && nc1020_type_text(session.machine, text.c_str());
+            reply(request, ok ? wqx::SERVER_OK : wqx::SERVER_ERROR_INVALID, nullptr, 0);
+            break;
+        }
+        case wqx::SERVER_OP_RUN: {
+            if (payload.size() != 4) {
+                reply(request, wqx::SERVER_ERROR_INVALID, nullptr, 0);
+                break;
+            }
+            if (!runSlice(session, request)) {
+                return false;
+            }
+            nc1020_stats_t stats;
+            nc1020_get_stats(session.machine, &stats);
+            rebase(session, wqx::Scheduler::NowUs());
+            reply(request, wqx::SERVER_OK, &stats.cycles, sizeof(stats.cycles));
+            break;
+        }
+        case wqx::SERVER_OP_LCD_DIFF:
+            lcdDiff(session, request);
+            break;
+        case wqx::SERVER_OP_SNAPSHOT: {
+            std::vector<uint8_t> snapshot(nc1020_snapshot_size(session.machine));
+            size_t size = nc1020_snapshot(session.machine, snapshot.data(), snapshot.size());
+            if (size == 0 || size > wqx::SERVER_MAX_PAYLOAD) {
+                reply(request, wqx::SERVER_ERROR_FAILED, nullptr, 0);
+                break;
+            }
+            reply(request, wqx::SERVER_OK, snapshot.data(), size);
+            break;
+        }
+        case wqx::SERVER_OP_RESTORE:
+            if (!nc1020_restore(session.machine, payload.data(), payload.size())) {
+                reply(request, wqx::SERVER_ERROR_INVALID, nullptr, 0);
+                break;
+            }
+            rebase(session, wqx::Scheduler::NowUs());
+            reply(request, wqx::SERVER_OK, nullptr, 0);
+            break;
+        case wqx::SERVER_OP_STATS:
+            sessionStats(session, request);
+            break;
+        default:
+            reply(request, wqx::SERVER_ERROR_INVALID, nullptr, 0);
+            break;
+        }
+        return true;
+    }
+
+    // Runs one slice of a SERVER_OP_RUN request. Returns false when there is more to run.
+    bool runSlice(Session &session, Request &request) {
+        if (!options.asyncPages) {
+            if (request.runMs == 0) {
+                request.runMs = ReadU32(request.payload);
+            }
+            uint32_t ms = request.runMs < RUN_SLICE_MS ? request.runMs : RUN_SLICE_MS;
+            nc1020_run_ms(session.machine, ms);
+            request.runMs -= ms;
+            return request.runMs == 0;
+        }
+        nc1020_stats_t stats;
+        nc1020_get_stats(session.machine, &stats);
+        if (request.runCycles == 0) {
+            request.runCycles = static_cast<uint64_t>(ReadU32(request.payload)) * stats.cpu_speed / 1000;
+        }
+        uint64_t slice = static_cast<uint64_t>(stats.cpu_speed) * RUN_SLICE_MS / 1000;
+        uint64_t done = nc1020_run_cycles(session.machine, request.runCycles < slice ? request.runCycles : slice);
+        request.runCycles -= done < request.runCycles ? done : request.runCycles;
+        return request.runCycles == 0;
+    }
+
+    void create(Session &session, Request &request) {
+        nc1020_config_t config = {options.rom, options.nor, options.bbs, 0, 0, options.asyncPages};
+        const std::vector<uint8_t> &payload = request.payload;
+        if (payload.size() != 0 && payload.size() != 4 && payload.size() != 8) {
+            reply(request, wqx::SERVER_ERROR_INVALID, nullptr, 0);
+            return;
+        }
+        if (payload.size() >= 4) {
+            config.cpu_speed = ReadU32(payload);
+        }
+        if (payload.size() == 8) {
+            uint32_t flags;
+            memcpy(&flags, &payload[4], sizeof(flags));
+            session.realtime = (flags & wqx::SERVER_CREATE_REALTIME) != 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sessionsMutex);
+            if (sessions.size() + pendingCreates >= options.maxSessions) {
+                reply(request, wqx::SERVER_ERROR_FAILED, nullptr, 0);
+                return;
+            }
+            pendingCreates++;
+        }
+        session.machine = nc1020_create(&config);
+        if (session.machine == nullptr) {
+            {
+                std::lock_guard<std::mutex> lock(sessionsMutex);
+                pendingCreates--;
+            }
+            reply(request, wqx::SERVER_ERROR_FAILED, nullptr, 0);
+            return;
+        }
+        rebase(session, wqx::Scheduler::NowUs());
+        {
+            std::lock_guard<std::mutex> lock(sessionsMutex);
+            pendingCreates--;
+            session.id = nextId++;
+            sessions[session.id] = session.shared_from_this();
+        }
+        request.header.session = session.id;
+        reply(request, wqx::SERVER_OK, nullptr, 0);
+    }
+
+    // Requests that arrive later are answered by dispatch().
+    void destroy(Session &session) {
+        std::deque<Request> requests;
+        {
+            std::lock_guard<std::mutex> lock(session.mutex);
+            session.destroyed = true;
+            requests.swap(session.requests);
+        }
+        {
+            std::lock_guard<std::mutex> lock(sessionsMutex);
+            sessions.erase(session.id);
+        }
+        nc1020_destroy(session.machine);
+        session.machine = nullptr;
+        for (const Request &request : requests) {
+            reply(request, wqx::SERVER_ERROR_NO_SESSION, nullptr, 0);
+        }
+    }
+
+    static void rebase(Session &session, uint64_t nowUs) {
+        nc1020_stats_t stats;
+        nc1020_get_stats(session.machine, &stats);
+        session.baseUs = nowUs;
+        session.baseCycles = stats.cycles;
+    }
+
+    // Runs a real-time session up to the current host time and returns when its next slice is due.
+    static uint64_t pace(Session &session, uint64_t nowUs) {
+        nc1020_stats_t stats;
+        nc1020_get_stats(session.machine, &stats);
+        uint64_t speed = stats.cpu_speed;
+        // The base may have been set after this slice started.
+        uint64_t elapsedUs = nowUs > session.baseUs ? nowUs - session.baseUs : 0;
+        uint64_t target = session.baseCycles + elapsedUs * speed / 1000000;
+        uint64_t sliceCycles = speed * REALTIME_SLICE_MS / 1000;
+        uint64_t cycles = stats.cycles;
+        if (target > cycles) {
+            uint64_t behind = target - cycles;
+            uint64_t limit = sliceCycles * REALTIME_CATCH_UP_SLICES;
+            cycles += nc1020_run_cycles(session.machine, behind < limit ? behind : limit);
+        }
+        session.lagUs = target > cycles ? (target - cycles) * 1000000 / speed : 0;
+        if (session.lagUs > session.maxLagUs) {
+            session.maxLagUs = session.lagUs;
+        }
+        // Due once a whole slice of guest time is ahead of the guest, or right away when lagging.
+        return session.baseUs + (cycles + sliceCycles - session.baseCycles) * 1000000 / speed;
+    }
+
+    void sessionStats(Session &session, const Request &request) {
+        wqx::scheduler_task_stats_t scheduling;
+        session.getSchedulerStats(&scheduling);
+        nc1020_stats_t stats;
+        nc1020_get_stats(session.machine, &stats);
+        wqx::server_session_stats_t result = {};
+        result.cycles = stats.cycles;
+        result.lag_us = session.lagUs;
+        result.max_lag_us = session.maxLagUs;
+        result.late_us = scheduling.late_us;
+        result.max_late_us = scheduling.max_late_us;
+        result.slices = scheduling.slices;
+        result.steals = scheduling.steals;
+        result.worker = scheduling.worker;
+        result.flags = (session.realtime ? wqx::SERVER_SESSION_REALTIME : 0) |
+                       (session.isInteractive() ? wqx::SERVER_SESSION_INTERACTIVE : 0) |
+                       (nc1020_waiting_for_page(session.machine) ? wqx::SERVER_SESSION_WAITING_PAGE : 0);
+        reply(request, wqx::SERVER_OK, &result, sizeof(result));
+    }
+
+    void lcdDiff(Session &session, const Request &request) {
+        uint8_t diff[wqx::SERVER_LCD_MASK_SIZE + LCD_SIZE] = {};
+        uint32_t size = wqx::SERVER_LCD_MASK_SIZE;
+        const uint8_t *lcd = nc1020_lcd(session.machine);
+        static const uint8_t blank[LCD_SIZE] = {};
+        if (lcd == nullptr) {
+            lcd = blank;
+        }
+        for (uint32_t row = 0; row < 80; row++) {
+            const uint8_t *line = &lcd[row * wqx::SERVER_LCD_ROW_SIZE];
+            uint8_t *last = &session.lastLcd[row * wqx::SERVER_LCD_ROW_SIZE];
+            if (memcmp(line, last, wqx::SERVER_LCD_ROW_SIZE) == 0) {
+                continue;
+            }
+            memcpy(last, line, wqx::SERVER_LCD_ROW_SIZE);
+            memcpy(&diff[size], line, wqx::SERVER_LCD_ROW_SIZE);
+            size += wqx::SERVER_LCD_ROW_SIZE;
+            diff[row / 8] |= 1 << (row % 8);
+        }
+        reply(request, wqx::SERVER_OK, diff, size);
+    }
+};
+
+uint64_t Session::run(uint64_t nowUs) {
+    return server.runSession(*this, nowUs);
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --rom FILE          ROM image (default rom.bin)\n"
+            "  --nor FILE          NOR flash image (default nor.bin)\n"
+            "  --bbs FILE          BBS image (default bbs.bin)\n"
+            "  --socket PATH       Unix domain socket to listen on (default nc1020.sock)\n"
+            "  --threads N         emulation threads (default one per CPU)\n"
+            "  --max-sessions N    session limit (default 1024)\n"
+            "  --async-pages       read image pages in the background instead of stalling a thread\n"
+            "\n"
+            "NOR changes are never written back. See include/nc1020_server.h for the protocol.\n",
+            name);
+}
+
+static int Listen(const char *path) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Splits the bytes received on a connection into requests. Returns false when the stream is invalid.
+static bool Receive(Server &server, const std::shared_ptr<Connection> &connection) {
+    std::vector<uint8_t> &input = connection->input;
+    size_t offset = 0;
+    while (input.size() - offset >= sizeof(server_message_t)) {
+        server_message_t header;
+        memcpy(&header, &input[offset], sizeof(header));
+        if (header.size > wqx::SERVER_MAX_PAYLOAD) {
+            return false;
+        }
+        if (input.size() - offset - sizeof(header) < header.size) {
+            break;
+        }
+        const uint8_t *payload = &input[offset + sizeof(header)];
+        server.dispatch(connection, header, std::vector<uint8_t>(payload, payload + header.size));
+        offset += sizeof(header) + header.size;
+    }
+    input.erase(input.begin(), input.begin() + offset);
+    return true;
+}
+
+// Sends queued responses until the socket is full. Returns false when the connection can't take any more.
+static bool Flush(Connection &connection) {
+    std::lock_guard<std::mutex> lock(connection.outputMutex);
+    size_t sent = 0;
+    while (!connection.broken && sent < connection.output.size()) {
+        ssize_t size = send(connection.fd, &connection.output[sent], connection.output.size() - sent, MSG_NOSIGNAL);
+        if (size >= 0) {
+            sent += size;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            connection.broken = true;
+            connection.output.clear();
+        }
+    }
+    if (!connection.broken) {
+        connection.output.erase(connection.output.begin(), connection.output.begin() + sent);
+    }
+    return !connection.broken;
+}
+
+static bool HasOutput(Connection &connection) {
+    std::lock_guard<std::mutex> lock(connection.outputMutex);
+    return !connection.output.empty() || connection.broken;
+}
+
+static void Serve(Server &server, int listener, int wakeFd) {
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<struct pollfd> fds;
+    std::vector<uint8_t> buffer(0x10000);
+    while (!stopRequested) {
+        fds.assign({{listener, POLLIN, 0}, {wakeFd, POLLIN, 0}});
+        for (const std::shared_ptr<Connection> &connection : connections) {
+            short events = (connection->readClosed ? 0 : POLLIN) | (HasOutput(*connection) ? POLLOUT : 0);
+            // Closed connections only wait for their last responses, and would report POLLHUP all the time.
+            fds.push_back({events != 0 ? connection->fd : -1, events, 0});
+        }
+        // Wake up now and then to notice signals.
+        if (poll(fds.data(), fds.size(), 200) < 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            while (read(wakeFd, buffer.data(), buffer.size()) > 0) {
+            }
+        }
+        // Walk backwards so that closed connections can be removed in place.
+        for (size_t i = connections.size(); i-- > 0;) {
+            Connection &connection = *connections[i];
+            short revents = fds[i + 2].revents;
+            bool ok = (revents & POLLOUT) == 0 || Flush(connection);
+            if (ok && (revents & (POLLIN | POLLHUP | POLLERR)) != 0 && !connection.readClosed) {
+                ssize_t size = recv(connection.fd, buffer.data(), buffer.size(), 0);
+                bool open;
+                if (size > 0) {
+                    connection.input.insert(connection.input.end(), buffer.begin(), buffer.begin() + size);
+                    open = Receive(server, connections[i]);
+                } else {
+                    open = size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+                }
+                if (!open) {
+                    shutdown(connection.fd, SHUT_RD);
+                    connection.readClosed = true;
+                }
+            }
+            if (!ok) {
+                // Requests still in flight keep the descriptor until they are answered, but nothing is sent anymore.
+                shutdown(connection.fd, SHUT_RDWR);
+                connections.erase(connections.begin() + i);
+            } else if (connection.readClosed && connections[i].use_count() == 1 && !HasOutput(connection)) {
+                // No request holds the connection and everything has been sent.
+                connections.erase(connections.begin() + i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd >= 0) {
+                connections.push_back(std::make_shared<Connection>(fd));
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPT_ROM = 0x100, OPT_NOR, OPT_BBS, OPT_SOCKET, OPT_THREADS, OPT_MAX_SESSIONS, OPT_ASYNC_PAGES, OPT_HELP,
+    };
+    static const struct option longOptions[] = {
+        {"rom", required_argument, nullptr, OPT_ROM},
+        {"nor", required_argument, nullptr, OPT_NOR},
+        {"bbs", required_argument, nullptr, OPT_BBS},
+        {"socket", required_argument, nullptr, OPT_SOCKET},
+        {"threads", required_argument, nullptr, OPT_THREADS},
+        {"max-sessions", required_argument, nullptr, OPT_MAX_SESSIONS},
+        {"async-pages", no_argument, nullptr, OPT_ASYNC_PAGES},
+        {"help", no_argument, nullptr, OPT_HELP},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Options options;
+    int opt;
+    bool valid = true;
+    while (valid && (opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case OPT_ROM: options.rom = optarg; break;
+        case OPT_NOR: options.nor = optarg; break;
+        case OPT_BBS: options.bbs = optarg; break;
+        case OPT_SOCKET: options.socket = optarg; break;
+        case OPT_THREADS: valid = ParseUint(optarg, &options.threads); break;
+        case OPT_MAX_SESSIONS: valid = ParseUint(optarg, &options.maxSessions); break;
+        case OPT_ASYNC_PAGES: options.asyncPages = true; break;
+        default: valid = false; break;
+        }
+    }
+    if (!valid || optind != argc) {
+        Usage(argv[0]);
+        return 2;
+    }
+    if (options.threads == 0) {
+        options.threads = std::thread::hardware_concurrency();
+        if (options.threads == 0) {
+            options.threads = 1;
+        }
+    }
+
+    // Fail early instead of on the first create.
+    nc1020_config_t config = {options.rom, options.nor, options.bbs, 0, 0, 0};
+    nc1020_t *probe = nc1020_create(&config);
+    if (probe == nullptr) {
+        fprintf(stderr, "Can't load %s, %s and %s.\n", options.rom, options.nor, options.bbs);
+        return 1;
+    }
+    nc1020_destroy(probe);
+
+    int listener = Listen(options.socket);
+    if (listener < 0) {
+        fprintf(stderr, "Can't listen on %s.\n", options.socket);
+        return 1;
+    }
+    int wakePipe[2];
+    if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fprintf(stderr, "Can't create a pipe.\n");
+        close(listener);
+        return 1;
+    }
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    printf("Listening on %s with %u threads.\n", options.socket, options.threads);
+    fflush(stdout);
+
+    Server server(options, wakePipe[1]);
+    server.start(options.threads);
+    Serve(server, listener, wakePipe[0]);
+    server.stop();
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    close(listener);
+    unlink(options.socket);
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "nc1020_shm.h"
+#include "nc1020.h"
+#include <fcntl.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace wqx {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared_display_t needs lock-free atomics");
+
+SharedDisplay::SharedDisplay() : region(nullptr) {
+    name[0] = '\0';
+}
+
+SharedDisplay::~SharedDisplay() {
+    end();
+}
+
+bool SharedDisplay::begin(const char *name) {
+    end();
+    if (strlen(name) >= sizeof(this->name)) {
+        return false;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, sizeof(shared_display_t)) == 0) {
+        mapping = mmap(nullptr, sizeof(shared_display_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    strcpy(this->name, name);
+    // The truncated object reads as zeros, which is a valid empty display.
+    region = new (mapping) shared_display_t();
+    region->version = SHARED_DISPLAY_VERSION;
+    region->cpu_speed = GetCpuSpeed();
+    region->magic.store(SHARED_DISPLAY_MAGIC, std::memory_order_release);
+    return true;
+}
+
+void SharedDisplay::end() {
+    if (region == nullptr) {
+        return;
+    }
+    region->magic.store(0, std::memory_order_relaxed);
+    munmap(region, sizeof(shared_display_t));
+    shm_unlink(name);
+    region = nullptr;
+}
+
+void SharedDisplay::push(const uint8_t *lcd, uint64_t cycle) {
+    if (region == nullptr) {
+        return;
+    }
+    uint32_t sequence = region->sequence.load(std::memory_order_relaxed);
+    region->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(region->lcd, lcd, sizeof(region->lcd));
+    region->frame_cycle = cycle;
+    region->cpu_speed = GetCpuSpeed();
+    region->frames++;
+    region->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void SharedDisplay::tick() {
+    if (region == nullptr) {
+        return;
+    }
+    uint32_t tail = region->key_tail.load(std::memory_order_relaxed);
+    uint32_t head = region->key_head.load(std::memory_order_acquire);
+    if (tail == head) {
+        return;
+    }
+    for (; tail != head; tail++) {
+        uint16_t entry = region->keys[tail % SHARED_DISPLAY_KEYS];
+        if (entry == SHARED_DISPLAY_RELEASE_ALL) {
+            ReleaseAllKeys();
+        } else if ((entry & 0xff) <= 0x3f) {
+            SetKey(entry & 0xff, (entry & 0x100) != 0);
+        }
+    }
+    region->key_tail.store(tail, std::memory_order_release);
+}
+
+uint32_t SharedDisplay::published() const {
+    return region != nullptr ? region->frames : 0;
+}
+
+SharedDisplayViewer::SharedDisplayViewer() : mapped(nullptr), lastSequence(0) {}
+
+SharedDisplayViewer::~SharedDisplayViewer() {
+    close();
+}
+
+bool SharedDisplayViewer::open(const char *name) {
+    close();
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+    void *mapping = mmap(nullptr, sizeof(shared_display_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    mapped = static_cast<shared_display_t *>(mapping);
+    if (mapped->magic.load(std::memory_order_acquire) != SHARED_DISPLAY_MAGIC ||
+        mapped->version != SHARED_DISPLAY_VERSION) {
+        close();
+        return false;
+    }
+    lastSequence = 0;
+    return true;
+}
+
+void SharedDisplayViewer::close() {
+    if (mapped != nullptr) {
+        munmap(mapped, sizeof(shared_display_t));
+        mapped = nullptr;
+    }
+}
+
+const shared_display_t *SharedDisplayViewer::region() const {
+    return mapped;
+}
+
+uint32_t SharedDisplayViewer::beginRead() const {
+    uint32_t sequence;
+    while ((sequence = mapped->sequence.load(std::memory_order_acquire)) & 1) {
+        // The writer only copies 1600 bytes.
+    }
+    return sequence;
+}
+
+bool SharedDisplayViewer::endRead(uint32_t sequence) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return mapped->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+bool SharedDisplayViewer::copyFrame(uint8_t *lcd, uint64_t *cycle) {
+    if (mapped == nullptr) {
+        return false;
+    }
+    uint32_t sequence;
+    uint64_t frameCycle;
+    do {
+        sequence = beginRead();
+        if (sequence == lastSequence) {
+            return false;
+        }
+        memcpy(lcd, mapped->lcd, sizeof(mapped->lcd));
+        frameCycle = mapped->frame_cycle;
+    } while (!endRead(sequence));
+    lastSequence = sequence;
+    if (cycle != nullptr) {
+        *cycle = frameCycle;
+    }
+    return true;
+}
+
+bool SharedDisplayViewer::push(uint16_t entry) {
+    if (mapped == nullptr) {
+        return false;
+    }
+    uint32_t head = mapped->key_head.load(std::memory_order_relaxed);
+    if (head - mapped->key_tail.load(std::memory_order_acquire) == SHARED_DISPLAY_KEYS) {
+        return false;
+    }
+    mapped->keys[head % SHARED_DISPLAY_KEYS] = entry;
+    mapped->key_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool SharedDisplayViewer::sendKey(uint8_t key_id, bool down_or_up) {
+    return push(key_id | (down_or_up ? 0x100 : 0));
+}
+
+bool SharedDisplayViewer::sendReleaseAll() {
+    return push(SHARED_DISPLAY_RELEASE_ALL);
+}
+
+}